@@ -32,15 +32,25 @@ LOCAL_SRC_FILES := libvncserver/auth.c \
                    libvncserver/stats.c \
                    libvncserver/translate.c \
                    libvncserver/ultra.c \
+                   libvncserver/lz4.c \
+                   libvncserver/workers.c \
+                   libvncserver/shm.c \
+                   libvncserver/uring.c \
+                   libvncserver/asynclog.c \
+                   libvncserver/metrics.c \
+                   libvncserver/trace.c \
+                   libvncserver/fbblock.c \
                    libvncserver/rfbssl_none.c \
                    common/d3des.c \
                    common/minilzo.c \
+                   common/lz4block.c \
                    common/sha1.c \
                    common/vncauth.c \
                    test/bmp.c
 
 # not 'LIBVNCSERVER_HAVE_LIBZ'
                    #libvncserver/zlib.c \
+                   libvncserver/deflate.c \
                    libvncserver/zrle.c \
                    libvncserver/zrleoutstream.c \
                    libvncserver/zrlepalettehelper.c \
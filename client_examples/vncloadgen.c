@@ -0,0 +1,254 @@
+/**
+ * @example vncloadgen.c
+ * Opens many sessions to one server and drives all of them from a single
+ * thread with an rfbClientMux, reporting frames per second, latency and
+ * bytes received per session.  Nothing is displayed; with -discard all
+ * sessions even decode into the same frame buffer, so hundreds of them fit
+ * into a small amount of memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <rfb/rfbclient.h>
+
+typedef struct {
+	int id;
+	rfbBool closed;
+	double connected;      /* when the session was set up */
+	double requested;      /* when the last update request was sent */
+	unsigned long frames;
+	double latencySum, latencyMax;
+} Session;
+
+static rfbClient** clients;
+static Session* sessions;
+static int nSessions = 10;
+static rfbBool discard = FALSE;
+static uint8_t* sharedFrameBuffer;
+static int nOpen;
+static volatile rfbBool quit = FALSE;
+static int sessionTag;
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void stop(int signal) {
+	(void)signal;
+	quit = TRUE;
+}
+
+static Session* getSession(rfbClient* client) {
+	return (Session*)rfbClientGetClientData(client, &sessionTag);
+}
+
+/*
+ * Every session gets the same buffer.  It is allocated once, large enough
+ * for any session that is accepted: a session suspended by the mux may
+ * still point into it, so it must never move.  Only the pages the sessions
+ * actually write get used.
+ */
+#define SHARED_FB_MAX_WIDTH 4096
+#define SHARED_FB_MAX_HEIGHT 4096
+#define SHARED_FB_SIZE ((size_t)SHARED_FB_MAX_WIDTH * SHARED_FB_MAX_HEIGHT * 4)
+
+static rfbBool mallocSharedFrameBuffer(rfbClient* client) {
+	if (client->width > SHARED_FB_MAX_WIDTH || client->height > SHARED_FB_MAX_HEIGHT) {
+		rfbClientErr("a %dx%d frame buffer is larger than the shared one of %dx%d\n",
+			     client->width, client->height, SHARED_FB_MAX_WIDTH, SHARED_FB_MAX_HEIGHT);
+		return FALSE;
+	}
+	if (sharedFrameBuffer == NULL) {
+		sharedFrameBuffer = malloc(SHARED_FB_SIZE);
+		if (sharedFrameBuffer == NULL) {
+			rfbClientErr("cannot allocate a frame buffer of %lu bytes\n", (unsigned long)SHARED_FB_SIZE);
+			return FALSE;
+		}
+	}
+	client->frameBuffer = sharedFrameBuffer;
+	return TRUE;
+}
+
+/*
+ * HandleRFBServerMessage() sends the next incremental request right before
+ * it calls this, so the latency of an update is the time from the previous
+ * call (or the initial request) until the update has been decoded.
+ */
+static void finishedUpdate(rfbClient* client) {
+	Session* s = getSession(client);
+	double t = now(), latency = t - s->requested;
+
+	s->frames++;
+	s->latencySum += latency;
+	if (latency > s->latencyMax)
+		s->latencyMax = latency;
+	s->requested = t;
+}
+
+static void closed(rfbClientMux* mux, rfbClient* client) {
+	Session* s = getSession(client);
+
+	(void)mux;
+	rfbClientLog("session %d closed\n", s->id);
+	s->closed = TRUE;
+	nOpen--;
+}
+
+static void report(double start, double from, double to, unsigned long* lastFrames, unsigned long* lastBytes) {
+	unsigned long frames = 0, bytes = 0;
+	double latencySum = 0;
+	int i;
+
+	for (i = 0; i < nSessions; i++) {
+		if (clients[i] == NULL)
+			continue;
+		frames += sessions[i].frames;
+		bytes += clients[i]->bytesReceived;
+		latencySum += sessions[i].latencySum;
+	}
+	printf("%7.1fs: %d sessions, %.1f fps, %.1f kB/s, %.2f ms average latency\n",
+	       to - start, nOpen, (frames - *lastFrames) / (to - from),
+	       (bytes - *lastBytes) / 1024.0 / (to - from),
+	       frames ? latencySum * 1000 / frames : 0.0);
+	*lastFrames = frames;
+	*lastBytes = bytes;
+}
+
+static void usage(const char* program) {
+	fprintf(stderr, "Usage: %s [-sessions n] [-duration seconds] [-discard]\n"
+		"\t[viewer options] server[:display]\n"
+		"The viewer options (e.g. -encodings) are passed to every session.\n",
+		program);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	rfbClientMux* mux;
+	char** args;
+	int nArgs = 0, i, duration = 0;
+	double t0, lastReport;
+	unsigned long lastFrames = 0, lastBytes = 0;
+
+	args = malloc((argc + 1) * sizeof(char*));
+	args[nArgs++] = argv[0];
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-sessions") == 0 && i + 1 < argc)
+			nSessions = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-duration") == 0 && i + 1 < argc)
+			duration = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-discard") == 0)
+			discard = TRUE;
+		else if (strcmp(argv[i], "-help") == 0)
+			usage(argv[0]);
+		else
+			args[nArgs++] = argv[i];
+	}
+	if (nSessions < 1 || nArgs < 2)
+		usage(argv[0]);
+
+	signal(SIGINT, stop);
+	signal(SIGPIPE, SIG_IGN);
+
+	clients = calloc(nSessions, sizeof(rfbClient*));
+	sessions = calloc(nSessions, sizeof(Session));
+	mux = rfbClientMuxNew(closed);
+	if (clients == NULL || sessions == NULL || mux == NULL)
+		return 1;
+
+	/* the sessions are set up one after the other, which is quick enough */
+	for (i = 0; i < nSessions && !quit; i++) {
+		rfbClient* client = rfbGetClient(8, 3, 4);
+		int n = nArgs;
+		char** a = malloc((nArgs + 1) * sizeof(char*));
+
+		/* rfbInitClient() removes the arguments it knows */
+		memcpy(a, args, nArgs * sizeof(char*));
+		a[nArgs] = NULL;
+
+		sessions[i].id = i;
+		rfbClientSetClientData(client, &sessionTag, &sessions[i]);
+		client->FinishedFrameBufferUpdate = finishedUpdate;
+		clients[i] = client;
+
+		sessions[i].requested = now();
+		if (!rfbInitClient(client, &n, a)) {
+			/* rfbInitClient() has freed the client already */
+			rfbClientErr("session %d could not connect\n", i);
+			clients[i] = NULL;
+			free(a);
+			continue;
+		}
+		free(a);
+		sessions[i].connected = now();
+
+		/* rfbClientCleanup() frees the frame buffer of a client that
+		   failed to connect, so it only gets the shared one now */
+		if (discard) {
+			free(client->frameBuffer);
+			client->frameBuffer = NULL;
+			client->MallocFrameBuffer = mallocSharedFrameBuffer;
+			if (!mallocSharedFrameBuffer(client))
+				return 1;
+		}
+
+		if (!rfbClientMuxAdd(mux, client)) {
+			sessions[i].closed = TRUE;
+			continue;
+		}
+		nOpen++;
+	}
+
+	rfbClientLog("%d of %d sessions connected\n", nOpen, nSessions);
+
+	t0 = lastReport = now();
+	while (!quit && nOpen > 0) {
+		double t;
+
+		if (rfbClientMuxRun(mux, 100000) < 0)
+			break;
+
+		t = now();
+		if (t - lastReport >= 1.0) {
+			report(t0, lastReport, t, &lastFrames, &lastBytes);
+			lastReport = t;
+		}
+		if (duration > 0 && t - t0 >= duration)
+			break;
+	}
+
+	printf("\nsession     fps  avg ms  max ms      kbytes\n");
+	for (i = 0; i < nSessions; i++) {
+		Session* s = &sessions[i];
+		double elapsed = now() - s->connected;
+
+		if (clients[i] == NULL) {
+			printf("%7d  not connected\n", i);
+			continue;
+		}
+		printf("%7d %7.1f %7.2f %7.2f %11.1f%s\n", i,
+		       elapsed > 0 ? s->frames / elapsed : 0.0,
+		       s->frames ? s->latencySum * 1000 / s->frames : 0.0,
+		       s->latencyMax * 1000,
+		       clients[i]->bytesReceived / 1024.0,
+		       s->closed ? " (closed)" : "");
+	}
+
+	rfbClientMuxDestroy(mux);
+	for (i = 0; i < nSessions; i++) {
+		if (clients[i] == NULL)
+			continue;
+		if (discard)
+			clients[i]->frameBuffer = NULL;
+		rfbClientCleanup(clients[i]);
+	}
+	free(sharedFrameBuffer);
+	free(clients);
+	free(sessions);
+	free(args);
+	return 0;
+}
@@ -0,0 +1,232 @@
+/*
+ * lz4block.c - a small compressor and decompressor for the LZ4 block
+ * format, used by the LZ4 encoding.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <string.h>
+#include "lz4block.h"
+
+#define MIN_MATCH     4
+/* the last match must start at least 12 bytes before the end of the
+   block, and the last 5 bytes are always literals */
+#define MF_LIMIT      12
+#define LAST_LITERALS 5
+#define MAX_DISTANCE  65535
+/* after this many misses the search starts skipping ahead faster */
+#define SKIP_TRIGGER  6
+
+static unsigned int read32(const unsigned char* p)
+{
+  unsigned int v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static int hash32(unsigned int v)
+{
+  return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* writes a length continuation (the part not fitting into the token) */
+static unsigned char* writeLength(unsigned char* op, int len)
+{
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+int lz4CompressBlock(const unsigned char* src, int srcLen,
+		     unsigned char* dst, int dstCapacity, lz4HashTable* ht)
+{
+  const unsigned char* ip = src;
+  const unsigned char* anchor = src;
+  const unsigned char* const iend = src + srcLen;
+  const unsigned char* const mflimit = iend - MF_LIMIT;
+  const unsigned char* const matchlimit = iend - LAST_LITERALS;
+  unsigned char* op = dst;
+  unsigned char* const oend = dst + dstCapacity;
+  int litLen;
+
+  if (srcLen < 0 || srcLen > LZ4_MAX_BLOCK_SIZE)
+    return 0;
+
+  if (srcLen >= MF_LIMIT + 1) {
+    memset(ht->table, 0, sizeof(ht->table));
+    ht->table[hash32(read32(ip))] = 0;
+    ip++;
+
+    for (;;) {
+      const unsigned char* ref;
+      unsigned char* token;
+      int misses = 1 << SKIP_TRIGGER, matchLen;
+
+      /* find a match */
+      for (;;) {
+	int h = hash32(read32(ip));
+	int step = misses++ >> SKIP_TRIGGER;
+
+	ref = src + ht->table[h];
+	ht->table[h] = (unsigned short)(ip - src);
+	if (ref < ip && ip - ref <= MAX_DISTANCE && read32(ref) == read32(ip))
+	  break;
+	ip += step;
+	if (ip > mflimit)
+	  goto lastLiterals;
+      }
+
+      /* extend it backwards into the literals */
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+	ip--;
+	ref--;
+      }
+
+      /* literals; the token, the length bytes, the offset and the final
+	 literals need some room too */
+      litLen = ip - anchor;
+      if (op + 1 + litLen / 255 + 1 + litLen + 2 + LAST_LITERALS > oend)
+	return 0;
+      token = op++;
+      if (litLen >= 15) {
+	*token = 15 << 4;
+	op = writeLength(op, litLen - 15);
+      } else
+	*token = litLen << 4;
+      memcpy(op, anchor, litLen);
+      op += litLen;
+
+      /* offset */
+      *op++ = (unsigned char)(ip - ref);
+      *op++ = (unsigned char)((ip - ref) >> 8);
+
+      /* match length */
+      ip += MIN_MATCH;
+      ref += MIN_MATCH;
+      anchor = ip;
+      while (ip < matchlimit && *ip == *ref) {
+	ip++;
+	ref++;
+      }
+      matchLen = ip - anchor;
+      if (op + 1 + matchLen / 255 + LAST_LITERALS > oend)
+	return 0;
+      if (matchLen >= 15) {
+	*token |= 15;
+	op = writeLength(op, matchLen - 15);
+      } else
+	*token |= matchLen;
+      anchor = ip;
+
+      if (ip > mflimit)
+	break;
+      /* the position two bytes back is likely to start a match later */
+      ht->table[hash32(read32(ip - 2))] = (unsigned short)(ip - 2 - src);
+    }
+  }
+
+lastLiterals:
+  litLen = iend - anchor;
+  if (op + 1 + litLen / 255 + 1 + litLen > oend)
+    return 0;
+  if (litLen >= 15) {
+    *op++ = 15 << 4;
+    op = writeLength(op, litLen - 15);
+  } else
+    *op++ = litLen << 4;
+  memcpy(op, anchor, litLen);
+  op += litLen;
+
+  return op - dst;
+}
+
+/* reads a length continuation, returns -1 if it runs off the end of src */
+static int readLength(const unsigned char** ip, const unsigned char* iend)
+{
+  int len = 0;
+  unsigned char b;
+
+  do {
+    if (*ip >= iend)
+      return -1;
+    b = *(*ip)++;
+    len += b;
+  } while (b == 255 && len < (1 << 30));
+  return len;
+}
+
+int lz4DecompressBlock(const unsigned char* src, int srcLen,
+		       unsigned char* dst, int dstCapacity)
+{
+  const unsigned char* ip = src;
+  const unsigned char* const iend = src + srcLen;
+  unsigned char* op = dst;
+  unsigned char* const oend = dst + dstCapacity;
+
+  while (ip < iend) {
+    int token = *ip++;
+    int len = token >> 4, extra, offset;
+    const unsigned char* ref;
+
+    /* literals */
+    if (len == 15) {
+      if ((extra = readLength(&ip, iend)) < 0)
+	return -1;
+      len += extra;
+    }
+    if (len > iend - ip || len > oend - op)
+      return -1;
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+
+    /* the last sequence has no match */
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op - dst)
+      return -1;
+    ref = op - offset;
+
+    len = token & 15;
+    if (len == 15) {
+      if ((extra = readLength(&ip, iend)) < 0)
+	return -1;
+      len += extra;
+    }
+    len += MIN_MATCH;
+    if (len > oend - op)
+      return -1;
+
+    /* a match may overlap the bytes it produces */
+    if (offset >= len) {
+      memcpy(op, ref, len);
+      op += len;
+    } else {
+      while (len--)
+	*op++ = *ref++;
+    }
+  }
+
+  return op - dst;
+}
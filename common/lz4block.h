@@ -0,0 +1,52 @@
+/*
+ * lz4block.h - a small compressor and decompressor for the LZ4 block
+ * format, used by the LZ4 encoding.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * A block is a sequence of (literals, match) pairs as described in the
+ * LZ4 block format specification, so blocks produced here can be decoded
+ * by the reference LZ4_decompress_safe() and vice versa.  Only blocks of up
+ * to LZ4_MAX_BLOCK_SIZE bytes are supported, which lets the compressor keep
+ * 16 bit positions in its hash table.
+ */
+
+#ifndef __LZ4BLOCK_H__
+#define __LZ4BLOCK_H__
+
+#define LZ4_MAX_BLOCK_SIZE 65535
+
+#define LZ4_HASH_LOG 12
+
+/* scratch memory of the compressor, one per thread */
+typedef struct {
+  unsigned short table[1 << LZ4_HASH_LOG];
+} lz4HashTable;
+
+/* compresses srcLen bytes of src into dst, returning the length of the
+   block, or 0 if it would not fit into dstCapacity bytes */
+int lz4CompressBlock(const unsigned char* src, int srcLen,
+		     unsigned char* dst, int dstCapacity, lz4HashTable* ht);
+
+/* decompresses the block of srcLen bytes at src into dst, returning the
+   number of bytes written, or -1 if the block is malformed or would not fit
+   into dstCapacity bytes.  Never reads or writes outside the buffers. */
+int lz4DecompressBlock(const unsigned char* src, int srcLen,
+		       unsigned char* dst, int dstCapacity);
+
+#endif /* __LZ4BLOCK_H__ */
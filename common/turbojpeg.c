@@ -456,9 +456,10 @@ static boolean empty_output_buffer(j_compress_ptr cinfo)
 
 static void dst_noop(j_compress_ptr cinfo)
 {
+	(void)cinfo;
 }
 
-static tjhandle _tjInitCompress(tjinstance *this)
+static tjhandle _tjInitCompress(tjinstance * volatile this)
 {
 	/* This is also straight out of example.c */
 	this->cinfo.err=jpeg_std_error(&this->jerr.pub);
@@ -468,7 +469,8 @@ static tjhandle _tjInitCompress(tjinstance *this)
 	if(setjmp(this->jerr.setjmp_buffer))
 	{
 		/* If we get here, the JPEG code has signaled an error. */
-		if(this) free(this);  return NULL;
+		if(this) free(this);
+		return NULL;
 	}
 
 	jpeg_create_compress(&this->cinfo);
@@ -539,9 +541,11 @@ DLLEXPORT int DLLCALL tjCompress2(tjhandle handle, unsigned char *srcBuf,
 	int width, int pitch, int height, int pixelFormat, unsigned char **jpegBuf,
 	unsigned long *jpegSize, int jpegSubsamp, int jpegQual, int flags)
 {
-	int i, retval=0;  JSAMPROW *row_pointer=NULL;
+	/* what is set before the setjmp() and used after it, by the error
+	   handler or the code following, is volatile */
+	int i;  volatile int retval=0, srcPitch;  JSAMPROW * volatile row_pointer=NULL;
 	#ifndef JCS_EXTENSIONS
-	unsigned char *rgbBuf=NULL;
+	unsigned char * volatile rgbBuf=NULL;
 	#endif
 
 	getinstance(handle)
@@ -553,25 +557,25 @@ DLLEXPORT int DLLCALL tjCompress2(tjhandle handle, unsigned char *srcBuf,
 		|| jpegSubsamp<0 || jpegSubsamp>=NUMSUBOPT || jpegQual<0 || jpegQual>100)
 		_throw("tjCompress2(): Invalid argument");
 
-	if(setjmp(this->jerr.setjmp_buffer))
-	{
-		/* If we get here, the JPEG code has signaled an error. */
-		retval=-1;
-		goto bailout;
-	}
-
-	if(pitch==0) pitch=width*tjPixelSize[pixelFormat];
+	srcPitch=pitch ? pitch : width*tjPixelSize[pixelFormat];
 
 	#ifndef JCS_EXTENSIONS
 	if(pixelFormat!=TJPF_GRAY)
 	{
 		rgbBuf=(unsigned char *)malloc(width*height*RGB_PIXELSIZE);
 		if(!rgbBuf) _throw("tjCompress2(): Memory allocation failure");
-		srcBuf=toRGB(srcBuf, width, pitch, height, pixelFormat, rgbBuf);
-		pitch=width*RGB_PIXELSIZE;
+		srcBuf=toRGB(srcBuf, width, srcPitch, height, pixelFormat, rgbBuf);
+		srcPitch=width*RGB_PIXELSIZE;
 	}
 	#endif
 
+	if(setjmp(this->jerr.setjmp_buffer))
+	{
+		/* If we get here, the JPEG code has signaled an error. */
+		retval=-1;
+		goto bailout;
+	}
+
 	cinfo->image_width=width;
 	cinfo->image_height=height;
 
@@ -590,8 +594,8 @@ DLLEXPORT int DLLCALL tjCompress2(tjhandle handle, unsigned char *srcBuf,
 		_throw("tjCompress2(): Memory allocation failure");
 	for(i=0; i<height; i++)
 	{
-		if(flags&TJFLAG_BOTTOMUP) row_pointer[i]=&srcBuf[(height-i-1)*pitch];
-		else row_pointer[i]=&srcBuf[i*pitch];
+		if(flags&TJFLAG_BOTTOMUP) row_pointer[i]=&srcBuf[(height-i-1)*srcPitch];
+		else row_pointer[i]=&srcBuf[i*srcPitch];
 	}
 	while(cinfo->next_scanline<cinfo->image_height)
 	{
@@ -634,15 +638,19 @@ static boolean fill_input_buffer(j_decompress_ptr dinfo)
 
 static void skip_input_data(j_decompress_ptr dinfo, long num_bytes)
 {
+	/* the data may come straight from the network */
+	if(num_bytes<0 || (size_t)num_bytes>dinfo->src->bytes_in_buffer)
+		ERREXIT(dinfo, JERR_BUFFER_SIZE);
 	dinfo->src->next_input_byte += (size_t) num_bytes;
 	dinfo->src->bytes_in_buffer -= (size_t) num_bytes;
 }
 
 static void src_noop(j_decompress_ptr dinfo)
 {
+	(void)dinfo;
 }
 
-static tjhandle _tjInitDecompress(tjinstance *this)
+static tjhandle _tjInitDecompress(tjinstance * volatile this)
 {
 	/* This is also straight out of example.c */
 	this->dinfo.err=jpeg_std_error(&this->jerr.pub);
@@ -652,7 +660,8 @@ static tjhandle _tjInitDecompress(tjinstance *this)
 	if(setjmp(this->jerr.setjmp_buffer))
 	{
 		/* If we get here, the JPEG code has signaled an error. */
-		if(this) free(this);  return NULL;
+		if(this) free(this);
+		return NULL;
 	}
 
 	jpeg_create_decompress(&this->dinfo);
@@ -747,11 +756,14 @@ DLLEXPORT int DLLCALL tjDecompress2(tjhandle handle, unsigned char *jpegBuf,
 	unsigned long jpegSize, unsigned char *dstBuf, int width, int pitch,
 	int height, int pixelFormat, int flags)
 {
-	int i, retval=0;  JSAMPROW *row_pointer=NULL;
-	int jpegwidth, jpegheight, scaledw, scaledh;
+	/* what the error handler reads after a longjmp() must be volatile, and
+	   the arguments must not change after the setjmp(), so the size and
+	   pitch of the output get variables of their own */
+	int i;  volatile int retval=0;  JSAMPROW * volatile row_pointer=NULL;
+	int jpegwidth, jpegheight, scaledw, scaledh, dstPitch;
+	unsigned char *rowBuf;  int rowPitch;
 	#ifndef JCS_EXTENSIONS
-	unsigned char *rgbBuf=NULL;
-	unsigned char *_dstBuf=NULL;  int _pitch=0;
+	unsigned char * volatile rgbBuf=NULL;
 	#endif
 
 	getinstance(handle);
@@ -784,23 +796,22 @@ DLLEXPORT int DLLCALL tjDecompress2(tjhandle handle, unsigned char *jpegBuf,
 	if(flags&TJFLAG_FASTUPSAMPLE) dinfo->do_fancy_upsampling=FALSE;
 
 	jpegwidth=dinfo->image_width;  jpegheight=dinfo->image_height;
-	if(width==0) width=jpegwidth;
-	if(height==0) height=jpegheight;
 	for(i=0; i<NUMSF; i++)
 	{
 		scaledw=TJSCALED(jpegwidth, sf[i]);
 		scaledh=TJSCALED(jpegheight, sf[i]);
-		if(scaledw<=width && scaledh<=height)
-				break;
+		if(scaledw<=(width ? width : jpegwidth)
+			&& scaledh<=(height ? height : jpegheight))
+			break;
 	}
-	if(scaledw>width || scaledh>height)
+	if(i>=NUMSF)
 		_throw("tjDecompress2(): Could not scale down to desired image dimensions");
-	width=scaledw;  height=scaledh;
 	dinfo->scale_num=sf[i].num;
 	dinfo->scale_denom=sf[i].denom;
 
 	jpeg_start_decompress(dinfo);
-	if(pitch==0) pitch=dinfo->output_width*tjPixelSize[pixelFormat];
+	dstPitch=pitch ? pitch : (int)dinfo->output_width*tjPixelSize[pixelFormat];
+	rowBuf=dstBuf;  rowPitch=dstPitch;
 
 	#ifndef JCS_EXTENSIONS
 	if(pixelFormat!=TJPF_GRAY &&
@@ -809,10 +820,9 @@ DLLEXPORT int DLLCALL tjDecompress2(tjhandle handle, unsigned char *jpegBuf,
 			RGB_BLUE!=tjBlueOffset[pixelFormat] ||
 			RGB_PIXELSIZE!=tjPixelSize[pixelFormat]))
 	{
-		rgbBuf=(unsigned char *)malloc(width*height*3);
+		rgbBuf=(unsigned char *)malloc(scaledw*scaledh*3);
 		if(!rgbBuf) _throw("tjDecompress2(): Memory allocation failure");
-		_pitch=pitch;  pitch=width*3;
-		_dstBuf=dstBuf;  dstBuf=rgbBuf;
+		rowBuf=rgbBuf;  rowPitch=scaledw*3;
 	}
 	#endif
 
@@ -822,8 +832,8 @@ DLLEXPORT int DLLCALL tjDecompress2(tjhandle handle, unsigned char *jpegBuf,
 	for(i=0; i<(int)dinfo->output_height; i++)
 	{
 		if(flags&TJFLAG_BOTTOMUP)
-			row_pointer[i]=&dstBuf[(dinfo->output_height-i-1)*pitch];
-		else row_pointer[i]=&dstBuf[i*pitch];
+			row_pointer[i]=&rowBuf[(dinfo->output_height-i-1)*rowPitch];
+		else row_pointer[i]=&rowBuf[i*rowPitch];
 	}
 	while(dinfo->output_scanline<dinfo->output_height)
 	{
@@ -833,7 +843,7 @@ DLLEXPORT int DLLCALL tjDecompress2(tjhandle handle, unsigned char *jpegBuf,
 	jpeg_finish_decompress(dinfo);
 
 	#ifndef JCS_EXTENSIONS
-	fromRGB(rgbBuf, _dstBuf, width, _pitch, height, pixelFormat);
+	if(rgbBuf) fromRGB(rgbBuf, dstBuf, scaledw, dstPitch, scaledh, pixelFormat);
 	#endif
 
 	bailout:
@@ -29,11 +29,14 @@
 #ifndef __TURBOJPEG_H__
 #define __TURBOJPEG_H__
 
+/* a library that builds its own copy can define DLLEXPORT to hide it */
+#ifndef DLLEXPORT
 #if defined(_WIN32) && defined(DLLDEFINE)
 #define DLLEXPORT __declspec(dllexport)
 #else
 #define DLLEXPORT
 #endif
+#endif
 #define DLLCALL
 
 
@@ -0,0 +1,63 @@
+/*
+ * workers.h - how many threads the work on one rectangle is spread over,
+ * shared by the encoders of libvncserver and the decoders of libvncclient.
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+#include <unistd.h>
+#endif
+
+/* at most this many threads, the one handling the client included, work
+   on one rectangle */
+#define RFB_MAX_WORKERS 16
+
+/*
+ * rfbWorkerCount returns how many workers nJobs are spread over: at most
+ * one per CPU and maxWorkers, and each with at least minJobs of them, but
+ * always at least one.  Kept static so that the libraries do not both
+ * export it.
+ */
+
+static inline int rfbWorkerCount(int nJobs, int minJobs, int maxWorkers)
+{
+  static int nCPUs = 0;
+  int n = nJobs / minJobs;
+
+  if (nCPUs == 0) {
+    int cpus = 1;
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) && defined(_SC_NPROCESSORS_ONLN)
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (cpus < 1)
+      cpus = 1;
+    if (cpus > RFB_MAX_WORKERS)
+      cpus = RFB_MAX_WORKERS;
+    nCPUs = cpus;
+  }
+
+  if (n > nCPUs)
+    n = nCPUs;
+  if (n > maxWorkers)
+    n = maxWorkers;
+  return n < 1 ? 1 : n;
+}
+
+#endif
@@ -87,6 +87,7 @@ static rfbBool handleBackChannelMessage(rfbClientPtr cl, void* data,
 }
 
 static int backChannelEncodings[] = {rfbBackChannel, 0};
+static int backChannelMessageTypes[] = {rfbBackChannel, 0};
 
 static rfbProtocolExtension backChannelExtension = {
 	NULL,				/* newClient */
@@ -97,7 +98,8 @@ static rfbProtocolExtension backChannelExtension = {
 	NULL,				/* close */
 	NULL,				/* usage */
 	NULL,				/* processArgument */
-	NULL				/* next extension */
+	NULL,				/* next extension */
+	backChannelMessageTypes		/* messageTypes */
 };
 
 int main(int argc,char** argv)
@@ -17,11 +17,27 @@
  *  USA.
  */
 
-#ifdef LIBVNCSERVER_CONFIG_LIBVA
+/*
+ * h264.c - handle H.264 encoding.
+ *
+ * This file shouldn't be compiled directly.  It is included once by
+ * rfbproto.c.  The frames are decoded by an rfbH264Decoder: the one the
+ * application set in client->h264Decoder, or else the first of the built-in
+ * ones below that works on this machine (VA-API, then libavcodec).  Each
+ * client has a decoder instance of its own, so any number of H.264 sessions
+ * can run in one process.  The decoded 4:2:0 YUV pictures are converted into
+ * the frame buffer by rfbH264ConvertPicture().
+ */
 
-#include <X11/Xlib.h>
-#include <va/va_x11.h>
-#include <termios.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef _DEBUG
+#define DebugLog(A) rfbClientLog A
+#else
+#define DebugLog(A)
+#endif
 
 enum _slice_types {
 	SLICE_TYPE_P = 0,  /* Predicted */
@@ -29,528 +45,481 @@ enum _slice_types {
 	SLICE_TYPE_I = 2,  /* Intra coded */
 };
 
+#ifdef LIBVNCSERVER_CONFIG_LIBVA
+
+/*----------------------------------------------------------------------------
+ *
+ * VA-API decoder.
+ *
+ * The server sends a single slice per frame with fixed parameters, which are
+ * passed to the GPU as they are.  It needs an X display to attach to.
+ */
+
+#include <X11/Xlib.h>
+#include <va/va_x11.h>
+
 #define SURFACE_NUM     7
 
-VADisplay       va_dpy = NULL;
-VAConfigID      va_config_id;
-VASurfaceID     va_surface_id[SURFACE_NUM];
-VAContextID     va_context_id = 0;
-
-VABufferID      va_pic_param_buf_id[SURFACE_NUM];
-VABufferID      va_mat_param_buf_id[SURFACE_NUM];
-VABufferID      va_sp_param_buf_id[SURFACE_NUM];
-VABufferID      va_d_param_buf_id[SURFACE_NUM];
-
-static int cur_height = 0;
-static int cur_width = 0;
-static unsigned int num_frames = 0;
-static int sid = 0;
-static unsigned int frame_id = 0;
-static int field_order_count = 0;
-static VASurfaceID curr_surface = VA_INVALID_ID;
-
-VAStatus gva_status;
-VASurfaceStatus gsurface_status;
-#define CHECK_SURF(X) \
-    gva_status = vaQuerySurfaceStatus(va_dpy, X, &gsurface_status); \
-    if (gsurface_status != 4) printf("ss: %d\n", gsurface_status);
+typedef struct {
+    Display         *x11_display;
+    VADisplay       va_dpy;
+    VAConfigID      va_config_id;
+    VASurfaceID     va_surface_id[SURFACE_NUM];
+    VAContextID     va_context_id;
+
+    VABufferID      va_pic_param_buf_id[SURFACE_NUM];
+    VABufferID      va_mat_param_buf_id[SURFACE_NUM];
+    VABufferID      va_sp_param_buf_id[SURFACE_NUM];
+    VABufferID      va_d_param_buf_id[SURFACE_NUM];
+
+    int cur_height;
+    int cur_width;
+    unsigned int num_frames;
+    int sid;
+    unsigned int frame_id;
+    int field_order_count;
+    VASurfaceID curr_surface;
+    VAPictureH264 va_picture_h264, va_old_picture_h264;
+    int t2_first;
+
+    VAImage decoded_image;          /* mapped by va_get_picture */
+} va_decoder;
 
 #ifdef _DEBUG
-#define DebugLog(A) rfbClientLog A
+#define CHECK_SURF(d, X) \
+    do { \
+        VASurfaceStatus surface_status; \
+        vaQuerySurfaceStatus(d->va_dpy, X, &surface_status); \
+        if (surface_status != VASurfaceReady) \
+            rfbClientLog("ss: %d\n", surface_status); \
+    } while (0)
 #else
-#define DebugLog(A)
+#define CHECK_SURF(d, X) do { } while (0)
 #endif
 
 #define CHECK_VASTATUS(va_status,func)                  \
     if (va_status != VA_STATUS_SUCCESS) {                   \
-        /*fprintf(stderr,"%s:%s (%d) failed,exit\n", __func__, func, __LINE__);*/ \
-        rfbClientErr("%s:%s:%d failed (0x%x),exit\n", __func__, func, __LINE__, va_status); \
-        exit(1);                                \
+        rfbClientErr("%s:%s:%d failed (0x%x)\n", __func__, func, __LINE__, va_status); \
+        return FALSE;                                \
     } else  { \
-        /*fprintf(stderr,">> SUCCESS for: %s:%s (%d)\n", __func__, func, __LINE__);*/ \
         DebugLog(("%s:%s:%d success\n", __func__, func, __LINE__)); \
     }
 
 /*
  * Forward declarations
  */
-static void h264_decode_frame(int f_width, int f_height, char *framedata, int framesize, int slice_type);
 static void SetVAPictureParameterBufferH264(VAPictureParameterBufferH264 *p, int width, int height);
 static void SetVASliceParameterBufferH264(VASliceParameterBufferH264 *p);
 static void SetVASliceParameterBufferH264_Intra(VASliceParameterBufferH264 *p, int first);
 
-static void put_updated_rectangle(rfbClient *client, int x, int y, int width, int height, int f_width, int f_height, int first_for_frame);
-static void nv12_to_rgba(const VAImage vaImage, rfbClient *client, int ch_x, int ch_y, int ch_w, int ch_h);
-
-
-/* FIXME: get this value from the server instead of hardcoding 32bit pixels */
-#define BPP (4 * 4)
-
-static FILE* fd = NULL;
-
-static const char *string_of_FOURCC(uint32_t fourcc)
+static void h264_cleanup_decoder(va_decoder *d)
 {
-    static int buf;
-    static char str[2][5];
-
-    buf ^= 1;
-    str[buf][0] = fourcc;
-    str[buf][1] = fourcc >> 8;
-    str[buf][2] = fourcc >> 16;
-    str[buf][3] = fourcc >> 24;
-    str[buf][4] = '\0';
-    return str[buf];
-}
-
-static inline const char *string_of_VAImageFormat(VAImageFormat *imgfmt)
-{
-    return string_of_FOURCC(imgfmt->fourcc);
-}
+    VAStatus va_status;
+    int i;
 
-static FILE* prepareRawOutput(const char* fileName) {
-    FILE* rawFp = NULL;
+    rfbClientLog("%s()\n", __FUNCTION__);
 
-    if (strcmp(fileName, "-") == 0) {
-        rawFp = stdout;
-    } else {
-        rawFp = fopen(fileName, "w");
-        if (rawFp == NULL) {
-            return NULL;
-        }
+    for (i = 0; i < SURFACE_NUM; ++i) {
+        if (d->va_pic_param_buf_id[i] != VA_INVALID_ID)
+            vaDestroyBuffer(d->va_dpy, d->va_pic_param_buf_id[i]);
+        if (d->va_mat_param_buf_id[i] != VA_INVALID_ID)
+            vaDestroyBuffer(d->va_dpy, d->va_mat_param_buf_id[i]);
+        if (d->va_sp_param_buf_id[i] != VA_INVALID_ID)
+            vaDestroyBuffer(d->va_dpy, d->va_sp_param_buf_id[i]);
+        if (d->va_d_param_buf_id[i] != VA_INVALID_ID)
+            vaDestroyBuffer(d->va_dpy, d->va_d_param_buf_id[i]);
+        d->va_pic_param_buf_id[i] = VA_INVALID_ID;
+        d->va_mat_param_buf_id[i] = VA_INVALID_ID;
+        d->va_sp_param_buf_id[i]  = VA_INVALID_ID;
+        d->va_d_param_buf_id[i]   = VA_INVALID_ID;
     }
 
-    int fd = fileno(rawFp);
-    if (isatty(fd)) {
-        // best effort -- reconfigure tty for "raw"
-        struct termios term;
-        if (tcgetattr(fd, &term) == 0) {
-            cfmakeraw(&term);
-            if (tcsetattr(fd, TCSANOW, &term) == 0) {
-            }
-        }
+    if (d->va_context_id) {
+        va_status = vaDestroyContext(d->va_dpy, d->va_context_id);
+        if (va_status != VA_STATUS_SUCCESS)
+            rfbClientErr("%s: vaDestroyContext failed (0x%x)\n", __FUNCTION__, va_status);
+        d->va_context_id = 0;
     }
 
-    return rawFp;
-}
-
-static rfbBool
-HandleH264 (rfbClient* client, int rx, int ry, int rw, int rh)
-{
-    rfbH264Header hdr;
-    char *framedata;
-
-    DebugLog(("Framebuffer update with H264 (x: %d, y: %d, w: %d, h: %d)\n", rx, ry, rw, rh));
-
-    /* First, read the frame size and allocate buffer to store the data */
-    if (!ReadFromRFBServer(client, (char *)&hdr, sz_rfbH264Header))
-        return FALSE;
-
-    hdr.slice_type = rfbClientSwap32IfLE(hdr.slice_type);
-    hdr.nBytes = rfbClientSwap32IfLE(hdr.nBytes);
-    hdr.width = rfbClientSwap32IfLE(hdr.width);
-    hdr.height = rfbClientSwap32IfLE(hdr.height);
-
-    if (hdr.nBytes <= 0) return TRUE;
-    framedata = (char*) malloc(hdr.nBytes);
-
-    /* Obtain frame data from the server */
-    DebugLog(("Reading %d bytes of frame data (type: %d), "
-		    "\n", hdr.nBytes, hdr.slice_type));
-    if (!ReadFromRFBServer(client, framedata, hdr.nBytes))
-        return FALSE;
-    DebugLog(("Read OK\n"));
-
-	if (!fd) {
-		fd = prepareRawOutput("./bb.mp4");
-	}
-
-	if (fd) {
-		fwrite(framedata, 1, hdr.nBytes, fd);
-		// Flush the data immediately in case we're streaming.
-		// We don't want to do this if all we've written is
-		// the SPS/PPS data because mplayer gets confused.
-		fflush(fd);
-	}
-
-    /* First make sure we have a large enough raw buffer to hold the
-     * decompressed data.  In practice, with a fixed BPP, fixed frame
-     * buffer size and the first update containing the entire frame
-     * buffer, this buffer allocation should only happen once, on the
-     * first update.
-     */
-    if ( client->raw_buffer_size < (( rw * rh ) * ( BPP / 8 ))) {
-        if ( client->raw_buffer != NULL ) {
-            free( client->raw_buffer );
-        }
-
-        client->raw_buffer_size = (( rw * rh ) * ( BPP / 8 ));
-        client->raw_buffer = (char*) malloc( client->raw_buffer_size );
-        rfbClientLog("Allocated raw buffer of %d bytes (%dx%dx%d BPP)\n", client->raw_buffer_size, rw, rh, BPP);
+    if (d->va_surface_id[0] != VA_INVALID_ID) {
+        va_status = vaDestroySurfaces(d->va_dpy, &d->va_surface_id[0], SURFACE_NUM);
+        if (va_status != VA_STATUS_SUCCESS)
+            rfbClientErr("%s: vaDestroySurfaces failed (0x%x)\n", __FUNCTION__, va_status);
+        d->va_surface_id[0] = VA_INVALID_ID;
     }
 
-    /* Decode frame if frame data was sent. Server only sends frame data for the first
-     * framebuffer update message for a particular frame buffer contents.
-     * If more than 1 rectangle is updated, the messages after the first one (with
-     * the H.264 frame) have nBytes == 0.
-     */
-    if (hdr.nBytes > 0) {
-        DebugLog(("  decoding %d bytes of H.264 data\n", hdr.nBytes));
-        h264_decode_frame(hdr.width, hdr.height, framedata, hdr.nBytes, hdr.slice_type);
+    if (d->va_config_id != VA_INVALID_ID) {
+        vaDestroyConfig(d->va_dpy, d->va_config_id);
+        d->va_config_id = VA_INVALID_ID;
     }
 
-    DebugLog(("  updating rectangle (%d, %d)-(%d, %d)\n", rx, ry, rw, rh));
-    put_updated_rectangle(client, rx, ry, rw, rh, hdr.width, hdr.height, hdr.nBytes != 0);
-
-    free(framedata);
-
-    return TRUE;
+    d->num_frames = 0;
+    d->sid = 0;
+    d->frame_id = 0;
+    d->field_order_count = 0;
+    d->curr_surface = VA_INVALID_ID;
+    d->cur_width = d->cur_height = 0;
 }
 
-static void h264_cleanup_decoder()
+static void va_destroy(void *decoder)
 {
-    VAStatus va_status;
-
-    rfbClientLog("%s()\n", __FUNCTION__);
-
-    if (va_surface_id[0] != VA_INVALID_ID) {
-        va_status = vaDestroySurfaces(va_dpy, &va_surface_id[0], SURFACE_NUM);
-        CHECK_VASTATUS(va_status, "vaDestroySurfaces");
-    }
-
-    if (va_context_id) {
-        va_status = vaDestroyContext(va_dpy, va_context_id);
-        CHECK_VASTATUS(va_status, "vaDestroyContext");
-        va_context_id = 0;
-    }
+    va_decoder *d = (va_decoder *)decoder;
 
-    num_frames = 0;
-    sid = 0;
-    frame_id = 0;
-    field_order_count = 0;
+    h264_cleanup_decoder(d);
+    vaTerminate(d->va_dpy);
+    XCloseDisplay(d->x11_display);
+    free(d);
 }
 
-static void h264_init_decoder(int width, int height)
+static void *va_create(rfbClient *client)
 {
+    va_decoder *d;
+    VAEntrypoint *entrypoints;
+    int num_entrypoints, major_ver, minor_ver, i;
+    int vld_entrypoint_found = 0;
     VAStatus va_status;
 
-    if (va_context_id) {
-        rfbClientLog("%s: va_dpy already initialized\n", __FUNCTION__);
+    d = calloc(1, sizeof(va_decoder));
+    if (d == NULL)
+        return NULL;
+    for (i = 0; i < SURFACE_NUM; ++i) {
+        d->va_surface_id[i]       = VA_INVALID_ID;
+        d->va_pic_param_buf_id[i] = VA_INVALID_ID;
+        d->va_mat_param_buf_id[i] = VA_INVALID_ID;
+        d->va_sp_param_buf_id[i]  = VA_INVALID_ID;
+        d->va_d_param_buf_id[i]   = VA_INVALID_ID;
     }
-
-    if (va_dpy != NULL) {
-        rfbClientLog("%s: Re-initializing H.264 decoder\n", __FUNCTION__);
+    d->va_config_id = VA_INVALID_ID;
+    d->curr_surface = VA_INVALID_ID;
+    d->decoded_image.image_id = VA_INVALID_ID;
+    d->t2_first = 1;
+
+    rfbClientLog("%s: initializing H.264 decoder\n", __FUNCTION__);
+
+    /* Attach VA display to local X display */
+    d->x11_display = XOpenDisplay(":0.0");
+    if (d->x11_display == NULL) {
+        rfbClientLog("%s: can't connect to local display\n", __FUNCTION__);
+        free(d);
+        return NULL;
     }
-    else {
-        rfbClientLog("%s: initializing H.264 decoder\n", __FUNCTION__);
 
-        /* Attach VA display to local X display */
-        Display *win_display = (Display *)XOpenDisplay(":0.0");
-        if (win_display == NULL) {
-            rfbClientErr("Can't connect to local display\n");
-            exit(-1);
+    d->va_dpy = vaGetDisplay(d->x11_display);
+    va_status = vaInitialize(d->va_dpy, &major_ver, &minor_ver);
+    if (va_status != VA_STATUS_SUCCESS) {
+        rfbClientLog("%s: vaInitialize failed (0x%x)\n", __FUNCTION__, va_status);
+        XCloseDisplay(d->x11_display);
+        free(d);
+        return NULL;
+    }
+    rfbClientLog("%s: libva version %d.%d found\n", __FUNCTION__, major_ver, minor_ver);
+
+    /* Check for VLD entrypoint; change VAProfileH264High if needed */
+    entrypoints = malloc(vaMaxNumEntrypoints(d->va_dpy) * sizeof(VAEntrypoint));
+    if (entrypoints != NULL &&
+        vaQueryConfigEntrypoints(d->va_dpy, VAProfileH264High, entrypoints,
+                                 &num_entrypoints) == VA_STATUS_SUCCESS) {
+        for (i = 0; i < num_entrypoints; ++i) {
+            if (entrypoints[i] == VAEntrypointVLD) {
+                vld_entrypoint_found = 1;
+                break;
+            }
         }
+    }
+    free(entrypoints);
 
-        int major_ver, minor_ver;
-        va_dpy = vaGetDisplay(win_display);
-        va_status = vaInitialize(va_dpy, &major_ver, &minor_ver);
-        CHECK_VASTATUS(va_status, "vaInitialize");
-        rfbClientLog("%s: libva version %d.%d found\n", __FUNCTION__, major_ver, minor_ver);
+    if (vld_entrypoint_found == 0) {
+        rfbClientLog("%s: VLD entrypoint not found\n", __FUNCTION__);
+        va_destroy(d);
+        return NULL;
     }
 
-    /* Check for VLD entrypoint */
-    int num_entrypoints;
-    VAEntrypoint    entrypoints[5];
-    int vld_entrypoint_found = 0;
+    return d;
+}
 
-    /* Change VAProfileH264High if needed */
-    VAProfile profile = VAProfileH264High;
-    va_status = vaQueryConfigEntrypoints(va_dpy, profile, entrypoints, &num_entrypoints);
-    CHECK_VASTATUS(va_status, "vaQueryConfigEntrypoints");
+static rfbBool h264_init_decoder(va_decoder *d, int width, int height)
+{
+    VAStatus va_status;
+    VAConfigAttrib attrib;
     int i;
-    for (i = 0; i < num_entrypoints; ++i) {
-        if (entrypoints[i] == VAEntrypointVLD) {
-            vld_entrypoint_found = 1;
-            break;
-        }
-    }
 
-    if (vld_entrypoint_found == 0) {
-        rfbClientErr("VLD entrypoint not found\n");
-        exit(1);
-    }
+    rfbClientLog("%s: setting up the H.264 decoder for %dx%d\n", __FUNCTION__, width, height);
 
     /* Create configuration for the decode pipeline */
-    VAConfigAttrib attrib;
     attrib.type = VAConfigAttribRTFormat;
-    va_status = vaCreateConfig(va_dpy, profile, VAEntrypointVLD, &attrib, 1, &va_config_id);
+    va_status = vaCreateConfig(d->va_dpy, VAProfileH264High, VAEntrypointVLD, &attrib, 1, &d->va_config_id);
     CHECK_VASTATUS(va_status, "vaCreateConfig");
 
     /* Create VA surfaces */
-    for (i = 0; i < SURFACE_NUM; ++i) {
-        va_surface_id[i]       = VA_INVALID_ID;
-        va_pic_param_buf_id[i] = VA_INVALID_ID;
-        va_mat_param_buf_id[i] = VA_INVALID_ID;
-        va_sp_param_buf_id[i]  = VA_INVALID_ID;
-        va_d_param_buf_id[i]   = VA_INVALID_ID;
-    }
-    va_status = vaCreateSurfaces(va_dpy, VA_RT_FORMAT_YUV420, width, height, &va_surface_id[0], SURFACE_NUM,  NULL, 0);
+    va_status = vaCreateSurfaces(d->va_dpy, VA_RT_FORMAT_YUV420, width, height, &d->va_surface_id[0], SURFACE_NUM,  NULL, 0);
     CHECK_VASTATUS(va_status, "vaCreateSurfaces");
     for (i = 0; i < SURFACE_NUM; ++i) {
-        DebugLog(("%s: va_surface_id[%d] = %p\n", __FUNCTION__, i, va_surface_id[i]));
+        DebugLog(("%s: va_surface_id[%d] = %p\n", __FUNCTION__, i, d->va_surface_id[i]));
     }
 
     /* Create VA context */
-    va_status = vaCreateContext(va_dpy, va_config_id, width, height,
-		    VA_PROGRESSIVE,  &va_surface_id[0], SURFACE_NUM, &va_context_id);
+    va_status = vaCreateContext(d->va_dpy, d->va_config_id, width, height,
+		    VA_PROGRESSIVE,  &d->va_surface_id[0], SURFACE_NUM, &d->va_context_id);
     CHECK_VASTATUS(va_status, "vaCreateContext");
-    DebugLog(("%s: VA context created (id: %d)\n", __FUNCTION__, va_context_id));
-
+    DebugLog(("%s: VA context created (id: %d)\n", __FUNCTION__, d->va_context_id));
 
     /* Instantiate decode pipeline */
-    va_status = vaBeginPicture(va_dpy, va_context_id, va_surface_id[0]);
+    va_status = vaBeginPicture(d->va_dpy, d->va_context_id, d->va_surface_id[0]);
     CHECK_VASTATUS(va_status, "vaBeginPicture");
 
-    rfbClientLog("%s: H.264 decoder initialized\n", __FUNCTION__);
+    d->cur_width = width;
+    d->cur_height = height;
+    return TRUE;
 }
 
-static void h264_decode_frame(int f_width, int f_height, char *framedata, int framesize, int slice_type)
+static rfbBool va_decode(void *decoder, const uint8_t *framedata, int framesize, int slice_type, int f_width, int f_height)
 {
+    va_decoder *d = (va_decoder *)decoder;
     VAStatus va_status;
+    VABufferID buffer_ids[2];
+    VAPictureParameterBufferH264 *pic_param_buf = NULL;
+    VAIQMatrixBufferH264 *iq_matrix_buf = NULL;
+    VASliceParameterBufferH264 *slice_param_buf = NULL;
+    char *slice_data_buf;
+    int sid = d->sid, sid_new;
 
     DebugLog(("%s: called for frame of %d bytes (%dx%d) slice_type=%d\n",
 		    __FUNCTION__, framesize, f_width, f_height, slice_type));
 
     /* Initialize decode pipeline if necessary */
-    if ( (f_width > cur_width) || (f_height > cur_height) ) {
-        if (va_dpy != NULL)
-            h264_cleanup_decoder();
-        cur_width = f_width;
-        cur_height = f_height;
-
-        h264_init_decoder(f_width, f_height);
-        rfbClientLog("%s: decoder initialized\n", __FUNCTION__);
+    if ( (f_width > d->cur_width) || (f_height > d->cur_height) ) {
+        if (d->va_context_id)
+            h264_cleanup_decoder(d);
+        if (!h264_init_decoder(d, f_width, f_height))
+            return FALSE;
+        sid = d->sid;
     }
 
-    /* Decode frame */
-    static VAPictureH264 va_picture_h264, va_old_picture_h264;
-
     /* The server should always send an I-frame when a new client connects
      * or when the resolution of the framebuffer changes, but we check
      * just in case.
      */
-    if ( (slice_type != SLICE_TYPE_I) && (num_frames == 0) ) {
+    if ( (slice_type != SLICE_TYPE_I) && (d->num_frames == 0) ) {
         rfbClientLog("First frame is not an I frame !!! Skipping!!!\n");
-        return;
+        return TRUE;
+    }
+    if (slice_type != SLICE_TYPE_I && slice_type != SLICE_TYPE_P) {
+        rfbClientLog("Frame type %d not supported!!!\n", slice_type);
+        return TRUE;
     }
 
-    DebugLog(("%s: frame_id=%d va_surface_id[%d]=0x%x field_order_count=%d\n", __FUNCTION__, frame_id, sid, va_surface_id[sid], field_order_count));
+    /* the slice data buffer below holds at most a 1080p frame */
+    if (framesize > 4177920) {
+        rfbClientErr("%s: frame of %d bytes is too large\n", __FUNCTION__, framesize);
+        return FALSE;
+    }
 
-    va_picture_h264.picture_id = va_surface_id[sid];
-    va_picture_h264.frame_idx  = frame_id;
-    va_picture_h264.flags = 0;
-    va_picture_h264.BottomFieldOrderCnt = field_order_count;
-    va_picture_h264.TopFieldOrderCnt = field_order_count;
+    DebugLog(("%s: frame_id=%d va_surface_id[%d]=0x%x field_order_count=%d\n", __FUNCTION__, d->frame_id, sid, d->va_surface_id[sid], d->field_order_count));
+
+    d->va_picture_h264.picture_id = d->va_surface_id[sid];
+    d->va_picture_h264.frame_idx  = d->frame_id;
+    d->va_picture_h264.flags = 0;
+    d->va_picture_h264.BottomFieldOrderCnt = d->field_order_count;
+    d->va_picture_h264.TopFieldOrderCnt = d->field_order_count;
 
     /* Set up picture parameter buffer */
-    if (va_pic_param_buf_id[sid] == VA_INVALID_ID) {
-        va_status = vaCreateBuffer(va_dpy, va_context_id,
+    if (d->va_pic_param_buf_id[sid] == VA_INVALID_ID) {
+        va_status = vaCreateBuffer(d->va_dpy, d->va_context_id,
         		VAPictureParameterBufferType, sizeof(VAPictureParameterBufferH264),
-			1, NULL, &va_pic_param_buf_id[sid]);
+			1, NULL, &d->va_pic_param_buf_id[sid]);
         CHECK_VASTATUS(va_status, "vaCreateBuffer(PicParam)");
     }
-    CHECK_SURF(va_surface_id[sid]);
+    CHECK_SURF(d, d->va_surface_id[sid]);
 
-    VAPictureParameterBufferH264 *pic_param_buf = NULL;
-    va_status = vaMapBuffer(va_dpy, va_pic_param_buf_id[sid], (void **)&pic_param_buf);
+    va_status = vaMapBuffer(d->va_dpy, d->va_pic_param_buf_id[sid], (void **)&pic_param_buf);
     CHECK_VASTATUS(va_status, "vaMapBuffer(PicParam)");
 
     SetVAPictureParameterBufferH264(pic_param_buf, f_width, f_height);
-    memcpy(&pic_param_buf->CurrPic, &va_picture_h264, sizeof(VAPictureH264));
+    memcpy(&pic_param_buf->CurrPic, &d->va_picture_h264, sizeof(VAPictureH264));
 
     if (slice_type == SLICE_TYPE_P) {
-        memcpy(&pic_param_buf->ReferenceFrames[0], &va_old_picture_h264, sizeof(VAPictureH264));
+        memcpy(&pic_param_buf->ReferenceFrames[0], &d->va_old_picture_h264, sizeof(VAPictureH264));
         pic_param_buf->ReferenceFrames[0].flags = 0;
     }
-    else if (slice_type != SLICE_TYPE_I) {
-        rfbClientLog("Frame type %d not supported!!!\n");
-        return;
-    }
-    pic_param_buf->frame_num = frame_id;
+    pic_param_buf->frame_num = d->frame_id;
 
-    va_status = vaUnmapBuffer(va_dpy, va_pic_param_buf_id[sid]);
+    va_status = vaUnmapBuffer(d->va_dpy, d->va_pic_param_buf_id[sid]);
     CHECK_VASTATUS(va_status, "vaUnmapBuffer(PicParam)");
 
     /* Set up IQ matrix buffer */
-    if (va_mat_param_buf_id[sid] == VA_INVALID_ID) {
-        va_status = vaCreateBuffer(va_dpy, va_context_id,
+    if (d->va_mat_param_buf_id[sid] == VA_INVALID_ID) {
+        va_status = vaCreateBuffer(d->va_dpy, d->va_context_id,
         		VAIQMatrixBufferType, sizeof(VAIQMatrixBufferH264),
-        		1, NULL, &va_mat_param_buf_id[sid]);
+        		1, NULL, &d->va_mat_param_buf_id[sid]);
         CHECK_VASTATUS(va_status, "vaCreateBuffer(IQMatrix)");
     }
-    CHECK_SURF(va_surface_id[sid]);
+    CHECK_SURF(d, d->va_surface_id[sid]);
 
-    VAIQMatrixBufferH264 *iq_matrix_buf = NULL;
-    va_status = vaMapBuffer(va_dpy, va_mat_param_buf_id[sid], (void **)&iq_matrix_buf);
+    va_status = vaMapBuffer(d->va_dpy, d->va_mat_param_buf_id[sid], (void **)&iq_matrix_buf);
     CHECK_VASTATUS(va_status, "vaMapBuffer(IQMatrix)");
 
-    static const unsigned char m_MatrixBufferH264[]= {
-        /* ScalingList4x4[6][16] */
-        0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,
-        0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,
-        0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,
-        0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,
-        0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,
-        0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,
-        /* ScalingList8x8[2][64] */
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-        0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00
-    };
-
-    memcpy(iq_matrix_buf, m_MatrixBufferH264, 224);
-    va_status = vaUnmapBuffer(va_dpy, va_mat_param_buf_id[sid]);
+    /* ScalingList4x4[6][16] all 0x10, ScalingList8x8[2][64] all 0 */
+    memset(iq_matrix_buf, 0, 224);
+    memset(iq_matrix_buf, 0x10, 6 * 16);
+    va_status = vaUnmapBuffer(d->va_dpy, d->va_mat_param_buf_id[sid]);
     CHECK_VASTATUS(va_status, "vaUnmapBuffer(IQMatrix)");
 
-    VABufferID buffer_ids[2];
-    buffer_ids[0] = va_pic_param_buf_id[sid];
-    buffer_ids[1] = va_mat_param_buf_id[sid];
+    buffer_ids[0] = d->va_pic_param_buf_id[sid];
+    buffer_ids[1] = d->va_mat_param_buf_id[sid];
 
-    CHECK_SURF(va_surface_id[sid]);
-    va_status = vaRenderPicture(va_dpy, va_context_id, buffer_ids, 2);
+    CHECK_SURF(d, d->va_surface_id[sid]);
+    va_status = vaRenderPicture(d->va_dpy, d->va_context_id, buffer_ids, 2);
     CHECK_VASTATUS(va_status, "vaRenderPicture");
 
     /* Set up slice parameter buffer */
-    if (va_sp_param_buf_id[sid] == VA_INVALID_ID) {
-        va_status = vaCreateBuffer(va_dpy, va_context_id,
+    if (d->va_sp_param_buf_id[sid] == VA_INVALID_ID) {
+        va_status = vaCreateBuffer(d->va_dpy, d->va_context_id,
         		VASliceParameterBufferType, sizeof(VASliceParameterBufferH264),
-			1, NULL, &va_sp_param_buf_id[sid]);
+			1, NULL, &d->va_sp_param_buf_id[sid]);
         CHECK_VASTATUS(va_status, "vaCreateBuffer(SliceParam)");
     }
-    CHECK_SURF(va_surface_id[sid]);
+    CHECK_SURF(d, d->va_surface_id[sid]);
 
-    VASliceParameterBufferH264 *slice_param_buf = NULL;
-    va_status = vaMapBuffer(va_dpy, va_sp_param_buf_id[sid], (void **)&slice_param_buf);
+    va_status = vaMapBuffer(d->va_dpy, d->va_sp_param_buf_id[sid], (void **)&slice_param_buf);
     CHECK_VASTATUS(va_status, "vaMapBuffer(SliceParam)");
 
-    static int t2_first = 1;
     if (slice_type == SLICE_TYPE_I) {
-        SetVASliceParameterBufferH264_Intra(slice_param_buf, t2_first);
-        t2_first = 0;
+        SetVASliceParameterBufferH264_Intra(slice_param_buf, d->t2_first);
+        d->t2_first = 0;
     } else {
         SetVASliceParameterBufferH264(slice_param_buf);
-        memcpy(&slice_param_buf->RefPicList0[0], &va_old_picture_h264, sizeof(VAPictureH264));
+        memcpy(&slice_param_buf->RefPicList0[0], &d->va_old_picture_h264, sizeof(VAPictureH264));
         slice_param_buf->RefPicList0[0].flags = 0;
     }
     slice_param_buf->slice_data_bit_offset = 0;
     slice_param_buf->slice_data_size = framesize;
 
-    va_status = vaUnmapBuffer(va_dpy, va_sp_param_buf_id[sid]);
+    va_status = vaUnmapBuffer(d->va_dpy, d->va_sp_param_buf_id[sid]);
     CHECK_VASTATUS(va_status, "vaUnmapBuffer(SliceParam)");
-    CHECK_SURF(va_surface_id[sid]);
+    CHECK_SURF(d, d->va_surface_id[sid]);
 
     /* Set up slice data buffer and copy H.264 encoded data */
-    if (va_d_param_buf_id[sid] == VA_INVALID_ID) {
+    if (d->va_d_param_buf_id[sid] == VA_INVALID_ID) {
         /* TODO use estimation matching framebuffer dimensions instead of this large value */
-        va_status = vaCreateBuffer(va_dpy, va_context_id, VASliceDataBufferType,
-        		4177920, 1, NULL, &va_d_param_buf_id[sid]); /* 1080p size */
+        va_status = vaCreateBuffer(d->va_dpy, d->va_context_id, VASliceDataBufferType,
+        		4177920, 1, NULL, &d->va_d_param_buf_id[sid]); /* 1080p size */
         CHECK_VASTATUS(va_status, "vaCreateBuffer(SliceData)");
     }
 
-    char *slice_data_buf;
-    va_status = vaMapBuffer(va_dpy, va_d_param_buf_id[sid], (void **)&slice_data_buf);
+    va_status = vaMapBuffer(d->va_dpy, d->va_d_param_buf_id[sid], (void **)&slice_data_buf);
     CHECK_VASTATUS(va_status, "vaMapBuffer(SliceData)");
     memcpy(slice_data_buf, framedata, framesize);
 
-    CHECK_SURF(va_surface_id[sid]);
-    va_status = vaUnmapBuffer(va_dpy, va_d_param_buf_id[sid]);
+    CHECK_SURF(d, d->va_surface_id[sid]);
+    va_status = vaUnmapBuffer(d->va_dpy, d->va_d_param_buf_id[sid]);
     CHECK_VASTATUS(va_status, "vaUnmapBuffer(SliceData)");
 
-    buffer_ids[0] = va_sp_param_buf_id[sid];
-    buffer_ids[1] = va_d_param_buf_id[sid];
+    buffer_ids[0] = d->va_sp_param_buf_id[sid];
+    buffer_ids[1] = d->va_d_param_buf_id[sid];
 
-    CHECK_SURF(va_surface_id[sid]);
-    va_status = vaRenderPicture(va_dpy, va_context_id, buffer_ids, 2);
+    CHECK_SURF(d, d->va_surface_id[sid]);
+    va_status = vaRenderPicture(d->va_dpy, d->va_context_id, buffer_ids, 2);
     CHECK_VASTATUS(va_status, "vaRenderPicture");
 
-    va_status = vaEndPicture(va_dpy, va_context_id);
+    va_status = vaEndPicture(d->va_dpy, d->va_context_id);
     CHECK_VASTATUS(va_status, "vaEndPicture");
 
     /* Prepare next one... */
-    int sid_new = (sid + 1) % SURFACE_NUM;
+    sid_new = (sid + 1) % SURFACE_NUM;
     DebugLog(("%s: new Surface ID = %d\n", __FUNCTION__, sid_new));
-    va_status = vaBeginPicture(va_dpy, va_context_id, va_surface_id[sid_new]);
+    va_status = vaBeginPicture(d->va_dpy, d->va_context_id, d->va_surface_id[sid_new]);
     CHECK_VASTATUS(va_status, "vaBeginPicture");
 
     /* Get decoded data */
-    va_status = vaSyncSurface(va_dpy, va_surface_id[sid]);
+    va_status = vaSyncSurface(d->va_dpy, d->va_surface_id[sid]);
     CHECK_VASTATUS(va_status, "vaSyncSurface");
-    CHECK_SURF(va_surface_id[sid]);
+    CHECK_SURF(d, d->va_surface_id[sid]);
 
-    curr_surface = va_surface_id[sid];
+    d->curr_surface = d->va_surface_id[sid];
 
-    sid = sid_new;
+    d->sid = sid_new;
 
-    field_order_count += 2;
-    ++frame_id;
-    if (frame_id > 15) {
-        frame_id = 0;
+    d->field_order_count += 2;
+    ++d->frame_id;
+    if (d->frame_id > 15) {
+        d->frame_id = 0;
     }
 
-    ++num_frames;
+    ++d->num_frames;
 
-    memcpy(&va_old_picture_h264, &va_picture_h264, sizeof(VAPictureH264));
+    memcpy(&d->va_old_picture_h264, &d->va_picture_h264, sizeof(VAPictureH264));
+    return TRUE;
 }
 
-static void put_updated_rectangle(rfbClient *client,
-		int x, int y, int width, int height, int f_width, int f_height, int first_for_frame)
+/* use efficient vaPutSurface() method of putting the framebuffer on the screen */
+static rfbBool va_present(void *decoder, rfbClient *client, int f_width, int f_height)
 {
-    if (curr_surface == VA_INVALID_ID) {
-        rfbClientErr("%s: called, but current surface is invalid\n", __FUNCTION__);
-        return;
-    }
+    va_decoder *d = (va_decoder *)decoder;
+    VAStatus va_status;
+
+    if (!client->outputWindow || d->curr_surface == VA_INVALID_ID)
+        return FALSE;
 
+    /* vaPutSurface() clears window contents outside the given destination rectangle => always update full screen. */
+    va_status = vaPutSurface(d->va_dpy, d->curr_surface,
+		    client->outputWindow, 0, 0, f_width, f_height, 0, 0, f_width, f_height,
+		    NULL, 0, VA_FRAME_PICTURE);
+    CHECK_VASTATUS(va_status, "vaPutSurface");
+    return TRUE;
+}
+
+/* ... or copy the changed framebuffer region manually as a fallback */
+static rfbBool va_get_picture(void *decoder, rfbH264Picture *picture)
+{
+    va_decoder *d = (va_decoder *)decoder;
     VAStatus va_status;
+    uint8_t *nv12_buf;
 
-    if (client->outputWindow) {
-        /* use efficient vaPutSurface() method of putting the framebuffer on the screen */
-        if (first_for_frame) {
-            /* vaPutSurface() clears window contents outside the given destination rectangle => always update full screen. */
-            va_status = vaPutSurface(va_dpy, curr_surface,
-        		    client->outputWindow, 0, 0, f_width, f_height, 0, 0, f_width, f_height,
-			    NULL, 0, VA_FRAME_PICTURE);
-            CHECK_VASTATUS(va_status, "vaPutSurface");
-        }
+    if (d->curr_surface == VA_INVALID_ID) {
+        rfbClientErr("%s: called, but current surface is invalid\n", __FUNCTION__);
+        return FALSE;
     }
-    else if (client->frameBuffer) {
-        /* ... or copy the changed framebuffer region manually as a fallback */
-        VAImage decoded_image;
-        decoded_image.image_id = VA_INVALID_ID;
-        decoded_image.buf      = VA_INVALID_ID;
-        va_status = vaDeriveImage(va_dpy, curr_surface, &decoded_image);
-        CHECK_VASTATUS(va_status, "vaDeriveImage");
 
-        if ((decoded_image.image_id == VA_INVALID_ID) || (decoded_image.buf == VA_INVALID_ID)) {
-            rfbClientErr("%s: vaDeriveImage() returned success but VA image is invalid (id: %d, buf: %d)\n", __FUNCTION__, decoded_image.image_id, decoded_image.buf);
-        }
+    d->decoded_image.image_id = VA_INVALID_ID;
+    d->decoded_image.buf      = VA_INVALID_ID;
+    va_status = vaDeriveImage(d->va_dpy, d->curr_surface, &d->decoded_image);
+    CHECK_VASTATUS(va_status, "vaDeriveImage");
 
-        nv12_to_rgba(decoded_image, client, x, y, width, height);
+    if ((d->decoded_image.image_id == VA_INVALID_ID) || (d->decoded_image.buf == VA_INVALID_ID)) {
+        rfbClientErr("%s: vaDeriveImage() returned success but VA image is invalid (id: %d, buf: %d)\n", __FUNCTION__, d->decoded_image.image_id, d->decoded_image.buf);
+        return FALSE;
+    }
+    if (d->decoded_image.format.fourcc != VA_FOURCC_NV12) {
+        rfbClientErr("%s: decoded image is not NV12\n", __FUNCTION__);
+        vaDestroyImage(d->va_dpy, d->decoded_image.image_id);
+        return FALSE;
+    }
 
-        va_status = vaDestroyImage(va_dpy, decoded_image.image_id);
-        CHECK_VASTATUS(va_status, "vaDestroyImage");
+    va_status = vaMapBuffer(d->va_dpy, d->decoded_image.buf, (void **)&nv12_buf);
+    if (va_status != VA_STATUS_SUCCESS) {
+        rfbClientErr("%s: vaMapBuffer(DecodedData) failed (0x%x)\n", __FUNCTION__, va_status);
+        vaDestroyImage(d->va_dpy, d->decoded_image.image_id);
+        return FALSE;
     }
+
+    picture->y = nv12_buf + d->decoded_image.offsets[0];
+    picture->u = nv12_buf + d->decoded_image.offsets[1];
+    picture->v = picture->u + 1;
+    picture->yPitch = d->decoded_image.pitches[0];
+    picture->uvPitch = d->decoded_image.pitches[1];
+    picture->uvStep = 2;
+    picture->width = d->decoded_image.width;
+    picture->height = d->decoded_image.height;
+    return TRUE;
+}
+
+static void va_put_picture(void *decoder, rfbH264Picture *picture)
+{
+    va_decoder *d = (va_decoder *)decoder;
+
+    vaUnmapBuffer(d->va_dpy, d->decoded_image.buf);
+    vaDestroyImage(d->va_dpy, d->decoded_image.image_id);
+    d->decoded_image.image_id = VA_INVALID_ID;
 }
 
 static void SetVAPictureParameterBufferH264(VAPictureParameterBufferH264 *p, int width, int height)
@@ -626,74 +595,501 @@ static void SetVASliceParameterBufferH264_Intra(VASliceParameterBufferH264 *p, i
     p->RefPicList0[0].picture_id = 0xffffffff;
 }
 
-static void nv12_to_rgba(const VAImage vaImage, rfbClient *client, int ch_x, int ch_y, int ch_w, int ch_h)
+rfbH264Decoder rfbH264DecoderVA = {
+    "vaapi", va_create, va_decode, va_get_picture, va_put_picture, va_present, va_destroy
+};
+
+#endif /* LIBVNCSERVER_CONFIG_LIBVA */
+
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+
+/*----------------------------------------------------------------------------
+ *
+ * libavcodec decoder.
+ *
+ * Decodes on the CPU, so it works without a GPU or a display.  The server
+ * sends an Annex B byte stream, SPS and PPS in front of the I frames, which
+ * the parser of libavcodec takes as it is.
+ */
+
+#include <libavcodec/avcodec.h>
+
+typedef struct {
+    AVCodecContext *context;
+    AVPacket *packet;
+    AVFrame *frame;                 /* the latest picture */
+    AVFrame *scratch;               /* what avcodec_receive_frame() fills */
+    rfbBool have_frame;
+} av_decoder;
+
+static void av_destroy(void *decoder)
 {
-    DebugLog(("%s: converting region (%d, %d)-(%d, %d) from NV12->RGBA\n", __FUNCTION__, ch_x, ch_y, ch_w, ch_h));
+    av_decoder *d = (av_decoder *)decoder;
 
-    VAStatus va_status;
-    uint8_t *nv12_buf;
-    va_status = vaMapBuffer(va_dpy, vaImage.buf, (void **)&nv12_buf);
-    CHECK_VASTATUS(va_status, "vaMapBuffer(DecodedData)");
+    av_frame_free(&d->frame);
+    av_frame_free(&d->scratch);
+    av_packet_free(&d->packet);
+    avcodec_free_context(&d->context);
+    free(d);
+}
 
-    /* adjust x, y, width, height of the affected area so
-     * x, y, width and height are always even.
-     */
-    if (ch_x % 2) { --ch_x; ++ch_w; }
-    if (ch_y % 2) { --ch_y; ++ch_h; }
-    if ((ch_x + ch_w) % 2) { ++ch_w; }
-    if ((ch_y + ch_h) % 2) { ++ch_h; }
-
-    /* point nv12_buf and dst to upper left corner of changed area */
-    uint8_t *nv12_y  = &nv12_buf[vaImage.offsets[0] + vaImage.pitches[0] * ch_y + ch_x];
-    uint8_t *nv12_uv = &nv12_buf[vaImage.offsets[1] + vaImage.pitches[1] * (ch_y / 2) + ch_x];
-    uint32_t *dst    = &((uint32_t*)client->frameBuffer)[client->width * ch_y + ch_x];
-
-    /* TODO: optimize R, G, B calculation. Possible ways to do this:
-     *       - use lookup tables
-     *       - convert from floating point to integer arithmetic
-     *       - use MMX/SSE to vectorize calculations
-     *       - use GPU (VA VPP, shader...)
-     */
-    int src_x, src_y;
-    for (src_y = 0; src_y < ch_h; src_y += 2) {
-        for (src_x = 0; src_x < ch_w; src_x += 2) {
-            uint8_t nv_u = nv12_uv[src_x];
-            uint8_t nv_v = nv12_uv[src_x + 1];
-            uint8_t nv_y[4] = { nv12_y[                     src_x], nv12_y[                     src_x + 1],
-                                nv12_y[vaImage.pitches[0] + src_x], nv12_y[vaImage.pitches[0] + src_x + 1] };
-
-        int i;
-            for (i = 0; i < 4; ++i) {
-                double R = 1.164 * (nv_y[i] - 16)                        + 1.596 * (nv_v - 128);
-                double G = 1.164 * (nv_y[i] - 16) - 0.391 * (nv_u - 128) - 0.813 * (nv_v - 128);
-                double B = 1.164 * (nv_y[i] - 16) + 2.018 * (nv_u - 128);
-
-                /* clamp R, G, B values. For some Y, U, V combinations,
-                 * the results of the above calculations fall outside of
-                 * the range 0-255.
-                 */
-                if (R < 0.0) R = 0.0;
-                if (G < 0.0) G = 0.0;
-                if (B < 0.0) B = 0.0;
-                if (R > 255.0) R = 255.0;
-                if (G > 255.0) G = 255.0;
-                if (B > 255.0) B = 255.0;
-
-                dst[client->width * (i / 2) + src_x + (i % 2)] = 0
-                               | ((unsigned int)(R + 0.5) << client->format.redShift)
-                               | ((unsigned int)(G + 0.5) << client->format.greenShift)
-                               | ((unsigned int)(B + 0.5) << client->format.blueShift);
+static void *av_create(rfbClient *client)
+{
+    const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    av_decoder *d;
+
+    if (codec == NULL) {
+        rfbClientLog("%s: libavcodec has no H.264 decoder\n", __FUNCTION__);
+        return NULL;
+    }
+
+    d = calloc(1, sizeof(av_decoder));
+    if (d == NULL)
+        return NULL;
+    d->context = avcodec_alloc_context3(codec);
+    d->packet = av_packet_alloc();
+    d->frame = av_frame_alloc();
+    d->scratch = av_frame_alloc();
+    if (d->context == NULL || d->packet == NULL || d->frame == NULL ||
+        d->scratch == NULL) {
+        av_destroy(d);
+        return NULL;
+    }
+
+    /* every frame is shown as soon as it has arrived: no frame threading,
+       which would hold back a frame per thread */
+    d->context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    d->context->thread_type = FF_THREAD_SLICE;
+
+    if (avcodec_open2(d->context, codec, NULL) < 0) {
+        rfbClientLog("%s: cannot open the H.264 decoder\n", __FUNCTION__);
+        av_destroy(d);
+        return NULL;
+    }
+
+    rfbClientLog("%s: using libavcodec %s\n", __FUNCTION__, av_version_info());
+    return d;
+}
+
+static rfbBool av_decode(void *decoder, const uint8_t *data, int len, int slice_type, int width, int height)
+{
+    av_decoder *d = (av_decoder *)decoder;
+    int ret;
+
+    d->packet->data = (uint8_t *)data;
+    d->packet->size = len;
+    ret = avcodec_send_packet(d->context, d->packet);
+    if (ret < 0) {
+        rfbClientErr("%s: avcodec_send_packet failed (%d)\n", __FUNCTION__, ret);
+        return FALSE;
+    }
+
+    /* keep the latest picture: avcodec_receive_frame() unrefs the frame
+       it is given even when it has none to return */
+    while ((ret = avcodec_receive_frame(d->context, d->scratch)) == 0) {
+        av_frame_unref(d->frame);
+        av_frame_move_ref(d->frame, d->scratch);
+        d->have_frame = TRUE;
+    }
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+        rfbClientErr("%s: avcodec_receive_frame failed (%d)\n", __FUNCTION__, ret);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static rfbBool av_get_picture(void *decoder, rfbH264Picture *picture)
+{
+    av_decoder *d = (av_decoder *)decoder;
+    AVFrame *frame = d->frame;
+
+    if (!d->have_frame)
+        return FALSE;
+
+    picture->y = frame->data[0];
+    picture->yPitch = frame->linesize[0];
+    picture->width = frame->width;
+    picture->height = frame->height;
+    switch (frame->format) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        picture->u = frame->data[1];
+        picture->v = frame->data[2];
+        picture->uvPitch = frame->linesize[1];
+        picture->uvStep = 1;
+        return TRUE;
+    case AV_PIX_FMT_NV12:
+        picture->u = frame->data[1];
+        picture->v = frame->data[1] + 1;
+        picture->uvPitch = frame->linesize[1];
+        picture->uvStep = 2;
+        return TRUE;
+    default:
+        rfbClientErr("%s: unsupported pixel format %d\n", __FUNCTION__, frame->format);
+        return FALSE;
+    }
+}
+
+rfbH264Decoder rfbH264DecoderAVCodec = {
+    "libavcodec", av_create, av_decode, av_get_picture, NULL, NULL, av_destroy
+};
+
+#endif /* LIBVNCSERVER_HAVE_LIBAVCODEC */
+
+/* the built-in decoders, in the order they are tried */
+static rfbH264Decoder* h264Decoders[] = {
+#ifdef LIBVNCSERVER_CONFIG_LIBVA
+    &rfbH264DecoderVA,
+#endif
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+    &rfbH264DecoderAVCodec,
+#endif
+    NULL
+};
+
+typedef struct {
+    rfbH264Decoder* decoder;
+    void* state;
+    rfbBool presented;              /* the decoder showed the last frame itself */
+#ifdef _DEBUG
+    FILE* dump;
+#endif
+} H264Data;
+
+static rfbBool
+HaveH264Decoder(rfbClient* client)
+{
+    return client->h264Decoder != NULL || h264Decoders[0] != NULL;
+}
+
+/* whether to ask the server for H.264; an extension of the application may
+   handle it even without a decoder */
+static rfbBool
+WantH264(rfbClient* client)
+{
+#ifdef LIBVNCSERVER_HAVE_ML_EXT_ENCODINGH264
+    (void)client;
+    return TRUE;
+#else
+    return HaveH264Decoder(client);
+#endif
+}
+
+static H264Data*
+GetH264Data(rfbClient* client)
+{
+    H264Data* data = (H264Data*)client->h264Data;
+    int i;
+
+    if (data != NULL)
+        return data;
+
+    data = calloc(1, sizeof(H264Data));
+    if (data == NULL)
+        return NULL;
+
+    if (client->h264Decoder != NULL) {
+        data->decoder = client->h264Decoder;
+        data->state = data->decoder->create(client);
+    } else {
+        for (i = 0; h264Decoders[i] != NULL && data->state == NULL; i++) {
+            data->decoder = h264Decoders[i];
+            data->state = data->decoder->create(client);
+        }
+    }
+
+    if (data->state == NULL) {
+        rfbClientErr("No H.264 decoder could be set up\n");
+        free(data);
+        return NULL;
+    }
+    rfbClientLog("Decoding H.264 with %s\n", data->decoder->name);
+
+    client->h264Data = data;
+    return data;
+}
+
+void
+FreeH264Decoder(rfbClient* client)
+{
+    H264Data* data = (H264Data*)client->h264Data;
+
+    if (data == NULL)
+        return;
+    data->decoder->destroy(data->state);
+#ifdef _DEBUG
+    if (data->dump)
+        fclose(data->dump);
+#endif
+    free(data);
+    client->h264Data = NULL;
+}
+
+/*
+ * The conversion from YUV to RGB uses the coefficients of BT.601 for video
+ * range in 13 bit fixed point: R = 1.164 (Y - 16) + 1.596 (V - 128) and so
+ * on.  The SSE2 version computes exactly the same as the plain one.
+ */
+
+#define YUV_SHIFT 13
+#define YUV_Y     9535          /* 1.164 */
+#define YUV_RV    13074         /* 1.596 */
+#define YUV_GU    (-3203)       /* -0.391 */
+#define YUV_GV    (-6660)       /* -0.813 */
+#define YUV_BU    16531         /* 2.018 */
+
+#define YUV_CLAMP(c) ((c) < 0 ? 0 : ((c) > 255 ? 255 : (c)))
+
+/* two 16 bit coefficients for _mm_madd_epi16, lo for the even word */
+#define YUV_PAIR(lo, hi) ((int)(((unsigned int)(hi) << 16) | ((lo) & 0xffff)))
+
+static void
+ConvertYUVRow32(uint32_t* dst, const uint8_t* y, const uint8_t* u, const uint8_t* v,
+                int uvStep, int x, int w, rfbPixelFormat* format)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    /* eight pixels at a time, starting at an even x */
+    if (x & 1) {
+        i = 1;
+    }
+    if (w - i >= 8) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i cRV = _mm_set1_epi32(YUV_PAIR(YUV_Y, YUV_RV));
+        const __m128i cGU = _mm_set1_epi32(YUV_PAIR(YUV_Y, YUV_GU));
+        const __m128i cGV = _mm_set1_epi32(YUV_PAIR(YUV_GV, 1 << (YUV_SHIFT - 1)));
+        const __m128i cBU = _mm_set1_epi32(YUV_PAIR(YUV_Y, YUV_BU));
+        const __m128i round = _mm_set1_epi32(1 << (YUV_SHIFT - 1));
+        const __m128i one = _mm_set1_epi16(1);
+        const __m128i c16 = _mm_set1_epi16(16), c128 = _mm_set1_epi16(128);
+        const __m128i lowWords = _mm_set1_epi32(0xffff);
+        const __m128i max = _mm_set1_epi16(255);
+        const __m128i rShift = _mm_cvtsi32_si128(format->redShift);
+        const __m128i gShift = _mm_cvtsi32_si128(format->greenShift);
+        const __m128i bShift = _mm_cvtsi32_si128(format->blueShift);
+
+        for (; i + 8 <= w; i += 8) {
+            int cx = (x + i) / 2;
+            __m128i yy, uu, vv, c, d, e, lo, hi, r, g, b;
+
+            yy = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(y + i)), zero);
+            if (uvStep == 2) {
+                /* U V U V U V U V -> U0 U0 U1 U1 ... and V0 V0 V1 V1 ... */
+                __m128i uv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + 2 * cx)), zero);
+                uu = _mm_and_si128(uv, lowWords);
+                vv = _mm_srli_epi32(uv, 16);
+            } else {
+                int u4, v4;
+                memcpy(&u4, u + cx, 4);
+                memcpy(&v4, v + cx, 4);
+                uu = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(u4), zero), zero);
+                vv = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v4), zero), zero);
             }
+            uu = _mm_or_si128(uu, _mm_slli_epi32(uu, 16));
+            vv = _mm_or_si128(vv, _mm_slli_epi32(vv, 16));
+
+            c = _mm_sub_epi16(yy, c16);
+            d = _mm_sub_epi16(uu, c128);
+            e = _mm_sub_epi16(vv, c128);
+
+            /* R = Y * c + V * rv */
+            lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(c, e), cRV), round);
+            hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(c, e), cRV), round);
+            r = _mm_packs_epi32(_mm_srai_epi32(lo, YUV_SHIFT), _mm_srai_epi32(hi, YUV_SHIFT));
+
+            /* G = Y * c + U * gu + V * gv (+ rounding as V's partner 1) */
+            lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(c, d), cGU),
+                               _mm_madd_epi16(_mm_unpacklo_epi16(e, one), cGV));
+            hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(c, d), cGU),
+                               _mm_madd_epi16(_mm_unpackhi_epi16(e, one), cGV));
+            g = _mm_packs_epi32(_mm_srai_epi32(lo, YUV_SHIFT), _mm_srai_epi32(hi, YUV_SHIFT));
+
+            /* B = Y * c + U * bu */
+            lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(c, d), cBU), round);
+            hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(c, d), cBU), round);
+            b = _mm_packs_epi32(_mm_srai_epi32(lo, YUV_SHIFT), _mm_srai_epi32(hi, YUV_SHIFT));
+
+            r = _mm_min_epi16(_mm_max_epi16(r, zero), max);
+            g = _mm_min_epi16(_mm_max_epi16(g, zero), max);
+            b = _mm_min_epi16(_mm_max_epi16(b, zero), max);
+
+            lo = _mm_or_si128(_mm_or_si128(
+                     _mm_sll_epi32(_mm_unpacklo_epi16(r, zero), rShift),
+                     _mm_sll_epi32(_mm_unpacklo_epi16(g, zero), gShift)),
+                     _mm_sll_epi32(_mm_unpacklo_epi16(b, zero), bShift));
+            hi = _mm_or_si128(_mm_or_si128(
+                     _mm_sll_epi32(_mm_unpackhi_epi16(r, zero), rShift),
+                     _mm_sll_epi32(_mm_unpackhi_epi16(g, zero), gShift)),
+                     _mm_sll_epi32(_mm_unpackhi_epi16(b, zero), bShift));
+            _mm_storeu_si128((__m128i*)(dst + i), lo);
+            _mm_storeu_si128((__m128i*)(dst + i + 4), hi);
         }
+    }
+    if (x & 1) {
+        /* the first pixel, skipped above */
+        int c = YUV_Y * (y[0] - 16), d = u[uvStep * (x / 2)] - 128, e = v[uvStep * (x / 2)] - 128;
+        int r = (c + YUV_RV * e + (1 << (YUV_SHIFT - 1))) >> YUV_SHIFT;
+        int g = (c + YUV_GU * d + YUV_GV * e + (1 << (YUV_SHIFT - 1))) >> YUV_SHIFT;
+        int b = (c + YUV_BU * d + (1 << (YUV_SHIFT - 1))) >> YUV_SHIFT;
+
+        if (w > 0)
+            dst[0] = (uint32_t)YUV_CLAMP(r) << format->redShift |
+                     (uint32_t)YUV_CLAMP(g) << format->greenShift |
+                     (uint32_t)YUV_CLAMP(b) << format->blueShift;
+    }
+#endif
 
-        nv12_y  += 2 * vaImage.pitches[0];
-        nv12_uv += vaImage.pitches[1];
-        dst     += 2 * client->width;
+    for (; i < w; i++) {
+        int cx = (x + i) / 2;
+        int c = YUV_Y * (y[i] - 16), d = u[uvStep * cx] - 128, e = v[uvStep * cx] - 128;
+        int r = (c + YUV_RV * e + (1 << (YUV_SHIFT - 1))) >> YUV_SHIFT;
+        int g = (c + YUV_GU * d + YUV_GV * e + (1 << (YUV_SHIFT - 1))) >> YUV_SHIFT;
+        int b = (c + YUV_BU * d + (1 << (YUV_SHIFT - 1))) >> YUV_SHIFT;
+
+        dst[i] = (uint32_t)YUV_CLAMP(r) << format->redShift |
+                 (uint32_t)YUV_CLAMP(g) << format->greenShift |
+                 (uint32_t)YUV_CLAMP(b) << format->blueShift;
     }
+}
 
-    CHECK_SURF(va_surface_id[sid]);
-    va_status = vaUnmapBuffer(va_dpy, vaImage.buf);
-    CHECK_VASTATUS(va_status, "vaUnmapBuffer(DecodedData)");
+static void
+ConvertYUVRow16(uint16_t* dst, const uint8_t* y, const uint8_t* u, const uint8_t* v,
+                int uvStep, int x, int w, rfbPixelFormat* format)
+{
+    int i;
+
+    for (i = 0; i < w; i++) {
+        int cx = (x + i) / 2;
+        int c = YUV_Y * (y[i] - 16), d = u[uvStep * cx] - 128, e = v[uvStep * cx] - 128;
+        int r = (c + YUV_RV * e + (1 << (YUV_SHIFT - 1))) >> YUV_SHIFT;
+        int g = (c + YUV_GU * d + YUV_GV * e + (1 << (YUV_SHIFT - 1))) >> YUV_SHIFT;
+        int b = (c + YUV_BU * d + (1 << (YUV_SHIFT - 1))) >> YUV_SHIFT;
+
+        dst[i] = (uint16_t)((YUV_CLAMP(r) * format->redMax + 127) / 255 << format->redShift |
+                            (YUV_CLAMP(g) * format->greenMax + 127) / 255 << format->greenShift |
+                            (YUV_CLAMP(b) * format->blueMax + 127) / 255 << format->blueShift);
+    }
 }
 
-#endif /* LIBVNCSERVER_CONFIG_LIBVA */
+void
+rfbH264ConvertPicture(rfbClient* client, const rfbH264Picture* picture,
+                      int x, int y, int w, int h)
+{
+    int bpp = client->format.bitsPerPixel / 8, row;
+
+    DebugLog(("%s: converting region (%d, %d)-(%d, %d) to RGB\n", __FUNCTION__, x, y, w, h));
+
+    /* the picture covers the frame buffer from its top left corner */
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > picture->width) w = picture->width - x;
+    if (y + h > picture->height) h = picture->height - y;
+    if (x + w > client->width) w = client->width - x;
+    if (y + h > client->height) h = client->height - y;
+    if (w <= 0 || h <= 0 || client->frameBuffer == NULL)
+        return;
+
+    for (row = y; row < y + h; row++) {
+        const uint8_t* yRow = picture->y + row * picture->yPitch + x;
+        const uint8_t* uRow = picture->u + (row / 2) * picture->uvPitch;
+        const uint8_t* vRow = picture->v + (row / 2) * picture->uvPitch;
+        uint8_t* dst = client->frameBuffer + (row * client->width + x) * bpp;
+
+        if (bpp == 4)
+            ConvertYUVRow32((uint32_t*)dst, yRow, uRow, vRow, picture->uvStep, x, w, &client->format);
+        else if (bpp == 2)
+            ConvertYUVRow16((uint16_t*)dst, yRow, uRow, vRow, picture->uvStep, x, w, &client->format);
+    }
+}
+
+/* libavcodec reads a little past the end of the data */
+#define H264_INPUT_PADDING 64
+
+static rfbBool
+HandleH264 (rfbClient* client, int rx, int ry, int rw, int rh)
+{
+    rfbH264Header hdr;
+    H264Data* data;
+    rfbH264Picture picture;
+    uint8_t *framedata;
+
+    DebugLog(("Framebuffer update with H264 (x: %d, y: %d, w: %d, h: %d)\n", rx, ry, rw, rh));
+
+    /* First, read the frame size and allocate buffer to store the data */
+    if (!ReadFromRFBServer(client, (char *)&hdr, sz_rfbH264Header))
+        return FALSE;
+
+    hdr.slice_type = rfbClientSwap32IfLE(hdr.slice_type);
+    hdr.nBytes = rfbClientSwap32IfLE(hdr.nBytes);
+    hdr.width = rfbClientSwap32IfLE(hdr.width);
+    hdr.height = rfbClientSwap32IfLE(hdr.height);
+
+    if (hdr.nBytes > 64 * 1024 * 1024) {
+        rfbClientErr("H.264 frame of %u bytes is too large\n", (unsigned int)hdr.nBytes);
+        return FALSE;
+    }
+
+    data = GetH264Data(client);
+
+    /* Decode frame if frame data was sent. Server only sends frame data for the first
+     * framebuffer update message for a particular frame buffer contents.
+     * If more than 1 rectangle is updated, the messages after the first one (with
+     * the H.264 frame) have nBytes == 0.
+     */
+    if (hdr.nBytes > 0) {
+        framedata = malloc(hdr.nBytes + H264_INPUT_PADDING);
+        if (framedata == NULL) {
+            rfbClientErr("Cannot allocate %u bytes for an H.264 frame\n", (unsigned int)hdr.nBytes);
+            return FALSE;
+        }
+
+        /* Obtain frame data from the server */
+        DebugLog(("Reading %d bytes of frame data (type: %d)\n", hdr.nBytes, hdr.slice_type));
+        if (!ReadFromRFBServer(client, (char *)framedata, hdr.nBytes)) {
+            free(framedata);
+            return FALSE;
+        }
+        memset(framedata + hdr.nBytes, 0, H264_INPUT_PADDING);
+
+        if (data == NULL) {
+            free(framedata);
+            return FALSE;
+        }
+
+#ifdef _DEBUG
+        /* a copy of the stream, to be played with e.g. mplayer */
+        if (!data->dump)
+            data->dump = fopen("./bb.mp4", "w");
+        if (data->dump) {
+            fwrite(framedata, 1, hdr.nBytes, data->dump);
+            fflush(data->dump);
+        }
+#endif
+
+        DebugLog(("  decoding %d bytes of H.264 data\n", hdr.nBytes));
+        if (!data->decoder->decode(data->state, framedata, hdr.nBytes, hdr.slice_type,
+                                   hdr.width, hdr.height)) {
+            free(framedata);
+            return FALSE;
+        }
+        free(framedata);
+
+        data->presented = data->decoder->present != NULL &&
+            data->decoder->present(data->state, client, hdr.width, hdr.height);
+    } else if (data == NULL) {
+        return FALSE;
+    }
+
+    if (data->presented)
+        return TRUE;
+
+    DebugLog(("  updating rectangle (%d, %d)-(%d, %d)\n", rx, ry, rw, rh));
+    if (data->decoder->getPicture(data->state, &picture)) {
+        rfbH264ConvertPicture(client, &picture, rx, ry, rw, rh);
+        if (data->decoder->putPicture)
+            data->decoder->putPicture(data->state, &picture);
+    }
+
+    return TRUE;
+}
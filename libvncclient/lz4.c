@@ -0,0 +1,162 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * lz4.c - handle LZ4 encoding.
+ *
+ * This file shouldn't be compiled directly.  It is included once by
+ * rfbproto.c: the tiles hold plain pixels in the client's format, so a
+ * single function handles every pixel size.
+ */
+
+#define LZ4_TILE_BYTES (rfbLZ4TileWidth * rfbLZ4TileHeight * 4)
+
+/* at most this many workers decode one rectangle */
+#define LZ4_MAX_WORKERS RFB_MAX_WORKERS
+
+/* a worker is only worth it for at least this many tiles */
+#define LZ4_MIN_TILES_PER_WORKER 4
+
+typedef struct {
+  rfbClient* client;
+  int x, y, w, h;             /* the whole rectangle */
+  int firstTile, nTiles;
+  rfbBool result;
+} lz4DecodeWorker;
+
+/*
+ * client->lz4Offsets holds the lengths of the tiles as sent (including the
+ * raw flag) in its first nTiles entries and where the data of each tile
+ * starts in client->lz4Buffer in the next nTiles.
+ */
+
+static void
+DecodeLZ4Tiles(void* arg)
+{
+  lz4DecodeWorker* worker = (lz4DecodeWorker*)arg;
+  rfbClient* client = worker->client;
+  int nTiles = ((worker->w + rfbLZ4TileWidth - 1) / rfbLZ4TileWidth) *
+    ((worker->h + rfbLZ4TileHeight - 1) / rfbLZ4TileHeight);
+  int tilesPerRow = (worker->w + rfbLZ4TileWidth - 1) / rfbLZ4TileWidth;
+  int bpp = client->format.bitsPerPixel / 8;
+  unsigned char tile[LZ4_TILE_BYTES];
+  int t;
+
+  worker->result = FALSE;
+
+  for (t = worker->firstTile; t < worker->firstTile + worker->nTiles; t++) {
+    int tx = (t % tilesPerRow) * rfbLZ4TileWidth;
+    int ty = (t / tilesPerRow) * rfbLZ4TileHeight;
+    int tw = worker->w - tx, th = worker->h - ty, rawLength;
+    uint32_t length = client->lz4Offsets[t];
+    unsigned char* data = (unsigned char*)client->lz4Buffer
+      + client->lz4Offsets[nTiles + t];
+
+    if (tw > rfbLZ4TileWidth)
+      tw = rfbLZ4TileWidth;
+    if (th > rfbLZ4TileHeight)
+      th = rfbLZ4TileHeight;
+    rawLength = tw * th * bpp;
+
+    if (length & rfbLZ4TileRaw) {
+      if ((int)(length & ~rfbLZ4TileRaw) != rawLength) {
+	rfbClientLog("LZ4: raw tile %d has %d bytes instead of %d\n",
+		     t, (int)(length & ~rfbLZ4TileRaw), rawLength);
+	return;
+      }
+      CopyRectangle(client, data, worker->x + tx, worker->y + ty, tw, th);
+    } else {
+      if (lz4DecompressBlock(data, length, tile, rawLength) != rawLength) {
+	rfbClientLog("LZ4: tile %d is corrupt\n", t);
+	return;
+      }
+      CopyRectangle(client, tile, worker->x + tx, worker->y + ty, tw, th);
+    }
+  }
+
+  worker->result = TRUE;
+}
+
+static rfbBool
+HandleLZ4 (rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  lz4DecodeWorker workers[LZ4_MAX_WORKERS];
+  int tilesPerRow = (rw + rfbLZ4TileWidth - 1) / rfbLZ4TileWidth;
+  int nTiles = tilesPerRow * ((rh + rfbLZ4TileHeight - 1) / rfbLZ4TileHeight);
+  int nWorkers = rfbWorkerCount(nTiles, LZ4_MIN_TILES_PER_WORKER, LZ4_MAX_WORKERS);
+  int bpp = client->format.bitsPerPixel / 8;
+  int i, t, total = 0;
+
+  if (nTiles == 0)
+    return TRUE;
+
+  if (client->lz4OffsetsSize < 2 * nTiles) {
+    free(client->lz4Offsets);
+    client->lz4Offsets = (uint32_t*) malloc(2 * nTiles * sizeof(uint32_t));
+    client->lz4OffsetsSize = client->lz4Offsets ? 2 * nTiles : 0;
+    if (client->lz4Offsets == NULL)
+      return FALSE;
+  }
+
+  if (!ReadFromRFBServer(client, (char *)client->lz4Offsets, nTiles * sizeof(uint32_t)))
+    return FALSE;
+
+  for (t = 0; t < nTiles; t++) {
+    uint32_t length = rfbClientSwap32IfLE(client->lz4Offsets[t]);
+
+    /* a tile never gets bigger than its raw pixels */
+    if ((length & ~rfbLZ4TileRaw) > (uint32_t)(rfbLZ4TileWidth * rfbLZ4TileHeight * bpp)) {
+      rfbClientLog("LZ4: tile %d is too long (%u bytes)\n", t,
+		   (unsigned int)(length & ~rfbLZ4TileRaw));
+      return FALSE;
+    }
+    client->lz4Offsets[t] = length;
+    client->lz4Offsets[nTiles + t] = total;
+    total += length & ~rfbLZ4TileRaw;
+  }
+
+  if (client->lz4BufferSize < total) {
+    free(client->lz4Buffer);
+    client->lz4Buffer = (char*) malloc(total);
+    client->lz4BufferSize = client->lz4Buffer ? total : 0;
+    if (client->lz4Buffer == NULL)
+      return FALSE;
+  }
+
+  if (!ReadFromRFBServer(client, client->lz4Buffer, total))
+    return FALSE;
+
+  for (i = 0, t = 0; i < nWorkers; i++) {
+    workers[i].client = client;
+    workers[i].x = rx;
+    workers[i].y = ry;
+    workers[i].w = rw;
+    workers[i].h = rh;
+    workers[i].firstTile = t;
+    workers[i].nTiles = (nTiles - t) / (nWorkers - i);
+    t += workers[i].nTiles;
+  }
+
+  /* the tiles cover separate parts of the frame buffer, so the workers do
+     not need any locking */
+  RunWorkers(client, nWorkers, DecodeLZ4Tiles, workers, sizeof(lz4DecodeWorker));
+
+  for (i = 0; i < nWorkers; i++)
+    if (!workers[i].result)
+      return FALSE;
+  return TRUE;
+}
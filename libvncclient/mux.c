@@ -0,0 +1,416 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * mux.c - drive many clients from one thread.
+ *
+ * The decoders read their data with ReadFromRFBServer() as they go, so a
+ * message cannot be handled before it has arrived completely without
+ * rewriting every one of them.  Instead HandleRFBServerMessage() runs on a
+ * stack of its own for each client (a ucontext coroutine): whenever a read
+ * would block, ReadFromRFBServer() calls rfbClientMuxWait(), which switches
+ * back to the loop in rfbClientMuxRun(), and the loop switches to the client
+ * again when its socket becomes readable.
+ *
+ * Where there is no ucontext (Windows, Android) a message is handled in one
+ * go once its first bytes are there, which is fine as long as the server
+ * sends its messages in one piece.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <rfb/rfbclient.h>
+#ifdef WIN32
+#undef SOCKET
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define MUX_EPOLL
+#elif !defined(WIN32)
+#include <poll.h>
+#endif
+
+#if !defined(WIN32) && !defined(__ANDROID__)
+#include <ucontext.h>
+#define MUX_COROUTINES
+/* the decoders keep tiles and such on the stack, and the callbacks of the
+   application run on it as well; pages not used are never touched */
+#define MUX_STACK_SIZE (512*1024)
+#endif
+
+#ifdef WIN32
+#define poll WSAPoll
+#endif
+
+/* at most this many events are fetched per epoll_wait */
+#define MUX_MAX_EVENTS 256
+
+typedef struct {
+  rfbClientMux* mux;
+  rfbClient* client;
+  int index;                  /* in mux->clients */
+#ifdef MUX_COROUTINES
+  ucontext_t context;
+  char* stack;
+  rfbBool started;            /* context has been set up */
+  rfbBool busy;               /* in the middle of HandleRFBServerMessage */
+#endif
+  rfbBool result;
+} muxClient;
+
+struct _rfbClientMux {
+  rfbClientMuxClosedProc closed;
+  muxClient** clients;
+  int nClients, clientsSize;
+#ifdef MUX_EPOLL
+  int epollFd;
+#else
+  struct pollfd* fds;
+#endif
+#ifdef MUX_COROUTINES
+  ucontext_t loop;
+  muxClient* current;         /* the client running on its own stack */
+#endif
+};
+
+
+rfbClientMux*
+rfbClientMuxNew(rfbClientMuxClosedProc closed)
+{
+  rfbClientMux* mux = calloc(1, sizeof(rfbClientMux));
+
+  if (mux == NULL)
+    return NULL;
+  mux->closed = closed;
+#ifdef MUX_EPOLL
+  mux->epollFd = epoll_create(MUX_MAX_EVENTS);
+  if (mux->epollFd < 0) {
+    rfbClientErr("rfbClientMuxNew: epoll_create (%s)\n", strerror(errno));
+    free(mux);
+    return NULL;
+  }
+#endif
+  return mux;
+}
+
+
+rfbBool
+rfbClientMuxAdd(rfbClientMux* mux, rfbClient* client)
+{
+  muxClient* c;
+
+  if (client->muxData) {
+    rfbClientErr("rfbClientMuxAdd: client is already driven by a mux\n");
+    return FALSE;
+  }
+
+  if (mux->nClients == mux->clientsSize) {
+    int size = mux->clientsSize ? 2 * mux->clientsSize : 64;
+    muxClient** clients = realloc(mux->clients, size * sizeof(muxClient*));
+
+    if (clients)
+      mux->clients = clients;
+#ifndef MUX_EPOLL
+    if (clients) {
+      struct pollfd* fds = realloc(mux->fds, size * sizeof(struct pollfd));
+
+      if (fds)
+        mux->fds = fds;
+      else
+        clients = NULL;
+    }
+#endif
+    if (clients == NULL) {
+      rfbClientErr("rfbClientMuxAdd: out of memory\n");
+      return FALSE;
+    }
+    mux->clientsSize = size;
+  }
+
+  c = calloc(1, sizeof(muxClient));
+  if (c == NULL) {
+    rfbClientErr("rfbClientMuxAdd: out of memory\n");
+    return FALSE;
+  }
+  c->mux = mux;
+  c->client = client;
+
+#ifdef MUX_EPOLL
+  {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(mux->epollFd, EPOLL_CTL_ADD, client->sock, &ev) < 0) {
+      rfbClientErr("rfbClientMuxAdd: epoll_ctl (%s)\n", strerror(errno));
+      free(c);
+      return FALSE;
+    }
+  }
+#endif
+
+  if (!SetNonBlocking(client->sock)) {
+#ifdef MUX_EPOLL
+    epoll_ctl(mux->epollFd, EPOLL_CTL_DEL, client->sock, NULL);
+#endif
+    free(c);
+    return FALSE;
+  }
+
+  c->index = mux->nClients;
+  mux->clients[mux->nClients++] = c;
+  client->muxData = c;
+  return TRUE;
+}
+
+
+void
+rfbClientMuxRemove(rfbClientMux* mux, rfbClient* client)
+{
+  muxClient* c = (muxClient*)client->muxData;
+
+  if (c == NULL || c->mux != mux)
+    return;
+
+#ifdef MUX_EPOLL
+  epoll_ctl(mux->epollFd, EPOLL_CTL_DEL, client->sock, NULL);
+#endif
+
+  /* keep the array dense, the order of the clients does not matter */
+  mux->clients[c->index] = mux->clients[--mux->nClients];
+  mux->clients[c->index]->index = c->index;
+
+#ifdef MUX_COROUTINES
+  free(c->stack);
+#endif
+  free(c);
+  client->muxData = NULL;
+}
+
+
+void
+rfbClientMuxDestroy(rfbClientMux* mux)
+{
+  while (mux->nClients > 0)
+    rfbClientMuxRemove(mux, mux->clients[0]->client);
+#ifdef MUX_EPOLL
+  close(mux->epollFd);
+#else
+  free(mux->fds);
+#endif
+  free(mux->clients);
+  free(mux);
+}
+
+
+#ifdef MUX_COROUTINES
+
+/*
+ * The body of every client coroutine: handle one message after the other,
+ * going back to the loop after each of them.  makecontext() only passes
+ * ints, so the pointer to the client comes in two halves.
+ */
+
+static void
+muxClientMain(unsigned int low, unsigned int high)
+{
+  muxClient* c = (muxClient*)(uintptr_t)(((unsigned long long)high << 32) | low);
+
+  for (;;) {
+    c->result = HandleRFBServerMessage(c->client);
+    c->busy = FALSE;
+    swapcontext(&c->context, &c->mux->loop);
+  }
+}
+
+#endif
+
+
+/*
+ * rfbClientMuxWait is called by ReadFromRFBServer when the socket of a client
+ * driven by a mux has no more data.  It returns FALSE if the client does not
+ * run on its own stack, so the caller has to wait for the data itself.
+ */
+
+rfbBool
+rfbClientMuxWait(rfbClient* client)
+{
+#ifdef MUX_COROUTINES
+  muxClient* c = (muxClient*)client->muxData;
+
+  if (c == NULL || !c->busy || c->mux->current != c)
+    return FALSE;
+  swapcontext(&c->context, &c->mux->loop);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+
+/*
+ * muxHandle lets a client handle what has arrived: it resumes a message
+ * waiting for more data, then starts new messages as long as there is
+ * buffered data.  Returns the number of messages completed, or -1 if the
+ * connection is over.
+ */
+
+static int
+muxHandle(rfbClientMux* mux, muxClient* c)
+{
+  /* volatile: it lives across swapcontext() */
+  volatile int handled = 0;
+
+  do {
+#ifdef MUX_COROUTINES
+    if (!c->started) {
+      c->stack = malloc(MUX_STACK_SIZE);
+      if (c->stack == NULL || getcontext(&c->context) < 0) {
+        rfbClientErr("muxHandle: cannot set up the stack of a client\n");
+        return -1;
+      }
+      c->context.uc_stack.ss_sp = c->stack;
+      c->context.uc_stack.ss_size = MUX_STACK_SIZE;
+      c->context.uc_link = NULL;
+      makecontext(&c->context, (void (*)(void))muxClientMain, 2,
+                  (unsigned int)(uintptr_t)c,
+                  (unsigned int)((unsigned long long)(uintptr_t)c >> 32));
+      c->started = TRUE;
+    }
+
+    /* not busy means a new message starts */
+    c->busy = TRUE;
+    mux->current = c;
+    swapcontext(&mux->loop, &c->context);
+    mux->current = NULL;
+    if (c->busy)
+      /* waiting for the rest of the message */
+      return handled;
+#else
+    c->result = HandleRFBServerMessage(c->client);
+#endif
+
+    if (!c->result)
+      return -1;
+    handled++;
+  } while (c->client->buffered > 0);
+
+  return handled;
+}
+
+
+/*
+ * muxReady is called for every client whose socket became readable (or
+ * closed); a client whose connection is over is removed and handed to the
+ * closed callback.
+ */
+
+static int
+muxReady(rfbClientMux* mux, muxClient* c)
+{
+  rfbClient* client = c->client;
+  int handled = muxHandle(mux, c);
+
+  if (handled < 0) {
+    rfbClientMuxRemove(mux, client);
+    if (mux->closed)
+      mux->closed(mux, client);
+    return 0;
+  }
+  return handled;
+}
+
+
+int
+rfbClientMuxRun(rfbClientMux* mux, unsigned int usecs)
+{
+  int i, n, handled = 0;
+#ifdef MUX_EPOLL
+  struct epoll_event events[MUX_MAX_EVENTS];
+#else
+  int nClients;
+  muxClient** ready;
+#endif
+
+  /* send the pipelined update requests that are due, and wake up in time
+     for the next ones */
+  for (i = 0; i < mux->nClients; i++) {
+    rfbClient* client = mux->clients[i]->client;
+    int due = SendPipelinedFramebufferUpdateRequests(client);
+
+    if (due == -2) {
+      /* the connection is over; the last client takes its place */
+      rfbClientMuxRemove(mux, client);
+      if (mux->closed)
+        mux->closed(mux, client);
+      i--;
+      continue;
+    }
+    if (due >= 0 && (unsigned int)due < usecs)
+      usecs = due;
+  }
+#ifdef MUX_EPOLL
+
+  n = epoll_wait(mux->epollFd, events, MUX_MAX_EVENTS, usecs / 1000 + (usecs % 1000 != 0));
+  if (n < 0) {
+    if (errno == EINTR)
+      return 0;
+    rfbClientErr("rfbClientMuxRun: epoll_wait (%s)\n", strerror(errno));
+    return -1;
+  }
+
+  for (i = 0; i < n; i++)
+    handled += muxReady(mux, (muxClient*)events[i].data.ptr);
+#else
+  nClients = mux->nClients;
+  for (i = 0; i < nClients; i++) {
+    mux->fds[i].fd = mux->clients[i]->client->sock;
+    mux->fds[i].events = POLLIN;
+    mux->fds[i].revents = 0;
+  }
+
+  n = poll(mux->fds, nClients, usecs / 1000 + (usecs % 1000 != 0));
+  if (n < 0) {
+    if (errno == EINTR)
+      return 0;
+    rfbClientErr("rfbClientMuxRun: poll (%s)\n", strerror(errno));
+    return -1;
+  }
+
+  if (n == 0)
+    return 0;
+
+  /* handling a client may remove it and reorder mux->clients */
+  ready = malloc(n * sizeof(muxClient*));
+  if (ready == NULL)
+    return -1;
+  for (i = 0, n = 0; i < nClients; i++)
+    if (mux->fds[i].revents)
+      ready[n++] = mux->clients[i];
+  for (i = 0; i < n; i++)
+    handled += muxReady(mux, ready[i]);
+  free(ready);
+#endif
+
+  return handled;
+}
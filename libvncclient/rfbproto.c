@@ -52,6 +52,7 @@
 #define HAVE_BOOLEAN
 #endif
 #include <jpeglib.h>
+#include "turbojpeg.h"
 #endif
 
 #ifndef _MSC_VER
@@ -61,12 +62,16 @@
 
 #include <stdarg.h>
 #include <time.h>
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #ifdef LIBVNCSERVER_WITH_CLIENT_GCRYPT
 #include <gcrypt.h>
 #endif
 
 #include "minilzo.h"
+#include "lz4block.h"
 #include "tls.h"
 
 #ifdef _MSC_VER
@@ -264,6 +269,8 @@ static void JpegSkipInputData(j_decompress_ptr cinfo, long num_bytes);
 static void JpegTermSource(j_decompress_ptr cinfo);
 static void JpegSetSrcManager(j_decompress_ptr cinfo, uint8_t *compressedData,
                               int compressedLen);
+static rfbBool FinishJpegRects(rfbClient* client);
+static rfbBool TakeQueuedJpegRect(rfbClient* client);
 #endif
 static rfbBool HandleZRLE8(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleZRLE15(rfbClient* client, int rx, int ry, int rw, int rh);
@@ -272,10 +279,26 @@ static rfbBool HandleZRLE24(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleZRLE24Up(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleZRLE24Down(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleZRLE32(rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool HandleZRLEStripes8(rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool HandleZRLEStripes15(rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool HandleZRLEStripes16(rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool HandleZRLEStripes24(rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool HandleZRLEStripes24Up(rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool HandleZRLEStripes24Down(rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool HandleZRLEStripes32(rfbClient* client, int rx, int ry, int rw, int rh);
 #endif
-#ifdef LIBVNCSERVER_CONFIG_LIBVA
 static rfbBool HandleH264 (rfbClient* client, int rx, int ry, int rw, int rh);
-#endif
+static rfbBool HaveH264Decoder(rfbClient* client);
+static rfbBool WantH264(rfbClient* client);
+static rfbBool HandleLZ4 (rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool WantSharedMemory(rfbClient* client);
+static rfbBool HandleSharedMemory(rfbClient* client, int rx, int ry, int rw, int rh);
+static rfbBool HandleSharedMemoryRect(rfbClient* client, int rx, int ry, int rw, int rh);
+
+/* vncrec.c */
+extern rfbBool OpenVNCRec(rfbClient* client);
+extern void RecordFrameBufferUpdate(rfbClient* client, int x, int y, int w, int h);
+extern void RecordFinishedUpdate(rfbClient* client);
 
 /*
  * Server Capability Functions
@@ -390,29 +413,7 @@ ConnectToRFBServer(rfbClient* client,const char *hostname, int port)
 {
   if (client->serverPort==-1) {
     /* serverHost is a file recorded by vncrec. */
-    const char* magic="vncLog0.0";
-    char buffer[10];
-    rfbVNCRec* rec = (rfbVNCRec*)malloc(sizeof(rfbVNCRec));
-    client->vncRec = rec;
-
-    rec->file = fopen(client->serverHost,"rb");
-    rec->tv.tv_sec = 0;
-    rec->readTimestamp = FALSE;
-    rec->doNotSleep = FALSE;
-    
-    if (!rec->file) {
-      rfbClientLog("Could not open %s.\n",client->serverHost);
-      return FALSE;
-    }
-    setbuf(rec->file,NULL);
-
-    if (fread(buffer,1,strlen(magic),rec->file) != strlen(magic) || strncmp(buffer,magic,strlen(magic))) {
-      rfbClientLog("File %s was not recorded by vncrec.\n",client->serverHost);
-      fclose(rec->file);
-      return FALSE;
-    }
-    client->sock = -1;
-    return TRUE;
+    return OpenVNCRec(client);
   }
 
 #ifndef WIN32
@@ -1358,6 +1359,8 @@ SetFormatAndEncodings(rfbClient* client)
 	  requestCompressLevel = TRUE;
       } else if (strncasecmp(encStr,"zrle",encStrLen) == 0) {
 	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingZRLE);
+      } else if (strncasecmp(encStr,"zrlestripes",encStrLen) == 0) {
+	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingZRLEStripes);
       } else if (strncasecmp(encStr,"zywrle",encStrLen) == 0) {
 	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingZYWRLE);
 	requestQualityLevel = TRUE;
@@ -1366,15 +1369,14 @@ SetFormatAndEncodings(rfbClient* client)
         /* There are 2 encodings used in 'ultra' */
         encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltra);
         encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltraZip);
+      } else if (strncasecmp(encStr,"lz4",encStrLen) == 0) {
+	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingLZ4);
       } else if (strncasecmp(encStr,"corre",encStrLen) == 0) {
 	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingCoRRE);
       } else if (strncasecmp(encStr,"rre",encStrLen) == 0) {
 	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingRRE);
-#if defined(LIBVNCSERVER_CONFIG_LIBVA) ||                                      \
-    defined(LIBVNCSERVER_HAVE_ML_EXT_ENCODINGH264)
-      } else if (strncasecmp(encStr,"h264",encStrLen) == 0) {
+      } else if (strncasecmp(encStr,"h264",encStrLen) == 0 && WantH264(client)) {
 	encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingH264);
-#endif
       } else {
 	rfbClientLog("Unknown encoding '%.*s'\n",encStrLen,encStr);
       }
@@ -1423,6 +1425,7 @@ SetFormatAndEncodings(rfbClient* client)
 #endif
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltra);
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingUltraZip);
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingLZ4);
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingCoRRE);
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingRRE);
 
@@ -1443,11 +1446,10 @@ SetFormatAndEncodings(rfbClient* client)
       encs[se->nEncodings++] = rfbClientSwap32IfLE(client->appData.qualityLevel +
 					  rfbEncodingQualityLevel0);
     }
-#if defined(LIBVNCSERVER_CONFIG_LIBVA) ||                                      \
-    defined(LIBVNCSERVER_HAVE_ML_EXT_ENCODINGH264)
-    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingH264);
-    rfbClientLog("h264 encoding added\n");
-#endif
+    if (WantH264(client)) {
+      encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingH264);
+      rfbClientLog("h264 encoding added\n");
+    }
   }
 
 
@@ -1462,6 +1464,10 @@ SetFormatAndEncodings(rfbClient* client)
       encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingPointerPos);
   }
 
+  /* pixels through shared memory, for local servers */
+  if (se->nEncodings < MAX_ENCODINGS && WantSharedMemory(client))
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingSharedMemory);
+
 #if 0
   /* Keyboard State Encodings */
   if (se->nEncodings < MAX_ENCODINGS)
@@ -1506,6 +1512,185 @@ SetFormatAndEncodings(rfbClient* client)
 }
 
 
+/*
+ * Pipelined update requests.
+ *
+ * With client->maxPendingUpdateRequests above 1 a request is sent as soon as
+ * an update starts to arrive, and more are sent in between, about one per
+ * frame time of the server, so that it has the next request at hand whenever
+ * it is done with a frame.  How many are kept outstanding follows the round
+ * trip time and the rate the updates come in at.
+ *
+ * Servers usually answer all the requests they have got with a single update,
+ * so an update is taken as the answer to the oldest outstanding request and
+ * to every other one sent longer ago than the shortest round trip seen.
+ */
+
+#define PIPELINE_MAX_REQUESTS 16
+
+/* outstanding requests older than this are given up on, in case the server
+   answered them with an update taken for the answer to an older one */
+#define PIPELINE_EXPIRY 1000000
+
+typedef struct {
+  int64_t sent[PIPELINE_MAX_REQUESTS];  /* outstanding requests, oldest first */
+  int first, nPending;
+  int target;                 /* how many to keep outstanding */
+  int64_t minRtt;             /* shortest round trip seen lately */
+  int64_t frameTime;          /* average time between updates */
+  int64_t lastUpdate;         /* when the previous update arrived */
+  int64_t lastAttempt;        /* when a request was last sent or skipped */
+} UpdatePipeline;
+
+static int64_t
+PipelineNow(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static UpdatePipeline*
+GetUpdatePipeline(rfbClient* client)
+{
+  if (client->maxPendingUpdateRequests <= 1)
+    return NULL;
+
+  if (client->updatePipeline == NULL) {
+    UpdatePipeline* p = calloc(1, sizeof(UpdatePipeline));
+
+    if (p == NULL)
+      return NULL;
+    p->target = 1;
+    client->updatePipeline = p;
+  }
+  return (UpdatePipeline*)client->updatePipeline;
+}
+
+/* the requests are spread evenly over a round trip */
+static int64_t
+PipelineSpacing(UpdatePipeline* p)
+{
+  int64_t spacing = p->minRtt / p->target;
+
+  return spacing < 1000 ? 1000 : spacing;
+}
+
+static void
+PipelineDropOldest(UpdatePipeline* p)
+{
+  p->first = (p->first + 1) % PIPELINE_MAX_REQUESTS;
+  p->nPending--;
+}
+
+static void
+PipelineRequestSent(UpdatePipeline* p, int64_t now)
+{
+  if (p->nPending == PIPELINE_MAX_REQUESTS)
+    PipelineDropOldest(p);
+  p->sent[(p->first + p->nPending) % PIPELINE_MAX_REQUESTS] = now;
+  p->nPending++;
+}
+
+/*
+ * PipelineUpdateArrived is called when an update starts to arrive.  It takes
+ * the answered requests off and adapts the number to keep outstanding.
+ * Returns NULL if the requests are not pipelined.
+ */
+
+static UpdatePipeline*
+PipelineUpdateArrived(rfbClient* client)
+{
+  UpdatePipeline* p = GetUpdatePipeline(client);
+  int64_t now;
+  int maxPending;
+
+  if (p == NULL)
+    return NULL;
+  now = PipelineNow();
+
+  if (p->nPending > 0) {
+    int64_t rtt = now - p->sent[p->first];
+
+    /* an update may have been held back until something changed, so the
+       shortest time seen is the round trip; it creeps up slowly in case the
+       route got longer */
+    if (p->minRtt == 0 || rtt < p->minRtt)
+      p->minRtt = rtt;
+    else if (rtt - p->minRtt < p->minRtt)
+      p->minRtt += (rtt - p->minRtt) / 64;
+    else
+      p->minRtt += p->minRtt / 64;
+
+    PipelineDropOldest(p);
+    while (p->nPending > 0 && now - p->sent[p->first] >= p->minRtt)
+      PipelineDropOldest(p);
+  }
+
+  if (p->lastUpdate != 0) {
+    int64_t interval = now - p->lastUpdate;
+
+    if (interval > PIPELINE_EXPIRY)
+      interval = PIPELINE_EXPIRY;
+    if (p->frameTime == 0)
+      p->frameTime = interval;
+    else
+      p->frameTime += (interval - p->frameTime) / 8;
+  }
+  p->lastUpdate = now;
+
+  /* while the updates come as fast as they are asked for, ask for more;
+     otherwise the server is the limit, and enough requests to cover a round
+     trip at its frame rate, plus the one being answered, keep it busy */
+  if (p->frameTime > 0) {
+    if (p->frameTime * 4 <= PipelineSpacing(p) * 5)
+      p->target++;
+    else
+      p->target = (int)((p->minRtt + p->frameTime - 1) / p->frameTime) + 1;
+  }
+  maxPending = client->maxPendingUpdateRequests;
+  if (maxPending > PIPELINE_MAX_REQUESTS)
+    maxPending = PIPELINE_MAX_REQUESTS;
+  if (p->target > maxPending)
+    p->target = maxPending;
+
+  return p;
+}
+
+
+int
+SendPipelinedFramebufferUpdateRequests(rfbClient* client)
+{
+  UpdatePipeline* p = GetUpdatePipeline(client);
+  int64_t now, spacing, due;
+
+  if (p == NULL)
+    return -1;
+  now = PipelineNow();
+
+  while (p->nPending > 0 && now - p->sent[p->first] >= PIPELINE_EXPIRY)
+    PipelineDropOldest(p);
+
+  spacing = PipelineSpacing(p);
+
+  if (p->nPending < p->target) {
+    due = p->lastAttempt + spacing;
+    if (now < due)
+      return (int)(due - now);
+    /* this sets lastAttempt, even if the request is held back */
+    if (!SendIncrementalFramebufferUpdateRequest(client))
+      return -2;
+    if (p->nPending < p->target)
+      return (int)spacing;
+  }
+
+  if (p->nPending == 0)
+    return -1;
+  return (int)(p->sent[p->first] + PIPELINE_EXPIRY - now);
+}
+
+
 /*
  * SendIncrementalFramebufferUpdateRequest.
  */
@@ -1527,9 +1712,16 @@ rfbBool
 SendFramebufferUpdateRequest(rfbClient* client, int x, int y, int w, int h, rfbBool incremental)
 {
   rfbFramebufferUpdateRequestMsg fur;
+  UpdatePipeline* pipeline;
 
   if (!SupportsClient2Server(client, rfbFramebufferUpdateRequest)) return TRUE;
 
+  /* while the frame buffer is blocked, a pipelined request is tried again
+     one frame time later */
+  pipeline = GetUpdatePipeline(client);
+  if (pipeline)
+    pipeline->lastAttempt = PipelineNow();
+
 #ifdef LIBVNCSERVER_HAVE_ML_EXT
   extern int __vnc_fb_is_blocking(rfbClient * client);
   if (__vnc_fb_is_blocking(client)) {
@@ -1547,6 +1739,9 @@ SendFramebufferUpdateRequest(rfbClient* client, int x, int y, int w, int h, rfbB
   if (!WriteToRFBServer(client, (char *)&fur, sz_rfbFramebufferUpdateRequestMsg))
     return FALSE;
 
+  if (pipeline)
+    PipelineRequestSent(pipeline, pipeline->lastAttempt);
+
 #ifdef LIBVNCSERVER_HAVE_ML_EXT
   extern void __vnc_fb_update_req_sent(rfbClient * cl);
   __vnc_fb_update_req_sent(client);
@@ -1803,6 +1998,7 @@ HandleRFBServerMessage(rfbClient* client)
     int linesToRead;
     int bytesPerLine;
     int i;
+    UpdatePipeline* pipeline;
 
     if (!ReadFromRFBServer(client, ((char *)&msg.fu) + 1,
 			   sz_rfbFramebufferUpdateMsg - 1))
@@ -1810,6 +2006,13 @@ HandleRFBServerMessage(rfbClient* client)
 
     msg.fu.nRects = rfbClientSwap16IfLE(msg.fu.nRects);
 
+    /* with pipelined requests, the server gets the next one before this
+       update is decoded */
+    pipeline = PipelineUpdateArrived(client);
+    if (pipeline && pipeline->nPending < pipeline->target &&
+        !SendIncrementalFramebufferUpdateRequest(client))
+      return FALSE;
+
     for (i = 0; i < msg.fu.nRects; i++) {
       if (!ReadFromRFBServer(client, (char *)&rect, sz_rfbFramebufferUpdateRectHeader))
 	return FALSE;
@@ -1823,6 +2026,12 @@ HandleRFBServerMessage(rfbClient* client)
       rect.r.w = rfbClientSwap16IfLE(rect.r.w);
       rect.r.h = rfbClientSwap16IfLE(rect.r.h);
 
+#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+      /* tight waits for JPEG rectangles still being decoded itself, if it
+         has to */
+      if (rect.encoding != rfbEncodingTight && !FinishJpegRects(client))
+        return FALSE;
+#endif
 
       if (rect.encoding == rfbEncodingXCursor ||
 	  rect.encoding == rfbEncodingRichCursor) {
@@ -1853,6 +2062,10 @@ HandleRFBServerMessage(rfbClient* client)
       }
 
       if (rect.encoding == rfbEncodingNewFBSize) {
+	/* recordings repeat the size with every keyframe */
+	if (client->serverPort == -1 && client->frameBuffer &&
+	    rect.r.w == client->width && rect.r.h == client->height)
+	  continue;
 	client->width = rect.r.w;
 	client->height = rect.r.h;
 	client->updateRect.x = client->updateRect.y = 0;
@@ -1869,6 +2082,13 @@ HandleRFBServerMessage(rfbClient* client)
 	continue;
       }
 
+      if (rect.encoding == rfbEncodingSharedMemory && rect.r.w == 0 && rect.r.h == 0) {
+	/* the server withdraws the shared memory */
+	if (!HandleSharedMemory(client, 0, 0, 0, 0))
+	  return FALSE;
+	continue;
+      }
+
       /* rect.r.w=byte count */
       if (rect.encoding == rfbEncodingSupportedMessages) {
           int loop;
@@ -1958,6 +2178,19 @@ HandleRFBServerMessage(rfbClient* client)
 	int y=rect.r.y, h=rect.r.h;
 
 	bytesPerLine = rect.r.w * client->format.bitsPerPixel / 8;
+
+	/* the rows go straight into the frame buffer */
+	if (client->frameBuffer != NULL && (client->format.bitsPerPixel == 8 ||
+	    client->format.bitsPerPixel == 16 || client->format.bitsPerPixel == 32)) {
+	  int stride = client->width * client->format.bitsPerPixel / 8;
+
+	  if (!ReadRectFromRFBServer(client, (char *)client->frameBuffer
+		  + y * stride + rect.r.x * client->format.bitsPerPixel / 8,
+		  stride, bytesPerLine, h))
+	    return FALSE;
+	  break;
+	}
+
 	linesToRead = RFB_BUFFER_SIZE / bytesPerLine;
 
 	while (h > 0) {
@@ -2078,6 +2311,24 @@ HandleRFBServerMessage(rfbClient* client)
         }
         break;
       }
+      case rfbEncodingLZ4:
+      {
+        if (!HandleLZ4(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+          return FALSE;
+        break;
+      }
+      case rfbEncodingSharedMemory:
+      {
+        if (!HandleSharedMemory(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+          return FALSE;
+        break;
+      }
+      case rfbEncodingSharedMemoryRect:
+      {
+        if (!HandleSharedMemoryRect(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+          return FALSE;
+        break;
+      }
       case rfbEncodingUltraZip:
       {
         switch (client->format.bitsPerPixel) {
@@ -2142,18 +2393,22 @@ HandleRFBServerMessage(rfbClient* client)
 	client->appData.qualityLevel = 9;
 	/* fall through */
       case rfbEncodingZYWRLE:
+      case rfbEncodingZRLEStripes:
       {
+	/* ZRLEStripes rectangles carry their own ZYWRLE level */
+	rfbBool stripes = (rect.encoding == rfbEncodingZRLEStripes);
+
 	switch (client->format.bitsPerPixel) {
 	case 8:
-	  if (!HandleZRLE8(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	  if (!(stripes ? HandleZRLEStripes8 : HandleZRLE8)(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
 	    return FALSE;
 	  break;
 	case 16:
 	  if (client->si.format.greenMax > 0x1F) {
-	    if (!HandleZRLE16(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    if (!(stripes ? HandleZRLEStripes16 : HandleZRLE16)(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
 	      return FALSE;
 	  } else {
-	    if (!HandleZRLE15(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    if (!(stripes ? HandleZRLEStripes15 : HandleZRLE15)(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
 	      return FALSE;
 	  }
 	  break;
@@ -2164,15 +2419,15 @@ HandleRFBServerMessage(rfbClient* client)
 		(client->format.blueMax<<client->format.blueShift);
 	  if ((client->format.bigEndian && (maxColor&0xff)==0) ||
 	      (!client->format.bigEndian && (maxColor&0xff000000)==0)) {
-	    if (!HandleZRLE24(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    if (!(stripes ? HandleZRLEStripes24 : HandleZRLE24)(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
 	      return FALSE;
 	  } else if (!client->format.bigEndian && (maxColor&0xff)==0) {
-	    if (!HandleZRLE24Up(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    if (!(stripes ? HandleZRLEStripes24Up : HandleZRLE24Up)(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
 	      return FALSE;
 	  } else if (client->format.bigEndian && (maxColor&0xff000000)==0) {
-	    if (!HandleZRLE24Down(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	    if (!(stripes ? HandleZRLEStripes24Down : HandleZRLE24Down)(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
 	      return FALSE;
-	  } else if (!HandleZRLE32(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	  } else if (!(stripes ? HandleZRLEStripes32 : HandleZRLE32)(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
 	    return FALSE;
 	  break;
 	}
@@ -2181,14 +2436,15 @@ HandleRFBServerMessage(rfbClient* client)
      }
 
 #endif
-#ifdef LIBVNCSERVER_CONFIG_LIBVA
-     /* use extension handler for 'LIBVNCSERVER_HAVE_ML_EXT_ENCODINGH264' */
-     case rfbEncodingH264: {
-       if (!HandleH264(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h))
-         return FALSE;
-       break;
-      }
-#endif
+     case rfbEncodingH264:
+       /* without a decoder, leave it to the extension handlers
+          ('LIBVNCSERVER_HAVE_ML_EXT_ENCODINGH264') */
+       if (HaveH264Decoder(client)) {
+         if (!HandleH264(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h))
+           return FALSE;
+         break;
+       }
+       /* fall through */
 
       default:
 	 {
@@ -2207,15 +2463,30 @@ HandleRFBServerMessage(rfbClient* client)
 	 }
       }
 
+#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+      /* reported by FinishJpegRects once it is decoded */
+      if (TakeQueuedJpegRect(client))
+        continue;
+#endif
+
       /* Now we may discard "soft cursor locks". */
       client->SoftCursorUnlockScreen(client);
 
+      if (client->vncRecorder)
+        RecordFrameBufferUpdate(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
       client->GotFrameBufferUpdate(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
     }
 
-    if (!SendIncrementalFramebufferUpdateRequest(client))
+    if (!pipeline && !SendIncrementalFramebufferUpdateRequest(client))
+      return FALSE;
+
+#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+    if (!FinishJpegRects(client))
       return FALSE;
+#endif
 
+    if (client->vncRecorder)
+      RecordFinishedUpdate(client);
     if (client->FinishedFrameBufferUpdate)
       client->FinishedFrameBufferUpdate(client);
 
@@ -2388,6 +2659,8 @@ HandleRFBServerMessage(rfbClient* client)
 #define CONCAT3(a,b,c) a##b##c
 #define CONCAT3E(a,b,c) CONCAT3(a,b,c)
 
+#include "workers.c"
+
 #define BPP 8
 #include "rre.c"
 #include "corre.c"
@@ -2426,6 +2699,8 @@ HandleRFBServerMessage(rfbClient* client)
 #include "zrle.c"
 #undef BPP
 #include "h264.c"
+#include "lz4.c"
+#include "shm.c"
 
 
 /*
@@ -0,0 +1,203 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * shm.c - handle the SharedMemory pseudo-encoding.
+ *
+ * This file shouldn't be compiled directly.  It is included once by
+ * rfbproto.c.  On a UNIX socket the server may hand out memory holding
+ * the frame buffer; the rectangles of an update then carry no pixels, they
+ * are copied out of that memory.
+ */
+
+#ifndef WIN32
+
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+typedef struct {
+  char* map;
+  size_t size;
+  int width, height, bytesPerLine;
+} SharedMemoryData;
+
+static rfbBool
+WantSharedMemory(rfbClient* client)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+
+  if (client->sock < 0 || client->tlsSession)
+    return FALSE;
+  if (getsockname(client->sock, (struct sockaddr *)&addr, &addrlen) < 0)
+    return FALSE;
+  return addr.ss_family == AF_UNIX;
+}
+
+void
+FreeSharedMemory(rfbClient* client)
+{
+  SharedMemoryData* shm = (SharedMemoryData*)client->sharedMemory;
+
+  if (client->receivedFd >= 0) {
+    close(client->receivedFd);
+    client->receivedFd = -1;
+  }
+  if (shm == NULL)
+    return;
+  munmap(shm->map, shm->size);
+  free(shm);
+  client->sharedMemory = NULL;
+}
+
+/* copies lines of the shared memory to the frame buffer */
+static void
+CopyFromSharedMemory(rfbClient* client, SharedMemoryData* shm, int x, int y, int w, int h)
+{
+  int bpp = client->format.bitsPerPixel / 8;
+  char* src = shm->map + (size_t)shm->bytesPerLine * y + x * bpp;
+
+  if (w == shm->width && shm->bytesPerLine == w * bpp) {
+    CopyRectangle(client, (uint8_t*)src, x, y, w, h);
+    return;
+  }
+  for (; h > 0; h--, y++, src += shm->bytesPerLine)
+    CopyRectangle(client, (uint8_t*)src, x, y, w, 1);
+}
+
+/*
+ * HandleSharedMemory maps the memory the server passed along with the
+ * rectangle header, replacing the old one, and takes the whole frame buffer
+ * from it.  An empty rectangle withdraws the memory.
+ */
+
+static rfbBool
+HandleSharedMemory(rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  SharedMemoryData* shm;
+  rfbSharedMemoryMsg sm;
+  struct stat st;
+  int fd;
+
+  if (!ReadFromRFBServer(client, (char *)&sm, sz_rfbSharedMemoryMsg))
+    return FALSE;
+  sm.bytesPerLine = rfbClientSwap32IfLE(sm.bytesPerLine);
+
+  fd = client->receivedFd;
+  client->receivedFd = -1;
+  if (client->sharedMemory) {
+    shm = (SharedMemoryData*)client->sharedMemory;
+    munmap(shm->map, shm->size);
+    free(shm);
+    client->sharedMemory = NULL;
+  }
+
+  if (rw == 0 && rh == 0) {
+    if (fd >= 0)
+      close(fd);
+    return TRUE;
+  }
+
+  if (fd < 0) {
+    rfbClientLog("SharedMemory rectangle without a file descriptor\n");
+    return FALSE;
+  }
+  if (rx != 0 || ry != 0 || rw != client->width || rh != client->height ||
+      sm.bytesPerLine < (uint32_t)rw * (client->format.bitsPerPixel / 8)) {
+    rfbClientLog("SharedMemory rectangle does not match the frame buffer\n");
+    close(fd);
+    return FALSE;
+  }
+
+  /* a file shorter than the mapping would have us die of SIGBUS */
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sm.bytesPerLine * rh) {
+    rfbClientLog("SharedMemory file is smaller than the frame buffer\n");
+    close(fd);
+    return FALSE;
+  }
+
+  shm = (SharedMemoryData*)calloc(1, sizeof(SharedMemoryData));
+  if (shm == NULL) {
+    close(fd);
+    return FALSE;
+  }
+  shm->width = rw;
+  shm->height = rh;
+  shm->bytesPerLine = sm.bytesPerLine;
+  shm->size = (size_t)sm.bytesPerLine * rh;
+  shm->map = mmap(NULL, shm->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm->map == MAP_FAILED) {
+    rfbClientErr("SharedMemory: mmap: %s\n", strerror(errno));
+    free(shm);
+    return FALSE;
+  }
+  client->sharedMemory = shm;
+
+  rfbClientLog("Using shared memory for the frame buffer\n");
+
+  CopyFromSharedMemory(client, shm, 0, 0, rw, rh);
+  return TRUE;
+}
+
+static rfbBool
+HandleSharedMemoryRect(rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  SharedMemoryData* shm = (SharedMemoryData*)client->sharedMemory;
+
+  if (shm == NULL) {
+    rfbClientLog("SharedMemoryRect without shared memory\n");
+    return FALSE;
+  }
+  if (rx + rw > shm->width || ry + rh > shm->height) {
+    rfbClientLog("SharedMemoryRect %dx%d at %d,%d outside of the shared memory\n",
+                 rw, rh, rx, ry);
+    return FALSE;
+  }
+
+  CopyFromSharedMemory(client, shm, rx, ry, rw, rh);
+  return TRUE;
+}
+
+#else
+
+static rfbBool
+WantSharedMemory(rfbClient* client)
+{
+  return FALSE;
+}
+
+void
+FreeSharedMemory(rfbClient* client)
+{
+}
+
+static rfbBool
+HandleSharedMemory(rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  rfbClientLog("SharedMemory is not supported\n");
+  return FALSE;
+}
+
+static rfbBool
+HandleSharedMemoryRect(rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  rfbClientLog("SharedMemoryRect is not supported\n");
+  return FALSE;
+}
+
+#endif
@@ -45,12 +45,17 @@
 #define read(sock,buf,len) recv(sock,buf,len,0)
 #define write(sock,buf,len) send(sock,buf,len,0)
 #define socklen_t int
+#define poll WSAPoll
+/* there is no readv(), ReadDirect only uses the first entry */
+struct iovec { void* iov_base; size_t iov_len; };
 #ifdef LIBVNCSERVER_HAVE_WS2TCPIP_H
 #undef socklen_t
 #include <ws2tcpip.h>
 #endif
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <sys/un.h>
 #include <netinet/tcp.h>
@@ -64,9 +69,241 @@
 #endif
 
 void PrintInHex(char *buf, int len);
+static int WaitForSocket(rfbClient* client,unsigned int usecs);
+
+/* mux.c */
+extern rfbBool rfbClientMuxWait(rfbClient* client);
+
+/* vncrec.c */
+extern rfbBool ReadFromVNCRec(rfbClient* client, char* out, unsigned int n);
 
 rfbBool errorMessageOnReadFailure = TRUE;
 
+/*
+ * The receive buffer starts out as client->buf.  While reads keep filling
+ * all the room there is, more data is queued than fits, i.e. the buffer is
+ * smaller than the bandwidth-delay product of the connection, so it is
+ * doubled (up to RFB_MAX_BUF_SIZE).  After many reads that only use a
+ * small part of it, it is halved again.
+ */
+
+#define RFB_MAX_BUF_SIZE (256*1024)
+
+/* this many reads using less than an eighth of the buffer shrink it */
+#define RFB_BUF_SHRINK_READS 256
+
+/* at most this many lines are read directly with one readv() */
+#define RFB_MAX_READ_LINES 64
+
+static int
+ReadBufferSize(rfbClient* client)
+{
+  return client->readBuf ? client->readBufSize : RFB_BUF_SIZE;
+}
+
+static char*
+ReadBuffer(rfbClient* client)
+{
+  return client->readBuf ? client->readBuf : client->buf;
+}
+
+static void
+ResizeReadBuffer(rfbClient* client, int size)
+{
+  char* buf = malloc(size);
+
+  /* without memory, the old buffer just stays */
+  if (buf == NULL)
+    return;
+  memcpy(buf, client->bufoutptr, client->buffered);
+  free(client->readBuf);
+  client->readBuf = buf;
+  client->readBufSize = size;
+  client->bufoutptr = buf;
+}
+
+/* called after got bytes have been read into room bytes of the buffer,
+   which must go on holding need bytes */
+static void
+AdaptReadBuffer(rfbClient* client, int got, int room, int need)
+{
+  int size = ReadBufferSize(client);
+
+  if (got == room && room >= size / 2) {
+    client->readBufIdleReads = 0;
+    if (size < RFB_MAX_BUF_SIZE)
+      ResizeReadBuffer(client, 2 * size);
+  } else if (got < size / 8 && size > RFB_BUF_SIZE
+	     && client->buffered <= size / 2 && need <= size / 2) {
+    if (++client->readBufIdleReads >= RFB_BUF_SHRINK_READS) {
+      client->readBufIdleReads = 0;
+      ResizeReadBuffer(client, size / 2);
+    }
+  } else {
+    client->readBufIdleReads = 0;
+  }
+}
+
+/*
+ * ReadFromSocket reads like readv().  A file descriptor the server passes
+ * along, for the SharedMemory pseudo-encoding on UNIX sockets, is kept in
+ * client->receivedFd.
+ */
+
+static int
+ReadFromSocket(rfbClient* client, struct iovec* iov, int nIov)
+{
+#ifdef WIN32
+  return read(client->sock, iov[0].iov_base, iov[0].iov_len);
+#else
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  int i, flags = 0;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = nIov;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+#ifdef MSG_CMSG_CLOEXEC
+  flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+  i = recvmsg(client->sock, &msg, flags);
+  for (cmsg = i > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      if (client->receivedFd >= 0)
+	close(client->receivedFd);
+      memcpy(&client->receivedFd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  return i;
+#endif
+}
+
+/*
+ * HandleReadError is called when a read returned i <= 0.  If the read would
+ * have blocked, it waits for more data and returns TRUE so the read can be
+ * retried.
+ */
+
+static rfbBool
+HandleReadError(rfbClient* client, int i, int* max_wait)
+{
+  if (i == 0) {
+    if (errorMessageOnReadFailure) {
+      rfbClientLog("VNC server closed connection\n");
+    }
+    return FALSE;
+  }
+
+#ifdef WIN32
+  errno=WSAGetLastError();
+#endif
+  if (errno == EWOULDBLOCK || errno == EAGAIN) {
+    /* TODO:
+       ProcessXtEvents();
+    */
+    if (client->muxData && rfbClientMuxWait(client))
+      return TRUE;
+    /* not WaitForMessage, which returns at once with data read ahead */
+    if (WaitForSocket(client, 100000) < 0) return FALSE;
+    if ((*max_wait)++ > 300) {
+      rfbClientErr("WaitForMessage too long\n");
+      return FALSE;
+    }
+    return TRUE;
+  }
+
+  rfbClientErr("read (%d: %s)\n",errno,strerror(errno));
+  return FALSE;
+}
+
+/*
+ * ReadDirect reads lines of bytesPerLine bytes each into dst, the lines being
+ * stride bytes apart, without going through the receive buffer.  Where
+ * possible, a single readv() fills several lines and reads ahead into the
+ * (empty) receive buffer at the same time, so the small reads following a
+ * large one need no system call.
+ */
+
+static rfbBool
+ReadDirect(rfbClient* client, char* dst, int stride, int bytesPerLine, int lines)
+{
+  int max_wait = 0;
+  int done = 0;                 /* bytes of the current line already there */
+
+  if (bytesPerLine <= 0)
+    return TRUE;
+
+  while (lines > 0) {
+    struct iovec iov[RFB_MAX_READ_LINES + 1];
+    int nIov = 0, lineBytes = 0, i, l;
+
+    /* what was read ahead goes first */
+    if (client->buffered > 0) {
+      int m = bytesPerLine - done;
+
+      if (m > client->buffered)
+	m = client->buffered;
+      memcpy(dst + done, client->bufoutptr, m);
+      client->bufoutptr += m;
+      client->buffered -= m;
+      done += m;
+      if (done == bytesPerLine) {
+	dst += stride;
+	lines--;
+	done = 0;
+      }
+      continue;
+    }
+    client->bufoutptr = ReadBuffer(client);
+
+    for (l = 0; l < lines && l < RFB_MAX_READ_LINES; l++) {
+      iov[nIov].iov_base = dst + l * stride + (l == 0 ? done : 0);
+      iov[nIov].iov_len = bytesPerLine - (l == 0 ? done : 0);
+      lineBytes += iov[nIov++].iov_len;
+    }
+    iov[nIov].iov_base = client->bufoutptr;
+    iov[nIov++].iov_len = ReadBufferSize(client);
+
+    if (client->tlsSession) {
+      i = ReadFromTLS(client, iov[0].iov_base, iov[0].iov_len);
+    } else {
+      i = ReadFromSocket(client, iov, nIov);
+    }
+
+    if (i <= 0) {
+      if (!HandleReadError(client, i, &max_wait))
+	return FALSE;
+      continue;
+    }
+    max_wait = 0;
+    client->bytesReceived += i;
+
+    /* anything beyond the lines went into the receive buffer */
+    if (i > lineBytes) {
+      client->buffered = i - lineBytes;
+      AdaptReadBuffer(client, client->buffered, ReadBufferSize(client),
+		      client->buffered);
+      i = lineBytes;
+    }
+
+    done += i;
+    while (done >= bytesPerLine) {
+      done -= bytesPerLine;
+      dst += stride;
+      lines--;
+    }
+  }
+
+  return TRUE;
+}
+
 /*
  * ReadFromRFBServer is called whenever we want to read some data from the RFB
  * server.  It is non-trivial for two reasons:
@@ -97,41 +334,9 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
   if(!out)
     return FALSE;
 
-  if (client->serverPort==-1) {
-    /* vncrec playing */
-    rfbVNCRec* rec = client->vncRec;
-    struct timeval tv;
-
-    if (rec->readTimestamp) {
-      rec->readTimestamp = FALSE;
-      if (!fread(&tv,sizeof(struct timeval),1,rec->file))
-        return FALSE;
-
-      tv.tv_sec = rfbClientSwap32IfLE (tv.tv_sec);
-      tv.tv_usec = rfbClientSwap32IfLE (tv.tv_usec);
-
-      if (rec->tv.tv_sec!=0 && !rec->doNotSleep) {
-        struct timeval diff;
-        diff.tv_sec = tv.tv_sec - rec->tv.tv_sec;
-        diff.tv_usec = tv.tv_usec - rec->tv.tv_usec;
-        if(diff.tv_usec<0) {
-	  diff.tv_sec--;
-	  diff.tv_usec+=1000000;
-        }
-#ifndef WIN32
-        sleep (diff.tv_sec);
-        usleep (diff.tv_usec);
-#else
-	Sleep (diff.tv_sec * 1000 + diff.tv_usec/1000);
-#endif
-      }
+  if (client->serverPort==-1)
+    return ReadFromVNCRec(client, out, n); /* vncrec playing */
 
-      rec->tv=tv;
-    }
-    
-    return (fread(out,1,n,rec->file) != n ? FALSE : TRUE);
-  }
-  
   if (n <= client->buffered) {
     memcpy(out, client->bufoutptr, n);
     client->bufoutptr += n;
@@ -147,45 +352,32 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
   out += client->buffered;
   n -= client->buffered;
 
-  client->bufoutptr = client->buf;
+  client->bufoutptr = ReadBuffer(client);
   client->buffered = 0;
 
-  if (n <= RFB_BUF_SIZE) {
+  if (n <= (unsigned int)ReadBufferSize(client)) {
     int max_wait = 0;
     while (client->buffered < n) {
+      int room = ReadBufferSize(client) - client->buffered;
       int i;
       if (client->tlsSession) {
-        i = ReadFromTLS(client, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
+        i = ReadFromTLS(client, client->bufoutptr + client->buffered, room);
       } else {
-        i = read(client->sock, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
+        struct iovec iov;
+
+        iov.iov_base = client->bufoutptr + client->buffered;
+        iov.iov_len = room;
+        i = ReadFromSocket(client, &iov, 1);
       }
       if (i <= 0) {
-	if (i < 0) {
-#ifdef WIN32
-	  errno=WSAGetLastError();
-#endif
-	  if (errno == EWOULDBLOCK || errno == EAGAIN) {
-	    /* TODO:
-	       ProcessXtEvents();
-	    */
-	    if (WaitForMessage(client, 100000) < 0) return FALSE;
-            if (max_wait++ > 300) {
-              rfbClientErr("WaitForMessage too long\n");
-              return FALSE;
-            }
-	    i = 0;
-	  } else {
-	    rfbClientErr("read (%d: %s)\n",errno,strerror(errno));
-	    return FALSE;
-	  }
-	} else {
-	  if (errorMessageOnReadFailure) {
-	    rfbClientLog("VNC server closed connection\n");
-	  }
+	if (!HandleReadError(client, i, &max_wait))
 	  return FALSE;
-	}
-      } else { max_wait = 0; }
+	continue;
+      }
+      max_wait = 0;
       client->buffered += i;
+      client->bytesReceived += i;
+      AdaptReadBuffer(client, i, room, n);
     }
 
     memcpy(out, client->bufoutptr, n);
@@ -193,44 +385,8 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
     client->buffered -= n;
 
   } else {
-    int max_wait = 0;
-    while (n > 0) {
-      int i;
-      if (client->tlsSession) {
-        i = ReadFromTLS(client, out, n);
-      } else {
-        i = read(client->sock, out, n);
-      }
-
-      if (i <= 0) {
-	if (i < 0) {
-#ifdef WIN32
-	  errno=WSAGetLastError();
-#endif
-	  if (errno == EWOULDBLOCK || errno == EAGAIN) {
-	    /* TODO:
-	       ProcessXtEvents();
-	    */
-	    if (WaitForMessage(client, 100000) < 0) return FALSE;
-            if (max_wait++ > 300) {
-              rfbClientErr("WaitForMessage too long\n");
-              return FALSE;
-            }
-	    i = 0;
-	  } else {
-	    rfbClientErr("read (%s)\n",strerror(errno));
-	    return FALSE;
-	  }
-	} else {
-	  if (errorMessageOnReadFailure) {
-	    rfbClientLog("VNC server closed connection\n");
-	  }
-	  return FALSE;
-	}
-      } else {  max_wait = 0; }
-      out += i;
-      n -= i;
-    }
+    if (!ReadDirect(client, out, n, n, 1))
+      return FALSE;
   }
 
 #ifdef DEBUG_READ_EXACT
@@ -245,6 +401,26 @@ hexdump:
   return TRUE;
 }
 
+/*
+ * ReadRectFromRFBServer reads lines lines of bytesPerLine bytes each into
+ * dst, where consecutive lines are stride bytes apart.  This lets raw
+ * rectangles go into the frame buffer without a copy.
+ */
+
+rfbBool
+ReadRectFromRFBServer(rfbClient* client, char *dst, int stride, int bytesPerLine, int lines)
+{
+  if (client->serverPort==-1) {
+    /* vncrec playing */
+    for (; lines > 0; lines--, dst += stride)
+      if (!ReadFromRFBServer(client, dst, bytesPerLine))
+	return FALSE;
+    return TRUE;
+  }
+
+  return ReadDirect(client, dst, stride, bytesPerLine, lines);
+}
+
 
 /*
  * Write an exact number of bytes, and don't return until you've sent them.
@@ -253,7 +429,7 @@ hexdump:
 rfbBool
 WriteToRFBServer(rfbClient* client, char *buf, int n)
 {
-  fd_set fds;
+  struct pollfd pfd;
   int i = 0;
   int j;
 
@@ -280,11 +456,12 @@ WriteToRFBServer(rfbClient* client, char *buf, int n)
 		errno == ENOENT ||
 #endif
 		errno == EAGAIN) {
-	  FD_ZERO(&fds);
-	  FD_SET(client->sock,&fds);
+	  pfd.fd = client->sock;
+	  pfd.events = POLLOUT;
+	  pfd.revents = 0;
 
-	  if (select(client->sock+1, NULL, &fds, NULL, NULL) <= 0) {
-	    rfbClientErr("select\n");
+	  if (poll(&pfd, 1, -1) <= 0) {
+	    rfbClientErr("poll\n");
 	    return FALSE;
 	  }
 	  j = 0;
@@ -811,21 +988,40 @@ PrintInHex(char *buf, int len)
 
 int WaitForMessage(rfbClient* client,unsigned int usecs)
 {
-  fd_set fds;
-  struct timeval timeout;
-  int num;
-
   if (client->serverPort==-1)
     /* playing back vncrec file */
     return 1;
-  
-  timeout.tv_sec=(usecs/1000000);
-  timeout.tv_usec=(usecs%1000000);
 
-  FD_ZERO(&fds);
-  FD_SET(client->sock,&fds);
+  /* read ahead already */
+  if (client->buffered > 0)
+    return 1;
+
+  /* send the pipelined update requests falling due in the meantime */
+  for (;;) {
+    int due = SendPipelinedFramebufferUpdateRequests(client), num;
+
+    if (due == -2)
+      return -1;
+    if (due < 0 || (unsigned int)due >= usecs)
+      return WaitForSocket(client, usecs);
+    num = WaitForSocket(client, due);
+    if (num != 0)
+      return num;
+    usecs -= due;
+  }
+}
+
+static int WaitForSocket(rfbClient* client,unsigned int usecs)
+{
+  struct pollfd pfd;
+  int num;
+
+  pfd.fd = client->sock;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
 
-  num=select(client->sock+1, &fds, NULL, NULL, &timeout);
+  /* rounded up, not to spin on timeouts below a millisecond */
+  num=poll(&pfd, 1, usecs / 1000 + (usecs % 1000 != 0));
   if(num<0) {
 #ifdef WIN32
     errno=WSAGetLastError();
@@ -32,6 +32,10 @@
 
 #define TIGHT_MIN_TO_COMPRESS 12
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define CARDBPP CONCAT3E(uint,BPP,_t)
 #define filterPtrBPP CONCAT2E(filterPtr,BPP)
 
@@ -114,6 +118,11 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     comp_ctl >>= 1;
   }
 
+  /* JPEG rectangles still being decoded must be done before anything else
+     is drawn */
+  if (comp_ctl != rfbTightJpeg && !FinishJpegRects(client))
+    return FALSE;
+
   /* Handle solid rectangles. */
   if (comp_ctl == rfbTightFill) {
 #if BPP == 32
@@ -355,40 +364,64 @@ InitFilterGradientBPP (rfbClient* client, int rw, int rh)
 
 #if BPP == 32
 
+/*
+ * With SSE2, the three components of a pixel are predicted at once in 16 bit
+ * lanes: _mm_packus_epi16 does the clamping to 0..255 for free and the byte
+ * wise add the modulo 256 of the correction.  The rows are read 4 bytes at a
+ * time, one byte beyond the pixel, which stays within client->buffer and
+ * thisRow.
+ */
+
 static void
 FilterGradient24 (rfbClient* client, int numRows, uint32_t *dst)
 {
-  int x, y, c;
-  uint8_t thisRow[2048*3];
-  uint8_t pix[3];
-  int est[3];
-
-  for (y = 0; y < numRows; y++) {
+  int x, y;
+  uint8_t thisRow[2048*3+1];
+  uint8_t *src = (uint8_t *)client->buffer;
+  uint8_t *prevRow = client->tightPrevRow;
+  int w = client->rectWidth;
+
+  for (y = 0; y < numRows; y++, src += w * 3, dst += w) {
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i left = zero, upLeft = zero, up, est;
+    uint32_t v;
+
+    for (x = 0; x < w; x++) {
+      memcpy(&v, &prevRow[x*3], 4);
+      up = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero);
+      est = _mm_packus_epi16(_mm_sub_epi16(_mm_add_epi16(up, left), upLeft), zero);
+      memcpy(&v, &src[x*3], 4);
+      est = _mm_add_epi8(est, _mm_cvtsi32_si128(v));
+      v = (uint32_t)_mm_cvtsi128_si32(est);
+      memcpy(&thisRow[x*3], &v, 4);
+      dst[x] = RGB24_TO_PIXEL32(thisRow[x*3], thisRow[x*3+1], thisRow[x*3+2]);
+      left = _mm_unpacklo_epi8(est, zero);
+      upLeft = up;
+    }
+#else
+    int c, est;
 
     /* First pixel in a row */
-    for (c = 0; c < 3; c++) {
-      pix[c] = client->tightPrevRow[c] + client->buffer[y*client->rectWidth*3+c];
-      thisRow[c] = pix[c];
-    }
-    dst[y*client->rectWidth] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
+    for (c = 0; c < 3; c++)
+      thisRow[c] = prevRow[c] + src[c];
+    dst[0] = RGB24_TO_PIXEL32(thisRow[0], thisRow[1], thisRow[2]);
 
     /* Remaining pixels of a row */
-    for (x = 1; x < client->rectWidth; x++) {
+    for (x = 1; x < w; x++) {
       for (c = 0; c < 3; c++) {
-	est[c] = (int)client->tightPrevRow[x*3+c] + (int)pix[c] -
-		 (int)client->tightPrevRow[(x-1)*3+c];
-	if (est[c] > 0xFF) {
-	  est[c] = 0xFF;
-	} else if (est[c] < 0x00) {
-	  est[c] = 0x00;
-	}
-	pix[c] = (uint8_t)est[c] + client->buffer[(y*client->rectWidth+x)*3+c];
-	thisRow[x*3+c] = pix[c];
+	est = (int)prevRow[x*3+c] + (int)thisRow[(x-1)*3+c] - (int)prevRow[(x-1)*3+c];
+	if (est > 0xFF)
+	  est = 0xFF;
+	else if (est < 0x00)
+	  est = 0x00;
+	thisRow[x*3+c] = (uint8_t)est + src[x*3+c];
       }
-      dst[y*client->rectWidth+x] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
+      dst[x] = RGB24_TO_PIXEL32(thisRow[x*3], thisRow[x*3+1], thisRow[x*3+2]);
     }
+#endif
 
-    memcpy(client->tightPrevRow, thisRow, client->rectWidth * 3);
+    memcpy(prevRow, thisRow, w * 3);
   }
 }
 
@@ -486,6 +519,12 @@ InitFilterPaletteBPP (rfbClient* client, int rw, int rh)
   return (client->rectColors == 2) ? 1 : 8;
 }
 
+/*
+ * Two colour rectangles are by far the most common palette ones (text), so
+ * they get a branch free expansion of 8 pixels per byte, 4 at a time with
+ * SSE2 at 32 bpp.
+ */
+
 static void
 FilterPaletteBPP (rfbClient* client, int numRows, CARDBPP *dst)
 {
@@ -494,14 +533,31 @@ FilterPaletteBPP (rfbClient* client, int numRows, CARDBPP *dst)
   CARDBPP *palette = (CARDBPP *)client->tightPalette;
 
   if (client->rectColors == 2) {
+    CARDBPP c0 = palette[0], diff = palette[0] ^ palette[1];
+#if BPP == 32 && defined(__SSE2__)
+    __m128i vc0 = _mm_set1_epi32((int)c0), vdiff = _mm_set1_epi32((int)diff);
+    __m128i bitsHigh = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+    __m128i bitsLow = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+#endif
+
     w = (client->rectWidth + 7) / 8;
-    for (y = 0; y < numRows; y++) {
+    for (y = 0; y < numRows; y++, src += w, dst += client->rectWidth) {
       for (x = 0; x < client->rectWidth / 8; x++) {
+#if BPP == 32 && defined(__SSE2__)
+	__m128i v = _mm_set1_epi32(src[x]);
+	__m128i m;
+
+	m = _mm_cmpeq_epi32(_mm_and_si128(v, bitsHigh), bitsHigh);
+	_mm_storeu_si128((__m128i *)&dst[x*8], _mm_xor_si128(vc0, _mm_and_si128(vdiff, m)));
+	m = _mm_cmpeq_epi32(_mm_and_si128(v, bitsLow), bitsLow);
+	_mm_storeu_si128((__m128i *)&dst[x*8+4], _mm_xor_si128(vc0, _mm_and_si128(vdiff, m)));
+#else
 	for (b = 7; b >= 0; b--)
-	  dst[y*client->rectWidth+x*8+7-b] = palette[src[y*w+x] >> b & 1];
+	  dst[x*8+7-b] = c0 ^ (diff & (CARDBPP)-(CARDBPP)(src[x] >> b & 1));
+#endif
       }
       for (b = 7; b >= 8 - client->rectWidth % 8; b--) {
-	dst[y*client->rectWidth+x*8+7-b] = palette[src[y*w+x] >> b & 1];
+	dst[x*8+7-b] = c0 ^ (diff & (CARDBPP)-(CARDBPP)(src[x] >> b & 1));
       }
     }
   } else {
@@ -547,6 +603,23 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
     return FALSE;
   }
 
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  /* decoded in the background while the next rectangles arrive */
+  if (client->frameBuffer != NULL && GetJpegDecoder(client) != NULL)
+    return QueueJpegRect(client, x, y, w, h, compressedData, compressedLen);
+#endif
+
+#if BPP == 32
+  if (client->frameBuffer != NULL && JpegPixelFormat(client) >= 0 &&
+      (client->jpegHandle != NULL ||
+       (client->jpegHandle = tjInitDecompress()) != NULL)) {
+    rfbBool ok = DecompressJpegDirect(client, client->jpegHandle, x, y, w, h,
+				      compressedData, compressedLen);
+    free(compressedData);
+    return ok;
+  }
+#endif
+
   cinfo.err = jpeg_std_error(&jerr);
   cinfo.client_data = client;
   jpeg_create_decompress(&cinfo);
@@ -592,6 +665,450 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
 
 #else
 
+/*----------------------------------------------------------------------------
+ *
+ * Direct JPEG decompression.
+ *
+ * When the pixels of the frame buffer are laid out like one of the 32-bit
+ * formats of TurboJPEG, libjpeg-turbo writes each row straight into the
+ * frame buffer instead of into a row of RGB that is then converted pixel by
+ * pixel.  The padding byte is set to 0xff.
+ */
+
+/* returns the TJPF_* matching the frame buffer, or -1 if there is none */
+static int
+JpegPixelFormat(rfbClient* client)
+{
+  static const int formats[] = { TJPF_RGBX, TJPF_BGRX, TJPF_XRGB, TJPF_XBGR };
+  int red, green, blue, i;
+
+  if (client->format.bitsPerPixel != 32 || client->format.redMax != 0xFF ||
+      client->format.greenMax != 0xFF || client->format.blueMax != 0xFF ||
+      client->format.redShift % 8 != 0 || client->format.greenShift % 8 != 0 ||
+      client->format.blueShift % 8 != 0)
+    return -1;
+
+  /* byte offsets of the components within a pixel in memory; like the
+     other tight subencodings, pixels are stored in host byte order */
+  red = client->format.redShift / 8;
+  green = client->format.greenShift / 8;
+  blue = client->format.blueShift / 8;
+  if (!*(char *)&client->endianTest) {
+    red = 3 - red;
+    green = 3 - green;
+    blue = 3 - blue;
+  }
+
+  for (i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++)
+    if (tjRedOffset[formats[i]] == red && tjGreenOffset[formats[i]] == green &&
+	tjBlueOffset[formats[i]] == blue)
+      return formats[i];
+  return -1;
+}
+
+static rfbBool
+DecompressJpegDirect(rfbClient* client, tjhandle handle, int x, int y, int w, int h,
+		     uint8_t *data, int len)
+{
+  int width, height, subsamp;
+
+  /* tjDecompress2 would scale a bigger image down to fit */
+  if (tjDecompressHeader2(handle, data, len, &width, &height, &subsamp) < 0 ||
+      width != w || height != h) {
+    rfbClientLog("Tight Encoding: Wrong JPEG data received.\n");
+    return FALSE;
+  }
+
+  if (tjDecompress2(handle, data, len,
+		    client->frameBuffer + (y * client->width + x) * 4,
+		    w, client->width * 4, h, JpegPixelFormat(client), 0) < 0) {
+    rfbClientLog("Tight Encoding: %s\n", tjGetErrorStr());
+    return FALSE;
+  }
+  return TRUE;
+}
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+
+/*----------------------------------------------------------------------------
+ *
+ * Background JPEG decompression.
+ *
+ * Video is sent as many JPEG rectangles in a row.  Rather than decoding each
+ * of them before reading the next one, they are handed to a few threads
+ * which decode them directly into the frame buffer.  Before anything else
+ * touches the frame buffer (any other rectangle, the end of the update) the
+ * network thread waits for them with FinishJpegRects(), which also calls
+ * GotFrameBufferUpdate for them then.
+ */
+
+/* at most this many threads decode JPEG rectangles for one client; none
+   for clients run by a mux (see mux.c) */
+#define JPEG_MAX_THREADS 4
+
+/* at most this many rectangles are waiting to be decoded */
+#define JPEG_MAX_JOBS 64
+
+typedef struct {
+  struct jpeg_source_mgr pub;
+  rfbBool error;
+  JOCTET* data;
+  size_t len;
+} JpegJobSource;
+
+typedef struct {
+  int x, y, w, h;
+  uint8_t *data;
+  int len;
+  rfbBool ok;
+} JpegJob;
+
+typedef struct {
+  rfbClient* client;
+  pthread_mutex_t mutex;
+  pthread_cond_t work, done;
+  pthread_t threads[JPEG_MAX_THREADS];
+  int nThreads;
+  JpegJob jobs[JPEG_MAX_JOBS];
+  int nJobs;                    /* queued since the last FinishJpegRects */
+  int nextJob;                  /* the next one for a thread to take */
+  int nDone;
+  rfbBool quit;
+  rfbBool queuedRect;           /* the last rectangle was queued */
+} JpegDecoder;
+
+static void
+JpegJobInitSource(j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+JpegJobFillInputBuffer(j_decompress_ptr cinfo)
+{
+  JpegJobSource* src = (JpegJobSource*)cinfo->src;
+
+  src->error = TRUE;
+  src->pub.bytes_in_buffer = src->len;
+  src->pub.next_input_byte = src->data;
+  return TRUE;
+}
+
+static void
+JpegJobSkipInputData(j_decompress_ptr cinfo, long num_bytes)
+{
+  JpegJobSource* src = (JpegJobSource*)cinfo->src;
+
+  if (num_bytes < 0 || num_bytes > src->pub.bytes_in_buffer) {
+    src->error = TRUE;
+    src->pub.bytes_in_buffer = src->len;
+    src->pub.next_input_byte = src->data;
+  } else {
+    src->pub.next_input_byte += (size_t) num_bytes;
+    src->pub.bytes_in_buffer -= (size_t) num_bytes;
+  }
+}
+
+static void
+JpegJobTermSource(j_decompress_ptr cinfo)
+{
+}
+
+/* RGB24_TO_PIXEL for any pixel size */
+#define JPEG_TO_PIXEL(r,g,b)                                                 \
+  (((uint32_t)(r) * client->format.redMax + 127) / 255                      \
+   << client->format.redShift |                                             \
+   ((uint32_t)(g) * client->format.greenMax + 127) / 255                    \
+   << client->format.greenShift |                                           \
+   ((uint32_t)(b) * client->format.blueMax + 127) / 255                     \
+   << client->format.blueShift)
+
+/* handle is the TurboJPEG instance of the thread, if it could get one */
+static rfbBool
+DecodeJpegJob(rfbClient* client, JpegJob* job, tjhandle handle)
+{
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  JpegJobSource src;
+  JSAMPROW rowPointer[1];
+  int bpp = client->format.bitsPerPixel / 8;
+  rfbBool direct24 = (client->format.depth == 24 && client->format.redMax == 0xFF &&
+		      client->format.greenMax == 0xFF && client->format.blueMax == 0xFF);
+  uint8_t *row;
+  int dx;
+
+  if (handle != NULL && JpegPixelFormat(client) >= 0)
+    return DecompressJpegDirect(client, handle, job->x, job->y, job->w, job->h,
+				job->data, job->len);
+
+  row = malloc(job->w * 3);
+  if (row == NULL)
+    return FALSE;
+
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+
+  src.pub.init_source = JpegJobInitSource;
+  src.pub.fill_input_buffer = JpegJobFillInputBuffer;
+  src.pub.skip_input_data = JpegJobSkipInputData;
+  src.pub.resync_to_restart = jpeg_resync_to_restart;
+  src.pub.term_source = JpegJobTermSource;
+  src.pub.next_input_byte = src.data = job->data;
+  src.pub.bytes_in_buffer = src.len = job->len;
+  src.error = FALSE;
+  cinfo.src = &src.pub;
+
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = JCS_RGB;
+
+  jpeg_start_decompress(&cinfo);
+  if (cinfo.output_width != job->w || cinfo.output_height != job->h ||
+      cinfo.output_components != 3) {
+    rfbClientLog("Tight Encoding: Wrong JPEG data received.\n");
+    jpeg_destroy_decompress(&cinfo);
+    free(row);
+    return FALSE;
+  }
+
+  rowPointer[0] = (JSAMPROW)row;
+  while (cinfo.output_scanline < cinfo.output_height) {
+    uint8_t *pixelPtr = client->frameBuffer +
+      ((job->y + cinfo.output_scanline) * client->width + job->x) * bpp;
+
+    jpeg_read_scanlines(&cinfo, rowPointer, 1);
+    if (src.error)
+      break;
+
+    if (direct24) {
+      for (dx = 0; dx < job->w; dx++)
+	((uint32_t *)pixelPtr)[dx] = RGB24_TO_PIXEL32(row[dx*3], row[dx*3+1], row[dx*3+2]);
+    } else {
+      for (dx = 0; dx < job->w; dx++) {
+	uint32_t pixel = JPEG_TO_PIXEL(row[dx*3], row[dx*3+1], row[dx*3+2]);
+
+	if (bpp == 2)
+	  ((uint16_t *)pixelPtr)[dx] = (uint16_t)pixel;
+	else
+	  ((uint32_t *)pixelPtr)[dx] = pixel;
+      }
+    }
+  }
+
+  if (!src.error)
+    jpeg_finish_decompress(&cinfo);
+
+  jpeg_destroy_decompress(&cinfo);
+  free(row);
+
+  return !src.error;
+}
+
+static void*
+JpegDecoderThread(void* arg)
+{
+  JpegDecoder* decoder = (JpegDecoder*)arg;
+  tjhandle handle = tjInitDecompress();
+
+  pthread_mutex_lock(&decoder->mutex);
+  for (;;) {
+    JpegJob* job;
+
+    while (!decoder->quit && decoder->nextJob == decoder->nJobs)
+      pthread_cond_wait(&decoder->work, &decoder->mutex);
+    if (decoder->quit)
+      break;
+
+    job = &decoder->jobs[decoder->nextJob++];
+    pthread_mutex_unlock(&decoder->mutex);
+
+    job->ok = DecodeJpegJob(decoder->client, job, handle);
+
+    pthread_mutex_lock(&decoder->mutex);
+    if (++decoder->nDone == decoder->nJobs)
+      pthread_cond_signal(&decoder->done);
+  }
+  pthread_mutex_unlock(&decoder->mutex);
+
+  if (handle != NULL)
+    tjDestroy(handle);
+
+  return NULL;
+}
+
+static JpegDecoder*
+GetJpegDecoder(rfbClient* client)
+{
+  JpegDecoder* decoder = (JpegDecoder*)client->jpegDecoder;
+  int i, nThreads = rfbWorkerCount(JPEG_MAX_THREADS, 1, JPEG_MAX_THREADS);
+
+  /* a mux drives many clients from one thread; rather than each of them
+     starting threads of its own, they decode synchronously */
+  if (client->muxData != NULL)
+    return NULL;
+
+  if (decoder != NULL)
+    return decoder->nThreads > 0 ? decoder : NULL;
+
+  decoder = calloc(1, sizeof(JpegDecoder));
+  if (decoder == NULL)
+    return NULL;
+  decoder->client = client;
+  pthread_mutex_init(&decoder->mutex, NULL);
+  pthread_cond_init(&decoder->work, NULL);
+  pthread_cond_init(&decoder->done, NULL);
+
+  /* if no thread can be started, decoding stays synchronous */
+  for (i = 0; i < nThreads; i++) {
+    if (pthread_create(&decoder->threads[i], NULL, JpegDecoderThread, decoder) != 0)
+      break;
+    decoder->nThreads++;
+  }
+
+  client->jpegDecoder = decoder;
+  return decoder->nThreads > 0 ? decoder : NULL;
+}
+
+/*
+ * FinishJpegRects waits for all queued JPEG rectangles and reports them to
+ * the application.  Returns FALSE if any of them was corrupt.
+ */
+
+static rfbBool
+FinishJpegRects(rfbClient* client)
+{
+  JpegDecoder* decoder = (JpegDecoder*)client->jpegDecoder;
+  rfbBool ok = TRUE;
+  int i;
+
+  if (decoder == NULL || decoder->nJobs == 0)
+    return TRUE;
+
+  pthread_mutex_lock(&decoder->mutex);
+  while (decoder->nDone < decoder->nJobs)
+    pthread_cond_wait(&decoder->done, &decoder->mutex);
+  pthread_mutex_unlock(&decoder->mutex);
+
+  /* the threads only look at the jobs after nJobs has grown again */
+  for (i = 0; i < decoder->nJobs; i++) {
+    JpegJob* job = &decoder->jobs[i];
+
+    free(job->data);
+    if (!job->ok)
+      ok = FALSE;
+    else if (ok) {
+      client->SoftCursorUnlockScreen(client);
+      if (client->vncRecorder)
+        RecordFrameBufferUpdate(client, job->x, job->y, job->w, job->h);
+      client->GotFrameBufferUpdate(client, job->x, job->y, job->w, job->h);
+    }
+  }
+  decoder->nJobs = decoder->nextJob = decoder->nDone = 0;
+
+  return ok;
+}
+
+/*
+ * QueueJpegRect hands a JPEG rectangle to the decoder threads of the client
+ * (see GetJpegDecoder), which then own data.
+ */
+
+static rfbBool
+QueueJpegRect(rfbClient* client, int x, int y, int w, int h, uint8_t *data, int len)
+{
+  JpegDecoder* decoder = (JpegDecoder*)client->jpegDecoder;
+  JpegJob* job;
+
+  if (decoder->nJobs == JPEG_MAX_JOBS && !FinishJpegRects(client)) {
+    free(data);
+    return FALSE;
+  }
+
+  job = &decoder->jobs[decoder->nJobs];
+  job->x = x;
+  job->y = y;
+  job->w = w;
+  job->h = h;
+  job->data = data;
+  job->len = len;
+  job->ok = FALSE;
+
+  pthread_mutex_lock(&decoder->mutex);
+  decoder->nJobs++;
+  pthread_cond_signal(&decoder->work);
+  pthread_mutex_unlock(&decoder->mutex);
+
+  decoder->queuedRect = TRUE;
+  return TRUE;
+}
+
+/* tells whether the rectangle just handled went to the decoder threads */
+static rfbBool
+TakeQueuedJpegRect(rfbClient* client)
+{
+  JpegDecoder* decoder = (JpegDecoder*)client->jpegDecoder;
+  rfbBool queued = decoder != NULL && decoder->queuedRect;
+
+  if (queued)
+    decoder->queuedRect = FALSE;
+  return queued;
+}
+
+void
+FreeJpegDecoder(rfbClient* client)
+{
+  JpegDecoder* decoder = (JpegDecoder*)client->jpegDecoder;
+  int i;
+
+  if (client->jpegHandle != NULL) {
+    tjDestroy(client->jpegHandle);
+    client->jpegHandle = NULL;
+  }
+  if (decoder == NULL)
+    return;
+
+  pthread_mutex_lock(&decoder->mutex);
+  while (decoder->nDone < decoder->nJobs)
+    pthread_cond_wait(&decoder->done, &decoder->mutex);
+  decoder->quit = TRUE;
+  pthread_cond_broadcast(&decoder->work);
+  pthread_mutex_unlock(&decoder->mutex);
+
+  for (i = 0; i < decoder->nThreads; i++)
+    pthread_join(decoder->threads[i], NULL);
+  for (i = 0; i < decoder->nJobs; i++)
+    free(decoder->jobs[i].data);
+
+  pthread_mutex_destroy(&decoder->mutex);
+  pthread_cond_destroy(&decoder->work);
+  pthread_cond_destroy(&decoder->done);
+  free(decoder);
+  client->jpegDecoder = NULL;
+}
+
+#else
+
+static rfbBool
+FinishJpegRects(rfbClient* client)
+{
+  return TRUE;
+}
+
+static rfbBool
+TakeQueuedJpegRect(rfbClient* client)
+{
+  return FALSE;
+}
+
+void
+FreeJpegDecoder(rfbClient* client)
+{
+  if (client->jpegHandle != NULL) {
+    tjDestroy(client->jpegHandle);
+    client->jpegHandle = NULL;
+  }
+}
+
+#endif
+
 static long
 ReadCompactLen (rfbClient* client)
 {
@@ -0,0 +1,10 @@
+/*
+ * libvncclient's copy of the TurboJPEG wrapper.  libvncserver exports the
+ * same functions, so here they are kept private to the library.
+ */
+
+#if defined(__GNUC__) && !defined(_WIN32)
+#define DLLEXPORT __attribute__((visibility("hidden")))
+#endif
+
+#include "../common/turbojpeg.c"
@@ -0,0 +1,779 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * vncrec.c - record a session to a file and play vncrec files back.
+ *
+ * A recording is a vncrec file: the magic "vncLog0.0", followed by what a
+ * server would have sent, with a timestamp (two CARD32, seconds and
+ * microseconds) in front of every message after the handshake.  The
+ * handshake asks for no authentication and announces the pixel format of
+ * the recording client, and every update is taken from its frame buffer and
+ * sent in the LZ4 encoding, which keeps no state from one rectangle to the
+ * next.  So unlike the server stream itself, playback can start at any
+ * message.
+ *
+ * Every few seconds the whole frame buffer is written as a keyframe: an
+ * update with a NewFBSize rectangle and one rectangle covering everything.
+ * The time and file offset of each keyframe go into an index next to the
+ * recording, <recording>.idx, which playback uses to seek.
+ */
+
+/* recordings outgrow 2 GB; makes off_t 64 bits on 32 bit systems */
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <rfb/rfbclient.h>
+#include "lz4block.h"
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef WIN32
+typedef __int64 vncRecOffset;
+#define TellVNCRecFile(file) _ftelli64(file)
+#define SeekVNCRecFile(file, offset) _fseeki64(file, offset, SEEK_SET)
+#else
+typedef off_t vncRecOffset;
+#define TellVNCRecFile(file) ftello(file)
+#define SeekVNCRecFile(file, offset) fseeko(file, offset, SEEK_SET)
+#endif
+
+#define VNCREC_MAGIC "vncLog0.0"
+#define VNCREC_INDEX_MAGIC "vncIdx0.0"
+#define VNCREC_MAGIC_LENGTH 9
+
+/* an index entry is the time (seconds, microseconds) and the file offset
+   (high and low 32 bits) of a keyframe, as four CARD32 */
+#define VNCREC_INDEX_ENTRY_SIZE 16
+
+#define VNCREC_DEFAULT_KEYFRAME_INTERVAL 10
+
+/* more rectangles than this are recorded as their bounding box */
+#define VNCREC_MAX_RECTS 1024
+
+/* playback that fell behind more than this rather starts over from where it
+   is than rushing to catch up */
+#define VNCREC_MAX_LAG 1000000
+
+#define LZ4_TILE_BYTES (rfbLZ4TileWidth * rfbLZ4TileHeight * 4)
+
+typedef struct {
+  int64_t time;
+  uint64_t offset;
+} vncRecIndexEntry;
+
+/* the part of the playback state not in rfbVNCRec */
+typedef struct {
+  /* the whole file, if it could be mapped */
+  unsigned char* map;
+  size_t mapSize, pos;
+
+  vncRecIndexEntry* index;
+  int nIndex;
+
+  int64_t startTime;          /* time of the first message, 0 if unknown */
+  int64_t seekOffset;         /* where to go on before the next message, or -1 */
+  int64_t skipUntil;          /* play messages before this time at once */
+
+  /* the message recorded at clockTime was played at clockWall */
+  int64_t clockTime, clockWall;
+  double clockSpeed;
+} vncRecPlayback;
+
+typedef struct {
+  FILE* file;
+  FILE* indexFile;
+  int64_t lastKeyframe;
+  int width, height;          /* of the last keyframe */
+
+  rfbRectangle* rects;        /* what changed since the last update written */
+  int nRects, rectsSize;
+
+  /* the encoded tiles of a rectangle */
+  unsigned char* buffer;
+  size_t bufferSize;
+  uint32_t* lengths;
+  int lengthsSize;
+  lz4HashTable hashTable;
+} vncRecorder;
+
+static int64_t
+VNCRecNow(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*
+ * Playback.
+ */
+
+#ifndef WIN32
+static void
+MapVNCRec(vncRecPlayback* p, FILE* file)
+{
+  struct stat st;
+  void* map;
+
+  /* recordings too large for the address space are read with stdio */
+  if (fstat(fileno(file), &st) != 0 || st.st_size <= 0 ||
+      (uint64_t)st.st_size > SIZE_MAX || (size_t)st.st_size == p->mapSize)
+    return;
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+  if (map == MAP_FAILED)
+    return;
+#ifdef MADV_SEQUENTIAL
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+  if (p->map)
+    munmap(p->map, p->mapSize);
+  p->map = (unsigned char*)map;
+  p->mapSize = st.st_size;
+}
+#endif
+
+static rfbBool
+ReadVNCRecData(rfbVNCRec* rec, char* out, size_t n)
+{
+  vncRecPlayback* p = (vncRecPlayback*)rec->data;
+
+  if (p->map == NULL)
+    return fread(out, 1, n, rec->file) == n;
+
+#ifndef WIN32
+  /* the recording may still be growing */
+  if (p->pos + n > p->mapSize)
+    MapVNCRec(p, rec->file);
+#endif
+  if (p->pos + n > p->mapSize)
+    return FALSE;
+  memcpy(out, p->map + p->pos, n);
+  p->pos += n;
+  return TRUE;
+}
+
+static rfbBool
+SetVNCRecPosition(rfbVNCRec* rec, int64_t offset)
+{
+  vncRecPlayback* p = (vncRecPlayback*)rec->data;
+
+  if (p->map) {
+    p->pos = offset;
+    return TRUE;
+  }
+  return SeekVNCRecFile(rec->file, (vncRecOffset)offset) == 0;
+}
+
+static void
+LoadVNCRecIndex(rfbClient* client, vncRecPlayback* p)
+{
+  char* name = malloc(strlen(client->serverHost) + 5);
+  char magic[VNCREC_MAGIC_LENGTH];
+  uint32_t entry[4];
+  FILE* file;
+  int size = 0;
+
+  if (name == NULL)
+    return;
+  sprintf(name, "%s.idx", client->serverHost);
+  file = fopen(name, "rb");
+  free(name);
+  if (file == NULL)
+    return;
+
+  if (fread(magic, 1, VNCREC_MAGIC_LENGTH, file) != VNCREC_MAGIC_LENGTH ||
+      memcmp(magic, VNCREC_INDEX_MAGIC, VNCREC_MAGIC_LENGTH)) {
+    rfbClientLog("Ignoring the index of %s, it is not a vncrec index\n",
+		 client->serverHost);
+    fclose(file);
+    return;
+  }
+
+  while (fread(entry, 1, VNCREC_INDEX_ENTRY_SIZE, file) == VNCREC_INDEX_ENTRY_SIZE) {
+    vncRecIndexEntry* e;
+
+    if (p->nIndex == size) {
+      vncRecIndexEntry* index = realloc(p->index, (size ? 2 * size : 64) * sizeof(vncRecIndexEntry));
+
+      if (index == NULL)
+	break;
+      p->index = index;
+      size = size ? 2 * size : 64;
+    }
+    e = &p->index[p->nIndex];
+    e->time = (int64_t)rfbClientSwap32IfLE(entry[0]) * 1000000 + rfbClientSwap32IfLE(entry[1]);
+    e->offset = ((uint64_t)rfbClientSwap32IfLE(entry[2]) << 32) | rfbClientSwap32IfLE(entry[3]);
+
+    /* keyframes come in order; anything else means the index is damaged */
+    if (p->nIndex > 0 && (e->time < e[-1].time || e->offset <= e[-1].offset))
+      break;
+    p->nIndex++;
+  }
+  fclose(file);
+
+  if (p->nIndex > 0)
+    p->startTime = p->index[0].time;
+}
+
+/*
+ * OpenVNCRec opens client->serverHost, a vncrec file, for playback.
+ */
+
+rfbBool
+OpenVNCRec(rfbClient* client)
+{
+  rfbVNCRec* rec = (rfbVNCRec*)calloc(1, sizeof(rfbVNCRec));
+  vncRecPlayback* p = (vncRecPlayback*)calloc(1, sizeof(vncRecPlayback));
+  char buffer[VNCREC_MAGIC_LENGTH];
+
+  if (rec == NULL || p == NULL) {
+    free(rec);
+    free(p);
+    return FALSE;
+  }
+  client->vncRec = rec;
+  rec->data = p;
+  rec->speed = 1;
+  p->seekOffset = -1;
+  p->skipUntil = -1;
+
+  rec->file = fopen(client->serverHost,"rb");
+  if (!rec->file) {
+    rfbClientLog("Could not open %s.\n",client->serverHost);
+    return FALSE;
+  }
+#ifndef WIN32
+  MapVNCRec(p, rec->file);
+#endif
+  if (p->map == NULL)
+    setbuf(rec->file,NULL);
+
+  if (!ReadVNCRecData(rec, buffer, VNCREC_MAGIC_LENGTH) ||
+      memcmp(buffer, VNCREC_MAGIC, VNCREC_MAGIC_LENGTH)) {
+    rfbClientLog("File %s was not recorded by vncrec.\n",client->serverHost);
+    return FALSE;
+  }
+
+  LoadVNCRecIndex(client, p);
+  client->sock = -1;
+  return TRUE;
+}
+
+void
+CloseVNCRec(rfbClient* client)
+{
+  rfbVNCRec* rec = client->vncRec;
+  vncRecPlayback* p;
+
+  if (rec == NULL)
+    return;
+  p = (vncRecPlayback*)rec->data;
+  if (p) {
+#ifndef WIN32
+    if (p->map)
+      munmap(p->map, p->mapSize);
+#endif
+    free(p->index);
+    free(p);
+  }
+  if (rec->file)
+    fclose(rec->file);
+  free(rec);
+  client->vncRec = NULL;
+}
+
+static void
+SleepVNCRec(int64_t usecs)
+{
+#ifndef WIN32
+  if (usecs >= 1000000)
+    sleep(usecs / 1000000);
+  usleep(usecs % 1000000);
+#else
+  Sleep(usecs / 1000);
+#endif
+}
+
+/* waits until the message recorded at time is due */
+static void
+WaitForVNCRecTime(rfbVNCRec* rec, int64_t time)
+{
+  vncRecPlayback* p = (vncRecPlayback*)rec->data;
+  double speed = rec->speed > 0 ? rec->speed : 1;
+  int64_t now, due;
+
+  if (p->startTime == 0)
+    p->startTime = time;
+
+  if (rec->doNotSleep || time < p->skipUntil) {
+    p->clockWall = 0;
+    return;
+  }
+  p->skipUntil = -1;
+
+  /* the messages are timed against a clock rather than one after the
+     other, so the time spent decoding does not add up */
+  now = VNCRecNow();
+  if (p->clockWall != 0 && speed == p->clockSpeed && time >= p->clockTime) {
+    due = p->clockWall + (int64_t)((time - p->clockTime) / speed);
+    if (due > now) {
+      SleepVNCRec(due - now);
+      return;
+    }
+    if (now - due < VNCREC_MAX_LAG)
+      return;
+  }
+  p->clockTime = time;
+  p->clockWall = now;
+  p->clockSpeed = speed;
+}
+
+/*
+ * ReadFromVNCRec is ReadFromRFBServer for playback.
+ */
+
+rfbBool
+ReadFromVNCRec(rfbClient* client, char* out, unsigned int n)
+{
+  rfbVNCRec* rec = client->vncRec;
+  vncRecPlayback* p = (vncRecPlayback*)rec->data;
+
+  if (rec->readTimestamp) {
+    uint32_t tv[2];
+
+    rec->readTimestamp = FALSE;
+
+    if (p->seekOffset >= 0) {
+      if (!SetVNCRecPosition(rec, p->seekOffset))
+	return FALSE;
+      p->seekOffset = -1;
+    }
+
+    if (!ReadVNCRecData(rec, (char *)tv, sizeof(tv)))
+      return FALSE;
+
+    rec->tv.tv_sec = rfbClientSwap32IfLE(tv[0]);
+    rec->tv.tv_usec = rfbClientSwap32IfLE(tv[1]);
+    WaitForVNCRecTime(rec, (int64_t)rec->tv.tv_sec * 1000000 + rec->tv.tv_usec);
+  }
+
+  return ReadVNCRecData(rec, out, n);
+}
+
+rfbBool
+rfbClientPlaybackSeek(rfbClient* client, unsigned int msecs)
+{
+  rfbVNCRec* rec = client->vncRec;
+  vncRecPlayback* p;
+  int64_t target;
+  int lo, hi;
+
+  if (client->serverPort != -1 || rec == NULL)
+    return FALSE;
+  p = (vncRecPlayback*)rec->data;
+  if (p->startTime == 0 && p->nIndex == 0)
+    return FALSE;
+  target = p->startTime + (int64_t)msecs * 1000;
+
+  if (p->nIndex == 0) {
+    /* without an index, only forward */
+    if (target < (int64_t)rec->tv.tv_sec * 1000000 + rec->tv.tv_usec) {
+      rfbClientLog("%s has no index, cannot seek backwards\n", client->serverHost);
+      return FALSE;
+    }
+    p->skipUntil = target;
+    return TRUE;
+  }
+
+  /* the last keyframe at or before the target */
+  lo = 0;
+  hi = p->nIndex - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+
+    if (p->index[mid].time <= target)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  p->seekOffset = p->index[lo].offset;
+  p->skipUntil = target;
+  return TRUE;
+}
+
+int64_t
+rfbClientPlaybackLength(rfbClient* client)
+{
+  rfbVNCRec* rec = client->vncRec;
+  vncRecPlayback* p;
+
+  if (client->serverPort != -1 || rec == NULL)
+    return -1;
+  p = (vncRecPlayback*)rec->data;
+  if (p->nIndex == 0)
+    return -1;
+  return (p->index[p->nIndex - 1].time - p->startTime) / 1000;
+}
+
+
+/*
+ * Recording.
+ */
+
+static rfbBool
+WriteTimestamp(rfbClient* client, vncRecorder* r, int64_t now)
+{
+  uint32_t tv[2];
+
+  tv[0] = rfbClientSwap32IfLE((uint32_t)(now / 1000000));
+  tv[1] = rfbClientSwap32IfLE((uint32_t)(now % 1000000));
+  return fwrite(tv, sizeof(tv), 1, r->file) == 1;
+}
+
+static rfbBool
+WriteRectHeader(rfbClient* client, vncRecorder* r, int x, int y, int w, int h, uint32_t encoding)
+{
+  rfbFramebufferUpdateRectHeader rect;
+
+  rect.r.x = rfbClientSwap16IfLE(x);
+  rect.r.y = rfbClientSwap16IfLE(y);
+  rect.r.w = rfbClientSwap16IfLE(w);
+  rect.r.h = rfbClientSwap16IfLE(h);
+  rect.encoding = rfbClientSwap32IfLE(encoding);
+  return fwrite(&rect, sz_rfbFramebufferUpdateRectHeader, 1, r->file) == 1;
+}
+
+/* writes a rectangle of the frame buffer in the LZ4 encoding */
+static rfbBool
+WriteLZ4Rect(rfbClient* client, vncRecorder* r, int x, int y, int w, int h)
+{
+  int bpp = client->format.bitsPerPixel / 8;
+  int stride = client->width * bpp;
+  int tilesPerRow = (w + rfbLZ4TileWidth - 1) / rfbLZ4TileWidth;
+  int nTiles = tilesPerRow * ((h + rfbLZ4TileHeight - 1) / rfbLZ4TileHeight);
+  unsigned char tile[LZ4_TILE_BYTES];
+  size_t total = 0;
+  int t;
+
+  if (!WriteRectHeader(client, r, x, y, w, h, rfbEncodingLZ4))
+    return FALSE;
+
+  if (r->lengthsSize < nTiles) {
+    free(r->lengths);
+    r->lengths = (uint32_t*)malloc(nTiles * sizeof(uint32_t));
+    r->lengthsSize = r->lengths ? nTiles : 0;
+    if (r->lengths == NULL)
+      return FALSE;
+  }
+  /* no tile gets bigger than its pixels */
+  if (r->bufferSize < (size_t)w * h * bpp) {
+    free(r->buffer);
+    r->buffer = (unsigned char*)malloc((size_t)w * h * bpp);
+    r->bufferSize = r->buffer ? (size_t)w * h * bpp : 0;
+    if (r->buffer == NULL)
+      return FALSE;
+  }
+
+  for (t = 0; t < nTiles; t++) {
+    int tx = x + (t % tilesPerRow) * rfbLZ4TileWidth;
+    int ty = y + (t / tilesPerRow) * rfbLZ4TileHeight;
+    int tw = x + w - tx, th = y + h - ty, rawLength, length, j;
+    unsigned char* src;
+
+    if (tw > rfbLZ4TileWidth)
+      tw = rfbLZ4TileWidth;
+    if (th > rfbLZ4TileHeight)
+      th = rfbLZ4TileHeight;
+    rawLength = tw * th * bpp;
+
+    src = (unsigned char*)client->frameBuffer + ty * stride + tx * bpp;
+    for (j = 0; j < th; j++, src += stride)
+      memcpy(tile + j * tw * bpp, src, tw * bpp);
+
+    length = lz4CompressBlock(tile, rawLength, r->buffer + total, rawLength - 1, &r->hashTable);
+    if (length == 0) {
+      memcpy(r->buffer + total, tile, rawLength);
+      r->lengths[t] = rfbClientSwap32IfLE((uint32_t)rawLength | rfbLZ4TileRaw);
+      total += rawLength;
+    } else {
+      r->lengths[t] = rfbClientSwap32IfLE((uint32_t)length);
+      total += length;
+    }
+  }
+
+  return fwrite(r->lengths, sizeof(uint32_t), nTiles, r->file) == (size_t)nTiles &&
+    fwrite(r->buffer, 1, total, r->file) == total;
+}
+
+static rfbBool
+WriteKeyframe(rfbClient* client, vncRecorder* r, int64_t now)
+{
+  rfbFramebufferUpdateMsg fu;
+  vncRecOffset offset = TellVNCRecFile(r->file);
+  uint32_t entry[4];
+
+  fu.type = rfbFramebufferUpdate;
+  fu.pad = 0;
+  fu.nRects = rfbClientSwap16IfLE(2);
+  if (offset < 0 || !WriteTimestamp(client, r, now) ||
+      fwrite(&fu, sz_rfbFramebufferUpdateMsg, 1, r->file) != 1 ||
+      !WriteRectHeader(client, r, 0, 0, client->width, client->height, rfbEncodingNewFBSize) ||
+      !WriteLZ4Rect(client, r, 0, 0, client->width, client->height))
+    return FALSE;
+
+  /* the index must not point beyond what is on disk */
+  if (fflush(r->file) != 0)
+    return FALSE;
+
+  entry[0] = rfbClientSwap32IfLE((uint32_t)(now / 1000000));
+  entry[1] = rfbClientSwap32IfLE((uint32_t)(now % 1000000));
+  entry[2] = rfbClientSwap32IfLE((uint32_t)((uint64_t)offset >> 32));
+  entry[3] = rfbClientSwap32IfLE((uint32_t)offset);
+  if (fwrite(entry, VNCREC_INDEX_ENTRY_SIZE, 1, r->indexFile) != 1 ||
+      fflush(r->indexFile) != 0)
+    return FALSE;
+
+  r->lastKeyframe = now;
+  r->width = client->width;
+  r->height = client->height;
+  return TRUE;
+}
+
+static rfbBool
+WriteUpdate(rfbClient* client, vncRecorder* r, int64_t now)
+{
+  rfbFramebufferUpdateMsg fu;
+  int i;
+
+  if (r->nRects > VNCREC_MAX_RECTS) {
+    int x1 = client->width, y1 = client->height, x2 = 0, y2 = 0;
+
+    for (i = 0; i < r->nRects; i++) {
+      if (r->rects[i].x < x1)
+	x1 = r->rects[i].x;
+      if (r->rects[i].y < y1)
+	y1 = r->rects[i].y;
+      if (r->rects[i].x + r->rects[i].w > x2)
+	x2 = r->rects[i].x + r->rects[i].w;
+      if (r->rects[i].y + r->rects[i].h > y2)
+	y2 = r->rects[i].y + r->rects[i].h;
+    }
+    r->rects[0].x = x1;
+    r->rects[0].y = y1;
+    r->rects[0].w = x2 - x1;
+    r->rects[0].h = y2 - y1;
+    r->nRects = 1;
+  }
+
+  fu.type = rfbFramebufferUpdate;
+  fu.pad = 0;
+  fu.nRects = rfbClientSwap16IfLE(r->nRects);
+  if (!WriteTimestamp(client, r, now) ||
+      fwrite(&fu, sz_rfbFramebufferUpdateMsg, 1, r->file) != 1)
+    return FALSE;
+
+  for (i = 0; i < r->nRects; i++)
+    if (!WriteLZ4Rect(client, r, r->rects[i].x, r->rects[i].y, r->rects[i].w, r->rects[i].h))
+      return FALSE;
+  return TRUE;
+}
+
+static void
+FreeRecorder(vncRecorder* r)
+{
+  if (r->file)
+    fclose(r->file);
+  if (r->indexFile)
+    fclose(r->indexFile);
+  free(r->rects);
+  free(r->buffer);
+  free(r->lengths);
+  free(r);
+}
+
+rfbBool
+rfbClientRecordStart(rfbClient* client, const char* filename)
+{
+  vncRecorder* r;
+  rfbServerInitMsg si;
+  char* indexName;
+  uint8_t security[2];
+  uint32_t result = 0;
+  size_t nameLength = client->desktopName ? strlen(client->desktopName) : 0;
+
+  if (client->frameBuffer == NULL) {
+    rfbClientLog("Cannot record before the connection is set up\n");
+    return FALSE;
+  }
+  rfbClientRecordStop(client);
+
+  r = (vncRecorder*)calloc(1, sizeof(vncRecorder));
+  indexName = malloc(strlen(filename) + 5);
+  if (r == NULL || indexName == NULL) {
+    free(r);
+    free(indexName);
+    return FALSE;
+  }
+  sprintf(indexName, "%s.idx", filename);
+  r->file = fopen(filename, "wb");
+  r->indexFile = fopen(indexName, "wb");
+  free(indexName);
+  if (r->file == NULL || r->indexFile == NULL) {
+    rfbClientErr("Could not open %s for recording: %s\n", filename, strerror(errno));
+    FreeRecorder(r);
+    return FALSE;
+  }
+  setvbuf(r->file, NULL, _IOFBF, 256 * 1024);
+
+  /* the handshake of a server without authentication that sends in the
+     pixel format of this client */
+  security[0] = 1;
+  security[1] = rfbNoAuth;
+  si.framebufferWidth = rfbClientSwap16IfLE(client->width);
+  si.framebufferHeight = rfbClientSwap16IfLE(client->height);
+  si.format = client->format;
+  si.format.redMax = rfbClientSwap16IfLE(client->format.redMax);
+  si.format.greenMax = rfbClientSwap16IfLE(client->format.greenMax);
+  si.format.blueMax = rfbClientSwap16IfLE(client->format.blueMax);
+  si.nameLength = rfbClientSwap32IfLE((uint32_t)nameLength);
+
+  if (fwrite(VNCREC_MAGIC, VNCREC_MAGIC_LENGTH, 1, r->file) != 1 ||
+      fprintf(r->file, rfbProtocolVersionFormat, 3, 8) != sz_rfbProtocolVersionMsg ||
+      fwrite(security, sizeof(security), 1, r->file) != 1 ||
+      fwrite(&result, sizeof(result), 1, r->file) != 1 ||
+      fwrite(&si, sz_rfbServerInitMsg, 1, r->file) != 1 ||
+      fwrite(client->desktopName, 1, nameLength, r->file) != nameLength ||
+      fwrite(VNCREC_INDEX_MAGIC, VNCREC_MAGIC_LENGTH, 1, r->indexFile) != 1 ||
+      !WriteKeyframe(client, r, VNCRecNow())) {
+    rfbClientErr("Could not write %s: %s\n", filename, strerror(errno));
+    FreeRecorder(r);
+    return FALSE;
+  }
+
+  client->vncRecorder = r;
+  return TRUE;
+}
+
+void
+rfbClientRecordStop(rfbClient* client)
+{
+  if (client->vncRecorder == NULL)
+    return;
+  FreeRecorder((vncRecorder*)client->vncRecorder);
+  client->vncRecorder = NULL;
+}
+
+/*
+ * RecordFrameBufferUpdate notes a rectangle that changed; it is written
+ * with the others by RecordFinishedUpdate at the end of the update.
+ */
+
+void
+RecordFrameBufferUpdate(rfbClient* client, int x, int y, int w, int h)
+{
+  vncRecorder* r = (vncRecorder*)client->vncRecorder;
+
+  if (x < 0) {
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    h += y;
+    y = 0;
+  }
+  if (x + w > client->width)
+    w = client->width - x;
+  if (y + h > client->height)
+    h = client->height - y;
+  if (w <= 0 || h <= 0 || r == NULL)
+    return;
+
+  /* past VNCREC_MAX_RECTS only the bounding box counts, so the last
+     slot keeps growing */
+  if (r->nRects == r->rectsSize) {
+    rfbRectangle* rects = NULL;
+
+    if (r->rectsSize <= VNCREC_MAX_RECTS)
+      rects = realloc(r->rects, (r->rectsSize ? 2 * r->rectsSize : 16) * sizeof(rfbRectangle));
+    if (rects == NULL) {
+      rfbRectangle* last;
+      int x2, y2;
+
+      if (r->nRects == 0)
+	return;
+      last = &r->rects[r->nRects - 1];
+      x2 = last->x + last->w;
+      y2 = last->y + last->h;
+
+      if (x < last->x)
+	last->x = x;
+      if (y < last->y)
+	last->y = y;
+      last->w = (x + w > x2 ? x + w : x2) - last->x;
+      last->h = (y + h > y2 ? y + h : y2) - last->y;
+      return;
+    }
+    r->rects = rects;
+    r->rectsSize = r->rectsSize ? 2 * r->rectsSize : 16;
+  }
+  r->rects[r->nRects].x = x;
+  r->rects[r->nRects].y = y;
+  r->rects[r->nRects].w = w;
+  r->rects[r->nRects].h = h;
+  r->nRects++;
+}
+
+void
+RecordFinishedUpdate(rfbClient* client)
+{
+  vncRecorder* r = (vncRecorder*)client->vncRecorder;
+  int interval = client->recordKeyframeInterval > 0 ?
+    client->recordKeyframeInterval : VNCREC_DEFAULT_KEYFRAME_INTERVAL;
+  int64_t now;
+  rfbBool ok;
+
+  if (r->nRects == 0 && client->width == r->width && client->height == r->height)
+    return;
+
+  now = VNCRecNow();
+  if (client->width != r->width || client->height != r->height ||
+      now - r->lastKeyframe >= (int64_t)interval * 1000000)
+    ok = WriteKeyframe(client, r, now);
+  else
+    ok = WriteUpdate(client, r, now);
+  r->nRects = 0;
+
+  if (!ok) {
+    rfbClientErr("Recording failed: %s\n", strerror(errno));
+    rfbClientRecordStop(client);
+  }
+}
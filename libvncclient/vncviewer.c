@@ -41,6 +41,19 @@
 #include <rfb/rfbclient.h>
 #include "tls.h"
 
+#if defined(LIBVNCSERVER_HAVE_LIBZ) && defined(LIBVNCSERVER_HAVE_LIBJPEG)
+/* tight.c */
+extern void FreeJpegDecoder(rfbClient* client);
+#endif
+/* workers.c */
+extern void FreeWorkers(rfbClient* client);
+/* h264.c */
+extern void FreeH264Decoder(rfbClient* client);
+/* vncrec.c */
+extern void CloseVNCRec(rfbClient* client);
+/* shm.c */
+extern void FreeSharedMemory(rfbClient* client);
+
 static void Dummy(rfbClient* client) {
 }
 static rfbBool DummyPoint(rfbClient* client, int x, int y) {
@@ -225,6 +238,7 @@ rfbClient* rfbGetClient(int bitsPerSample,int samplesPerPixel,
   client->GetCredential = NULL;
   client->tlsSession = NULL;
   client->sock = -1;
+  client->receivedFd = -1;
   client->listenSock = -1;
   client->listenAddress = NULL;
   client->listen6Sock = -1;
@@ -295,6 +309,7 @@ static rfbBool rfbInitConnection(rfbClient* client)
 
 rfbBool rfbInitClient(rfbClient* client,int* argc,char** argv) {
   int i,j;
+  const char* recordFile = NULL;
 
   if(argv && argc && *argc) {
     if(client->programName==0)
@@ -326,6 +341,12 @@ rfbBool rfbInitClient(rfbClient* client,int* argc,char** argv) {
       } else if (i+1<*argc && strcmp(argv[i], "-qosdscp") == 0) {
         client->QoS_DSCP = atoi(argv[i+1]);
         j+=2;
+      } else if (i+1<*argc && strcmp(argv[i], "-record") == 0) {
+        recordFile = argv[i+1];
+        j+=2;
+      } else if (i+1<*argc && strcmp(argv[i], "-pipeline") == 0) {
+        client->maxPendingUpdateRequests = atoi(argv[i+1]);
+        j+=2;
       } else if (i+1<*argc && strcmp(argv[i], "-repeaterdest") == 0) {
 	char* colon=strchr(argv[i+1],':');
 
@@ -369,6 +390,11 @@ rfbBool rfbInitClient(rfbClient* client,int* argc,char** argv) {
     return FALSE;
   }
 
+  if(recordFile && !rfbClientRecordStart(client, recordFile)) {
+    rfbClientCleanup(client);
+    return FALSE;
+  }
+
   return TRUE;
 }
 
@@ -393,9 +419,41 @@ void rfbClientCleanup(rfbClient* client) {
 
   if (client->jpegSrcManager)
     free(client->jpegSrcManager);
+
+  FreeJpegDecoder(client);
 #endif
 #endif
 
+  /* before the stripes and buffers they work on */
+  FreeWorkers(client);
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  if (client->zrleStripes) {
+    int j;
+
+    for (j = 0; j < rfbZRLEMaxStripes; j++) {
+      rfbZRLEStripe* stripe = &client->zrleStripes[j];
+
+      if (stripe->decompStreamInited == TRUE &&
+	  inflateEnd (&stripe->decompStream) != Z_OK &&
+	  stripe->decompStream.msg != NULL)
+	rfbClientLog("inflateEnd: %s\n", stripe->decompStream.msg);
+      free(stripe->buffer);
+      free(stripe->rawBuffer);
+    }
+    free(client->zrleStripes);
+  }
+#endif
+
+  free(client->lz4Buffer);
+  free(client->lz4Offsets);
+
+  FreeH264Decoder(client);
+
+  rfbClientRecordStop(client);
+  CloseVNCRec(client);
+  FreeSharedMemory(client);
+
   FreeTLS(client);
 
   while (client->clientData) {
@@ -414,6 +472,8 @@ void rfbClientCleanup(rfbClient* client) {
     free(client->destHost);
   if (client->clientAuthSchemes)
     free(client->clientAuthSchemes);
+  free(client->readBuf);
+  free(client->updatePipeline);
   if (client->frameBuffer) /* chenbd */
     free(client->frameBuffer);
   free(client);
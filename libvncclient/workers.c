@@ -0,0 +1,176 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * workers.c - threads of a client that share the work on one rectangle.
+ *
+ * This file shouldn't be compiled directly.  It is included once by
+ * rfbproto.c, before the decoders that cut a rectangle into independent
+ * jobs (ZRLEStripes, LZ4) and hand them to RunWorkers().  The threads are
+ * started with the first rectangle that needs them and wait for the next
+ * one in between; the network thread takes jobs as well.  They are stopped
+ * by FreeWorkers() in rfbClientCleanup().
+ *
+ * Clients run by a mux, which drives many of them from one thread, get no
+ * threads of their own.
+ */
+
+#include "workers.h"
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t work, done;
+  pthread_t threads[RFB_MAX_WORKERS - 1];
+  int nThreads;
+
+  /* the jobs of the rectangle being decoded */
+  void (*run)(void* job);
+  char* jobs;
+  size_t jobSize;
+  int nJobs;
+  int nextJob;                  /* the next one to take */
+  int nDone;
+  rfbBool quit;
+} Workers;
+
+/* takes jobs until there are none left; called with the mutex held */
+static void
+TakeJobs(Workers* workers)
+{
+  while (workers->nextJob < workers->nJobs) {
+    void* job = workers->jobs + workers->nextJob++ * workers->jobSize;
+
+    pthread_mutex_unlock(&workers->mutex);
+    workers->run(job);
+    pthread_mutex_lock(&workers->mutex);
+    if (++workers->nDone == workers->nJobs)
+      pthread_cond_signal(&workers->done);
+  }
+}
+
+static void*
+WorkerThread(void* arg)
+{
+  Workers* workers = (Workers*)arg;
+
+  pthread_mutex_lock(&workers->mutex);
+  while (!workers->quit) {
+    TakeJobs(workers);
+    if (!workers->quit)
+      pthread_cond_wait(&workers->work, &workers->mutex);
+  }
+  pthread_mutex_unlock(&workers->mutex);
+  return NULL;
+}
+
+/* returns FALSE if there are no threads to help */
+static rfbBool
+RunWorkersInThreads(rfbClient* client, int nJobs, void (*run)(void* job),
+		    void* jobs, size_t jobSize)
+{
+  Workers* workers = (Workers*)client->workers;
+
+  if (workers == NULL) {
+    workers = (Workers*)calloc(1, sizeof(Workers));
+    if (workers == NULL)
+      return FALSE;
+    pthread_mutex_init(&workers->mutex, NULL);
+    pthread_cond_init(&workers->work, NULL);
+    pthread_cond_init(&workers->done, NULL);
+    client->workers = workers;
+  }
+
+  /* if no more threads can be started, the others do all the work */
+  while (workers->nThreads < nJobs - 1 &&
+	 workers->nThreads < RFB_MAX_WORKERS - 1 &&
+	 pthread_create(&workers->threads[workers->nThreads], NULL,
+			WorkerThread, workers) == 0)
+    workers->nThreads++;
+  if (workers->nThreads == 0)
+    return FALSE;
+
+  pthread_mutex_lock(&workers->mutex);
+  workers->run = run;
+  workers->jobs = (char*)jobs;
+  workers->jobSize = jobSize;
+  workers->nJobs = nJobs;
+  workers->nextJob = 0;
+  workers->nDone = 0;
+  pthread_cond_broadcast(&workers->work);
+  TakeJobs(workers);
+  while (workers->nDone < workers->nJobs)
+    pthread_cond_wait(&workers->done, &workers->mutex);
+  pthread_mutex_unlock(&workers->mutex);
+  return TRUE;
+}
+
+void
+FreeWorkers(rfbClient* client)
+{
+  Workers* workers = (Workers*)client->workers;
+  int i;
+
+  if (workers == NULL)
+    return;
+
+  pthread_mutex_lock(&workers->mutex);
+  workers->quit = TRUE;
+  pthread_cond_broadcast(&workers->work);
+  pthread_mutex_unlock(&workers->mutex);
+  for (i = 0; i < workers->nThreads; i++)
+    pthread_join(workers->threads[i], NULL);
+
+  pthread_mutex_destroy(&workers->mutex);
+  pthread_cond_destroy(&workers->work);
+  pthread_cond_destroy(&workers->done);
+  free(workers);
+  client->workers = NULL;
+}
+
+#else
+
+void
+FreeWorkers(rfbClient* client)
+{
+  (void)client;
+}
+
+#endif
+
+/*
+ * RunWorkers calls run on each of the nJobs jobs, which are jobSize bytes
+ * apart from jobs on, and returns when all of them are done.  The jobs must
+ * not touch anything the others touch.
+ */
+
+static void
+RunWorkers(rfbClient* client, int nJobs, void (*run)(void* job),
+	   void* jobs, size_t jobSize)
+{
+  int i;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  if (nJobs > 1 && client->muxData == NULL &&
+      RunWorkersInThreads(client, nJobs, run, jobs, jobSize))
+    return;
+#endif
+
+  for (i = 0; i < nJobs; i++)
+    run((char*)jobs + i * jobSize);
+}
@@ -35,12 +35,18 @@
 #if !defined(UNCOMP) || UNCOMP==0
 #define HandleZRLE CONCAT2E(HandleZRLE,REALBPP)
 #define HandleZRLETile CONCAT2E(HandleZRLETile,REALBPP)
+#define HandleZRLEStripes CONCAT2E(HandleZRLEStripes,REALBPP)
+#define HandleZRLEStripe CONCAT2E(HandleZRLEStripe,REALBPP)
 #elif UNCOMP>0
 #define HandleZRLE CONCAT3E(HandleZRLE,REALBPP,Down)
 #define HandleZRLETile CONCAT3E(HandleZRLETile,REALBPP,Down)
+#define HandleZRLEStripes CONCAT3E(HandleZRLEStripes,REALBPP,Down)
+#define HandleZRLEStripe CONCAT3E(HandleZRLEStripe,REALBPP,Down)
 #else
 #define HandleZRLE CONCAT3E(HandleZRLE,REALBPP,Up)
 #define HandleZRLETile CONCAT3E(HandleZRLETile,REALBPP,Up)
+#define HandleZRLEStripes CONCAT3E(HandleZRLEStripes,REALBPP,Up)
+#define HandleZRLEStripe CONCAT3E(HandleZRLEStripe,REALBPP,Up)
 #endif
 #define CARDBPP CONCAT3E(uint,BPP,_t)
 #define CARDREALBPP CONCAT3E(uint,REALBPP,_t)
@@ -76,9 +82,115 @@
 #endif
 #undef CPIXEL
 
+#ifndef ZRLE_STRIPES_ONCE
+#define ZRLE_STRIPES_ONCE
+
+/*
+ * ReadZRLEStripes reads the header and the compressed data of every stripe
+ * of a ZRLEStripes rectangle into client->zrleStripes, so that they can be
+ * decoded independently.  Returns the number of stripes, or 0 on error.
+ */
+
+static int
+ReadZRLEStripes(rfbClient* client, int rx, int ry, int rw, int rh, int bytesPerPixel)
+{
+	rfbZRLEStripesHeader header;
+	int i, nStripes, stripeHeight;
+
+	if (!ReadFromRFBServer(client, (char *)&header, sz_rfbZRLEStripesHeader))
+		return 0;
+
+	nStripes = header.nStripes;
+	stripeHeight = rfbClientSwap16IfLE(header.stripeHeight);
+
+	if (nStripes < 1 || nStripes > rfbZRLEMaxStripes ||
+			stripeHeight <= 0 || stripeHeight % rfbZRLETileHeight != 0 ||
+			nStripes * stripeHeight < rh ||
+			(nStripes > 1 && (nStripes - 1) * stripeHeight >= rh)) {
+		rfbClientLog("Invalid ZRLEStripes header: %d stripes of %d rows for %d rows\n",
+				nStripes, stripeHeight, rh);
+		return 0;
+	}
+
+	if (client->zrleStripes == NULL) {
+		client->zrleStripes = (rfbZRLEStripe*) calloc(rfbZRLEMaxStripes, sizeof(rfbZRLEStripe));
+		if (client->zrleStripes == NULL)
+			return 0;
+	}
+
+	for (i = 0; i < nStripes; i++) {
+		rfbZRLEStripe* stripe = &client->zrleStripes[i];
+		rfbZRLEHeader zhdr;
+		int rawSize;
+
+		stripe->client = client;
+		stripe->x = rx;
+		stripe->y = ry + i * stripeHeight;
+		stripe->w = rw;
+		stripe->h = (i == nStripes - 1) ? rh - i * stripeHeight : stripeHeight;
+		stripe->zywrleLevel = header.zywrleLevel;
+
+		if (!ReadFromRFBServer(client, (char *)&zhdr, sz_rfbZRLEHeader))
+			return 0;
+		stripe->length = rfbClientSwap32IfLE(zhdr.length);
+		if (stripe->length < 0) {
+			rfbClientLog("Invalid ZRLEStripes stripe length\n");
+			return 0;
+		}
+
+		if (stripe->bufferSize < stripe->length) {
+			free(stripe->buffer);
+			stripe->bufferSize = stripe->length;
+			stripe->buffer = (char*) malloc(stripe->bufferSize);
+			if (stripe->buffer == NULL) {
+				stripe->bufferSize = 0;
+				return 0;
+			}
+		}
+		if (!ReadFromRFBServer(client, stripe->buffer, stripe->length))
+			return 0;
+
+		/* see HandleZRLE for the size of the raw buffer */
+		rawSize = stripe->w * stripe->h * bytesPerPixel * 2;
+		if (stripe->rawBufferSize < rawSize) {
+			free(stripe->rawBuffer);
+			stripe->rawBufferSize = rawSize;
+			stripe->rawBuffer = (char*) malloc(stripe->rawBufferSize);
+			if (stripe->rawBuffer == NULL) {
+				stripe->rawBufferSize = 0;
+				return 0;
+			}
+		}
+	}
+
+	return nStripes;
+}
+
+/*
+ * RunZRLEStripes calls decode on each of the first nStripes stripes, on
+ * the threads of the client where possible.  The stripes cover separate
+ * rows of the frame buffer, so they do not need any locking.
+ */
+
+static rfbBool
+RunZRLEStripes(rfbClient* client, int nStripes, void (*decode)(void*))
+{
+	int i;
+
+	RunWorkers(client, nStripes, decode, client->zrleStripes, sizeof(rfbZRLEStripe));
+
+	for (i = 0; i < nStripes; i++)
+		if (!client->zrleStripes[i].result)
+			return FALSE;
+	return TRUE;
+}
+
+#endif /* ZRLE_STRIPES_ONCE */
+
 static int HandleZRLETile(rfbClient* client,
 	uint8_t* buffer,size_t buffer_length,
-	int x,int y,int w,int h);
+	int x,int y,int w,int h,
+	int zywrle_level,int* zywrleBuf);
 
 static rfbBool
 HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
@@ -88,6 +200,11 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 	int inflateResult;
 	int toRead;
 	int min_buffer_size = rw * rh * (REALBPP / 8) * 2;
+#if BPP!=8
+	int zywrle_level = 3 - client->appData.qualityLevel / 3;
+#else
+	int zywrle_level = 0;
+#endif
 
 	/* First make sure we have a large enough raw buffer to hold the
 	 * decompressed data.  In practice, with a fixed REALBPP, fixed frame
@@ -198,7 +315,8 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 			for(i=0; i<rw; i+=rfbZRLETileWidth) {
 				int subWidth=(i+rfbZRLETileWidth>rw)?rw-i:rfbZRLETileWidth;
 				int subHeight=(j+rfbZRLETileHeight>rh)?rh-j:rfbZRLETileHeight;
-				int result=HandleZRLETile(client,buf,remaining,rx+i,ry+j,subWidth,subHeight);
+				int result=HandleZRLETile(client,buf,remaining,rx+i,ry+j,subWidth,subHeight,
+						zywrle_level,(int*)client->zlib_buffer);
 
 				if(result<0) {
 					rfbClientLog("ZRLE decoding failed (%d)\n",result);
@@ -223,6 +341,88 @@ return TRUE;
 	return TRUE;
 }
 
+/*
+ * HandleZRLEStripe inflates and decodes one stripe of a ZRLEStripes
+ * rectangle, which ReadZRLEStripes has read already.  It may run on a thread
+ * of its own, so it only touches its stripe and its part of the frame buffer.
+ */
+
+static void
+HandleZRLEStripe(void* arg)
+{
+	rfbZRLEStripe* stripe = (rfbZRLEStripe*)arg;
+	rfbClient* client = stripe->client;
+	z_stream* zs = &stripe->decompStream;
+	char* buf = stripe->rawBuffer;
+	int inflateResult, remaining, i, j;
+
+	stripe->result = FALSE;
+
+	if (!stripe->decompStreamInited) {
+		zs->zalloc = Z_NULL;
+		zs->zfree = Z_NULL;
+		zs->opaque = Z_NULL;
+		inflateResult = inflateInit(zs);
+		if (inflateResult != Z_OK) {
+			rfbClientLog("inflateInit returned error: %d, msg: %s\n",
+					inflateResult, zs->msg);
+			return;
+		}
+		stripe->decompStreamInited = TRUE;
+	}
+
+	remaining = 0;
+	if (stripe->length > 0) {
+		zs->next_in = (Bytef *)stripe->buffer;
+		zs->avail_in = stripe->length;
+		zs->next_out = (Bytef *)stripe->rawBuffer;
+		zs->avail_out = stripe->rawBufferSize;
+		zs->data_type = Z_BINARY;
+
+		inflateResult = inflate(zs, Z_SYNC_FLUSH);
+		if (inflateResult != Z_OK) {
+			rfbClientLog("zlib inflate returned error: %d, msg: %s\n",
+					inflateResult, zs->msg);
+			return;
+		}
+		if (zs->avail_in > 0) {
+			rfbClientLog("zlib inflate ran out of space!\n");
+			return;
+		}
+		remaining = stripe->rawBufferSize - zs->avail_out;
+	}
+
+	for (j = 0; j < stripe->h; j += rfbZRLETileHeight)
+		for (i = 0; i < stripe->w; i += rfbZRLETileWidth) {
+			int subWidth = (i + rfbZRLETileWidth > stripe->w) ? stripe->w - i : rfbZRLETileWidth;
+			int subHeight = (j + rfbZRLETileHeight > stripe->h) ? stripe->h - j : rfbZRLETileHeight;
+			int result = HandleZRLETile(client, (uint8_t*)buf, remaining,
+					stripe->x + i, stripe->y + j, subWidth, subHeight,
+					stripe->zywrleLevel, stripe->zywrleBuf);
+
+			if (result < 0) {
+				rfbClientLog("ZRLE decoding failed (%d)\n", result);
+				return;
+			}
+
+			buf += result;
+			remaining -= result;
+		}
+
+	stripe->result = TRUE;
+}
+
+static rfbBool
+HandleZRLEStripes (rfbClient* client, int rx, int ry, int rw, int rh)
+{
+	int nStripes = ReadZRLEStripes(client, rx, ry, rw, rh, REALBPP / 8);
+
+	if (nStripes == 0)
+		return FALSE;
+
+	return RunZRLEStripes(client, nStripes, HandleZRLEStripe);
+}
+
 #if REALBPP!=BPP && defined(UNCOMP) && UNCOMP!=0
 #if UNCOMP>0
 #define UncompressCPixel(pointer) ((*(CARDBPP*)pointer)>>UNCOMP)
@@ -235,13 +435,16 @@ return TRUE;
 
 static int HandleZRLETile(rfbClient* client,
 		uint8_t* buffer,size_t buffer_length,
-		int x,int y,int w,int h) {
+		int x,int y,int w,int h,
+		int zywrle_level,int* zywrleBuf) {
 	uint8_t* buffer_copy = buffer;
 	uint8_t* buffer_end = buffer+buffer_length;
 	uint8_t type;
-#if BPP!=8
-	uint8_t zywrle_level = (client->appData.qualityLevel & 0x80) ?
-		0 : (3 - client->appData.qualityLevel / 3);
+
+#if BPP==8
+	/* no ZYWRLE at 8 bits per pixel */
+	(void)zywrle_level;
+	(void)zywrleBuf;
 #endif
 
 	if(buffer_length<1)
@@ -255,13 +458,11 @@ static int HandleZRLETile(rfbClient* client,
           if( zywrle_level > 0 ){
 			CARDBPP* pFrame = (CARDBPP*)client->frameBuffer + y*client->width+x;
 			int ret;
-			client->appData.qualityLevel |= 0x80;
-			ret = HandleZRLETile(client, buffer, buffer_end-buffer, x, y, w, h);
-		    client->appData.qualityLevel &= 0x7F;
+			ret = HandleZRLETile(client, buffer, buffer_end-buffer, x, y, w, h, 0, zywrleBuf);
 			if( ret < 0 ){
 				return ret;
 			}
-			ZYWRLE_SYNTHESIZE( pFrame, pFrame, w, h, client->width, zywrle_level, (int*)client->zlib_buffer );
+			ZYWRLE_SYNTHESIZE( pFrame, pFrame, w, h, client->width, zywrle_level, zywrleBuf );
 			buffer += ret;
 		  }else
 #endif
@@ -419,6 +620,8 @@ static int HandleZRLETile(rfbClient* client,
 #undef CARDREALBPP
 #undef HandleZRLE
 #undef HandleZRLETile
+#undef HandleZRLEStripes
+#undef HandleZRLEStripe
 #undef UncompressCPixel
 #undef REALBPP
 
@@ -0,0 +1,290 @@
+/*
+ * asynclog.c
+ *
+ * Routines to implement the asynchronous logger: rfbLog() and rfbErr()
+ * put the formatted message into a ring owned by the calling thread, and
+ * a background thread stamps the messages with the time and writes them
+ * to stderr.  Logging threads never take a lock nor touch stdio.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_RING_SIZE 128            /* records per thread, a power of two */
+#define LOG_RECORD_SIZE 512
+#define LOG_FLUSH_INTERVAL 10        /* ms */
+
+typedef struct {
+  unsigned long seq;                 /* orders the records of all threads */
+  time_t when;
+  char text[LOG_RECORD_SIZE - sizeof(unsigned long) - sizeof(time_t)];
+} rfbLogRecord;
+
+/*
+ * A ring has one writer, the thread owning it, and one reader, the
+ * flusher.  Rings are never freed: when its thread exits a ring is given
+ * up and taken over by the next thread wanting one.
+ */
+typedef struct rfbLogRing {
+  struct rfbLogRing* next;
+  int owned;
+  unsigned head;                     /* written by the owner */
+  unsigned tail;                     /* written by the flusher */
+  rfbLogRecord records[LOG_RING_SIZE];
+} rfbLogRing;
+
+static rfbLogRing* logRings = NULL;
+static unsigned long logSeq = 0;
+static unsigned long logDropped = 0;
+static int logRunning = 0;
+static int logKeyCreated = 0;
+static int logExitRegistered = 0;
+static pthread_key_t logRingKey;
+static pthread_t logFlusher;
+
+static void
+ReleaseRing(void* data)
+{
+  rfbLogRing* ring = (rfbLogRing*)data;
+
+  __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+static rfbLogRing*
+GetRing(void)
+{
+  rfbLogRing* ring = (rfbLogRing*)pthread_getspecific(logRingKey);
+  int unowned;
+
+  if (ring)
+    return ring;
+
+  /* a ring given up is only taken over once it has been written out */
+  for (ring = __atomic_load_n(&logRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head)
+      continue;
+    unowned = 0;
+    if (__atomic_compare_exchange_n(&ring->owned, &unowned, 1, FALSE,
+				    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+  if (ring == NULL) {
+    ring = (rfbLogRing*)calloc(1, sizeof(rfbLogRing));
+    if (ring == NULL)
+      return NULL;
+    ring->owned = 1;
+    ring->next = __atomic_load_n(&logRings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&logRings, &ring->next, ring, TRUE,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  pthread_setspecific(logRingKey, ring);
+  return ring;
+}
+
+/*
+ * rfbAsyncLog and rfbAsyncErr are what rfbLog and rfbErr point to while
+ * the asynchronous logger runs.  Only the message is formatted here, the
+ * time stamp is made by the flusher.  If the ring is full the message is
+ * dropped.
+ */
+
+static void
+rfbAsyncLogV(const char *format, va_list args)
+{
+  rfbLogRing* ring;
+  rfbLogRecord* rec;
+  unsigned head;
+  int n;
+
+  if (!rfbEnableLogging)
+    return;
+
+  ring = GetRing();
+  if (ring == NULL) {
+    __atomic_fetch_add(&logDropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+    __atomic_fetch_add(&logDropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+  rec->seq = __atomic_fetch_add(&logSeq, 1, __ATOMIC_RELAXED);
+  time(&rec->when);
+  n = vsnprintf(rec->text, sizeof(rec->text), format, args);
+  if (n >= (int)sizeof(rec->text))
+    strcpy(rec->text + sizeof(rec->text) - 5, "...\n");
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void
+rfbAsyncLog(const char *format, ...)
+{
+  va_list args;
+
+  if (rfbLogLevel < RFB_LOG_INFO)
+    return;
+
+  va_start(args, format);
+  rfbAsyncLogV(format, args);
+  va_end(args);
+}
+
+static void
+rfbAsyncErr(const char *format, ...)
+{
+  va_list args;
+
+  va_start(args, format);
+  rfbAsyncLogV(format, args);
+  va_end(args);
+}
+
+/* writes out the records of all rings, oldest first */
+static void
+FlushRings(void)
+{
+  static time_t stampTime = (time_t)-1;
+  static char stamp[64];
+  rfbLogRing *ring, *oldest;
+  rfbLogRecord* rec;
+  unsigned long dropped;
+  int written = 0;
+
+  while (1) {
+    oldest = NULL;
+    for (ring = __atomic_load_n(&logRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+      if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+	continue;
+      if (oldest == NULL ||
+	  (long)(ring->records[ring->tail & (LOG_RING_SIZE - 1)].seq -
+		 oldest->records[oldest->tail & (LOG_RING_SIZE - 1)].seq) < 0)
+	oldest = ring;
+    }
+    if (oldest == NULL)
+      break;
+
+    rec = &oldest->records[oldest->tail & (LOG_RING_SIZE - 1)];
+    if (rec->when != stampTime) {
+      stampTime = rec->when;
+      strftime(stamp, sizeof(stamp), "%d/%m/%Y %X ", localtime(&stampTime));
+    }
+    fputs(stamp, stderr);
+    fputs(rec->text, stderr);
+    written = 1;
+
+    __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+  }
+
+  dropped = __atomic_exchange_n(&logDropped, 0, __ATOMIC_RELAXED);
+  if (dropped) {
+    fprintf(stderr, "%lu log messages dropped\n", dropped);
+    written = 1;
+  }
+  if (written)
+    fflush(stderr);
+}
+
+static void*
+LogFlusher(void* data)
+{
+  (void)data;
+  while (__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE)) {
+    FlushRings();
+    usleep(LOG_FLUSH_INTERVAL * 1000);
+  }
+  return NULL;
+}
+
+/*
+ * rfbStartAsyncLog makes rfbLog and rfbErr asynchronous, unless the
+ * application has set log functions of its own.  rfbStopAsyncLog writes
+ * out what is left and goes back to logging synchronously; it is also
+ * called at exit.
+ */
+
+rfbBool
+rfbStartAsyncLog(void)
+{
+  if (logRunning)
+    return TRUE;
+  if (rfbLog != rfbDefaultLog || rfbErr != rfbDefaultErr)
+    return FALSE;
+
+  if (!logKeyCreated) {
+    if (pthread_key_create(&logRingKey, ReleaseRing) != 0)
+      return FALSE;
+    logKeyCreated = 1;
+  }
+
+  __atomic_store_n(&logRunning, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&logFlusher, NULL, LogFlusher, NULL) != 0) {
+    logRunning = 0;
+    rfbLogPerror("rfbStartAsyncLog: pthread_create");
+    return FALSE;
+  }
+  if (!logExitRegistered) {
+    atexit(rfbStopAsyncLog);
+    logExitRegistered = 1;
+  }
+
+  rfbLog = rfbAsyncLog;
+  rfbErr = rfbAsyncErr;
+  return TRUE;
+}
+
+void
+rfbStopAsyncLog(void)
+{
+  if (!logRunning)
+    return;
+
+  rfbLog = rfbDefaultLog;
+  rfbErr = rfbDefaultErr;
+
+  __atomic_store_n(&logRunning, 0, __ATOMIC_RELEASE);
+  pthread_join(logFlusher, NULL);
+  FlushRings();
+}
+
+#else
+
+rfbBool
+rfbStartAsyncLog(void)
+{
+  return FALSE;
+}
+
+void
+rfbStopAsyncLog(void)
+{
+}
+
+#endif
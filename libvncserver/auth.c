@@ -333,7 +333,7 @@ rfbProcessClientSecurityType(rfbClientPtr cl)
     uint8_t chosenType;
     rfbSecurityHandler* handler;
     
-    rfbLog("rfbProcessClientSecurityType() cl: %p", cl);
+    rfbDebug("rfbProcessClientSecurityType() cl: %p\n", cl);
     /* Read the security type. */
     n = rfbReadExact(cl, (char *)&chosenType, 1);
     if (n <= 0) {
@@ -372,7 +372,7 @@ rfbAuthProcessClientMessage(rfbClientPtr cl)
     uint8_t response[CHALLENGESIZE];
     uint32_t authResult;
 
-    rfbLog("rfbAuthProcessClientMessage() cl: %p", cl);
+    rfbDebug("rfbAuthProcessClientMessage() cl: %p\n", cl);
     if ((n = rfbReadExact(cl, (char *)response, CHALLENGESIZE)) <= 0) {
         if (n != 0)
             rfbLogPerror("rfbAuthProcessClientMessage: read");
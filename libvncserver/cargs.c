@@ -49,6 +49,8 @@ rfbUsage(void)
     fprintf(stderr, "-httpportv6 portnum    use portnum for IPv6 http connection\n");
 #endif
     fprintf(stderr, "-enablehttpproxy       enable http proxy support\n");
+    fprintf(stderr, "-httpmetrics           serve the client metrics over http as /metrics,\n");
+    fprintf(stderr, "                       and the trace as /trace.json and /trace.bin\n");
     fprintf(stderr, "-progressive height    enable progressive updating for slow links\n");
     fprintf(stderr, "-listen ipaddr         listen for connections only on network interface with\n");
     fprintf(stderr, "                       addr ipaddr. '-listen localhost' and hostname work too.\n");
@@ -56,6 +58,19 @@ rfbUsage(void)
     fprintf(stderr, "-listenv6 ipv6addr     listen for IPv6 connections only on network interface with\n");
     fprintf(stderr, "                       addr ipv6addr. '-listen localhost' and hostname work too.\n");
 #endif
+    fprintf(stderr, "-unixsock path         also listen for local clients on the UNIX socket path;\n");
+    fprintf(stderr, "                       they get the pixels through shared memory\n");
+    fprintf(stderr, "-iouring               send to the clients through io_uring (Linux only)\n");
+    fprintf(stderr, "-nocork                send the pieces of updates as they come, not as full\n");
+    fprintf(stderr, "                       TCP segments\n");
+    fprintf(stderr, "-asynclog              write the log from a background thread\n");
+    fprintf(stderr, "-loglevel level        0 errors, 1 informational (default), 2 debug\n");
+    fprintf(stderr, "-trace records         trace the latest changes to the framebuffer on their\n");
+    fprintf(stderr, "                       way to the clients\n");
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    fprintf(stderr, "-deflate backend       deflate implementation for zlib, tight and ZRLE:\n");
+    fprintf(stderr, "                       zlib (default) or fast\n");
+#endif
 
     for(extension=rfbGetExtensionIterator();extension;extension=extension->next)
 	if(extension->usage)
@@ -175,6 +190,8 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 #endif
         } else if (strcmp(argv[i], "-enablehttpproxy") == 0) {
             rfbScreen->httpEnableProxyConnect = TRUE;
+        } else if (strcmp(argv[i], "-httpmetrics") == 0) {
+            rfbScreen->httpEnableMetrics = TRUE;
         } else if (strcmp(argv[i], "-progressive") == 0) {  /* -httpport portnum */
             if (i + 1 >= *argc) {
 		rfbUsage();
@@ -196,6 +213,44 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 		return FALSE;
 	    }
 	    rfbScreen->listen6Interface = argv[++i];
+#endif
+	} else if (strcmp(argv[i], "-unixsock") == 0) {  /* -unixsock path */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+	    rfbScreen->unixSockPath = argv[++i];
+	} else if (strcmp(argv[i], "-iouring") == 0) {
+	    rfbScreen->useIOUring = TRUE;
+	} else if (strcmp(argv[i], "-nocork") == 0) {
+	    rfbScreen->corkUpdates = FALSE;
+	} else if (strcmp(argv[i], "-asynclog") == 0) {
+	    rfbStartAsyncLog();
+	} else if (strcmp(argv[i], "-loglevel") == 0) {  /* -loglevel level */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+	    rfbLogLevel = atoi(argv[++i]);
+	} else if (strcmp(argv[i], "-trace") == 0) {  /* -trace records */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+	    if (!rfbTraceStart(atoi(argv[++i])))
+		rfbErr("could not start tracing\n");
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+        } else if (strcmp(argv[i], "-deflate") == 0) {  /* -deflate backend */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->deflateBackend = rfbGetDeflateBackend(argv[++i]);
+            if (rfbScreen->deflateBackend == NULL) {
+		rfbErr("unknown deflate backend %s\n", argv[i]);
+		rfbUsage();
+		return FALSE;
+	    }
 #endif
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
         } else if (strcmp(argv[i], "-sslkeyfile") == 0) {  /* -sslkeyfile sslkeyfile */
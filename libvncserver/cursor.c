@@ -25,8 +25,164 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
+#include "scale.h"
 
-void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
+/*
+ * The encoded cursor shapes are kept with the cursor, one for each
+ * encoding, pixel format and scale they were sent in, and shared between
+ * the clients: animated cursors change many times a second, and all the
+ * clients usually want the same.  A cursor must not be changed in place
+ * other than by passing it to rfbSetCursor() again, which drops them.
+ */
+
+#define MAX_ENCODED_CURSORS 8
+
+typedef struct rfbEncodedCursor {
+    struct rfbEncodedCursor* next;
+    rfbScreenInfoPtr screen;	/* the format and colour map it is from */
+    uint32_t encoding;
+    rfbPixelFormat format;	/* for RichCursor */
+    int width, height;		/* of the (scaled) screen it is for */
+    int len;
+    char data[1];		/* rectangle header and cursor data */
+} rfbEncodedCursor;
+
+static MUTEX(encodedCursorMutex);
+static int encodedCursorMutex_initialized = 0;
+
+void rfbInitEncodedCursors(void)
+{
+    if (!encodedCursorMutex_initialized) {
+	INIT_MUTEX(encodedCursorMutex);
+	encodedCursorMutex_initialized = 1;
+    }
+}
+
+static void FreeEncodedCursors(rfbCursorPtr c)
+{
+    rfbEncodedCursor *e, *next;
+
+    if (c->encoded == NULL)
+	return;
+    LOCK(encodedCursorMutex);
+    for (e = (rfbEncodedCursor*)c->encoded; e; e = next) {
+	next = e->next;
+	free(e);
+    }
+    c->encoded = NULL;
+    UNLOCK(encodedCursorMutex);
+}
+
+/* the size of the cursor as a client of the scaled screen d sees it */
+static void ScaledCursorSize(rfbScreenInfoPtr s, rfbScreenInfoPtr d, rfbCursorPtr c,
+			     int* w, int* h, int* xhot, int* yhot)
+{
+    *w = c->width;
+    *h = c->height;
+    *xhot = c->xhot;
+    *yhot = c->yhot;
+    if (s == d)
+	return;
+    *w = (int)(((int64_t)c->width * d->width + s->width - 1) / s->width);
+    *h = (int)(((int64_t)c->height * d->height + s->height - 1) / s->height);
+    *xhot = (int)((int64_t)c->xhot * *w / c->width);
+    *yhot = (int)((int64_t)c->yhot * *h / c->height);
+}
+
+/* samples the bitmap (source or mask) of a w0 x h0 cursor at w x h */
+static void ScaleCursorBitmap(const unsigned char* from, int w0, int h0,
+			      unsigned char* to, int w, int h)
+{
+    int x, y, sx, sy, rowBytes0 = (w0 + 7) / 8, rowBytes = (w + 7) / 8;
+
+    memset(to, 0, rowBytes * h);
+    for (y = 0; y < h; y++) {
+	sy = y * h0 / h;
+	for (x = 0; x < w; x++) {
+	    sx = x * w0 / w;
+	    if (from[sy * rowBytes0 + sx / 8] & (0x80 >> (sx & 7)))
+		to[y * rowBytes + x / 8] |= 0x80 >> (x & 7);
+	}
+    }
+}
+
+/*
+ * EncodeCursorShape writes the rectangle for the client's cursor shape
+ * update into buf, returning its length, or 0 when out of memory.
+ */
+
+static int EncodeCursorShape(rfbClientPtr cl, rfbCursorPtr c, int w, int h,
+			     int xhot, int yhot, char* buf)
+{
+    rfbFramebufferUpdateRectHeader rect;
+    rfbXCursorColors colors;
+    int bitmapRowBytes = (w + 7) / 8, maskBytes = bitmapRowBytes * h;
+    int scaled = (w != c->width || h != c->height);
+    int len = 0;
+
+    rect.encoding = Swap32IfLE(cl->useRichCursorEncoding ? rfbEncodingRichCursor : rfbEncodingXCursor);
+    rect.r.x = Swap16IfLE(xhot);
+    rect.r.y = Swap16IfLE(yhot);
+    rect.r.w = Swap16IfLE(w);
+    rect.r.h = Swap16IfLE(h);
+    memcpy(buf, (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
+    len += sz_rfbFramebufferUpdateRectHeader;
+
+    /* Prepare actual cursor data (depends on encoding used). */
+
+    if (!cl->useRichCursorEncoding) {
+	/* XCursor encoding. */
+	colors.foreRed   = (char)(c->foreRed   >> 8);
+	colors.foreGreen = (char)(c->foreGreen >> 8);
+	colors.foreBlue  = (char)(c->foreBlue  >> 8);
+	colors.backRed   = (char)(c->backRed   >> 8);
+	colors.backGreen = (char)(c->backGreen >> 8);
+	colors.backBlue  = (char)(c->backBlue  >> 8);
+
+	memcpy(&buf[len], (char *)&colors, sz_rfbXCursorColors);
+	len += sz_rfbXCursorColors;
+
+	if (scaled)
+	    ScaleCursorBitmap(c->source, c->width, c->height, (unsigned char*)&buf[len], w, h);
+	else
+	    memcpy(&buf[len], c->source, maskBytes);
+	len += maskBytes;
+    } else {
+	/* RichCursor encoding. */
+	int bpp1=cl->screen->serverFormat.bitsPerPixel/8,
+	  bpp2=cl->format.bitsPerPixel/8;
+	char* richSource = (char*)c->richSource;
+
+	if (scaled) {
+	    int x, y;
+
+	    richSource = (char*)malloc(w*h*bpp1);
+	    if (richSource == NULL)
+		return 0;
+	    for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++)
+		    memcpy(richSource + (y*w + x)*bpp1,
+			   c->richSource + ((y*c->height/h)*c->width + x*c->width/w)*bpp1, bpp1);
+	}
+	(*cl->translateFn)(cl->translateLookupTable,
+			   &(cl->screen->serverFormat),
+			   &cl->format, richSource, &buf[len],
+			   w*bpp1, w, h);
+	len += w*bpp2*h;
+	if (scaled)
+	    free(richSource);
+    }
+
+    /* Prepare transparency mask. */
+
+    if (scaled)
+	ScaleCursorBitmap(c->mask, c->width, c->height, (unsigned char*)&buf[len], w, h);
+    else
+	memcpy(&buf[len], c->mask, maskBytes);
+    len += maskBytes;
+
+    return len;
+}
 
 /*
  * Send cursor shape either in X-style format or in client pixel format.
@@ -37,14 +193,12 @@ rfbSendCursorShape(rfbClientPtr cl)
 {
     rfbCursorPtr pCursor;
     rfbFramebufferUpdateRectHeader rect;
-    rfbXCursorColors colors;
-    int saved_ublen;
+    rfbEncodedCursor *e, **last;
     int bitmapRowBytes, maskBytes, dataBytes;
-    int i, j;
-    uint8_t *bitmapData;
-    uint8_t bitmapByte;
-
-    /* TODO: scale the cursor data to the correct size */
+    int w, h, xhot, yhot, n, len;
+    uint32_t encoding;
+    /* what the translation depends on besides the formats */
+    rfbBool cacheable = cl->screen->serverFormat.trueColour && cl->format.trueColour;
 
     pCursor = cl->screen->getCursorPtr(cl);
     /*if(!pCursor) return TRUE;*/
@@ -52,11 +206,12 @@ rfbSendCursorShape(rfbClientPtr cl)
     if (cl->useRichCursorEncoding) {
       if(pCursor && !pCursor->richSource)
 	rfbMakeRichCursorFromXCursor(cl->screen,pCursor);
-      rect.encoding = Swap32IfLE(rfbEncodingRichCursor);
+      encoding = rfbEncodingRichCursor;
     } else {
        if(pCursor && !pCursor->source)
 	 rfbMakeXCursorFromRichCursor(cl->screen,pCursor);
-       rect.encoding = Swap32IfLE(rfbEncodingXCursor);
+       encoding = rfbEncodingXCursor;
+       cacheable = TRUE;
     }
 
     /* If there is no cursor, send update with empty cursor data. */
@@ -72,6 +227,7 @@ rfbSendCursorShape(rfbClientPtr cl)
 	    if (!rfbSendUpdateBuf(cl))
 		return FALSE;
 	}
+	rect.encoding = Swap32IfLE(encoding);
 	rect.r.x = rect.r.y = 0;
 	rect.r.w = rect.r.h = 0;
 	memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
@@ -86,86 +242,67 @@ rfbSendCursorShape(rfbClientPtr cl)
 
     /* Calculate data sizes. */
 
-    bitmapRowBytes = (pCursor->width + 7) / 8;
-    maskBytes = bitmapRowBytes * pCursor->height;
+    ScaledCursorSize(cl->screen, cl->scaledScreen, pCursor, &w, &h, &xhot, &yhot);
+    bitmapRowBytes = (w + 7) / 8;
+    maskBytes = bitmapRowBytes * h;
     dataBytes = (cl->useRichCursorEncoding) ?
-	(pCursor->width * pCursor->height *
-	 (cl->format.bitsPerPixel / 8)) : maskBytes;
+	(w * h * (cl->format.bitsPerPixel / 8)) : sz_rfbXCursorColors + maskBytes;
+    len = sz_rfbFramebufferUpdateRectHeader + dataBytes + maskBytes;
 
     /* Send buffer contents if needed. */
 
-    if ( cl->ublen + sz_rfbFramebufferUpdateRectHeader +
-	 sz_rfbXCursorColors + maskBytes + dataBytes > UPDATE_BUF_SIZE ) {
+    if ( cl->ublen + len > UPDATE_BUF_SIZE ) {
 	if (!rfbSendUpdateBuf(cl))
 	    return FALSE;
     }
 
-    if ( cl->ublen + sz_rfbFramebufferUpdateRectHeader +
-	 sz_rfbXCursorColors + maskBytes + dataBytes > UPDATE_BUF_SIZE ) {
+    if ( cl->ublen + len > UPDATE_BUF_SIZE ) {
 	return FALSE;		/* FIXME. */
     }
 
-    saved_ublen = cl->ublen;
-
-    /* Prepare rectangle header. */
-
-    rect.r.x = Swap16IfLE(pCursor->xhot);
-    rect.r.y = Swap16IfLE(pCursor->yhot);
-    rect.r.w = Swap16IfLE(pCursor->width);
-    rect.r.h = Swap16IfLE(pCursor->height);
-
-    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,sz_rfbFramebufferUpdateRectHeader);
-    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
-
-    /* Prepare actual cursor data (depends on encoding used). */
-
-    if (!cl->useRichCursorEncoding) {
-	/* XCursor encoding. */
-	colors.foreRed   = (char)(pCursor->foreRed   >> 8);
-	colors.foreGreen = (char)(pCursor->foreGreen >> 8);
-	colors.foreBlue  = (char)(pCursor->foreBlue  >> 8);
-	colors.backRed   = (char)(pCursor->backRed   >> 8);
-	colors.backGreen = (char)(pCursor->backGreen >> 8);
-	colors.backBlue  = (char)(pCursor->backBlue  >> 8);
-
-	memcpy(&cl->updateBuf[cl->ublen], (char *)&colors, sz_rfbXCursorColors);
-	cl->ublen += sz_rfbXCursorColors;
-
-	bitmapData = (uint8_t *)pCursor->source;
-
-	for (i = 0; i < pCursor->height; i++) {
-	    for (j = 0; j < bitmapRowBytes; j++) {
-		bitmapByte = bitmapData[i * bitmapRowBytes + j];
-		cl->updateBuf[cl->ublen++] = (char)bitmapByte;
-	    }
-	}
+    if (!cacheable) {
+	if (!EncodeCursorShape(cl, pCursor, w, h, xhot, yhot, &cl->updateBuf[cl->ublen]))
+	    return FALSE;
     } else {
-	/* RichCursor encoding. */
-       int bpp1=cl->screen->serverFormat.bitsPerPixel/8,
-	 bpp2=cl->format.bitsPerPixel/8;
-       (*cl->translateFn)(cl->translateLookupTable,
-		       &(cl->screen->serverFormat),
-                       &cl->format, (char*)pCursor->richSource,
-		       &cl->updateBuf[cl->ublen],
-                       pCursor->width*bpp1, pCursor->width, pCursor->height);
-
-       cl->ublen += pCursor->width*bpp2*pCursor->height;
-    }
-
-    /* Prepare transparency mask. */
-
-    bitmapData = (uint8_t *)pCursor->mask;
-
-    for (i = 0; i < pCursor->height; i++) {
-	for (j = 0; j < bitmapRowBytes; j++) {
-	    bitmapByte = bitmapData[i * bitmapRowBytes + j];
-	    cl->updateBuf[cl->ublen++] = (char)bitmapByte;
+	LOCK(encodedCursorMutex);
+	for (e = (rfbEncodedCursor*)pCursor->encoded, last = NULL, n = 0; e; e = e->next, n++) {
+	    if (e->screen == cl->screen && e->encoding == encoding &&
+		e->width == cl->scaledScreen->width && e->height == cl->scaledScreen->height &&
+		(encoding != rfbEncodingRichCursor ||
+		 memcmp(&e->format, &cl->format, sizeof(rfbPixelFormat)) == 0))
+		break;
+	    if (n == MAX_ENCODED_CURSORS - 2)
+		last = &e->next;
+	}
+	if (e == NULL) {
+	    e = (rfbEncodedCursor*)malloc(sizeof(rfbEncodedCursor) + len);
+	    if (e == NULL ||
+		!EncodeCursorShape(cl, pCursor, w, h, xhot, yhot, e->data)) {
+		UNLOCK(encodedCursorMutex);
+		free(e);
+		return FALSE;
+	    }
+	    e->screen = cl->screen;
+	    e->encoding = encoding;
+	    e->format = cl->format;
+	    e->width = cl->scaledScreen->width;
+	    e->height = cl->scaledScreen->height;
+	    e->len = len;
+	    /* make room, dropping the oldest */
+	    if (last) {
+		free(*last);
+		*last = NULL;
+	    }
+	    e->next = (rfbEncodedCursor*)pCursor->encoded;
+	    pCursor->encoded = e;
 	}
+	memcpy(&cl->updateBuf[cl->ublen], e->data, len);
+	UNLOCK(encodedCursorMutex);
     }
+    cl->ublen += len;
 
     /* Send everything we have prepared in the cl->updateBuf[]. */
-    rfbStatRecordEncodingSent(cl, (cl->useRichCursorEncoding ? rfbEncodingRichCursor : rfbEncodingXCursor), 
-        sz_rfbFramebufferUpdateRectHeader + (cl->ublen - saved_ublen), sz_rfbFramebufferUpdateRectHeader + (cl->ublen - saved_ublen));
+    rfbStatRecordEncodingSent(cl, encoding, len, len);
 
     if (!rfbSendUpdateBuf(cl))
 	return FALSE;
@@ -346,6 +483,7 @@ char* rfbMakeMaskFromAlphaSource(int width,int height,unsigned char* alphaSource
 void rfbFreeCursor(rfbCursorPtr cursor)
 {
    if(cursor) {
+       FreeEncodedCursors(cursor);
        if(cursor->cleanupRichSource && cursor->richSource)
 	   free(cursor->richSource);
        if(cursor->cleanupRichSource && cursor->alphaSource)
@@ -467,102 +605,54 @@ void rfbMakeRichCursorFromXCursor(rfbScreenInfoPtr rfbScreen,rfbCursorPtr cursor
        else memcpy(cp,back,bpp);
 }
 
-/* functions to draw/hide cursor directly in the frame buffer */
+/*
+ * Clients without cursor shape updates get the cursor drawn into the
+ * pixels sent to them.  It is not drawn into the frame buffer, which is
+ * shared by all clients, but into an overlay of the client: a screen of
+ * the size of the client's (scaled) frame buffer, of which only the part
+ * under the cursor is ever written to (and so, mapped into memory).  The
+ * part of an update under the cursor is encoded from the overlay.
+ */
 
-void rfbHideCursor(rfbClientPtr cl)
+/* the part of the client's frame buffer the cursor covers, and the part
+   of the screen that is scaled into that; FALSE if the cursor is off screen */
+static rfbBool rfbClientCursorRect(rfbClientPtr cl, rfbCursorPtr c, sraRect* drawn, sraRect* from)
 {
-   rfbScreenInfoPtr s=cl->screen;
-   rfbCursorPtr c=s->cursor;
-   int j,x1,x2,y1,y2,bpp=s->serverFormat.bitsPerPixel/8,
-     rowstride=s->paddedWidthInBytes;
-   LOCK(s->cursorMutex);
-   if(!c) {
-     UNLOCK(s->cursorMutex);
-     return;
-   }
-   
-   /* restore what is under the cursor */
-   x1=cl->cursorX-c->xhot;
+   rfbScreenInfoPtr s=cl->screen, d=cl->scaledScreen;
+   int x1, y1, x2, y2;
+
+   x1=ScaleX(s, d, cl->cursorX)-c->xhot;
+   y1=ScaleY(s, d, cl->cursorY)-c->yhot;
    x2=x1+c->width;
-   if(x1<0) x1=0;
-   if(x2>=s->width) x2=s->width-1;
-   x2-=x1; if(x2<=0) {
-     UNLOCK(s->cursorMutex);
-     return;
-   }
-   y1=cl->cursorY-c->yhot;
    y2=y1+c->height;
-   if(y1<0) y1=0;
-   if(y2>=s->height) y2=s->height-1;
-   y2-=y1; if(y2<=0) {
-     UNLOCK(s->cursorMutex);
-     return;
+   if(!sraClipRect2(&x1,&y1,&x2,&y2,0,0,d->width,d->height))
+     return FALSE;
+   if(drawn) {
+     drawn->x1=x1; drawn->y1=y1;
+     drawn->x2=x2; drawn->y2=y2;
    }
-
-   /* get saved data */
-   for(j=0;j<y2;j++)
-     memcpy(s->frameBuffer+(y1+j)*rowstride+x1*bpp,
-	    s->underCursorBuffer+j*x2*bpp,
-	    x2*bpp);
-
-   /* Copy to all scaled versions */
-   rfbScaledScreenUpdate(s, x1, y1, x1+x2, y1+y2);
-   
-   UNLOCK(s->cursorMutex);
+   if(from) {
+     from->x1=(int)((int64_t)x1*s->width/d->width);
+     from->y1=(int)((int64_t)y1*s->height/d->height);
+     from->x2=(int)(((int64_t)x2*s->width+d->width-1)/d->width);
+     from->y2=(int)(((int64_t)y2*s->height+d->height-1)/d->height);
+   }
+   return TRUE;
 }
 
-void rfbShowCursor(rfbClientPtr cl)
+/* draws the cursor with its top left at x,y into the part clip of o */
+static void rfbDrawCursor(rfbScreenInfoPtr s, rfbCursorPtr c, rfbScreenInfoPtr o, int x, int y, const sraRect* clip)
 {
-   rfbScreenInfoPtr s=cl->screen;
-   rfbCursorPtr c=s->cursor;
-   int i,j,x1,x2,y1,y2,i1,j1,bpp=s->serverFormat.bitsPerPixel/8,
-     rowstride=s->paddedWidthInBytes,
-     bufSize,w;
-   rfbBool wasChanged=FALSE;
-
-   if(!c) return;
-   LOCK(s->cursorMutex);
-
-   bufSize=c->width*c->height*bpp;
-   w=(c->width+7)/8;
-   if(s->underCursorBufferLen<bufSize) {
-      if(s->underCursorBuffer!=NULL)
-	free(s->underCursorBuffer);
-      s->underCursorBuffer=malloc(bufSize);
-      s->underCursorBufferLen=bufSize;
-   }
-
-   /* save what is under the cursor */
-   i1=j1=0; /* offset in cursor */
-   x1=cl->cursorX-c->xhot;
-   x2=x1+c->width;
-   if(x1<0) { i1=-x1; x1=0; }
-   if(x2>=s->width) x2=s->width-1;
-   x2-=x1; if(x2<=0) {
-     UNLOCK(s->cursorMutex);
-     return; /* nothing to do */
-   }
-
-   y1=cl->cursorY-c->yhot;
-   y2=y1+c->height;
-   if(y1<0) { j1=-y1; y1=0; }
-   if(y2>=s->height) y2=s->height-1;
-   y2-=y1; if(y2<=0) {
-     UNLOCK(s->cursorMutex);
-     return; /* nothing to do */
-   }
+   int i,j,x1,x2,y1,y2,bpp=s->serverFormat.bitsPerPixel/8,
+     rowstride=o->paddedWidthInBytes,w=(c->width+7)/8;
+
+   x1=x>clip->x1?x:clip->x1;
+   y1=y>clip->y1?y:clip->y1;
+   x2=x+c->width<clip->x2?x+c->width:clip->x2;
+   y2=y+c->height<clip->y2?y+c->height:clip->y2;
+   if(x1>=x2 || y1>=y2)
+     return;
 
-   /* save data */
-   for(j=0;j<y2;j++) {
-     char* dest=s->underCursorBuffer+j*x2*bpp;
-     const char* src=s->frameBuffer+(y1+j)*rowstride+x1*bpp;
-     unsigned int count=x2*bpp;
-     if(wasChanged || memcmp(dest,src,count)) {
-       wasChanged=TRUE;
-       memcpy(dest,src,count);
-     }
-   }
-   
    if(!c->richSource)
      rfbMakeRichCursorFromXCursor(s,c);
   
@@ -584,8 +674,8 @@ void rfbShowCursor(rfbClientPtr cl)
 	gmask = (gmax << gshift);
 	bmask = (bmax << bshift);
 
-	for(j=0;j<y2;j++) {
-		for(i=0;i<x2;i++) {
+	for(j=y1;j<y2;j++) {
+		for(i=x1;i<x2;i++) {
 			/*
 			 * we loop over the whole cursor ignoring c->mask[],
 			 * using the extracted alpha value instead.
@@ -596,9 +686,9 @@ void rfbShowCursor(rfbClientPtr cl)
 			int rdst, gdst, bdst;		/* fb RGB */
 			int asrc, rsrc, gsrc, bsrc;	/* rich source ARGB */
 
-			dest = s->frameBuffer + (j+y1)*rowstride + (i+x1)*bpp;
-			src  = c->richSource  + (j+j1)*c->width*bpp + (i+i1)*bpp;
-			aptr = c->alphaSource + (j+j1)*c->width + (i+i1);
+			dest = o->frameBuffer + j*rowstride + i*bpp;
+			src  = c->richSource  + (j-y)*c->width*bpp + (i-x)*bpp;
+			aptr = c->alphaSource + (j-y)*c->width + (i-x);
 
 			asrc = *aptr;
 			if (!asrc) {
@@ -658,17 +748,106 @@ void rfbShowCursor(rfbClientPtr cl)
 	}
    } else {
       /* now the cursor has to be drawn */
-      for(j=0;j<y2;j++)
-        for(i=0;i<x2;i++)
-          if((c->mask[(j+j1)*w+(i+i1)/8]<<((i+i1)&7))&0x80)
-   	 memcpy(s->frameBuffer+(j+y1)*rowstride+(i+x1)*bpp,
-   		c->richSource+(j+j1)*c->width*bpp+(i+i1)*bpp,bpp);
+      for(j=y1;j<y2;j++)
+        for(i=x1;i<x2;i++)
+          if((c->mask[(j-y)*w+(i-x)/8]<<((i-x)&7))&0x80)
+   	 memcpy(o->frameBuffer+j*rowstride+i*bpp,
+   		c->richSource+(j-y)*c->width*bpp+(i-x)*bpp,bpp);
    }
+}
 
-   /* Copy to all scaled versions */
-   rfbScaledScreenUpdate(s, x1, y1, x1+x2, y1+y2);
+/*
+ * rfbCursorRegion takes the part under the cursor out of updateRegion;
+ * NULL if none of it is.
+ */
 
+sraRegionPtr rfbCursorRegion(rfbClientPtr cl, sraRegionPtr updateRegion)
+{
+   rfbScreenInfoPtr s=cl->screen;
+   sraRegionPtr region=NULL;
+   sraRect from;
+
+   LOCK(s->cursorMutex);
+   if(s->cursor && rfbClientCursorRect(cl, s->cursor, NULL, &from)) {
+     region=sraRgnCreateRect(from.x1, from.y1, from.x2, from.y2);
+     if(sraRgnAnd(region, updateRegion)) {
+       sraRgnSubtract(updateRegion, region);
+     } else {
+       sraRgnDestroy(region);
+       region=NULL;
+     }
+   }
    UNLOCK(s->cursorMutex);
+   return region;
+}
+
+/*
+ * rfbCursorOverlay fills the parts of the client's overlay to be sent with
+ * the frame buffer and draws the cursor over them.  It returns the overlay,
+ * to be encoded from in place of cl->scaledScreen, or NULL.
+ */
+
+rfbScreenInfoPtr rfbCursorOverlay(rfbClientPtr cl, sraRegionPtr region)
+{
+   rfbScreenInfoPtr s=cl->screen, d=cl->scaledScreen, o=cl->cursorOverlay;
+   int bpp=s->serverFormat.bitsPerPixel/8, j;
+   sraRectangleIterator* i;
+   sraRect rect, drawn;
+   rfbCursorPtr c;
+
+   if(o && (o->width!=d->width || o->height!=d->height ||
+	    o->paddedWidthInBytes!=d->paddedWidthInBytes ||
+	    memcmp(&o->serverFormat, &d->serverFormat, sizeof(rfbPixelFormat)))) {
+     rfbFreeCursorOverlay(cl);
+     o=NULL;
+   }
+   if(o==NULL) {
+     o=(rfbScreenInfoPtr)malloc(sizeof(rfbScreenInfo));
+     if(o==NULL)
+       return NULL;
+     memcpy(o, d, sizeof(rfbScreenInfo));
+     o->scaledScreenNext=NULL;
+     o->scaledScreenRefCount=0;
+     o->scaler=NULL;
+     /* only the pages under the cursor get touched */
+     o->frameBuffer=(char*)calloc(d->height, d->paddedWidthInBytes);
+     if(o->frameBuffer==NULL) {
+       free(o);
+       return NULL;
+     }
+     cl->cursorOverlay=o;
+   }
+
+   LOCK(s->cursorMutex);
+   c=s->cursor;
+   if(c==NULL || !rfbClientCursorRect(cl, c, &drawn, NULL)) {
+     UNLOCK(s->cursorMutex);
+     return NULL;
+   }
+   for(i=sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);) {
+     int x=rect.x1, y=rect.y1, w=rect.x2-rect.x1, h=rect.y2-rect.y1;
+
+     if(s!=d)
+       rfbScaledCorrection(s, d, &x, &y, &w, &h, "rfbCursorOverlay");
+     for(j=y; j<y+h; j++)
+       memcpy(o->frameBuffer+j*o->paddedWidthInBytes+x*bpp,
+	      d->frameBuffer+j*d->paddedWidthInBytes+x*bpp, w*bpp);
+     rect.x1=x; rect.y1=y; rect.x2=x+w; rect.y2=y+h;
+     rfbDrawCursor(s, c, o, ScaleX(s, d, cl->cursorX)-c->xhot,
+		   ScaleY(s, d, cl->cursorY)-c->yhot, &rect);
+   }
+   sraRgnReleaseIterator(i);
+   UNLOCK(s->cursorMutex);
+   return o;
+}
+
+void rfbFreeCursorOverlay(rfbClientPtr cl)
+{
+   if(cl->cursorOverlay==NULL)
+     return;
+   free(cl->cursorOverlay->frameBuffer);
+   free(cl->cursorOverlay);
+   cl->cursorOverlay=NULL;
 }
 
 /* 
@@ -681,18 +860,11 @@ void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion)
 {
     rfbScreenInfoPtr s = cl->screen;
     rfbCursorPtr c = s->cursor;
+    sraRect from;
     
-    if(c) {
-	int x,y,x2,y2;
-
-	x = cl->cursorX-c->xhot;
-	y = cl->cursorY-c->yhot;
-	x2 = x+c->width;
-	y2 = y+c->height;
-
-	if(sraClipRect2(&x,&y,&x2,&y2,0,0,s->width,s->height)) {
+    if(c && rfbClientCursorRect(cl, c, NULL, &from)) {
 	    sraRegionPtr rect;
-	    rect = sraRgnCreateRect(x,y,x2,y2);
+	    rect = sraRgnCreateRect(from.x1,from.y1,from.x2,from.y2);
 	    if(updateRegion) {
 	    	sraRgnOr(updateRegion,rect);
 	    } else {
@@ -701,7 +873,6 @@ void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion)
 		    UNLOCK(cl->updateMutex);
 	    }
 	    sraRgnDestroy(rect);
-	}
     }
 }
 
@@ -737,11 +908,15 @@ void rfbSetCursor(rfbScreenInfoPtr rfbScreen,rfbCursorPtr c)
 	  rfbRedrawAfterHideCursor(cl,NULL);
     rfbReleaseClientIterator(iterator);
 
-    if(rfbScreen->cursor->cleanup)
+    /* setting it again tells that it was changed */
+    if(rfbScreen->cursor->cleanup && rfbScreen->cursor != c)
 	 rfbFreeCursor(rfbScreen->cursor);
   }
 
   rfbScreen->cursor = c;
+  /* it may have been changed since it was last sent */
+  if(c)
+    FreeEncodedCursors(c);
 
   iterator=rfbGetClientIterator(rfbScreen);
   while((cl=rfbClientIteratorNext(iterator))) {
@@ -0,0 +1,95 @@
+/*
+ * deflate.c
+ *
+ * The deflate backends shared by the zlib, tight and ZRLE encoders.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+
+/*
+ * The encoders keep one deflate stream per client (per stripe for
+ * ZRLEStripes, four for tight) for the whole session and sync flush it
+ * after every rectangle, while the viewer runs a single inflate stream on
+ * its side.  A backend therefore has to support streaming compression
+ * with Z_SYNC_FLUSH; one shot compressors such as libdeflate cannot be
+ * used here without breaking existing viewers.
+ */
+
+static int zlibInit(z_streamp strm, int level, int windowBits, int memLevel,
+		int strategy)
+{
+  return deflateInit2(strm, level, Z_DEFLATED, windowBits, memLevel, strategy);
+}
+
+static int zlibParams(z_streamp strm, int level, int strategy)
+{
+  return deflateParams(strm, level, strategy);
+}
+
+static int zlibDeflate(z_streamp strm, int flush)
+{
+  return deflate(strm, flush);
+}
+
+static int zlibEnd(z_streamp strm)
+{
+  return deflateEnd(strm);
+}
+
+rfbDeflateBackend rfbDeflateBackendZlib = {
+  "zlib", zlibInit, zlibParams, zlibDeflate, zlibEnd
+};
+
+/*
+ * Level 1 uses zlib's deflate_fast(), which only does a single hash lookup
+ * per position and no lazy matching.  The pixel data the encoders hand
+ * over is already run-length or palette coded, so the longer searches of
+ * the higher levels buy little but cost most of the encoding time.
+ */
+
+static int fastLevel(int level)
+{
+  return level == 0 ? 0 : Z_BEST_SPEED;
+}
+
+static int fastInit(z_streamp strm, int level, int windowBits, int memLevel,
+		int strategy)
+{
+  return deflateInit2(strm, fastLevel(level), Z_DEFLATED, windowBits,
+		      memLevel, strategy);
+}
+
+static int fastParams(z_streamp strm, int level, int strategy)
+{
+  return deflateParams(strm, fastLevel(level), strategy);
+}
+
+rfbDeflateBackend rfbDeflateBackendFast = {
+  "fast", fastInit, fastParams, zlibDeflate, zlibEnd
+};
+
+rfbDeflateBackend* rfbGetDeflateBackend(const char* name)
+{
+  if (strcmp(name, rfbDeflateBackendZlib.name) == 0)
+    return &rfbDeflateBackendZlib;
+  if (strcmp(name, rfbDeflateBackendFast.name) == 0)
+    return &rfbDeflateBackendFast;
+  return NULL;
+}
@@ -0,0 +1,197 @@
+/*
+ * fbblock.c
+ *
+ * Routines to implement MirrorLink framebuffer blocking: a client tells
+ * which rectangles of which application it blanks (Framebuffer Blocking
+ * Notification, e.g. video while driving), and those are not encoded or
+ * sent to it, nor do changes to them wake up its updates, until they are
+ * unblocked again.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+#include <rfb/rfbregion.h>
+
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+
+/* what is blocked of one application */
+typedef struct rfbFramebufferBlock {
+  struct rfbFramebufferBlock* next;
+  uint32_t appId;
+  sraRegionPtr region;
+} rfbFramebufferBlock;
+
+/* rebuilds the union of the blocks; updateMutex held */
+static void
+UpdateBlockedRegion(rfbClientPtr cl)
+{
+  rfbFramebufferBlock* block;
+
+  if (cl->blockedRegion) {
+    sraRgnDestroy(cl->blockedRegion);
+    cl->blockedRegion = NULL;
+  }
+  for (block = cl->fbBlocks; block; block = block->next) {
+    if (cl->blockedRegion == NULL)
+      cl->blockedRegion = sraRgnCreateRgn(block->region);
+    else
+      sraRgnOr(cl->blockedRegion, block->region);
+  }
+}
+
+/*
+ * rfbBlockFramebuffer adds a rectangle, in the coordinates of the client's
+ * (scaled) frame buffer, to what the client blocks of an application.
+ */
+
+void
+rfbBlockFramebuffer(rfbClientPtr cl, uint32_t appId, int x, int y, int w, int h)
+{
+  rfbScreenInfoPtr s = cl->screen, d = cl->scaledScreen;
+  rfbFramebufferBlock* block;
+  int x1 = x, y1 = y, x2 = x + w, y2 = y + h;
+  sraRegionPtr region;
+
+  /* only what is scaled into the rectangle alone */
+  if (s != d) {
+    x1 = (int)(((int64_t)x1 * s->width + d->width - 1) / d->width);
+    y1 = (int)(((int64_t)y1 * s->height + d->height - 1) / d->height);
+    x2 = (int)((int64_t)x2 * s->width / d->width);
+    y2 = (int)((int64_t)y2 * s->height / d->height);
+  }
+  if (!sraClipRect2(&x1, &y1, &x2, &y2, 0, 0, s->width, s->height))
+    return;
+  region = sraRgnCreateRect(x1, y1, x2, y2);
+
+  LOCK(cl->updateMutex);
+  for (block = cl->fbBlocks; block; block = block->next)
+    if (block->appId == appId)
+      break;
+  if (block) {
+    sraRgnOr(block->region, region);
+    sraRgnDestroy(region);
+  } else {
+    block = (rfbFramebufferBlock*)malloc(sizeof(rfbFramebufferBlock));
+    if (block == NULL) {
+      UNLOCK(cl->updateMutex);
+      sraRgnDestroy(region);
+      return;
+    }
+    block->appId = appId;
+    block->region = region;
+    block->next = cl->fbBlocks;
+    cl->fbBlocks = block;
+  }
+  UpdateBlockedRegion(cl);
+  sraRgnSubtract(cl->modifiedRegion, cl->blockedRegion);
+  UNLOCK(cl->updateMutex);
+
+  rfbLog("Client %s blocks %dx%d+%d+%d of application 0x%x\n",
+	 cl->host, w, h, x, y, appId);
+}
+
+/*
+ * rfbUnblockFramebuffer lifts what the client blocked of an application,
+ * which is sent again with the next update.
+ */
+
+void
+rfbUnblockFramebuffer(rfbClientPtr cl, uint32_t appId)
+{
+  rfbFramebufferBlock *block, **prev;
+
+  LOCK(cl->updateMutex);
+  for (prev = &cl->fbBlocks; (block = *prev); prev = &block->next)
+    if (block->appId == appId)
+      break;
+  if (block == NULL) {
+    UNLOCK(cl->updateMutex);
+    return;
+  }
+  *prev = block->next;
+  sraRgnOr(cl->modifiedRegion, block->region);
+  sraRgnDestroy(block->region);
+  free(block);
+  UpdateBlockedRegion(cl);
+  TSIGNAL(cl->updateCond);
+  UNLOCK(cl->updateMutex);
+
+  rfbLog("Client %s unblocks application 0x%x\n", cl->host, appId);
+}
+
+/* drops all the blocks, when the client is gone or the frame buffer was
+   replaced; updateMutex held */
+void
+rfbFreeFramebufferBlocks(rfbClientPtr cl)
+{
+  rfbFramebufferBlock *block, *next;
+
+  for (block = cl->fbBlocks; block; block = next) {
+    next = block->next;
+    sraRgnDestroy(block->region);
+    free(block);
+  }
+  cl->fbBlocks = NULL;
+  UpdateBlockedRegion(cl);
+}
+
+/*
+ * rfbMLExtFBBlockingNotify handles the payload of a Framebuffer Blocking
+ * Notification, for the protocol extension reading the MirrorLink
+ * messages: with reasons the rectangle is blocked, without the
+ * application is unblocked.
+ */
+
+void
+rfbMLExtFBBlockingNotify(rfbClientPtr cl, const rfbMLExt_FBBlockingNotify_t* msg)
+{
+  uint32_t appId = Swap32IfLE(msg->app_unique_id);
+
+  if (Swap16IfLE(msg->reasion_bits) == 0)
+    rfbUnblockFramebuffer(cl, appId);
+  else
+    rfbBlockFramebuffer(cl, appId, Swap16IfLE(msg->x), Swap16IfLE(msg->y),
+			Swap16IfLE(msg->w), Swap16IfLE(msg->h));
+}
+
+/*
+ * rfbDropBlocked takes what is blocked out of the pending update; copies
+ * from blocked pixels are sent as pixels instead.  updateMutex held.
+ */
+
+void
+rfbDropBlocked(rfbClientPtr cl)
+{
+  sraRegionPtr source;
+
+  if (cl->blockedRegion == NULL)
+    return;
+  source = sraRgnCreateRgn(cl->blockedRegion);
+  sraRgnOffset(source, cl->copyDX, cl->copyDY);
+  if (sraRgnAnd(source, cl->copyRegion)) {
+    sraRgnSubtract(cl->copyRegion, source);
+    sraRgnOr(cl->modifiedRegion, source);
+  }
+  sraRgnDestroy(source);
+  sraRgnSubtract(cl->copyRegion, cl->blockedRegion);
+  sraRgnSubtract(cl->modifiedRegion, cl->blockedRegion);
+}
+
+#endif
@@ -87,6 +87,8 @@
 
 
 static void httpProcessInput(rfbScreenInfoPtr screen);
+static void httpSendMetrics(rfbScreenInfoPtr rfbScreen, rfbClientPtr cl);
+static void httpSendTrace(rfbClientPtr cl, rfbBool binary);
 static rfbBool compareAndSkip(char **ptr, const char *str);
 static rfbBool parseParams(const char *request, char *result, int max_bytes);
 static rfbBool validateString(char *str);
@@ -108,7 +110,7 @@ rfbHttpInitSockets(rfbScreenInfoPtr rfbScreen)
 
     rfbScreen->httpInitDone = TRUE;
 
-    if (!rfbScreen->httpDir)
+    if (!rfbScreen->httpDir && !rfbScreen->httpEnableMetrics)
 	return;
 
     if (rfbScreen->httpPort == 0) {
@@ -176,7 +178,7 @@ rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 #endif
     socklen_t addrlen = sizeof(addr);
 
-    if (!rfbScreen->httpDir)
+    if (!rfbScreen->httpDir && !rfbScreen->httpEnableMetrics)
 	return;
 
     if (rfbScreen->httpListenSock < 0)
@@ -291,12 +293,12 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
    
     cl.sock=rfbScreen->httpSock;
 
-    if (strlen(rfbScreen->httpDir) > 255) {
+    if (rfbScreen->httpDir && strlen(rfbScreen->httpDir) > 255) {
 	rfbErr("-httpd directory too long\n");
 	httpCloseSock(rfbScreen);
 	return;
     }
-    strcpy(fullFname, rfbScreen->httpDir);
+    strcpy(fullFname, rfbScreen->httpDir ? rfbScreen->httpDir : "");
     fname = &fullFname[strlen(fullFname)];
     maxFnameLen = 511 - strlen(fullFname);
 
@@ -424,6 +426,25 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
     }
 
 
+    if (rfbScreen->httpEnableMetrics && strcmp(fname, "/metrics") == 0) {
+	httpSendMetrics(rfbScreen, &cl);
+	httpCloseSock(rfbScreen);
+	return;
+    }
+
+    if (rfbScreen->httpEnableMetrics &&
+	(strcmp(fname, "/trace.json") == 0 || strcmp(fname, "/trace.bin") == 0)) {
+	httpSendTrace(&cl, strcmp(fname, "/trace.bin") == 0);
+	httpCloseSock(rfbScreen);
+	return;
+    }
+
+    if (!rfbScreen->httpDir) {
+	rfbWriteExact(&cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
+	httpCloseSock(rfbScreen);
+	return;
+    }
+
     /* If we were asked for '/', actually read the file index.vnc */
 
     if (strcmp(fname, "/") == 0) {
@@ -552,6 +573,62 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
 }
 
 
+/*
+ * httpSendMetrics answers a request for /metrics with rfbMetricsFormat().
+ */
+
+static void
+httpSendMetrics(rfbScreenInfoPtr rfbScreen, rfbClientPtr cl)
+{
+    static const char* METRICS_OK_STR = "HTTP/1.0 200 OK\r\nConnection: close\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n";
+    char *text;
+    int len;
+
+    len = rfbMetricsFormat(rfbScreen, NULL, 0);
+    text = malloc(len + 1);
+    if (text == NULL) {
+	rfbWriteExact(cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
+	return;
+    }
+    /* clients may have come or gone in between */
+    len = rfbMetricsFormat(rfbScreen, text, len + 1);
+    rfbWriteExact(cl, METRICS_OK_STR, strlen(METRICS_OK_STR));
+    rfbWriteExact(cl, text, strlen(text));
+    free(text);
+}
+
+
+/*
+ * httpSendTrace answers a request for /trace.json or /trace.bin with
+ * rfbTraceDumpJSON() or rfbTraceDumpBinary().
+ */
+
+static void
+httpSendTrace(rfbClientPtr cl, rfbBool binary)
+{
+    static const char* TRACE_JSON_OK_STR = "HTTP/1.0 200 OK\r\nConnection: close\r\nContent-Type: application/json\r\n\r\n";
+    static const char* TRACE_BIN_OK_STR = "HTTP/1.0 200 OK\r\nConnection: close\r\nContent-Type: application/octet-stream\r\n\r\n";
+    FILE *f = tmpfile();
+    size_t n;
+
+    if (f == NULL || !(binary ? rfbTraceDumpBinary(f) : rfbTraceDumpJSON(f))) {
+	rfbWriteExact(cl, NOT_FOUND_STR, strlen(NOT_FOUND_STR));
+	if (f)
+	    fclose(f);
+	return;
+    }
+    rewind(f);
+    if (binary)
+	rfbWriteExact(cl, TRACE_BIN_OK_STR, strlen(TRACE_BIN_OK_STR));
+    else
+	rfbWriteExact(cl, TRACE_JSON_OK_STR, strlen(TRACE_JSON_OK_STR));
+    while ((n = fread(buf, 1, BUF_SIZE, f)) > 0)
+	if (rfbWriteExact(cl, buf, n) < 0)
+	    break;
+    fclose(f);
+}
+
+
 static rfbBool
 compareAndSkip(char **ptr, const char *str)
 {
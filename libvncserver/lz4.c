@@ -0,0 +1,269 @@
+/*
+ * lz4.c
+ *
+ * Routines to implement the LZ4 encoding: independently compressed tiles,
+ * spread over several threads.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+#include "lz4block.h"
+#include "workers.h"
+
+#define LZ4_TILE_BYTES (rfbLZ4TileWidth * rfbLZ4TileHeight * 4)
+
+/* at most this many threads work on one rectangle */
+#define LZ4_MAX_WORKERS RFB_MAX_WORKERS
+
+/* a worker is only worth it for at least this many tiles */
+#define LZ4_MIN_TILES_PER_WORKER 4
+
+
+/*
+ * Each worker compresses a contiguous run of tiles into an output buffer of
+ * its own, so the buffers only have to be sent one after the other.  The
+ * buffers are kept from one rectangle to the next.
+ */
+
+typedef struct {
+  rfbClientPtr cl;
+  int x, y, w, h;             /* the whole rectangle */
+  int firstTile, nTiles;
+  uint32_t* lengths;          /* of all tiles of the rectangle */
+
+  char* out;
+  int outSize;
+  int outLength;
+} lz4Worker;
+
+typedef struct {
+  lz4Worker workers[LZ4_MAX_WORKERS];
+  uint32_t* lengths;
+  int lengthsSize;
+} lz4Data;
+
+
+void rfbFreeLZ4Data(rfbClientPtr cl)
+{
+  lz4Data* data = (lz4Data*)cl->lz4Data;
+  int i;
+
+  if (data == NULL)
+    return;
+  for (i = 0; i < LZ4_MAX_WORKERS; i++)
+    free(data->workers[i].out);
+  free(data->lengths);
+  free(data);
+  cl->lz4Data = NULL;
+}
+
+static void lz4EncodeTiles(void* arg)
+{
+  lz4Worker* worker = (lz4Worker*)arg;
+  rfbClientPtr cl = worker->cl;
+  int bpp = cl->format.bitsPerPixel / 8;
+  int tilesPerRow = (worker->w + rfbLZ4TileWidth - 1) / rfbLZ4TileWidth;
+  char tile[LZ4_TILE_BYTES];
+  lz4HashTable ht;
+  int t;
+
+  worker->outLength = 0;
+
+  for (t = worker->firstTile; t < worker->firstTile + worker->nTiles; t++) {
+    int tx = (t % tilesPerRow) * rfbLZ4TileWidth;
+    int ty = (t / tilesPerRow) * rfbLZ4TileHeight;
+    int tw = worker->w - tx, th = worker->h - ty, rawLength, length;
+    char* fbptr;
+
+    if (tw > rfbLZ4TileWidth)
+      tw = rfbLZ4TileWidth;
+    if (th > rfbLZ4TileHeight)
+      th = rfbLZ4TileHeight;
+    rawLength = tw * th * bpp;
+
+    fbptr = (cl->scaledScreen->frameBuffer
+             + (cl->scaledScreen->paddedWidthInBytes * (worker->y + ty))
+             + ((worker->x + tx) * (cl->scaledScreen->bitsPerPixel / 8)));
+    (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
+                       &cl->format, fbptr, tile,
+                       cl->scaledScreen->paddedWidthInBytes, tw, th);
+
+    /* anything not smaller than the raw pixels is sent raw */
+    length = lz4CompressBlock((unsigned char*)tile, rawLength,
+                              (unsigned char*)worker->out + worker->outLength,
+                              rawLength - 1, &ht);
+    if (length == 0) {
+      memcpy(worker->out + worker->outLength, tile, rawLength);
+      worker->lengths[t] = Swap32IfLE(rawLength | rfbLZ4TileRaw);
+      worker->outLength += rawLength;
+    } else {
+      worker->lengths[t] = Swap32IfLE(length);
+      worker->outLength += length;
+    }
+  }
+}
+
+
+/*
+ * lz4SendBuffers appends the given buffers to the update.  Like
+ * zrleSendStream, it copies small amounts into updateBuf and hands large
+ * ones to the socket directly.  iov[0] is filled in with updateBuf here.
+ */
+
+static rfbBool lz4SendBuffers(rfbClientPtr cl, struct iovec* iov, int n)
+{
+  int i, total = 0;
+  rfbBool direct;
+
+  for (i = 1; i < n; i++)
+    total += iov[i].iov_len;
+  direct = (cl->ublen + total > UPDATE_BUF_SIZE);
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+  /* rfbWriteExactV knows nothing about WebSockets framing or TLS */
+  if (cl->wsctx || cl->sslctx)
+    direct = FALSE;
+#endif
+
+  if (direct) {
+    iov[0].iov_base = cl->updateBuf;
+    iov[0].iov_len = cl->ublen;
+    if (rfbWriteExactV(cl, iov, n) < 0) {
+      rfbLogPerror("lz4SendBuffers: rfbWriteExactV");
+      rfbCloseClient(cl);
+      return FALSE;
+    }
+    cl->ublen = 0;
+    return TRUE;
+  }
+
+  for (i = 1; i < n; i++) {
+    char* buf = (char*)iov[i].iov_base;
+    int length = iov[i].iov_len;
+
+    while (length > 0) {
+      int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
+
+      if (bytesToCopy > length)
+        bytesToCopy = length;
+      memcpy(cl->updateBuf+cl->ublen, buf, bytesToCopy);
+      cl->ublen += bytesToCopy;
+      buf += bytesToCopy;
+      length -= bytesToCopy;
+
+      if (cl->ublen == UPDATE_BUF_SIZE && !rfbSendUpdateBuf(cl))
+        return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+
+/*
+ * rfbSendRectEncodingLZ4 - send a given rectangle using LZ4 encoding.
+ */
+
+rfbBool rfbSendRectEncodingLZ4(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  rfbFramebufferUpdateRectHeader rect;
+  lz4Data* data = (lz4Data*)cl->lz4Data;
+  struct iovec iov[LZ4_MAX_WORKERS + 2];
+  int tilesPerRow = (w + rfbLZ4TileWidth - 1) / rfbLZ4TileWidth;
+  int nTiles = tilesPerRow * ((h + rfbLZ4TileHeight - 1) / rfbLZ4TileHeight);
+  int nWorkers = rfbWorkerCount(nTiles, LZ4_MIN_TILES_PER_WORKER, LZ4_MAX_WORKERS);
+  int i, tile, bytes, outSize;
+
+  if (data == NULL) {
+    data = cl->lz4Data = calloc(1, sizeof(lz4Data));
+    if (data == NULL) {
+      rfbErr("rfbSendRectEncodingLZ4: out of memory\n");
+      return FALSE;
+    }
+  }
+
+  if (data->lengthsSize < nTiles) {
+    free(data->lengths);
+    data->lengths = malloc(nTiles * sizeof(uint32_t));
+    data->lengthsSize = data->lengths ? nTiles : 0;
+    if (data->lengths == NULL) {
+      rfbErr("rfbSendRectEncodingLZ4: out of memory\n");
+      return FALSE;
+    }
+  }
+
+  for (i = 0, tile = 0; i < nWorkers; i++) {
+    lz4Worker* worker = &data->workers[i];
+
+    worker->cl = cl;
+    worker->x = x;
+    worker->y = y;
+    worker->w = w;
+    worker->h = h;
+    worker->lengths = data->lengths;
+    worker->firstTile = tile;
+    worker->nTiles = (nTiles - tile) / (nWorkers - i);
+    tile += worker->nTiles;
+
+    /* enough for the tiles even if they all have to be sent raw */
+    outSize = worker->nTiles * rfbLZ4TileWidth * rfbLZ4TileHeight
+      * (cl->format.bitsPerPixel / 8);
+    if (worker->outSize < outSize) {
+      free(worker->out);
+      worker->out = malloc(outSize);
+      worker->outSize = worker->out ? outSize : 0;
+      if (worker->out == NULL) {
+        rfbErr("rfbSendRectEncodingLZ4: out of memory\n");
+        return FALSE;
+      }
+    }
+  }
+
+  rfbRunWorkers(cl, nWorkers, lz4EncodeTiles, data->workers, sizeof(lz4Worker));
+
+  bytes = sz_rfbFramebufferUpdateRectHeader + nTiles * sizeof(uint32_t);
+  for (i = 0; i < nWorkers; i++)
+    bytes += data->workers[i].outLength;
+  rfbStatRecordEncodingSent(cl, rfbEncodingLZ4, bytes,
+      w * (cl->format.bitsPerPixel / 8) * h);
+
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+    if (!rfbSendUpdateBuf(cl))
+      return FALSE;
+  }
+
+  rect.r.x = Swap16IfLE(x);
+  rect.r.y = Swap16IfLE(y);
+  rect.r.w = Swap16IfLE(w);
+  rect.r.h = Swap16IfLE(h);
+  rect.encoding = Swap32IfLE(rfbEncodingLZ4);
+
+  memcpy(cl->updateBuf+cl->ublen, (char *)&rect,
+         sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+  iov[1].iov_base = data->lengths;
+  iov[1].iov_len = nTiles * sizeof(uint32_t);
+  for (i = 0; i < nWorkers; i++) {
+    iov[i + 2].iov_base = data->workers[i].out;
+    iov[i + 2].iov_len = data->workers[i].outLength;
+  }
+
+  return lz4SendBuffers(cl, iov, nWorkers + 2);
+}
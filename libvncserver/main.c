@@ -16,6 +16,7 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
+#include "scale.h"
 
 #include <stdarg.h>
 #include <errno.h>
@@ -45,7 +46,8 @@ static MUTEX(logMutex);
 static MUTEX(extMutex);
 #endif
 
-static int rfbEnableLogging=1;
+int rfbEnableLogging=1;
+int rfbLogLevel=RFB_LOG_INFO;
 
 #ifdef LIBVNCSERVER_WORDS_BIGENDIAN
 char rfbEndianTest = (1==0);
@@ -55,9 +57,104 @@ char rfbEndianTest = (1==1);
 
 /*
  * Protocol extensions
+ *
+ * Readers never lock: the list is only changed under extMutex and every
+ * change is published with a release store, so a reader walking it sees
+ * either the old or the new link.  Next to the list a snapshot of it,
+ * with the pseudo encodings hashed, is rebuilt on every change; readers
+ * announce themselves in extReaders and the snapshots they may still be
+ * looking at are freed once there are none.
  */
 
+typedef struct {
+	int encoding;                  /* 0 for an empty slot */
+	rfbProtocolExtension* extension;
+} rfbPseudoEncodingSlot;
+
+typedef struct rfbExtensionSnapshot {
+	int count;
+	rfbProtocolExtension** extensions;   /* in list order */
+	unsigned encodingMask;
+	rfbPseudoEncodingSlot* encodings;
+	struct rfbExtensionSnapshot* retired;
+} rfbExtensionSnapshot;
+
 static rfbProtocolExtension* rfbExtensionHead = NULL;
+static rfbExtensionSnapshot* extSnapshot = NULL;
+static rfbExtensionSnapshot* extRetired = NULL;
+static int extReaders = 0;
+
+#define ENCODING_HASH(enc, mask) ((((unsigned)(enc)) * 2654435761U) & (mask))
+
+/* rebuilds the snapshot of the list; called with extMutex held */
+static void
+rfbPublishExtensions(void)
+{
+	rfbExtensionSnapshot *snapshot, *old;
+	rfbProtocolExtension* e;
+	int count = 0, encodings = 0, i;
+	unsigned size = 1, slot;
+	int* enc;
+
+	for(e = rfbExtensionHead; e; e = e->next) {
+		count++;
+		for(enc = e->pseudoEncodings; enc && *enc; enc++)
+			encodings++;
+	}
+	while(size < 2 * (unsigned)encodings)
+		size <<= 1;
+
+	snapshot = calloc(1, sizeof(rfbExtensionSnapshot)
+			+ count * sizeof(rfbProtocolExtension*)
+			+ size * sizeof(rfbPseudoEncodingSlot));
+	if(snapshot == NULL) {
+		rfbErr("rfbPublishExtensions: out of memory\n");
+		return;
+	}
+	snapshot->count = count;
+	snapshot->encodings = (rfbPseudoEncodingSlot*)(snapshot + 1);
+	snapshot->encodingMask = size - 1;
+	snapshot->extensions = (rfbProtocolExtension**)(snapshot->encodings + size);
+
+	/* linear probing keeps the extensions claiming the same encoding in
+	   list order */
+	for(e = rfbExtensionHead, i = 0; e; e = e->next, i++) {
+		snapshot->extensions[i] = e;
+		for(enc = e->pseudoEncodings; enc && *enc; enc++) {
+			slot = ENCODING_HASH(*enc, snapshot->encodingMask);
+			while(snapshot->encodings[slot].encoding)
+				slot = (slot + 1) & snapshot->encodingMask;
+			snapshot->encodings[slot].encoding = *enc;
+			snapshot->encodings[slot].extension = e;
+		}
+	}
+
+	old = __atomic_exchange_n(&extSnapshot, snapshot, __ATOMIC_SEQ_CST);
+	if(old) {
+		old->retired = extRetired;
+		extRetired = old;
+	}
+	if(__atomic_load_n(&extReaders, __ATOMIC_SEQ_CST) == 0) {
+		while(extRetired) {
+			old = extRetired;
+			extRetired = old->retired;
+			free(old);
+		}
+	}
+}
+
+static rfbExtensionSnapshot*
+rfbGetExtensionSnapshot(void)
+{
+	__atomic_add_fetch(&extReaders, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&extSnapshot, __ATOMIC_SEQ_CST);
+}
+
+static void
+rfbReleaseExtensionSnapshot(void)
+{
+	__atomic_sub_fetch(&extReaders, 1, __ATOMIC_SEQ_CST);
+}
 
 /*
  * This method registers a list of new extensions.  
@@ -70,7 +167,7 @@ rfbRegisterProtocolExtension(rfbProtocolExtension* extension)
 {
 	rfbProtocolExtension *head = rfbExtensionHead, *next = NULL;
 
-    rfbLog("rfbRegisterProtocolExtension() %p", extension);
+    rfbDebug("rfbRegisterProtocolExtension() %p\n", extension);
 	if(extension == NULL)
 		return;
 
@@ -93,8 +190,9 @@ rfbRegisterProtocolExtension(rfbProtocolExtension* extension)
 		head = head->next;
 	}
 
-	extension->next = rfbExtensionHead;
-	rfbExtensionHead = extension;
+	__atomic_store_n(&extension->next, rfbExtensionHead, __ATOMIC_RELAXED);
+	__atomic_store_n(&rfbExtensionHead, extension, __ATOMIC_RELEASE);
+	rfbPublishExtensions();
 
 	UNLOCK(extMutex);
 	rfbRegisterProtocolExtension(next);
@@ -111,7 +209,7 @@ rfbUnregisterProtocolExtension(rfbProtocolExtension* extension)
 
 	rfbProtocolExtension *cur = NULL, *pre = NULL;
 
-    rfbLog("rfbUnregisterProtocolExtension() %p", extension);
+    rfbDebug("rfbUnregisterProtocolExtension() %p\n", extension);
 	if(extension == NULL)
 		return;
 
@@ -123,7 +221,8 @@ rfbUnregisterProtocolExtension(rfbProtocolExtension* extension)
 	LOCK(extMutex);
 
 	if(rfbExtensionHead == extension) {
-		rfbExtensionHead = rfbExtensionHead->next;
+		__atomic_store_n(&rfbExtensionHead, rfbExtensionHead->next, __ATOMIC_RELEASE);
+		rfbPublishExtensions();
 		UNLOCK(extMutex);
 		rfbUnregisterProtocolExtension(extension->next);
 		return;
@@ -133,7 +232,9 @@ rfbUnregisterProtocolExtension(rfbProtocolExtension* extension)
 
 	while(cur) {
 		if(cur == extension) {
-			pre->next = cur->next;
+			/* cur->next stays, readers on cur go on from there */
+			__atomic_store_n(&pre->next, cur->next, __ATOMIC_RELEASE);
+			rfbPublishExtensions();
 			break;
 		}
 		pre = cur;
@@ -145,22 +246,137 @@ rfbUnregisterProtocolExtension(rfbProtocolExtension* extension)
 	rfbUnregisterProtocolExtension(extension->next);
 }
 
+/*
+ * The iterator does not lock any more; rfbReleaseExtensionIterator() is
+ * kept for the callers.
+ */
+
 rfbProtocolExtension* rfbGetExtensionIterator()
 {
-    rfbLog("rfbGetExtensionIterator()");
-	if (! extMutex_initialized) {
-		INIT_MUTEX(extMutex);
-		extMutex_initialized = 1;
+	return __atomic_load_n(&rfbExtensionHead, __ATOMIC_ACQUIRE);
+}
+
+void rfbReleaseExtensionIterator()
+{
+}
+
+/*
+ * rfbNewClientExtensions offers a new client to all registered
+ * extensions.
+ */
+
+void
+rfbNewClientExtensions(rfbClientPtr cl)
+{
+	rfbExtensionSnapshot* snapshot = rfbGetExtensionSnapshot();
+	int i;
+
+	for(i = 0; snapshot && i < snapshot->count; i++) {
+		rfbProtocolExtension* extension = snapshot->extensions[i];
+		void* data = NULL;
+		/* if the extension does not have a newClient method, it wants
+		 * to be initialized later. */
+		if(extension->newClient && extension->newClient(cl, &data))
+			rfbEnableExtension(cl, extension, data);
 	}
+	rfbReleaseExtensionSnapshot();
+}
 
-	LOCK(extMutex);
-	return rfbExtensionHead;
+/*
+ * rfbEnablePseudoEncodingExtension looks up the registered extensions
+ * claiming a pseudo encoding and enables the first one accepting it.
+ */
+
+rfbBool
+rfbEnablePseudoEncodingExtension(rfbClientPtr cl, int encoding)
+{
+	rfbExtensionSnapshot* snapshot = rfbGetExtensionSnapshot();
+	rfbBool handled = FALSE;
+	unsigned slot;
+
+	if(snapshot == NULL || encoding == 0) {
+		rfbReleaseExtensionSnapshot();
+		return FALSE;
+	}
+
+	for(slot = ENCODING_HASH(encoding, snapshot->encodingMask);
+			snapshot->encodings[slot].encoding;
+			slot = (slot + 1) & snapshot->encodingMask) {
+		rfbProtocolExtension* e = snapshot->encodings[slot].extension;
+		void* data = NULL;
+
+		if(snapshot->encodings[slot].encoding != encoding)
+			continue;
+		if(!e->enablePseudoEncoding(cl, &data, encoding)) {
+			rfbLog("Installed extension pretends to handle pseudo encoding 0x%x, but does not!\n", encoding);
+		} else {
+			rfbEnableExtension(cl, e, data);
+			handled = TRUE;
+			break;
+		}
+	}
+	rfbReleaseExtensionSnapshot();
+
+	return handled;
 }
 
-void rfbReleaseExtensionIterator()
+/*
+ * Messages the server does not know are routed through a table by message
+ * type, made from the client's enabled extensions.  Each slot holds the
+ * first extension that can handle the type: one listing it in
+ * messageTypes, or one listing none at all.
+ */
+
+static rfbBool
+rfbExtensionTakesMessage(rfbProtocolExtension* extension, int type)
 {
-    rfbLog("rfbReleaseExtensionIterator()");
-	UNLOCK(extMutex);
+	int* t;
+
+	if(extension->handleMessage == NULL)
+		return FALSE;
+	if(extension->messageTypes == NULL)
+		return TRUE;
+	for(t = extension->messageTypes; *t; t++)
+		if(*t == type)
+			return TRUE;
+	return FALSE;
+}
+
+static void
+rfbInvalidateExtensionHandlers(rfbClientPtr cl)
+{
+	free(cl->extensionHandlers);
+	cl->extensionHandlers = NULL;
+}
+
+rfbBool
+rfbExtensionHandleMessage(rfbClientPtr cl, const rfbClientToServerMsg* msg)
+{
+	rfbExtensionData *e, *next;
+	int type;
+
+	if(cl->extensionHandlers == NULL) {
+		cl->extensionHandlers = calloc(256, sizeof(rfbExtensionData*));
+		if(cl->extensionHandlers == NULL)
+			return FALSE;
+		for(type = 255; type >= 0; type--)
+			for(e = cl->extensions; e; e = e->next)
+				if(rfbExtensionTakesMessage(e->extension, type)) {
+					cl->extensionHandlers[type] = e;
+					break;
+				}
+	}
+
+	/* handleMessage may disable the extension and change the table */
+	type = msg->type;
+	for(e = cl->extensionHandlers[type]; e; e = next) {
+		next = e->next;
+		if(rfbExtensionTakesMessage(e->extension, type) &&
+				e->extension->handleMessage(cl, e->data, msg))
+			return TRUE;
+	}
+
+	return FALSE;
 }
 
 rfbBool rfbEnableExtension(rfbClientPtr cl, rfbProtocolExtension* extension,
@@ -168,7 +384,7 @@ rfbBool rfbEnableExtension(rfbClientPtr cl, rfbProtocolExtension* extension,
 {
 	rfbExtensionData* extData;
 
-    rfbLog("rfbEnableExtension() cl: %p extension: %p", cl, extension);
+    rfbDebug("rfbEnableExtension() cl: %p extension: %p\n", cl, extension);
 
 	/* make sure extension is not yet enabled. */
 	for(extData = cl->extensions; extData; extData = extData->next)
@@ -180,6 +396,7 @@ rfbBool rfbEnableExtension(rfbClientPtr cl, rfbProtocolExtension* extension,
 	extData->data = data;
 	extData->next = cl->extensions;
 	cl->extensions = extData;
+	rfbInvalidateExtensionHandlers(cl);
 
 	return TRUE;
 }
@@ -189,7 +406,7 @@ rfbBool rfbDisableExtension(rfbClientPtr cl, rfbProtocolExtension* extension)
 	rfbExtensionData* extData;
 	rfbExtensionData* prevData = NULL;
 
-    rfbLog("rfbDisableExtension() cl: %p extension: %p", cl, extension);
+    rfbDebug("rfbDisableExtension() cl: %p extension: %p\n", cl, extension);
 	for(extData = cl->extensions; extData; extData = extData->next) {
 		if(extData->extension == extension) {
 			if(extData->data)
@@ -198,6 +415,7 @@ rfbBool rfbDisableExtension(rfbClientPtr cl, rfbProtocolExtension* extension)
 				cl->extensions = extData->next;
 			else
 				prevData->next = extData->next;
+			rfbInvalidateExtensionHandlers(cl);
 			return TRUE;
 		}
 		prevData = extData;
@@ -227,7 +445,7 @@ void* rfbGetExtensionClientData(rfbClientPtr cl, rfbProtocolExtension* extension
  */
 
 void rfbLogEnable(int enabled) {
-  rfbLog("rfbLogEnable() enabled: %d", enabled);
+  rfbDebug("rfbLogEnable() enabled: %d\n", enabled);
   rfbEnableLogging=enabled;
 }
 
@@ -236,9 +454,8 @@ void rfbLogEnable(int enabled) {
  */
 
 static void
-rfbDefaultLog(const char *format, ...)
+rfbDefaultLogV(const char *format, va_list args)
 {
-    va_list args;
     char buf[256];
     time_t log_clock;
 
@@ -251,7 +468,6 @@ rfbDefaultLog(const char *format, ...)
     }
 
     LOCK(logMutex);
-    va_start(args, format);
 
     time(&log_clock);
     strftime(buf, 255, "%d/%m/%Y %X ", localtime(&log_clock));
@@ -260,12 +476,34 @@ rfbDefaultLog(const char *format, ...)
     vfprintf(stderr, format, args);
     fflush(stderr);
 
-    va_end(args);
     UNLOCK(logMutex);
 }
 
+void
+rfbDefaultLog(const char *format, ...)
+{
+    va_list args;
+
+    if(rfbLogLevel < RFB_LOG_INFO)
+      return;
+
+    va_start(args, format);
+    rfbDefaultLogV(format, args);
+    va_end(args);
+}
+
+void
+rfbDefaultErr(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    rfbDefaultLogV(format, args);
+    va_end(args);
+}
+
 rfbLogProc rfbLog=rfbDefaultLog;
-rfbLogProc rfbErr=rfbDefaultLog;
+rfbLogProc rfbErr=rfbDefaultErr;
 
 void rfbLogPerror(const char *str)
 {
@@ -408,11 +646,28 @@ void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
 {
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
+   uint32_t damage = rfbTraceMarked(modRegion);
 
    iterator=rfbGetClientIterator(screen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+     /* changes the client blocks do not make for an update */
+     if(cl->blockedRegion) {
+       sraRegionPtr unblocked=sraRgnCreateRgn(modRegion);
+       sraRgnSubtract(unblocked,cl->blockedRegion);
+       if(sraRgnEmpty(unblocked)) {
+         sraRgnDestroy(unblocked);
+         UNLOCK(cl->updateMutex);
+         continue;
+       }
+       sraRgnOr(cl->modifiedRegion,unblocked);
+       sraRgnDestroy(unblocked);
+     } else
+#endif
      sraRgnOr(cl->modifiedRegion,modRegion);
+     rfbMetricsDamage(cl);
+     rfbTraceClientDamage(cl, damage);
 #ifndef LIBVNCSERVER_HAVE_ML_EXT
      TSIGNAL(cl->updateCond);
 #endif
@@ -457,7 +712,7 @@ clientOutput(void *data)
     rfbBool haveUpdate;
     sraRegion* updateRegion;
 
-    rfbLog("clientOutput() running");
+    rfbDebug("clientOutput() running\n");
     while (1) {
         haveUpdate = false;
         while (!haveUpdate) {
@@ -486,6 +741,8 @@ clientOutput(void *data)
 
 		if (!haveUpdate) {
 			WAIT(cl->updateCond, cl->updateMutex);
+		} else if (cl->screen->deferUpdateTime > 0) {
+			rfbTraceClient(cl, rfbTraceStageDeferred);
 		}
 
 		UNLOCK(cl->updateMutex);
@@ -524,7 +781,7 @@ clientInput(void *data)
     pthread_t output_thread;
     pthread_create(&output_thread, NULL, clientOutput, (void *)cl);
 
-    rfbLog("clientInput() running");
+    rfbDebug("clientInput() running\n");
     while (1) {
 	fd_set rfds, wfds, efds;
 	struct timeval tv;
@@ -597,6 +854,8 @@ listenerRun(void *data)
 	  FD_SET(screen->listenSock, &listen_fds);
 	if(screen->listen6Sock >= 0) 
 	  FD_SET(screen->listen6Sock, &listen_fds);
+	if(screen->listenUnixSock >= 0)
+	  FD_SET(screen->listenUnixSock, &listen_fds);
 
         if (select(screen->maxFd+1, &listen_fds, NULL, NULL, NULL) == -1) {
             rfbLogPerror("listenerRun: error in select");
@@ -609,6 +868,8 @@ listenerRun(void *data)
 	    client_fd = accept(screen->listenSock, (struct sockaddr*)&peer, &len);
 	else if (FD_ISSET(screen->listen6Sock, &listen_fds))
 	    client_fd = accept(screen->listen6Sock, (struct sockaddr*)&peer, &len);
+	else if (screen->listenUnixSock >= 0 && FD_ISSET(screen->listenUnixSock, &listen_fds))
+	    client_fd = accept(screen->listenUnixSock, NULL, NULL);
 
     rfbLog("client_fd: %d", client_fd);
 	if(client_fd >= 0)
@@ -854,9 +1115,15 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    screen->maxFd=0;
    screen->listenSock=-1;
    screen->listen6Sock=-1;
+   screen->unixSockPath=NULL;
+   screen->listenUnixSock=-1;
+   screen->useIOUring=FALSE;
+   screen->ioUring=NULL;
+   screen->corkUpdates=TRUE;
 
    screen->httpInitDone=FALSE;
    screen->httpEnableProxyConnect=FALSE;
+   screen->httpEnableMetrics=FALSE;
    screen->httpPort=0;
    screen->http6Port=0;
    screen->httpDir=NULL;
@@ -921,9 +1188,19 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    screen->dontConvertRichCursorToXCursor = FALSE;
    screen->cursor = &myCursor;
    INIT_MUTEX(screen->cursorMutex);
+   rfbInitEncodedCursors();
+
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+   screen->mlContextAreas = NULL;
+   INIT_MUTEX(screen->mlContextMutex);
+#endif
 
    IF_PTHREADS(screen->backgroundLoop = FALSE);
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+   rfbZrleInitScreen(screen);
+#endif
+
    /* proc's and hook's */
 
    screen->kbdAddEvent = rfbDefaultKbdAddEvent;
@@ -1008,6 +1285,10 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
     sraRgnMakeEmpty(cl->copyRegion);
     cl->copyDX = 0;
     cl->copyDY = 0;
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+    /* they were for the old layout */
+    rfbFreeFramebufferBlocks(cl);
+#endif
 
     if (cl->useNewFBSize)
       cl->newFBSizePending = TRUE;
@@ -1091,9 +1372,14 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
   TINI_MUTEX(screen->cursorMutex);
   if(screen->cursor && screen->cursor->cleanup)
     rfbFreeCursor(screen->cursor);
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+  rfbMLExtFreeContextInformation(screen);
+  TINI_MUTEX(screen->mlContextMutex);
+#endif
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
   rfbZlibCleanup(screen);
+  rfbZrleCleanup(screen);
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
   rfbTightCleanup(screen);
 #endif
@@ -1104,6 +1390,9 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
       rfbScreenInfoPtr ptr;
       ptr = screen->scaledScreenNext;
       screen->scaledScreenNext = ptr->scaledScreenNext;
+      sraRgnDestroy(ptr->scaledDamage);
+      TINI_MUTEX(ptr->scaledDamageMutex);
+      rfbScaledScreenFreeScaler(ptr);
       free(ptr->frameBuffer);
       free(ptr);
   }
@@ -1118,7 +1407,7 @@ void rfbInitServer(rfbScreenInfoPtr screen)
   WSADATA trash;
   WSAStartup(MAKEWORD(2,2),&trash);
 #endif
-  rfbLog("rfbInitServer() screen: %p", screen);
+  rfbDebug("rfbInitServer() screen: %p\n", screen);
   rfbInitSockets(screen);
   rfbHttpInitSockets(screen);
 #ifndef WIN32
@@ -1128,7 +1417,7 @@ void rfbInitServer(rfbScreenInfoPtr screen)
 }
 
 void rfbShutdownServer(rfbScreenInfoPtr screen,rfbBool disconnectClients) {
-  rfbLog("rfbShutdownServer() screen: %p disconnectClients: %d", screen, disconnectClients);
+  rfbDebug("rfbShutdownServer() screen: %p disconnectClients: %d\n", screen, disconnectClients);
   if(disconnectClients) {
     rfbClientPtr cl = NULL;
     rfbClientIteratorPtr iter = rfbGetClientIterator(screen);
@@ -1181,6 +1470,10 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
   rfbCheckFds(screen,usec);
   rfbHttpCheckFds(screen);
 
+  /* with io_uring, the updates of all clients go out together */
+  if(screen->ioUring)
+    rfbUringBeginBatch(screen);
+
   i = rfbGetClientIteratorWithClosed(screen);
   cl=rfbClientIteratorHead(i);
   while(cl) {
@@ -1194,6 +1487,9 @@ rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
   }
   rfbReleaseClientIterator(i);
 
+  if(screen->ioUring)
+    rfbUringFlush(screen);
+
   return result;
 }
 
@@ -1213,6 +1509,7 @@ rfbUpdateClient(rfbClientPtr cl)
         gettimeofday(&cl->startDeferring,NULL);
         if(cl->startDeferring.tv_usec == 0)
           cl->startDeferring.tv_usec++;
+        rfbTraceClient(cl, rfbTraceStageDeferred);
       } else {
         gettimeofday(&tv,NULL);
         if(tv.tv_sec < cl->startDeferring.tv_sec /* at midnight */
@@ -0,0 +1,437 @@
+/*
+ * metrics.c
+ *
+ * Routines to implement the per-client metrics: counters and histograms of
+ * encoding time, update latency, send queue depth and update size, read
+ * with rfbMetricsGetHistogram() and rfbMetricsGetCounter(), or as text with
+ * rfbMetricsFormat() (also served by the httpd as /metrics).
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+#include <time.h>
+#include <stdarg.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
+
+#ifdef _MSC_VER
+#define snprintf _snprintf /* Missing in MSVC */
+#endif
+
+/* the encodings with histograms and stat slots of their own, in the order
+   of rfbMetricsEncodingIndex(); the others share the last one */
+static const uint32_t metricsEncodings[RFB_METRICS_ENCODINGS - 1] = {
+  rfbEncodingRaw, rfbEncodingCopyRect, rfbEncodingRRE, rfbEncodingCoRRE,
+  rfbEncodingHextile, rfbEncodingZlib, rfbEncodingTight, rfbEncodingZlibHex,
+  rfbEncodingUltra, rfbEncodingZRLE, rfbEncodingZYWRLE, rfbEncodingTightPng,
+  rfbEncodingLZ4, rfbEncodingZRLEStripes, rfbEncodingSharedMemoryRect
+};
+
+#define METRICS_MESSAGES 256
+
+typedef struct _rfbClientMetrics {
+  /* held while the counters and histograms are written or read, as the
+     httpd formats them on a thread of its own */
+  MUTEX(mutex);
+  uint64_t damageTime;                    /* of the oldest damage not sent */
+  uint64_t counters[rfbCounterMax];
+  rfbHistogram updateLatency, queueDepth, frameBytes;
+  rfbHistogram* encodeTime[RFB_METRICS_ENCODINGS];
+  /* rfbStatLookupEncoding/Message go through these */
+  rfbStatList* encodingStats[RFB_METRICS_ENCODINGS];
+  rfbStatList* messageStats[METRICS_MESSAGES];
+} rfbClientMetrics;
+
+uint64_t
+rfbMetricsNow(void)
+{
+#if defined(CLOCK_MONOTONIC) && !defined(WIN32)
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+int
+rfbMetricsEncodingIndex(uint32_t encoding)
+{
+  switch (encoding) {
+  case rfbEncodingRaw:               return 0;
+  case rfbEncodingCopyRect:          return 1;
+  case rfbEncodingRRE:               return 2;
+  case rfbEncodingCoRRE:             return 3;
+  case rfbEncodingHextile:           return 4;
+  case rfbEncodingZlib:              return 5;
+  case rfbEncodingTight:             return 6;
+  case rfbEncodingZlibHex:           return 7;
+  case rfbEncodingUltra:             return 8;
+  case rfbEncodingZRLE:              return 9;
+  case rfbEncodingZYWRLE:            return 10;
+  case rfbEncodingTightPng:          return 11;
+  case rfbEncodingLZ4:               return 12;
+  case rfbEncodingZRLEStripes:       return 13;
+  case rfbEncodingSharedMemoryRect:  return 14;
+  }
+  return RFB_METRICS_ENCODINGS - 1;
+}
+
+/*
+ * Histograms
+ *
+ * The buckets are log-linear like in HdrHistogram: 8 per power of two, so
+ * a value is known to 12.5%, up to 2^32.
+ */
+
+static int
+HistogramBucket(uint64_t value)
+{
+  int e = 0, bucket;
+
+  if (value < 8)
+    return (int)value;
+#ifdef __GNUC__
+  e = 63 - __builtin_clzll(value);
+#else
+  while (value >> (e + 1))
+    e++;
+#endif
+  bucket = (e - 2) * 8 + (int)((value >> (e - 3)) & 7);
+  return bucket < RFB_HISTOGRAM_BUCKETS ? bucket : RFB_HISTOGRAM_BUCKETS - 1;
+}
+
+/* the smallest value going into a bucket */
+static uint64_t
+HistogramBucketValue(int bucket)
+{
+  if (bucket < 8)
+    return bucket;
+  return (uint64_t)(8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+void
+rfbHistogramRecord(rfbHistogram* h, uint64_t value)
+{
+  if (h->count == 0 || value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+  h->count++;
+  h->sum += value;
+  h->buckets[HistogramBucket(value)]++;
+}
+
+void
+rfbHistogramMerge(rfbHistogram* into, const rfbHistogram* h)
+{
+  int i;
+
+  if (h->count == 0)
+    return;
+  if (into->count == 0 || h->min < into->min)
+    into->min = h->min;
+  if (h->max > into->max)
+    into->max = h->max;
+  into->count += h->count;
+  into->sum += h->sum;
+  for (i = 0; i < RFB_HISTOGRAM_BUCKETS; i++)
+    into->buckets[i] += h->buckets[i];
+}
+
+/* the value percentile percent of the recorded ones are at or below,
+   rounded up to the end of its bucket */
+uint64_t
+rfbHistogramPercentile(const rfbHistogram* h, double percentile)
+{
+  uint64_t rank, seen = 0, value;
+  int i;
+
+  if (h == NULL || h->count == 0)
+    return 0;
+  rank = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  for (i = 0; i < RFB_HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  if (i >= RFB_HISTOGRAM_BUCKETS - 1)
+    return h->max;
+  value = HistogramBucketValue(i + 1) - 1;
+  return value < h->max ? value : h->max;
+}
+
+/*
+ * Recording
+ */
+
+void
+rfbMetricsNewClient(rfbClientPtr cl)
+{
+  cl->metrics = (rfbClientMetrics*)calloc(1, sizeof(rfbClientMetrics));
+  if (cl->metrics)
+    INIT_MUTEX(cl->metrics->mutex);
+}
+
+void
+rfbMetricsFreeClient(rfbClientPtr cl)
+{
+  int i;
+
+  if (cl->metrics == NULL)
+    return;
+  for (i = 0; i < RFB_METRICS_ENCODINGS; i++)
+    free(cl->metrics->encodeTime[i]);
+  TINI_MUTEX(cl->metrics->mutex);
+  free(cl->metrics);
+  cl->metrics = NULL;
+}
+
+/* called with updateMutex held, when the client's modifiedRegion grows */
+void
+rfbMetricsDamage(rfbClientPtr cl)
+{
+  if (cl->metrics && cl->metrics->damageTime == 0)
+    cl->metrics->damageTime = rfbMetricsNow();
+}
+
+/* called with updateMutex held, when an update takes the modifiedRegion;
+   returns when the damage happened, 0 if there was none */
+uint64_t
+rfbMetricsTakeDamage(rfbClientPtr cl, rfbBool allSent)
+{
+  uint64_t damageTime;
+
+  if (cl->metrics == NULL)
+    return 0;
+  damageTime = cl->metrics->damageTime;
+  if (allSent)
+    cl->metrics->damageTime = 0;
+  return damageTime;
+}
+
+void
+rfbMetricsRecordEncode(rfbClientPtr cl, uint32_t encoding, uint64_t start)
+{
+  rfbClientMetrics* m = cl->metrics;
+  int i;
+
+  if (m == NULL)
+    return;
+  i = rfbMetricsEncodingIndex(encoding);
+  LOCK(m->mutex);
+  if (m->encodeTime[i] != NULL ||
+      (m->encodeTime[i] = (rfbHistogram*)calloc(1, sizeof(rfbHistogram))) != NULL) {
+    rfbHistogramRecord(m->encodeTime[i], rfbMetricsNow() - start);
+    m->counters[rfbCounterRects]++;
+  }
+  UNLOCK(m->mutex);
+}
+
+/* called once an update has been written */
+void
+rfbMetricsRecordUpdate(rfbClientPtr cl, uint64_t damageTime, int bytesBefore)
+{
+  rfbClientMetrics* m = cl->metrics;
+  unsigned int bytes = (unsigned int)cl->bytesSent - (unsigned int)bytesBefore;
+
+  if (m == NULL)
+    return;
+  LOCK(m->mutex);
+  if (damageTime)
+    rfbHistogramRecord(&m->updateLatency, rfbMetricsNow() - damageTime);
+  rfbHistogramRecord(&m->frameBytes, bytes);
+  m->counters[rfbCounterUpdates]++;
+  m->counters[rfbCounterBytes] += bytes;
+#if defined(__linux__) && defined(SIOCOUTQ)
+  {
+    int queued;
+
+    if (cl->sock >= 0 && ioctl(cl->sock, SIOCOUTQ, &queued) == 0)
+      rfbHistogramRecord(&m->queueDepth, queued);
+  }
+#endif
+  UNLOCK(m->mutex);
+}
+
+/* where rfbStatLookupEncoding/Message keep the entry of a type, NULL if
+   it is not one of those with a slot */
+rfbStatList**
+rfbMetricsStatSlot(rfbClientPtr cl, uint32_t type, rfbBool message)
+{
+  int i;
+
+  if (cl->metrics == NULL)
+    return NULL;
+  if (message)
+    return type < METRICS_MESSAGES ? &cl->metrics->messageStats[type] : NULL;
+  i = rfbMetricsEncodingIndex(type);
+  return i < RFB_METRICS_ENCODINGS - 1 ? &cl->metrics->encodingStats[i] : NULL;
+}
+
+void
+rfbMetricsResetStatSlots(rfbClientPtr cl)
+{
+  if (cl->metrics == NULL)
+    return;
+  memset(cl->metrics->encodingStats, 0, sizeof(cl->metrics->encodingStats));
+  memset(cl->metrics->messageStats, 0, sizeof(cl->metrics->messageStats));
+}
+
+/*
+ * Reading
+ */
+
+const rfbHistogram*
+rfbMetricsGetHistogram(rfbClientPtr cl, rfbMetric metric, uint32_t encoding)
+{
+  if (cl == NULL || cl->metrics == NULL)
+    return NULL;
+  switch (metric) {
+  case rfbMetricUpdateLatency:
+    return &cl->metrics->updateLatency;
+  case rfbMetricQueueDepth:
+    return &cl->metrics->queueDepth;
+  case rfbMetricFrameBytes:
+    return &cl->metrics->frameBytes;
+  case rfbMetricEncodeTime:
+    return cl->metrics->encodeTime[rfbMetricsEncodingIndex(encoding)];
+  }
+  return NULL;
+}
+
+uint64_t
+rfbMetricsGetCounter(rfbClientPtr cl, rfbCounter counter)
+{
+  if (cl == NULL || cl->metrics == NULL || counter < 0 || counter >= rfbCounterMax)
+    return 0;
+  return cl->metrics->counters[counter];
+}
+
+typedef struct {
+  char* buf;
+  int len, used;
+} MetricsOutput;
+
+static void
+Output(MetricsOutput* out, const char* format, ...)
+{
+  va_list args;
+  int n;
+
+  va_start(args, format);
+  n = vsnprintf(out->used < out->len ? out->buf + out->used : NULL,
+		out->used < out->len ? out->len - out->used : 0, format, args);
+  va_end(args);
+  if (n > 0)
+    out->used += n;
+}
+
+/* formats a copy of h, taken under the mutex of m so that an update
+   recorded meanwhile does not tear it */
+static void
+OutputHistogram(MetricsOutput* out, const char* name, const char* labels,
+		rfbClientMetrics* m, const rfbHistogram* h)
+{
+  static const double quantiles[] = { 50, 90, 99, 99.9 };
+  rfbHistogram copy;
+  int i;
+
+  LOCK(m->mutex);
+  copy = *h;
+  UNLOCK(m->mutex);
+  if (copy.count == 0)
+    return;
+  for (i = 0; i < (int)(sizeof(quantiles) / sizeof(quantiles[0])); i++)
+    Output(out, "%s{%s,quantile=\"%g\"} %llu\n", name, labels,
+	   quantiles[i] / 100, (unsigned long long)rfbHistogramPercentile(&copy, quantiles[i]));
+  Output(out, "%s_max{%s} %llu\n", name, labels, (unsigned long long)copy.max);
+  Output(out, "%s_sum{%s} %llu\n", name, labels, (unsigned long long)copy.sum);
+  Output(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)copy.count);
+}
+
+/*
+ * rfbMetricsFormat writes the metrics of all clients of the screen as
+ * text, one "name{labels} value" per line.  Like snprintf it returns the
+ * length of the whole text, even if that did not fit into buf.
+ */
+
+int
+rfbMetricsFormat(rfbScreenInfoPtr screen, char* buf, int len)
+{
+  MetricsOutput out;
+  rfbClientIteratorPtr iterator;
+  rfbClientPtr cl;
+  char labels[128], encLabels[192], encBuf[64];
+  int i;
+
+  out.buf = buf;
+  out.len = len;
+  out.used = 0;
+  if (len > 0)
+    buf[0] = '\0';
+
+  iterator = rfbGetClientIterator(screen);
+  while ((cl = rfbClientIteratorNext(iterator))) {
+    rfbClientMetrics* m = cl->metrics;
+    uint64_t counters[rfbCounterMax];
+    rfbHistogram* encodeTime[RFB_METRICS_ENCODINGS];
+
+    if (m == NULL)
+      continue;
+    LOCK(m->mutex);
+    memcpy(counters, m->counters, sizeof(counters));
+    memcpy(encodeTime, m->encodeTime, sizeof(encodeTime));
+    UNLOCK(m->mutex);
+    snprintf(labels, sizeof(labels), "client=\"%s\",sock=\"%d\"",
+	     cl->host ? cl->host : "", cl->sock);
+
+    Output(&out, "rfb_updates_total{%s} %llu\n", labels,
+	   (unsigned long long)counters[rfbCounterUpdates]);
+    Output(&out, "rfb_rects_total{%s} %llu\n", labels,
+	   (unsigned long long)counters[rfbCounterRects]);
+    Output(&out, "rfb_update_bytes_total{%s} %llu\n", labels,
+	   (unsigned long long)counters[rfbCounterBytes]);
+    OutputHistogram(&out, "rfb_update_latency_us", labels, m, &m->updateLatency);
+    OutputHistogram(&out, "rfb_update_bytes", labels, m, &m->frameBytes);
+    OutputHistogram(&out, "rfb_send_queue_bytes", labels, m, &m->queueDepth);
+    /* a histogram, once allocated, stays until the client goes away */
+    for (i = 0; i < RFB_METRICS_ENCODINGS; i++) {
+      if (encodeTime[i] == NULL)
+	continue;
+      snprintf(encLabels, sizeof(encLabels), "%s,encoding=\"%s\"", labels,
+	       i < RFB_METRICS_ENCODINGS - 1 ?
+	       encodingName(metricsEncodings[i], encBuf, sizeof(encBuf)) : "other");
+      OutputHistogram(&out, "rfb_encode_time_us", encLabels, m, encodeTime[i]);
+    }
+  }
+  rfbReleaseClientIterator(iterator);
+
+  return out.used;
+}
@@ -3,13 +3,21 @@
 
 /* from cursor.c */
 
-void rfbShowCursor(rfbClientPtr cl);
-void rfbHideCursor(rfbClientPtr cl);
+void rfbInitEncodedCursors(void);
+sraRegionPtr rfbCursorRegion(rfbClientPtr cl, sraRegionPtr updateRegion);
+rfbScreenInfoPtr rfbCursorOverlay(rfbClientPtr cl, sraRegionPtr region);
+void rfbFreeCursorOverlay(rfbClientPtr cl);
 void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion);
 
 /* from main.c */
 
 rfbClientPtr rfbClientIteratorHead(rfbClientIteratorPtr i);
+void rfbNewClientExtensions(rfbClientPtr cl);
+rfbBool rfbEnablePseudoEncodingExtension(rfbClientPtr cl, int encoding);
+rfbBool rfbExtensionHandleMessage(rfbClientPtr cl, const rfbClientToServerMsg* msg);
+extern int rfbEnableLogging;
+void rfbDefaultLog(const char *format, ...);
+void rfbDefaultErr(const char *format, ...);
 
 /* from tight.c */
 
@@ -23,6 +31,8 @@ extern void rfbZlibCleanup(rfbScreenInfoPtr screen);
 
 /* from zrle.c */
 void rfbFreeZrleData(rfbClientPtr cl);
+void rfbZrleInitScreen(rfbScreenInfoPtr screen);
+void rfbZrleCleanup(rfbScreenInfoPtr screen);
 
 #endif
 
@@ -31,5 +41,62 @@ void rfbFreeZrleData(rfbClientPtr cl);
 
 extern void rfbFreeUltraData(rfbClientPtr cl);
 
+/* from lz4.c */
+
+extern void rfbFreeLZ4Data(rfbClientPtr cl);
+
+/* from workers.c */
+
+extern void rfbRunWorkers(rfbClientPtr cl, int nJobs, void (*run)(void* job),
+                          void* jobs, size_t jobSize);
+extern void rfbFreeWorkers(rfbClientPtr cl);
+
+/* from shm.c */
+
+extern void rfbFreeSharedMemory(rfbClientPtr cl);
+
+/* from metrics.c */
+
+extern void rfbMetricsNewClient(rfbClientPtr cl);
+extern void rfbMetricsFreeClient(rfbClientPtr cl);
+extern void rfbMetricsDamage(rfbClientPtr cl);
+extern uint64_t rfbMetricsTakeDamage(rfbClientPtr cl, rfbBool allSent);
+extern void rfbMetricsRecordEncode(rfbClientPtr cl, uint32_t encoding, uint64_t start);
+extern void rfbMetricsRecordUpdate(rfbClientPtr cl, uint64_t damageTime, int bytesBefore);
+extern rfbStatList** rfbMetricsStatSlot(rfbClientPtr cl, uint32_t type, rfbBool message);
+extern void rfbMetricsResetStatSlots(rfbClientPtr cl);
+extern int rfbMetricsEncodingIndex(uint32_t encoding);
+
+/* from trace.c */
+
+extern uint32_t rfbTraceMarked(sraRegionPtr region);
+extern void rfbTraceClientDamage(rfbClientPtr cl, uint32_t id);
+extern void rfbTraceClient(rfbClientPtr cl, rfbTraceStage stage);
+extern void rfbTraceUpdate(rfbClientPtr cl, rfbTraceStage stage, uint32_t first, uint32_t last);
+
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+/* from fbblock.c */
+
+extern void rfbFreeFramebufferBlocks(rfbClientPtr cl);
+extern void rfbDropBlocked(rfbClientPtr cl);
+
+/* from rfbserver.c */
+
+extern void rfbMLExtFreeContextInformation(rfbScreenInfoPtr screen);
+#endif
+
+/* from uring.c */
+
+extern rfbBool rfbUringInit(rfbScreenInfoPtr screen);
+extern void rfbUringShutdown(rfbScreenInfoPtr screen);
+extern void rfbUringFreeClient(rfbClientPtr cl);
+extern void rfbUringBeginBatch(rfbScreenInfoPtr screen);
+extern void rfbUringFlush(rfbScreenInfoPtr screen);
+extern rfbBool rfbUringFlushClient(rfbClientPtr cl);
+extern int rfbUringWrite(rfbClientPtr cl, const char* buf, int len);
+extern int rfbUringRecv(rfbClientPtr cl, char* buf, int len, int timeout);
+extern int rfbUringWaitWritable(rfbClientPtr cl, int timeout);
+extern rfbBool rfbUringBatching(rfbClientPtr cl);
+
 #endif
 
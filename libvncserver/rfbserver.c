@@ -262,7 +262,7 @@ void
 rfbNewClientConnection(rfbScreenInfoPtr rfbScreen,
                        int sock)
 {
-    rfbLog("rfbNewClientConnection() rfbscreen: %p sock: %d", rfbScreen, sock);
+    rfbDebug("rfbNewClientConnection() rfbscreen: %p sock: %d\n", rfbScreen, sock);
     rfbNewClient(rfbScreen,sock);
 }
 
@@ -326,7 +326,6 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
     struct sockaddr_in addr;
 #endif
     socklen_t addrlen = sizeof(addr);
-    rfbProtocolExtension* extension;
 
     cl = (rfbClientPtr)calloc(sizeof(rfbClientRec),1);
 
@@ -337,6 +336,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
     cl->scaledScreen = rfbScreen;
     cl->scaledScreen->scaledScreenRefCount++;
 
+    rfbMetricsNewClient(cl);
     rfbResetStats(cl);
 
     cl->clientData = NULL;
@@ -349,8 +349,12 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 		char host[1024];
 #endif
       int one=1;
+      rfbBool isUnix = rfbIsUnixSocket(sock);
 
       getpeername(sock, (struct sockaddr *)&addr, &addrlen);
+      if(isUnix)
+	cl->host = strdup("unix socket");
+      else
 #ifdef LIBVNCSERVER_IPv6
       if(getnameinfo((struct sockaddr*)&addr, addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) {
 	rfbLogPerror("rfbNewClient: error in getnameinfo");
@@ -374,12 +378,13 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 	return NULL;
       }
 
-      if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+      if (!isUnix && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
 		     (char *)&one, sizeof(one)) < 0) {
 	rfbLogPerror("setsockopt failed");
 	close(sock);
 	return NULL;
       }
+      cl->canCork = !isUnix;
 
       FD_SET(sock,&(rfbScreen->allFds));
 		rfbScreen->maxFd = max(sock,rfbScreen->maxFd);
@@ -399,6 +404,8 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       cl->correMaxHeight = 48;
 #ifdef LIBVNCSERVER_HAVE_LIBZ
       cl->zrleData = NULL;
+      cl->zrleStripes = NULL;
+      cl->enableZRLEStripes = FALSE;
 #endif
 
       cl->copyRegion = sraRgnCreate();
@@ -454,6 +461,11 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 #ifdef LIBVNCSERVER_HAVE_ML_EXT
       cl->enableMLExtContextInformation = FALSE;
       cl->enableMLExtEncoding525 = rfbCheckMLExtEncoding525(sock);
+      cl->fbBlocks = NULL;
+      cl->blockedRegion = NULL;
+      cl->mlContextSent = cl->mlContextNext = NULL;
+      cl->mlContextSentLen = cl->mlContextNextLen = 0;
+      cl->mlContextSentSize = cl->mlContextNextSize = 0;
 #endif
       cl->lastKeyboardLedState = -1;
       cl->cursorX = rfbScreen->cursorX;
@@ -469,6 +481,8 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       cl->compStream.opaque = Z_NULL;
 
       cl->zlibCompressLevel = 5;
+      cl->deflateBackend = rfbScreen->deflateBackend ?
+	rfbScreen->deflateBackend : &rfbDeflateBackendZlib;
 #endif
 
       cl->progressiveSliceY = 0;
@@ -502,15 +516,7 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       }
     }
 
-    for(extension = rfbGetExtensionIterator(); extension;
-	    extension=extension->next) {
-	void* data = NULL;
-	/* if the extension does not have a newClient method, it wants
-	 * to be initialized later. */
-	if(extension->newClient && extension->newClient(cl, &data))
-		rfbEnableExtension(cl, extension, data);
-    }
-    rfbReleaseExtensionIterator();
+    rfbNewClientExtensions(cl);
 
     switch (cl->screen->newClientHook(cl)) {
     case RFB_CLIENT_ON_HOLD:
@@ -554,7 +560,7 @@ rfbClientConnectionGone(rfbClientPtr cl)
     int i;
 #endif
 
-    rfbLog("rfbClientConnectionGone() cl: %p", cl);
+    rfbDebug("rfbClientConnectionGone() cl: %p\n", cl);
 
     LOCK(rfbClientListMutex);
 
@@ -586,11 +592,17 @@ rfbClientConnectionGone(rfbClientPtr cl)
     if (cl->scaledScreen!=NULL)
         cl->scaledScreen->scaledScreenRefCount--;
 
+    /* before the stripes and buffers they work on */
+    rfbFreeWorkers(cl);
+
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     rfbFreeZrleData(cl);
 #endif
 
     rfbFreeUltraData(cl);
+    rfbFreeLZ4Data(cl);
+    rfbFreeSharedMemory(cl);
+    rfbUringFreeClient(cl);
 
     /* free buffers holding pixel data before and after encoding */
     free(cl->beforeEncBuf);
@@ -607,13 +619,13 @@ rfbClientConnectionGone(rfbClientPtr cl)
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     /* Release the compression state structures if any. */
     if ( cl->compStreamInited ) {
-	deflateEnd( &(cl->compStream) );
+	cl->deflateBackend->end( &(cl->compStream) );
     }
 
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
     for (i = 0; i < 4; i++) {
 	if (cl->zsActive[i])
-	    deflateEnd(&cl->zsStruct[i]);
+	    cl->deflateBackend->end(&cl->zsStruct[i]);
     }
 #endif
 #endif
@@ -621,6 +633,11 @@ rfbClientConnectionGone(rfbClientPtr cl)
     if (cl->screen->pointerClient == cl)
         cl->screen->pointerClient = NULL;
 
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+    rfbFreeFramebufferBlocks(cl);
+    free(cl->mlContextSent);
+    free(cl->mlContextNext);
+#endif
     sraRgnDestroy(cl->modifiedRegion);
     sraRgnDestroy(cl->requestedRegion);
     sraRgnDestroy(cl->copyRegion);
@@ -635,6 +652,7 @@ rfbClientConnectionGone(rfbClientPtr cl)
         extension = next;
       }
     }
+    free(cl->extensionHandlers);
 
     TINI_COND(cl->updateCond);
     TINI_MUTEX(cl->updateMutex);
@@ -650,6 +668,8 @@ rfbClientConnectionGone(rfbClientPtr cl)
 
     rfbPrintStats(cl);
     rfbResetStats(cl);
+    rfbMetricsFreeClient(cl);
+    rfbFreeCursorOverlay(cl);
 
     free(cl);
 }
@@ -695,7 +715,7 @@ rfbProcessClientProtocolVersion(rfbClientPtr cl)
     rfbProtocolVersionMsg pv;
     int n, major_, minor_;
 
-    rfbLog("rfbProcessClientProtocolVersion() cl: %p", cl);
+    rfbDebug("rfbProcessClientProtocolVersion() cl: %p\n", cl);
 
     if ((n = rfbReadExact(cl, pv, sz_rfbProtocolVersionMsg)) <= 0) {
         if (n == 0)
@@ -804,7 +824,7 @@ rfbProcessClientInitMessage(rfbClientPtr cl)
     rfbClientPtr otherCl;
     rfbExtensionData* extension;
 
-    rfbLog("rfbProcessClientInitMessage() cl: %p", cl);
+    rfbDebug("rfbProcessClientInitMessage() cl: %p\n", cl);
     if (cl->state == RFB_INITIALISATION_SHARED) {
         /* In this case behave as though an implicit ClientInit message has
          * already been received with a shared-flag of true. */
@@ -1032,6 +1052,7 @@ rfbSendSupportedEncodings(rfbClientPtr cl)
 	rfbEncodingZlib,
 	rfbEncodingZRLE,
 	rfbEncodingZYWRLE,
+	rfbEncodingZRLEStripes,
 #endif
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 	rfbEncodingTight,
@@ -1041,6 +1062,8 @@ rfbSendSupportedEncodings(rfbClientPtr cl)
 #endif
 	rfbEncodingUltra,
 	rfbEncodingUltraZip,
+	rfbEncodingLZ4,
+	rfbEncodingSharedMemory,
 	rfbEncodingXCursor,
 	rfbEncodingRichCursor,
 	rfbEncodingPointerPos,
@@ -1149,32 +1172,104 @@ rfbSendServerIdentity(rfbClientPtr cl)
 
 #ifdef LIBVNCSERVER_HAVE_ML_EXT
 /*
- * Send rfbMLExt_PseudoEncoding_524.
+ * The context information of the areas of the screen the applications
+ * show, each sent as an rfbMLExt_PseudoEncoding_524 rectangle.  Without
+ * any, the context information in screenData is sent for the whole screen.
  */
 
-rfbBool
-rfbMLExtSendContextInformation(rfbClientPtr cl)
+typedef struct rfbMLExtContextArea {
+    struct rfbMLExtContextArea* next;
+    int x, y, w, h;
+    rfbMLExt_ContextInformation_t ctx;	/* in host byte order */
+} rfbMLExtContextArea;
+
+#define sz_rfbMLExtContextRect (sz_rfbFramebufferUpdateRectHeader + sz_rfbMLExtContextInformation)
+
+/*
+ * rfbMLExtSetContextInformation sets the context information of the area
+ * of an application, replacing the one it had.
+ */
+
+void
+rfbMLExtSetContextInformation(rfbScreenInfoPtr screen, int x, int y, int w, int h,
+                              const rfbMLExt_ContextInformation_t* ctx)
+{
+    rfbMLExtContextArea* area;
+
+    LOCK(screen->mlContextMutex);
+    for (area = screen->mlContextAreas; area; area = area->next)
+        if (area->ctx.app_unique_id == ctx->app_unique_id)
+            break;
+    if (area == NULL) {
+        area = (rfbMLExtContextArea*)malloc(sizeof(rfbMLExtContextArea));
+        if (area == NULL) {
+            UNLOCK(screen->mlContextMutex);
+            return;
+        }
+        area->next = screen->mlContextAreas;
+        screen->mlContextAreas = area;
+    }
+    area->x = x;
+    area->y = y;
+    area->w = w;
+    area->h = h;
+    area->ctx = *ctx;
+    UNLOCK(screen->mlContextMutex);
+}
+
+void
+rfbMLExtClearContextInformation(rfbScreenInfoPtr screen, uint32_t appId)
+{
+    rfbMLExtContextArea *area, **prev;
+
+    LOCK(screen->mlContextMutex);
+    for (prev = &screen->mlContextAreas; (area = *prev); prev = &area->next)
+        if (area->ctx.app_unique_id == appId) {
+            *prev = area->next;
+            free(area);
+            break;
+        }
+    UNLOCK(screen->mlContextMutex);
+}
+
+void
+rfbMLExtFreeContextInformation(rfbScreenInfoPtr screen)
+{
+    rfbMLExtContextArea *area, *next;
+
+    for (area = screen->mlContextAreas; area; area = next) {
+        next = area->next;
+        free(area);
+    }
+    screen->mlContextAreas = NULL;
+}
+
+/* appends the rectangle for an area, in the client's coordinates */
+static rfbBool
+rfbMLExtAddContextRect(rfbClientPtr cl, int x, int y, int w, int h,
+                       const rfbMLExt_ContextInformation_t* ctx, int* size)
 {
     rfbFramebufferUpdateRectHeader rect;
     rfbMLExt_ContextInformation_t context_information;
-    rfbMLExt_ContextInformation_t *ctx =
-        (rfbMLExt_ContextInformation_t *)cl->screen->screenData;
+    char* buf;
 
-    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader
-                  + sz_rfbMLExtContextInformation> UPDATE_BUF_SIZE) {
-        if (!rfbSendUpdateBuf(cl))
+    if (cl->mlContextNextLen + sz_rfbMLExtContextRect > *size) {
+        buf = (char*)realloc(cl->mlContextNext, *size * 2 + sz_rfbMLExtContextRect);
+        if (buf == NULL)
             return FALSE;
+        cl->mlContextNext = buf;
+        *size = *size * 2 + sz_rfbMLExtContextRect;
     }
+    buf = cl->mlContextNext + cl->mlContextNextLen;
 
+    if (cl->screen != cl->scaledScreen)
+        rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbMLExtAddContextRect");
     rect.encoding = Swap32IfLE(rfbMLExt_PseudoEncoding_524);
-    rect.r.x = 0;
-    rect.r.y = 0;
-    rect.r.w = Swap16IfLE(cl->screen->width);
-    rect.r.h = Swap16IfLE(cl->screen->height);
-
-    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
-        sz_rfbFramebufferUpdateRectHeader);
-    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+    rect.r.x = Swap16IfLE(x);
+    rect.r.y = Swap16IfLE(y);
+    rect.r.w = Swap16IfLE(w);
+    rect.r.h = Swap16IfLE(h);
+    memcpy(buf, (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
 
     memset((char *)&context_information, 0, sz_rfbMLExtContextInformation);
 
@@ -1188,23 +1283,77 @@ rfbMLExtSendContextInformation(rfbClientPtr cl)
 
     context_information.content_rules_bits = Swap32IfLE(ctx->content_rules_bits);
 
-    memcpy(&cl->updateBuf[cl->ublen], (char *)&context_information, sz_rfbMLExtContextInformation);
-    cl->ublen += sz_rfbMLExtContextInformation;
+    memcpy(buf + sz_rfbFramebufferUpdateRectHeader, (char *)&context_information,
+           sz_rfbMLExtContextInformation);
+    cl->mlContextNextLen += sz_rfbMLExtContextRect;
+    return TRUE;
+}
+
+/*
+ * rfbMLExtPrepareContextInformation puts together the context information
+ * rectangles for the client and returns how many of them are to be sent:
+ * none if they are the same as those last sent.
+ */
 
-    rfbLog("rfbMLExtSendContextInformation() cl: %p %dx%d app_unique_id: 0x%x"
-           " trust level: 0x%02x 0x%02x"
-           " app_category: 0x%x content_category: 0x%x"
-           " content_rules_bits: 0x%x",
-           cl, cl->screen->width, cl->screen->height, ctx->app_unique_id,
-           ctx->app_category_trust_level, ctx->content_category_trust_level,
-           ctx->app_category, ctx->content_category, ctx->content_rules_bits);
+static int
+rfbMLExtPrepareContextInformation(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr s = cl->screen;
+    rfbMLExtContextArea* area;
+    int size = cl->mlContextNext ? cl->mlContextNextSize : 0;
+    rfbBool ok = TRUE, areas;
+
+    cl->mlContextNextLen = 0;
+    LOCK(s->mlContextMutex);
+    areas = s->mlContextAreas != NULL;
+    for (area = s->mlContextAreas; area && ok; area = area->next)
+        ok = rfbMLExtAddContextRect(cl, area->x, area->y, area->w, area->h, &area->ctx, &size);
+    UNLOCK(s->mlContextMutex);
+    if (!areas && s->screenData)
+        ok = rfbMLExtAddContextRect(cl, 0, 0, s->width, s->height,
+                                    (rfbMLExt_ContextInformation_t *)s->screenData, &size);
+    cl->mlContextNextSize = size;
+
+    if (!ok || (cl->mlContextNextLen == cl->mlContextSentLen &&
+                memcmp(cl->mlContextNext, cl->mlContextSent, cl->mlContextSentLen) == 0))
+        return 0;
+    return cl->mlContextNextLen / sz_rfbMLExtContextRect;
+}
 
-    rfbStatRecordEncodingSent(cl, rfbMLExt_PseudoEncoding_524,
-        sz_rfbFramebufferUpdateRectHeader+sz_rfbMLExtContextInformation,
-        sz_rfbFramebufferUpdateRectHeader+sz_rfbMLExtContextInformation);
+/*
+ * Send the rfbMLExt_PseudoEncoding_524 rectangles prepared by
+ * rfbMLExtPrepareContextInformation(), with the rest of the update.
+ */
 
-    if (!rfbSendUpdateBuf(cl))
-        return FALSE;
+rfbBool
+rfbMLExtSendContextInformation(rfbClientPtr cl)
+{
+    char* sent;
+    int i, size;
+
+    for (i = 0; i < cl->mlContextNextLen; i += sz_rfbMLExtContextRect) {
+        if (cl->ublen + sz_rfbMLExtContextRect > UPDATE_BUF_SIZE) {
+            if (!rfbSendUpdateBuf(cl))
+                return FALSE;
+        }
+        memcpy(&cl->updateBuf[cl->ublen], cl->mlContextNext + i, sz_rfbMLExtContextRect);
+        cl->ublen += sz_rfbMLExtContextRect;
+        rfbStatRecordEncodingSent(cl, rfbMLExt_PseudoEncoding_524,
+            sz_rfbMLExtContextRect, sz_rfbMLExtContextRect);
+    }
+
+    rfbDebug("rfbMLExtSendContextInformation() cl: %p %d areas\n",
+             cl, cl->mlContextNextLen / sz_rfbMLExtContextRect);
+
+    /* what was sent is compared with the next time */
+    sent = cl->mlContextSent;
+    size = cl->mlContextSentSize;
+    cl->mlContextSent = cl->mlContextNext;
+    cl->mlContextSentSize = cl->mlContextNextSize;
+    cl->mlContextSentLen = cl->mlContextNextLen;
+    cl->mlContextNext = sent;
+    cl->mlContextNextSize = size;
+    cl->mlContextNextLen = 0;
 
     return TRUE;
 }
@@ -2198,6 +2347,10 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
         cl->enableSupportedMessages  = FALSE;
         cl->enableSupportedEncodings = FALSE;
         cl->enableServerIdentity     = FALSE;
+        cl->enableSharedMemory       = FALSE;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+        cl->enableZRLEStripes        = FALSE;
+#endif
 #if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
         cl->tightQualityLevel        = -1;
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
@@ -2227,6 +2380,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
             case rfbEncodingCoRRE:
             case rfbEncodingHextile:
             case rfbEncodingUltra:
+            case rfbEncodingLZ4:
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 	    case rfbEncodingZlib:
             case rfbEncodingZRLE:
@@ -2326,6 +2480,28 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
                   cl->enableServerIdentity = TRUE;
                 }
                 break;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+            case rfbEncodingZRLEStripes:
+                if (!cl->enableZRLEStripes) {
+                  rfbLog("Enabling ZRLEStripes protocol extension for client "
+                          "%s\n", cl->host);
+                  cl->enableZRLEStripes = TRUE;
+                }
+                break;
+#endif
+            case rfbEncodingSharedMemory:
+                /* only where the memory can be handed over */
+                if (rfbIsUnixSocket(cl->sock)
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+                    && !cl->wsctx
+#endif
+                    ) {
+                  if (!cl->sharedMemory)
+                    rfbLog("Enabling SharedMemory protocol extension for client "
+                            "%s\n", cl->host);
+                  cl->enableSharedMemory = TRUE;
+                }
+                break;
 	    case rfbEncodingXvp:
 	        rfbLog("Enabling Xvp protocol extension for client "
 		        "%s\n", cl->host);
@@ -2379,33 +2555,10 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 				e = next;
 			}
 			if(e == NULL) {
-				rfbBool handled = FALSE;
 				/* if the pseudo encoding is not handled by the
 				   enabled extensions, search through all
 				   extensions. */
-				rfbProtocolExtension* e;
-
-				for(e = rfbGetExtensionIterator(); e;) {
-					int* encs = e->pseudoEncodings;
-					while(encs && *encs!=0) {
-						if(*encs==(int)enc) {
-							void* data = NULL;
-							if(!e->enablePseudoEncoding(cl, &data, (int)enc)) {
-								rfbLog("Installed extension pretends to handle pseudo encoding 0x%x, but does not!\n",(int)enc);
-							} else {
-								rfbEnableExtension(cl, e, data);
-								handled = TRUE;
-								e = NULL;
-								break;
-							}
-						}
-						encs++;
-					}
-
-					if(e)
-						e = e->next;
-				}
-				rfbReleaseExtensionIterator();
+				rfbBool handled = rfbEnablePseudoEncodingExtension(cl, (int)enc);
 
 				if(!handled)
 					rfbLog("rfbProcessClientNormalMessage: "
@@ -2779,18 +2932,11 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
     default:
 	{
-	    rfbExtensionData *e,*next;
-
-	    for(e=cl->extensions; e;) {
-		next = e->next;
-		if(e->extension->handleMessage &&
-			e->extension->handleMessage(cl, e->data, &msg))
-                {
-                    rfbStatRecordMessageRcvd(cl, msg.type, 0, 0); /* Extension should handle this */
-		    return;
-                }
-		e = next;
-	    }
+	    if(rfbExtensionHandleMessage(cl, &msg))
+            {
+                rfbStatRecordMessageRcvd(cl, msg.type, 0, 0); /* Extension should handle this */
+		return;
+            }
 
 	    rfbLog("rfbProcessClientNormalMessage: unknown message type %d\n",
 		    msg.type);
@@ -2803,6 +2949,132 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
 
 
+/*
+ * rfbCountUpdateRects counts the rectangles the encoding of the client
+ * sends region in, 0xFFFF if it cannot tell in advance.
+ */
+
+static int
+rfbCountUpdateRects(rfbClientPtr cl, sraRegionPtr region)
+{
+    sraRectangleIterator* i;
+    sraRect rect;
+    int n, m;
+
+    if (cl->enableSharedMemory) {
+        n = sraRgnCountRects(region);
+    } else if (cl->preferredEncoding == rfbEncodingCoRRE) {
+        n = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+	    int rectsPerRow, rows;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbCountUpdateRects");
+	    rectsPerRow = (w-1)/cl->correMaxWidth+1;
+	    rows = (h-1)/cl->correMaxHeight+1;
+	    n += rectsPerRow*rows;
+        }
+	sraRgnReleaseIterator(i);
+    } else if (cl->preferredEncoding == rfbEncodingUltra) {
+        n = 0;
+        
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbCountUpdateRects");
+            n += (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
+          }
+        sraRgnReleaseIterator(i);
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    } else if (cl->preferredEncoding == rfbEncodingZlib) {
+	n = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbCountUpdateRects");
+	    n += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
+	}
+	sraRgnReleaseIterator(i);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    } else if (cl->preferredEncoding == rfbEncodingTight) {
+	n = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbCountUpdateRects");
+	    m = rfbNumCodedRectsTight(cl, x, y, w, h);
+	    if (m == 0) {
+		n = 0xFFFF;
+		break;
+	    }
+	    n += m;
+	}
+	sraRgnReleaseIterator(i);
+#endif
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBPNG)
+    } else if (cl->preferredEncoding == rfbEncodingTightPng) {
+	n = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbCountUpdateRects");
+	    m = rfbNumCodedRectsTight(cl, x, y, w, h);
+	    if (m == 0) {
+		n = 0xFFFF;
+		break;
+	    }
+	    n += m;
+	}
+	sraRgnReleaseIterator(i);
+#endif
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    } else if (cl->preferredEncoding == rfbEncodingZRLE ||
+               cl->preferredEncoding == rfbEncodingZYWRLE) {
+	n = 0;
+
+        for(i = sraRgnGetIterator(region); sraRgnIteratorNext(i,&rect);){
+            int x = rect.x1;
+            int y = rect.y1;
+            int w = rect.x2 - x;
+            int h = rect.y2 - y;
+            /* We need to count the number of rects in the scaled screen */
+            if (cl->screen!=cl->scaledScreen)
+                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbCountUpdateRects");
+	    n += rfbNumCodedRectsZRLE(cl, x, y, w, h);
+	}
+	sraRgnReleaseIterator(i);
+#endif
+    } else {
+        n = sraRgnCountRects(region);
+    }
+    return n;
+}
+
 /*
  * rfbSendFramebufferUpdate - send the currently pending framebuffer update to
  * the RFB client.
@@ -2818,6 +3090,8 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     int nUpdateRegionRects;
     rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
     sraRegionPtr updateRegion,updateCopyRegion,tmpRegion;
+    sraRegionPtr sendRegion, cursorRegion = NULL;
+    rfbScreenInfoPtr overlaidScreen = NULL;
     int dx, dy;
     rfbBool sendCursorShape = FALSE;
     rfbBool sendCursorPos = FALSE;
@@ -2825,10 +3099,14 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     rfbBool sendSupportedMessages = FALSE;
     rfbBool sendSupportedEncodings = FALSE;
     rfbBool sendServerIdentity = FALSE;
+    rfbBool sendSharedMemory = FALSE;
 #ifdef LIBVNCSERVER_HAVE_ML_EXT
-    rfbBool sendMLExtContextInformation = FALSE;
+    int nMLExtContextRects = 0;
 #endif
     rfbBool result = TRUE;
+    uint64_t damageTime, rectStart;
+    int bytesBefore = cl->bytesSent;
+    uint32_t traceFirst, traceLast;
 
     // rfbLog("rfbSendFramebufferUpdate() cl: %p", cl);
 
@@ -2924,16 +3202,27 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
         cl->enableServerIdentity = FALSE;
     }
 
+    /*
+     * Does the shared memory have to be handed out, replaced or withdrawn?
+     */
+    if (cl->enableSharedMemory || cl->sharedMemory)
+        sendSharedMemory = rfbSharedMemoryNeedsSetup(cl);
+
 #ifdef LIBVNCSERVER_HAVE_ML_EXT
     if (cl->enableMLExtContextInformation)
     {
-        sendMLExtContextInformation = TRUE;
+        nMLExtContextRects = rfbMLExtPrepareContextInformation(cl);
         cl->enableMLExtContextInformation = FALSE;
 	}
 #endif
 
     LOCK(cl->updateMutex);
 
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+    /* nothing the client blocks is sent */
+    rfbDropBlocked(cl);
+#endif
+
     /*
      * The modifiedRegion may overlap the destination copyRegion.  We remove
      * any overlapping bits from the copyRegion (since they'd only be
@@ -2971,12 +3260,20 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     }
 
     sraRgnOr(updateRegion,cl->copyRegion);
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+    if(cl->blockedRegion)
+	sraRgnSubtract(updateRegion,cl->blockedRegion);
+#endif
     if(!sraRgnAnd(updateRegion,cl->requestedRegion) &&
        sraRgnEmpty(updateRegion) &&
        (cl->enableCursorShapeUpdates ||
 	(cl->cursorX == cl->screen->cursorX && cl->cursorY == cl->screen->cursorY)) &&
        !sendCursorShape && !sendCursorPos && !sendKeyboardLedState &&
-       !sendSupportedMessages && !sendSupportedEncodings && !sendServerIdentity) {
+       !sendSupportedMessages && !sendSupportedEncodings && !sendServerIdentity &&
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+       !nMLExtContextRects &&
+#endif
+       !sendSharedMemory) {
       sraRgnDestroy(updateRegion);
       UNLOCK(cl->updateMutex);
       if(cl->screen->displayFinishedHook)
@@ -3002,6 +3299,14 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     dx = cl->copyDX;
     dy = cl->copyDY;
 
+    /*
+     * The shared memory is only written by the server, so copies are sent
+     * as modified pixels.
+     */
+
+    if (cl->enableSharedMemory)
+        sraRgnMakeEmpty(updateCopyRegion);
+
     /*
      * Next we remove updateCopyRegion from updateRegion so that updateRegion
      * is the part of this update which is sent as ordinary pixel data (i.e not
@@ -3020,6 +3325,12 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      sraRgnOr(cl->modifiedRegion,cl->copyRegion);
      sraRgnSubtract(cl->modifiedRegion,updateRegion);
      sraRgnSubtract(cl->modifiedRegion,updateCopyRegion);
+     damageTime = rfbMetricsTakeDamage(cl, sraRgnEmpty(cl->modifiedRegion));
+     traceFirst = cl->traceFirstDamage;
+     traceLast = cl->traceLastDamage;
+     if (sraRgnEmpty(cl->modifiedRegion))
+       cl->traceFirstDamage = cl->traceLastDamage = 0;
+     rfbTraceUpdate(cl, rfbTraceStagePickedUp, traceFirst, traceLast);
 
      sraRgnMakeEmpty(cl->requestedRegion);
      sraRgnMakeEmpty(cl->copyRegion);
@@ -3037,7 +3348,18 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	UNLOCK(cl->screen->cursorMutex);
 	rfbRedrawAfterHideCursor(cl,updateRegion);
       }
-      rfbShowCursor(cl);
+      /* what is under the cursor is sent from the overlay, see cursor.c */
+      cursorRegion = rfbCursorRegion(cl, updateRegion);
+    }
+
+    /* bring what is sent of a scaled screen up to date */
+    if (cl->screen!=cl->scaledScreen) {
+        tmpRegion = sraRgnCreateRgn(updateRegion);
+        sraRgnOr(tmpRegion, updateCopyRegion);
+        if (cursorRegion)
+            sraRgnOr(tmpRegion, cursorRegion);
+        rfbScaledScreenPrepare(cl, tmpRegion);
+        sraRgnDestroy(tmpRegion);
     }
 
     /*
@@ -3045,100 +3367,7 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      */
     
     rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 0, 0);
-    if (cl->preferredEncoding == rfbEncodingCoRRE) {
-        nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-	    int rectsPerRow, rows;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    rectsPerRow = (w-1)/cl->correMaxWidth+1;
-	    rows = (h-1)/cl->correMaxHeight+1;
-	    nUpdateRegionRects += rectsPerRow*rows;
-        }
-	sraRgnReleaseIterator(i); i=NULL;
-    } else if (cl->preferredEncoding == rfbEncodingUltra) {
-        nUpdateRegionRects = 0;
-        
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-            nUpdateRegionRects += (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
-          }
-        sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-    } else if (cl->preferredEncoding == rfbEncodingZlib) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    nUpdateRegionRects += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
-	}
-	sraRgnReleaseIterator(i); i=NULL;
-#ifdef LIBVNCSERVER_HAVE_LIBJPEG
-    } else if (cl->preferredEncoding == rfbEncodingTight) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            int n;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
-	    if (n == 0) {
-		nUpdateRegionRects = 0xFFFF;
-		break;
-	    }
-	    nUpdateRegionRects += n;
-	}
-	sraRgnReleaseIterator(i); i=NULL;
-#endif
-#endif
-#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && defined(LIBVNCSERVER_HAVE_LIBPNG)
-    } else if (cl->preferredEncoding == rfbEncodingTightPng) {
-	nUpdateRegionRects = 0;
-
-        for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
-            int x = rect.x1;
-            int y = rect.y1;
-            int w = rect.x2 - x;
-            int h = rect.y2 - y;
-            int n;
-            /* We need to count the number of rects in the scaled screen */
-            if (cl->screen!=cl->scaledScreen)
-                rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-	    n = rfbNumCodedRectsTight(cl, x, y, w, h);
-	    if (n == 0) {
-		nUpdateRegionRects = 0xFFFF;
-		break;
-	    }
-	    nUpdateRegionRects += n;
-	}
-	sraRgnReleaseIterator(i); i=NULL;
-#endif
-    } else {
-        nUpdateRegionRects = sraRgnCountRects(updateRegion);
-    }
+    nUpdateRegionRects = rfbCountUpdateRects(cl, updateRegion);
 
     fu->type = rfbFramebufferUpdate;
     if (nUpdateRegionRects != 0xFFFF) {
@@ -3165,24 +3394,40 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	    updateRegion = newUpdateRegion;
 	    nUpdateRegionRects = sraRgnCountRects(updateRegion);
 	}
+	if (cursorRegion) {
+	    int n = rfbCountUpdateRects(cl, cursorRegion);
+	    nUpdateRegionRects = n == 0xFFFF ? 0xFFFF : nUpdateRegionRects + n;
+	}
+    }
+    if (nUpdateRegionRects != 0xFFFF) {
 #ifdef LIBVNCSERVER_HAVE_ML_EXT
 	fu->nRects = Swap16IfLE((uint16_t)(sraRgnCountRects(updateCopyRegion) +
 					   nUpdateRegionRects +
 					   !!sendCursorShape + !!sendCursorPos + !!sendKeyboardLedState +
-					   !!sendSupportedMessages + !!sendSupportedEncodings + !!sendServerIdentity + !!sendMLExtContextInformation));
+					   !!sendSupportedMessages + !!sendSupportedEncodings + !!sendServerIdentity + nMLExtContextRects +
+					   !!sendSharedMemory));
 #else
     fu->nRects = Swap16IfLE((uint16_t)(sraRgnCountRects(updateCopyRegion) +
                    nUpdateRegionRects +
                    !!sendCursorShape + !!sendCursorPos + !!sendKeyboardLedState +
-                   !!sendSupportedMessages + !!sendSupportedEncodings + !!sendServerIdentity));
+                   !!sendSupportedMessages + !!sendSupportedEncodings + !!sendServerIdentity +
+                   !!sendSharedMemory));
 #endif
     } else {
 	fu->nRects = 0xFFFF;
     }
     cl->ublen = sz_rfbFramebufferUpdateMsg;
 
+    /* the update goes out in full segments, see rfbUncorkClient below */
+    rfbCorkClient(cl);
+
+    if (sendSharedMemory) {
+        if (!rfbSendSharedMemory(cl))
+            goto updateFailed;
+    }
+
 #ifdef LIBVNCSERVER_HAVE_ML_EXT
-    if (sendMLExtContextInformation) {
+    if (nMLExtContextRects) {
         if (!rfbMLExtSendContextInformation(cl))
             goto updateFailed;
 	}
@@ -3223,7 +3468,9 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	        goto updateFailed;
     }
 
-    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
+    sendRegion = updateRegion;
+sendRects:
+    for(i = sraRgnGetIterator(sendRegion); sraRgnIteratorNext(i,&rect);){
         int x = rect.x1;
         int y = rect.y1;
         int w = rect.x2 - x;
@@ -3233,6 +3480,15 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
         if (cl->screen!=cl->scaledScreen)
             rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
 
+        rectStart = rfbMetricsNow();
+
+        if (cl->sharedMemory) {
+            if (!rfbSendRectEncodingSharedMemory(cl, x, y, w, h))
+                goto updateFailed;
+            rfbMetricsRecordEncode(cl, rfbEncodingSharedMemoryRect, rectStart);
+            continue;
+        }
+
         switch (cl->preferredEncoding) {
 	case -1:
         case rfbEncodingRaw:
@@ -3255,6 +3511,10 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
             if (!rfbSendRectEncodingUltra(cl, x, y, w, h))
                 goto updateFailed;
             break;
+        case rfbEncodingLZ4:
+            if (!rfbSendRectEncodingLZ4(cl, x, y, w, h))
+                goto updateFailed;
+            break;
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 	case rfbEncodingZlib:
 	    if (!rfbSendRectEncodingZlib(cl, x, y, w, h))
@@ -3292,27 +3552,49 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 		break;
 #endif
         }
+        rfbMetricsRecordEncode(cl, cl->preferredEncoding, rectStart);
     }
     if (i) {
         sraRgnReleaseIterator(i);
         i = NULL;
     }
+    /* then the part under the cursor, from the overlay */
+    if (cursorRegion && sendRegion != cursorRegion) {
+        rfbScreenInfoPtr overlay = rfbCursorOverlay(cl, cursorRegion);
+
+        if (overlay) {
+            overlaidScreen = cl->scaledScreen;
+            cl->scaledScreen = overlay;
+        }
+        sendRegion = cursorRegion;
+        goto sendRects;
+    }
+    if (overlaidScreen) {
+        cl->scaledScreen = overlaidScreen;
+        overlaidScreen = NULL;
+    }
 
     if ( nUpdateRegionRects == 0xFFFF &&
 	 !rfbSendLastRectMarker(cl) )
 	    goto updateFailed;
+    rfbTraceUpdate(cl, rfbTraceStageEncoded, traceFirst, traceLast);
 
     if (!rfbSendUpdateBuf(cl)) {
 updateFailed:
 	result = FALSE;
     }
-
-    if (!cl->enableCursorShapeUpdates) {
-      rfbHideCursor(cl);
+    if (overlaidScreen)
+        cl->scaledScreen = overlaidScreen;
+    rfbUncorkClient(cl);
+    if (result) {
+        rfbMetricsRecordUpdate(cl, damageTime, bytesBefore);
+        rfbTraceUpdate(cl, rfbTraceStageWritten, traceFirst, traceLast);
     }
 
     if(i)
         sraRgnReleaseIterator(i);
+    if(cursorRegion)
+        sraRgnDestroy(cursorRegion);
     sraRgnDestroy(updateRegion);
     sraRgnDestroy(updateCopyRegion);
 
@@ -61,10 +61,13 @@
 #define DEBUGPROTO(x)
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 /****************************/
-#define CEIL(x)  ( (double) ((int) (x)) == (x) ? \
-        (double) ((int) (x)) : (double) ((int) (x) + 1) )
-#define FLOOR(x) ( (double) ((int) (x)) )
 
 static inline int pad4(int value)
 {
@@ -76,13 +79,13 @@ static inline int pad4(int value)
 int ScaleX(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int x)
 {
     if ((from==to) || (from==NULL) || (to==NULL)) return x;
-    return ((int)(((double) x / (double)from->width) * (double)to->width ));
+    return (int)((int64_t)x * to->width / from->width);
 }
 
 int ScaleY(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int y)
 {
     if ((from==to) || (from==NULL) || (to==NULL)) return y;
-    return ((int)(((double) y / (double)from->height) * (double)to->height ));
+    return (int)((int64_t)y * to->height / from->height);
 }
 
 /* So, all of the encodings point to the ->screen->frameBuffer,
@@ -90,45 +93,26 @@ int ScaleY(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int y)
  */
 void rfbScaledCorrection(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int *x, int *y, int *w, int *h, const char *function)
 {
-    double x1,y1,w1,h1, x2, y2, w2, h2;
-    double scaleW = ((double) to->width) / ((double) from->width);
-    double scaleH = ((double) to->height) / ((double) from->height);
-
-
-    /*
-     * rfbLog("rfbScaledCorrection(%p -> %p, %dx%d->%dx%d (%dXx%dY-%dWx%dH)\n",
-     * from, to, from->width, from->height, to->width, to->height, *x, *y, *w, *h);
-     */
+    int x2, y2;
 
     /* If it's the original framebuffer... */
     if (from==to) return;
 
-    x1 = ((double) *x) * scaleW;
-    y1 = ((double) *y) * scaleH;
-    w1 = ((double) *w) * scaleW;
-    h1 = ((double) *h) * scaleH;
-
-
-    /*cast from double to int is same as "*x = floor(x1);" */
-    x2 = FLOOR(x1);
-    y2 = FLOOR(y1);
-
-    /* include into W and H the jitter of scaling X and Y */
-    w2 = CEIL(w1 + ( x1 - x2 ));
-    h2 = CEIL(h1 + ( y1 - y2 ));
+    /* the scaled rectangle covers every pixel the original one touches:
+     * floor() the top left, ceil() the bottom right */
+    x2 = (int)(((int64_t)(*x + *w) * to->width + from->width - 1) / from->width);
+    y2 = (int)(((int64_t)(*y + *h) * to->height + from->height - 1) / from->height);
+    *x = (int)((int64_t)*x * to->width / from->width);
+    *y = (int)((int64_t)*y * to->height / from->height);
+    *w = x2 - *x;
+    *h = y2 - *y;
 
     /*
-     * rfbLog("%s (%dXx%dY-%dWx%dH  ->  %fXx%fY-%fWx%fH) {%dWx%dH -> %dWx%dH}\n",
-     *    function, *x, *y, *w, *h, x2, y2, w2, h2,
+     * rfbLog("%s (%dXx%dY-%dWx%dH) {%dWx%dH -> %dWx%dH}\n",
+     *    function, *x, *y, *w, *h,
      *    from->width, from->height, to->width, to->height);
      */
 
-    /* simulate ceil() without math library */
-    *x = (int)x2;
-    *y = (int)y2;
-    *w = (int)w2;
-    *h = (int)h2;
-
     /* Small changes for a thumbnail may be scaled to zero */
     if (*w==0) (*w)++;
     if (*h==0) (*h)++;
@@ -137,147 +121,508 @@ void rfbScaledCorrection(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int *x, int
     if (*y+*h > to->height) *h=to->height - *y;
 }
 
+/*
+ * The scaler is separable and works in fixed point.  Each scaled pixel is
+ * a weighted sum of the original pixels along an axis, the weights adding
+ * up to 4096: when shrinking, over the area the pixel covers (so integer
+ * and fractional ratios alike), when enlarging, of the two nearest pixels
+ * (bilinear).  The weights are rounded where the original pixels start,
+ * so they add up exactly and none is off by more than half a step, which
+ * keeps a scaled pixel within one step of the exact area average.  The
+ * pixels are handled as 4 bytes of up to 8 bit channels; 32 bit frame
+ * buffers with byte aligned channels are taken as they are, others are
+ * unpacked into that first.  A scaled row is the sum of the original rows
+ * in 32 bit lanes, cut down to 16 bit lanes with 8 fraction bits, and then
+ * the weighted sum of its columns in 32 bit lanes (65280 * 4096 fits).
+ */
+
+#define SCALE_BITS 12
+#define SCALE_ONE (1 << SCALE_BITS)
+#define SCALE_ROW_BITS 8        /* fraction bits kept of a scaled row */
+#define SCALE_CUT (SCALE_BITS - SCALE_ROW_BITS)  /* the bits a row is cut by */
+#define SCALE_ROW_HALF (1 << (SCALE_BITS + SCALE_ROW_BITS - 1))
+
+typedef struct {
+    int *first;          /* the first original pixel of each scaled one */
+    int *taps;           /* and how many go into it */
+    uint16_t *weights;   /* stride per scaled pixel, adding up to SCALE_ONE */
+    int stride;
+} ScaleFilter;
+
+static void ScaleFilterFree(ScaleFilter *f)
+{
+    free(f->first);
+    free(f->taps);
+    free(f->weights);
+    f->first = f->taps = NULL;
+    f->weights = NULL;
+}
+
+/* sets up the filter for an axis of dst pixels scaled from src */
+static rfbBool ScaleFilterInit(ScaleFilter *f, int src, int dst)
+{
+    int n = dst, d, i, t;
+
+    f->stride = src > dst ? (src + dst - 1) / dst + 1 : 2;
+    f->first = (int *)malloc(n * sizeof(int));
+    f->taps = (int *)malloc(n * sizeof(int));
+    f->weights = (uint16_t *)malloc(n * f->stride * sizeof(uint16_t));
+    if (f->first == NULL || f->taps == NULL || f->weights == NULL) {
+        ScaleFilterFree(f);
+        return FALSE;
+    }
+
+    for (d = 0; d < dst; d++) {
+        int *first = &f->first[d], *taps = &f->taps[d];
+        uint16_t *weight = &f->weights[d * f->stride];
+
+        if (src > dst) {
+            /* area: [a, b) in units of 1/dst of an original pixel */
+            int64_t a = (int64_t)d * src, b = a + src;
+            int start = 0, end;
+
+            *first = (int)(a / dst);
+            *taps = (int)((b - 1) / dst) - *first + 1;
+            for (t = 0; t < *taps; t++) {
+                int64_t to = (int64_t)(*first + t + 1) * dst;
+
+                end = (int)((((to < b ? to : b) - a) * SCALE_ONE + src / 2) / src);
+                weight[t] = (uint16_t)(end - start);
+                start = end;
+            }
+        } else {
+            /* bilinear, between the pixels around the centre */
+            int64_t p = ((int64_t)(2 * d + 1) * src * SCALE_ONE) / (2 * dst) - SCALE_ONE / 2;
+            int frac;
+
+            if (p < 0)
+                p = 0;
+            i = (int)(p / SCALE_ONE);
+            frac = (int)(p % SCALE_ONE);
+            *first = i;
+            if (i >= src - 1 || frac == 0) {
+                *first = i < src - 1 ? i : src - 1;
+                *taps = 1;
+                weight[0] = SCALE_ONE;
+            } else {
+                *taps = 2;
+                weight[0] = SCALE_ONE - frac;
+                weight[1] = frac;
+            }
+        }
+    }
+    return TRUE;
+}
+
+#if defined(__SSE2__)
+/* adds the 32 bit products of the 16 bit lanes of s and w to acc */
+static inline void ScaleAccumulate8(uint32_t *acc, __m128i s, __m128i w)
+{
+    __m128i lo = _mm_mullo_epi16(s, w), hi = _mm_mulhi_epu16(s, w);
+
+    _mm_storeu_si128((__m128i *)acc, _mm_add_epi32(_mm_loadu_si128((const __m128i *)acc),
+                                                   _mm_unpacklo_epi16(lo, hi)));
+    _mm_storeu_si128((__m128i *)(acc + 4), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(acc + 4)),
+                                                         _mm_unpackhi_epi16(lo, hi)));
+}
+
+/* the same for the first row, which sets acc */
+static inline void ScaleSet8(uint32_t *acc, __m128i s, __m128i w)
+{
+    __m128i lo = _mm_mullo_epi16(s, w), hi = _mm_mulhi_epu16(s, w);
+
+    _mm_storeu_si128((__m128i *)acc, _mm_unpacklo_epi16(lo, hi));
+    _mm_storeu_si128((__m128i *)(acc + 4), _mm_unpackhi_epi16(lo, hi));
+}
+#endif
+
+/* acc = (first ? 0 : acc) + src * weight, for n bytes */
+static void ScaleAccumulate(uint32_t *acc, const uint8_t *src, int n, int weight, rfbBool first)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    __m128i vw = _mm_set1_epi16((short)weight), zero = _mm_setzero_si128();
+
+    if (first) {
+        for (; i + 16 <= n; i += 16) {
+            __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+
+            ScaleSet8(acc + i, _mm_unpacklo_epi8(s, zero), vw);
+            ScaleSet8(acc + i + 8, _mm_unpackhi_epi8(s, zero), vw);
+        }
+        for (; i < n; i++)
+            acc[i] = src[i] * weight;
+        return;
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+
+        ScaleAccumulate8(acc + i, _mm_unpacklo_epi8(s, zero), vw);
+        ScaleAccumulate8(acc + i + 8, _mm_unpackhi_epi8(s, zero), vw);
+    }
+#else
+    if (first)
+        memset(acc, 0, n * sizeof(uint32_t));
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(s)), hi = vmovl_u8(vget_high_u8(s));
+
+        vst1q_u32(acc + i, vmlal_n_u16(vld1q_u32(acc + i), vget_low_u16(lo), weight));
+        vst1q_u32(acc + i + 4, vmlal_n_u16(vld1q_u32(acc + i + 4), vget_high_u16(lo), weight));
+        vst1q_u32(acc + i + 8, vmlal_n_u16(vld1q_u32(acc + i + 8), vget_low_u16(hi), weight));
+        vst1q_u32(acc + i + 12, vmlal_n_u16(vld1q_u32(acc + i + 12), vget_high_u16(hi), weight));
+    }
+#endif
+    for (; i < n; i++)
+        acc[i] += src[i] * weight;
+}
+
+/* rounds the accumulated row down to SCALE_ROW_BITS fraction bits, which
+   fits 16 bits (255 << 8) */
+static void ScaleNarrow(uint16_t *dst, const uint32_t *acc, int n)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    /* there is no unsigned 32 to 16 bit pack in SSE2, so move into the
+       signed range and back */
+    __m128i bias = _mm_set1_epi32((1 << (SCALE_CUT - 1)) - (32768 << SCALE_CUT));
+    __m128i flip = _mm_set1_epi16((short)0x8000);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(acc + i)), bias);
+        __m128i hi = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(acc + i + 4)), bias);
+
+        lo = _mm_srai_epi32(lo, SCALE_CUT);
+        hi = _mm_srai_epi32(hi, SCALE_CUT);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_packs_epi32(lo, hi), flip));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 8 <= n; i += 8)
+        vst1q_u16(dst + i, vcombine_u16(vrshrn_n_u32(vld1q_u32(acc + i), SCALE_CUT),
+                                        vrshrn_n_u32(vld1q_u32(acc + i + 4), SCALE_CUT)));
+#endif
+    for (; i < n; i++)
+        dst[i] = (uint16_t)((acc[i] + (1 << (SCALE_CUT - 1))) >> SCALE_CUT);
+}
+
+/* the scaled pixels d1 to d2 of a row from the accumulated one, which
+   starts at original pixel x */
+static void ScaleRow(uint8_t *dst, const uint16_t *acc, const ScaleFilter *f, int d1, int d2, int x)
+{
+    int d, t;
+
+    for (d = d1; d < d2; d++, dst += 4) {
+        const uint16_t *src = acc + (f->first[d] - x) * 4;
+        const uint16_t *weight = &f->weights[d * f->stride];
+#if defined(__SSE2__)
+        __m128i sum = _mm_set1_epi32(SCALE_ROW_HALF);
+
+        for (t = 0; t < f->taps[d]; t++, src += 4) {
+            __m128i s = _mm_loadl_epi64((const __m128i *)src);
+            __m128i w = _mm_set1_epi16((short)weight[t]);
+
+            /* the 32 bit products from their low and high halves */
+            sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(_mm_mullo_epi16(s, w),
+                                                        _mm_mulhi_epu16(s, w)));
+        }
+        sum = _mm_srli_epi32(sum, SCALE_BITS + SCALE_ROW_BITS);
+        sum = _mm_packs_epi32(sum, sum);
+        *(uint32_t *)dst = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        uint32x4_t sum = vdupq_n_u32(SCALE_ROW_HALF);
+        uint8x8_t out;
+
+        for (t = 0; t < f->taps[d]; t++, src += 4)
+            sum = vmlal_n_u16(sum, vld1_u16(src), weight[t]);
+        out = vmovn_u16(vcombine_u16(vmovn_u32(vshrq_n_u32(sum, SCALE_BITS + SCALE_ROW_BITS)), vdup_n_u16(0)));
+        vst1_lane_u32((uint32_t *)dst, vreinterpret_u32_u8(out), 0);
+#else
+        uint32_t sum[4] = { SCALE_ROW_HALF, SCALE_ROW_HALF, SCALE_ROW_HALF, SCALE_ROW_HALF };
+
+        for (t = 0; t < f->taps[d]; t++, src += 4) {
+            sum[0] += src[0] * weight[t];
+            sum[1] += src[1] * weight[t];
+            sum[2] += src[2] * weight[t];
+            sum[3] += src[3] * weight[t];
+        }
+        dst[0] = sum[0] >> (SCALE_BITS + SCALE_ROW_BITS);
+        dst[1] = sum[1] >> (SCALE_BITS + SCALE_ROW_BITS);
+        dst[2] = sum[2] >> (SCALE_BITS + SCALE_ROW_BITS);
+        dst[3] = sum[3] >> (SCALE_BITS + SCALE_ROW_BITS);
+#endif
+    }
+}
+
+/* splits n pixels of the frame buffer into 4 bytes of channels */
+static void ScaleUnpack(uint8_t *dst, const char *src, int n, const rfbPixelFormat *format)
+{
+    int i;
+
+    switch (format->bitsPerPixel) {
+#define UNPACK(type)                                                        \
+    for (i = 0; i < n; i++, dst += 4) {                                     \
+        uint32_t pixel = ((const type *)src)[i];                            \
+        dst[0] = (pixel >> format->redShift) & format->redMax;              \
+        dst[1] = (pixel >> format->greenShift) & format->greenMax;          \
+        dst[2] = (pixel >> format->blueShift) & format->blueMax;            \
+        dst[3] = 0;                                                         \
+    }                                                                       \
+    break;
+    case 8:  UNPACK(uint8_t)
+    case 16: UNPACK(uint16_t)
+    case 32: UNPACK(uint32_t)
+#undef UNPACK
+    }
+}
+
+static void ScalePack(char *dst, const uint8_t *src, int n, const rfbPixelFormat *format)
+{
+    int i;
+
+    switch (format->bitsPerPixel) {
+#define PACK(type)                                                          \
+    for (i = 0; i < n; i++, src += 4)                                       \
+        ((type *)dst)[i] = (type)((src[0] << format->redShift) |            \
+                                  (src[1] << format->greenShift) |          \
+                                  (src[2] << format->blueShift));           \
+    break;
+    case 8:  PACK(uint8_t)
+    case 16: PACK(uint16_t)
+    case 32: PACK(uint32_t)
+#undef PACK
+    }
+}
+
+/* colour maps cannot be blended: take the pixel at the top left */
+static void ScaleNearest(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, int dx1, int dy1, int dx2, int dy2)
+{
+    int bytesPerPixel = screen->bitsPerPixel / 8;
+    int x, y;
+
+    for (y = dy1; y < dy2; y++) {
+        const char *src = screen->frameBuffer +
+            (int64_t)y * screen->height / ptr->height * screen->paddedWidthInBytes;
+        char *dst = ptr->frameBuffer + y * ptr->paddedWidthInBytes;
+
+        for (x = dx1; x < dx2; x++)
+            memcpy(dst + x * bytesPerPixel,
+                   src + (int64_t)x * screen->width / ptr->width * bytesPerPixel,
+                   bytesPerPixel);
+    }
+}
+
+/* the scaled pixels whose original pixels meet [s1, s2) */
+static void ScaleRange(int src, int dst, int s1, int s2, int *d1, int *d2)
+{
+    /* one more on each side for the bilinear filter */
+    s1 = s1 > 0 ? s1 - 1 : 0;
+    s2 = s2 < src ? s2 + 1 : src;
+    *d1 = (int)((int64_t)s1 * dst / src);
+    *d2 = (int)(((int64_t)s2 * dst + src - 1) / src);
+    if (*d2 > dst)
+        *d2 = dst;
+}
+
+/*
+ * The filters and line buffers of a scaled screen.  They are kept from one
+ * update to the next and only set up again when the size of the original or
+ * of the scaled screen, and so the scale factor, changes.
+ */
+typedef struct _rfbScaler {
+    int srcWidth, srcHeight, dstWidth, dstHeight;
+    ScaleFilter fx, fy;
+    uint32_t *acc;       /* the original rows summed up */
+    uint16_t *narrow;    /* and cut down to 16 bit lanes */
+    uint8_t *row, *out;  /* unpacked original and scaled pixels */
+} rfbScaler;
+
+void rfbScaledScreenFreeScaler(rfbScreenInfoPtr ptr)
+{
+    rfbScaler *scaler = ptr->scaler;
+
+    if (scaler == NULL)
+        return;
+    ScaleFilterFree(&scaler->fx);
+    ScaleFilterFree(&scaler->fy);
+    free(scaler->acc);
+    free(scaler->narrow);
+    free(scaler->row);
+    free(scaler->out);
+    free(scaler);
+    ptr->scaler = NULL;
+}
+
+/* the scaler from screen to ptr, set up if the sizes changed */
+static rfbScaler *ScalerGet(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr)
+{
+    rfbScaler *scaler = ptr->scaler;
+
+    if (scaler != NULL &&
+        scaler->srcWidth == screen->width && scaler->srcHeight == screen->height &&
+        scaler->dstWidth == ptr->width && scaler->dstHeight == ptr->height)
+        return scaler;
+
+    rfbScaledScreenFreeScaler(ptr);
+    scaler = (rfbScaler *)calloc(1, sizeof(rfbScaler));
+    if (scaler == NULL)
+        return NULL;
+    ptr->scaler = scaler;
+    scaler->srcWidth = screen->width;
+    scaler->srcHeight = screen->height;
+    scaler->dstWidth = ptr->width;
+    scaler->dstHeight = ptr->height;
+
+    if (!ScaleFilterInit(&scaler->fx, screen->width, ptr->width) ||
+        !ScaleFilterInit(&scaler->fy, screen->height, ptr->height)) {
+        rfbScaledScreenFreeScaler(ptr);
+        return NULL;
+    }
+    /* a rectangle never needs more than all the original columns */
+    scaler->acc = (uint32_t *)malloc(screen->width * 4 * sizeof(uint32_t));
+    scaler->narrow = (uint16_t *)malloc(screen->width * 4 * sizeof(uint16_t));
+    scaler->row = (uint8_t *)malloc(screen->width * 4);
+    scaler->out = (uint8_t *)malloc(ptr->width * 4);
+    if (scaler->acc == NULL || scaler->narrow == NULL ||
+        scaler->row == NULL || scaler->out == NULL) {
+        rfbScaledScreenFreeScaler(ptr);
+        return NULL;
+    }
+    return scaler;
+}
+
+/* called with ptr->scaledDamageMutex held, as it uses ptr->scaler */
 void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, int x0, int y0, int w0, int h0)
 {
-    int x,y,w,v,z;
-    int x1, y1, w1, h1;
-    int bitsPerPixel, bytesPerPixel, bytesPerLine, areaX, areaY, area2;
-    unsigned char *srcptr, *dstptr;
+    const rfbPixelFormat *format = &screen->serverFormat;
+    int bytesPerPixel = screen->bitsPerPixel / 8;
+    int dx1, dy1, dx2, dy2, sx1, sx2, span, d, y, t;
+    rfbBool raw;
+    rfbScaler *scaler;
+    const ScaleFilter *fx, *fy;
 
     /* Nothing to do!!! */
     if (screen==ptr) return;
 
-    x1 = x0;
-    y1 = y0;
-    w1 = w0;
-    h1 = h0;
-
-    rfbScaledCorrection(screen, ptr, &x1, &y1, &w1, &h1, "rfbScaledScreenUpdateRect");
-    x0 = ScaleX(ptr, screen, x1);
-    y0 = ScaleY(ptr, screen, y1);
-    w0 = ScaleX(ptr, screen, w1);
-    h0 = ScaleY(ptr, screen, h1);
-
-    bitsPerPixel = screen->bitsPerPixel;
-    bytesPerPixel = bitsPerPixel / 8;
-    bytesPerLine = w1 * bytesPerPixel;
-    srcptr = (unsigned char *)(screen->frameBuffer +
-     (y0 * screen->paddedWidthInBytes + x0 * bytesPerPixel));
-    dstptr = (unsigned char *)(ptr->frameBuffer +
-     ( y1 * ptr->paddedWidthInBytes + x1 * bytesPerPixel));
-    /* The area of the source framebuffer for each destination pixel */
-    areaX = ScaleX(ptr,screen,1);
-    areaY = ScaleY(ptr,screen,1);
-    area2 = areaX*areaY;
-
-
-    /* Ensure that we do not go out of bounds */
-    if ((x1+w1) > (ptr->width))
-    {
-      if (x1==0) w1=ptr->width; else x1 = ptr->width - w1;
-    }
-    if ((y1+h1) > (ptr->height))
-    {
-      if (y1==0) h1=ptr->height; else y1 = ptr->height - h1;
+    if (x0 < 0) { w0 += x0; x0 = 0; }
+    if (y0 < 0) { h0 += y0; y0 = 0; }
+    if (x0 + w0 > screen->width) w0 = screen->width - x0;
+    if (y0 + h0 > screen->height) h0 = screen->height - y0;
+    if (w0 <= 0 || h0 <= 0)
+        return;
+
+    ScaleRange(screen->width, ptr->width, x0, x0 + w0, &dx1, &dx2);
+    ScaleRange(screen->height, ptr->height, y0, y0 + h0, &dy1, &dy2);
+    if (dx1 >= dx2 || dy1 >= dy2)
+        return;
+
+    if (!format->trueColour || format->redMax > 255 || format->greenMax > 255 ||
+        format->blueMax > 255 || (bytesPerPixel != 1 && bytesPerPixel != 2 && bytesPerPixel != 4)) {
+        ScaleNearest(screen, ptr, dx1, dy1, dx2, dy2);
+        return;
     }
+    /* 32 bit with byte aligned channels need no unpacking */
+    raw = bytesPerPixel == 4 &&
+        format->redMax == 255 && format->greenMax == 255 && format->blueMax == 255 &&
+        format->redShift % 8 == 0 && format->greenShift % 8 == 0 && format->blueShift % 8 == 0;
+
+    scaler = ScalerGet(screen, ptr);
+    if (scaler == NULL)
+        return;
+    fx = &scaler->fx;
+    fy = &scaler->fy;
+
+    /* the original columns needed */
+    sx1 = fx->first[dx1];
+    sx2 = fx->first[dx2 - 1] + fx->taps[dx2 - 1];
+    span = sx2 - sx1;
+
     /*
-     * rfbLog("rfbScaledScreenUpdateRect(%dXx%dY-%dWx%dH  ->  %dXx%dY-%dWx%dH <%dx%d>) {%dWx%dH -> %dWx%dH} 0x%p\n",
-     *    x0, y0, w0, h0, x1, y1, w1, h1, areaX, areaY,
-     *    screen->width, screen->height, ptr->width, ptr->height, ptr->frameBuffer);
+     * rfbLog("rfbScaledScreenUpdateRect(%dXx%dY-%dWx%dH  ->  %dXx%dY-%dWx%dH) {%dWx%dH -> %dWx%dH}\n",
+     *    x0, y0, w0, h0, dx1, dy1, dx2-dx1, dy2-dy1,
+     *    screen->width, screen->height, ptr->width, ptr->height);
      */
 
-    if (screen->serverFormat.trueColour) { /* Blend neighbouring pixels together */
-      unsigned char *srcptr2;
-      unsigned long pixel_value, red, green, blue;
-      unsigned int redShift = screen->serverFormat.redShift;
-      unsigned int greenShift = screen->serverFormat.greenShift;
-      unsigned int blueShift = screen->serverFormat.blueShift;
-      unsigned long redMax = screen->serverFormat.redMax;
-      unsigned long greenMax = screen->serverFormat.greenMax;
-      unsigned long blueMax = screen->serverFormat.blueMax;
-
-     /* for each *destination* pixel... */
-     for (y = 0; y < h1; y++) {
-       for (x = 0; x < w1; x++) {
-         red = green = blue = 0;
-         /* Get the totals for rgb from the source grid... */
-         for (w = 0; w < areaX; w++) {
-           for (v = 0; v < areaY; v++) {
-             srcptr2 = &srcptr[(((x * areaX) + w) * bytesPerPixel) +
-                               (v * screen->paddedWidthInBytes)];
-             pixel_value = 0;
-
-
-             switch (bytesPerPixel) {
-             case 4: pixel_value = *((unsigned int *)srcptr2);   break;
-             case 2: pixel_value = *((unsigned short *)srcptr2); break;
-             case 1: pixel_value = *((unsigned char *)srcptr2);  break;
-             default:
-               /* fixme: endianess problem? */
-               for (z = 0; z < bytesPerPixel; z++)
-                 pixel_value += (srcptr2[z] << (8 * z));
-                break;
-              }
-              /*
-              srcptr2 += bytesPerPixel;
-              */
-
-            red += ((pixel_value >> redShift) & redMax);
-            green += ((pixel_value >> greenShift) & greenMax);
-            blue += ((pixel_value >> blueShift) & blueMax);
-
-           }
-         }
-         /* We now have a total for all of the colors, find the average! */
-         red /= area2;
-         green /= area2;
-         blue /= area2;
-          /* Stuff the new value back into memory */
-         pixel_value = ((red & redMax) << redShift) | ((green & greenMax) << greenShift) | ((blue & blueMax) << blueShift);
-
-         switch (bytesPerPixel) {
-         case 4: *((unsigned int *)dstptr)   = (unsigned int)   pixel_value; break;
-         case 2: *((unsigned short *)dstptr) = (unsigned short) pixel_value; break;
-         case 1: *((unsigned char *)dstptr)  = (unsigned char)  pixel_value; break;
-         default:
-           /* fixme: endianess problem? */
-           for (z = 0; z < bytesPerPixel; z++)
-             dstptr[z]=(pixel_value >> (8 * z)) & 0xff;
-            break;
-          }
-          dstptr += bytesPerPixel;
-       }
-       srcptr += (screen->paddedWidthInBytes * areaY);
-       dstptr += (ptr->paddedWidthInBytes - bytesPerLine);
-     }
-   } else
-   { /* Not truecolour, so we can't blend. Just use the top-left pixel instead */
-     for (y = y1; y < (y1+h1); y++) {
-       for (x = x1; x < (x1+w1); x++)
-         memcpy (&ptr->frameBuffer[(y *ptr->paddedWidthInBytes) + (x * bytesPerPixel)],
-                 &screen->frameBuffer[(y * areaY * screen->paddedWidthInBytes) + (x *areaX * bytesPerPixel)], bytesPerPixel);
-     }
-  }
+    for (d = dy1; d < dy2; d++) {
+        const uint16_t *weight = &fy->weights[d * fy->stride];
+        char *dst = ptr->frameBuffer + d * ptr->paddedWidthInBytes + dx1 * bytesPerPixel;
+
+        for (t = 0; t < fy->taps[d]; t++) {
+            const char *src;
+
+            y = fy->first[d] + t;
+            src = screen->frameBuffer + y * screen->paddedWidthInBytes + sx1 * bytesPerPixel;
+            if (!raw) {
+                ScaleUnpack(scaler->row, src, span, format);
+                src = (const char *)scaler->row;
+            }
+            ScaleAccumulate(scaler->acc, (const uint8_t *)src, span * 4, weight[t], t == 0);
+        }
+        ScaleNarrow(scaler->narrow, scaler->acc, span * 4);
+
+        if (raw) {
+            ScaleRow((uint8_t *)dst, scaler->narrow, fx, dx1, dx2, sx1);
+        } else {
+            ScaleRow(scaler->out, scaler->narrow, fx, dx1, dx2, sx1);
+            ScalePack(dst, scaler->out, dx2 - dx1, format);
+        }
+    }
 }
 
 void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2)
 {
-    /* ok, now the task is to update each and every scaled version of the framebuffer
-     * and we only have to do this for this specific changed rectangle!
+    /* The scaled versions of the framebuffer are only brought up to date
+     * when a client of theirs is sent an update, see rfbScaledScreenPrepare(),
+     * so here we only remember what changed.
      */
     rfbScreenInfoPtr ptr;
-    int count=0;
+    sraRegionPtr region = NULL;
 
     /* We don't point to cl->screen as it is the original */
     for (ptr=screen->scaledScreenNext;ptr!=NULL;ptr=ptr->scaledScreenNext)
     {
-        /* Only update if it has active clients... */
+        /* Only if it has active clients, the others are redone when taken */
         if (ptr->scaledScreenRefCount>0)
         {
-          rfbScaledScreenUpdateRect(screen, ptr, x1, y1, x2-x1, y2-y1);
-          count++;
+          if (region==NULL)
+            region = sraRgnCreateRect(x1, y1, x2, y2);
+          LOCK(ptr->scaledDamageMutex);
+          sraRgnOr(ptr->scaledDamage, region);
+          UNLOCK(ptr->scaledDamageMutex);
         }
     }
+    if (region)
+        sraRgnDestroy(region);
+}
+
+/*
+ * rfbScaledScreenPrepare scales the parts of region (in the coordinates of
+ * the original framebuffer) that changed since they were last scaled into
+ * the client's scaled screen, before they are encoded from it.
+ */
+void rfbScaledScreenPrepare(rfbClientPtr cl, sraRegionPtr region)
+{
+    rfbScreenInfoPtr ptr = cl->scaledScreen;
+    sraRectangleIterator* i;
+    sraRegionPtr todo;
+    sraRect rect;
+
+    if (ptr==cl->screen)
+        return;
+
+    LOCK(ptr->scaledDamageMutex);
+    todo = sraRgnCreateRgn(ptr->scaledDamage);
+    if (sraRgnAnd(todo, region)) {
+        for(i = sraRgnGetIterator(todo); sraRgnIteratorNext(i,&rect);)
+            rfbScaledScreenUpdateRect(cl->screen, ptr, rect.x1, rect.y1,
+                                      rect.x2 - rect.x1, rect.y2 - rect.y1);
+        sraRgnReleaseIterator(i);
+        sraRgnSubtract(ptr->scaledDamage, todo);
+    }
+    UNLOCK(ptr->scaledDamageMutex);
+    sraRgnDestroy(todo);
 }
 
 /* Create a new scaled version of the framebuffer */
@@ -320,8 +665,10 @@ rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
         ptr->frameBuffer = malloc(ptr->sizeInBytes);
         if (ptr->frameBuffer!=NULL)
         {
-            /* Reset to a known condition: scale the entire framebuffer */
-            rfbScaledScreenUpdateRect(cl->screen, ptr, 0, 0, cl->screen->width, cl->screen->height);
+            /* Reset to a known condition: the entire framebuffer is to be scaled */
+            ptr->scaledDamage = sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+            INIT_MUTEX(ptr->scaledDamageMutex);
+            ptr->scaler = NULL;
             /* Now, insert into the chain */
             LOCK(cl->updateMutex);
             ptr->scaledScreenNext = cl->screen->scaledScreenNext;
@@ -365,9 +712,15 @@ void rfbScalingSetup(rfbClientPtr cl, int width, int height)
     /* Now, there is a new screen available (if ptr is not NULL) */
     if (ptr!=NULL)
     {
-        /* Update it! */
-        if (ptr->scaledScreenRefCount<1)
-            rfbScaledScreenUpdateRect(cl->screen, ptr, 0, 0, cl->screen->width, cl->screen->height);
+        /* Changes were not tracked while it had no clients, so scale it all */
+        if (ptr!=cl->screen && ptr->scaledScreenRefCount<1) {
+            sraRegionPtr all = sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+
+            LOCK(ptr->scaledDamageMutex);
+            sraRgnOr(ptr->scaledDamage, all);
+            UNLOCK(ptr->scaledDamageMutex);
+            sraRgnDestroy(all);
+        }
         /*
          * rfbLog("Taking one from %dx%d-%d and adding it to %dx%d-%d\n",
          *    cl->scaledScreen->width, cl->scaledScreen->height,
@@ -375,12 +728,15 @@ void rfbScalingSetup(rfbClientPtr cl, int width, int height)
          *    ptr->width, ptr->height, ptr->scaledScreenRefCount);
          */
 
+        /* not while an update is sent, which may swap in the cursor overlay */
+        LOCK(cl->sendMutex);
         LOCK(cl->updateMutex);
         cl->scaledScreen->scaledScreenRefCount--;
         ptr->scaledScreenRefCount++;
         cl->scaledScreen=ptr;
         cl->newFBSizePending = TRUE;
         UNLOCK(cl->updateMutex);
+        UNLOCK(cl->sendMutex);
 
         rfbLog("Scaling to %dx%d (refcount=%d)\n",width,height,ptr->scaledScreenRefCount);
     }
@@ -0,0 +1,350 @@
+/*
+ * shm.c
+ *
+ * Routines to implement the shared memory transport: clients on a UNIX
+ * socket get the pixels through memory shared with the server, and the
+ * updates only say which rectangles changed.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <rfb/rfb.h>
+#include "private.h"
+#include <errno.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#endif
+
+#ifndef WIN32
+
+/* the copy of the frame buffer a client reads from */
+typedef struct {
+  int fd;
+  char* map;
+  size_t size;
+  int width, height, bytesPerLine;
+  rfbPixelFormat format;      /* of the client when it was set up */
+} rfbSharedMemoryData;
+
+rfbBool
+rfbIsUnixSocket(int sock)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+
+  if (getsockname(sock, (struct sockaddr *)&addr, &addrlen) < 0)
+    return FALSE;
+  return addr.ss_family == AF_UNIX;
+}
+
+static int
+CreateSharedMemoryFd(size_t size)
+{
+  int fd;
+
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+  fd = memfd_create("libvncserver", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  char name[] = "/tmp/libvncserver-shm-XXXXXX";
+
+  fd = mkstemp(name);
+  if (fd >= 0)
+    unlink(name);
+#endif
+  if (fd < 0)
+    return -1;
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    return -1;
+  }
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+  /* the client must not be able to truncate it under our mapping, which
+     would have CopyToSharedMemory die of SIGBUS */
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+    close(fd);
+    return -1;
+  }
+#endif
+  return fd;
+}
+
+void
+rfbFreeSharedMemory(rfbClientPtr cl)
+{
+  rfbSharedMemoryData* shm = (rfbSharedMemoryData*)cl->sharedMemory;
+
+  if (shm == NULL)
+    return;
+  munmap(shm->map, shm->size);
+  close(shm->fd);
+  free(shm);
+  cl->sharedMemory = NULL;
+}
+
+/*
+ * rfbSharedMemoryNeedsSetup tells if the next update has to start with an
+ * rfbEncodingSharedMemory rectangle: to hand out the memory, to replace it
+ * after the size or pixel format changed, or to withdraw it.
+ */
+
+rfbBool
+rfbSharedMemoryNeedsSetup(rfbClientPtr cl)
+{
+  rfbSharedMemoryData* shm = (rfbSharedMemoryData*)cl->sharedMemory;
+
+  if (!cl->enableSharedMemory)
+    return shm != NULL;
+  return shm == NULL ||
+    shm->width != cl->scaledScreen->width ||
+    shm->height != cl->scaledScreen->height ||
+    memcmp(&shm->format, &cl->format, sizeof(rfbPixelFormat)) != 0;
+}
+
+/* writes a rectangle of the frame buffer into the memory, in the client's
+   pixel format */
+static void
+CopyToSharedMemory(rfbClientPtr cl, rfbSharedMemoryData* shm, int x, int y, int w, int h)
+{
+  int bpp = cl->format.bitsPerPixel / 8;
+  char* fbptr = cl->scaledScreen->frameBuffer + cl->scaledScreen->paddedWidthInBytes * y
+    + x * (cl->scaledScreen->bitsPerPixel / 8);
+  char* dst = shm->map + (size_t)shm->bytesPerLine * y + x * bpp;
+
+  /* the translate functions write the lines one after the other */
+  if (w == shm->width) {
+    (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
+		       &cl->format, fbptr, dst,
+		       cl->scaledScreen->paddedWidthInBytes, w, h);
+    return;
+  }
+  for (; h > 0; h--) {
+    (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
+		       &cl->format, fbptr, dst,
+		       cl->scaledScreen->paddedWidthInBytes, w, 1);
+    fbptr += cl->scaledScreen->paddedWidthInBytes;
+    dst += shm->bytesPerLine;
+  }
+}
+
+/* like rfbWriteExact, passing fd along with the first byte */
+static rfbBool
+WriteWithFd(rfbClientPtr cl, const char* buf, int len, int fd)
+{
+  const int timeout = (cl->screen && cl->screen->maxClientWait) ? cl->screen->maxClientWait : rfbMaxClientWait;
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  int n, waited = 0;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  iov.iov_base = (void*)buf;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  /* what io_uring has queued goes first */
+  if (!rfbUringFlushClient(cl))
+    return FALSE;
+
+  LOCK(cl->outputMutex);
+  while ((n = sendmsg(cl->sock, &msg, 0)) <= 0) {
+    fd_set fds;
+    struct timeval tv;
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0 || (errno != EWOULDBLOCK && errno != EAGAIN) || waited >= timeout) {
+      UNLOCK(cl->outputMutex);
+      rfbLogPerror("WriteWithFd: sendmsg");
+      return FALSE;
+    }
+    FD_ZERO(&fds);
+    FD_SET(cl->sock, &fds);
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    if (select(cl->sock + 1, NULL, &fds, NULL, &tv) == 0)
+      waited += 1000;
+  }
+  cl->writesSent++;
+  cl->bytesSent += n;
+  UNLOCK(cl->outputMutex);
+
+  return n == len || rfbWriteExact(cl, buf + n, len - n) > 0;
+}
+
+/*
+ * rfbSendSharedMemory sends the rfbEncodingSharedMemory rectangle, setting
+ * up new memory filled with the whole frame buffer first, unless the client
+ * no longer wants any.
+ */
+
+rfbBool
+rfbSendSharedMemory(rfbClientPtr cl)
+{
+  rfbSharedMemoryData* shm;
+  char buf[sz_rfbFramebufferUpdateRectHeader + sz_rfbSharedMemoryMsg];
+  rfbFramebufferUpdateRectHeader rect;
+  rfbSharedMemoryMsg sm;
+  int width = cl->scaledScreen->width, height = cl->scaledScreen->height;
+
+  rfbFreeSharedMemory(cl);
+
+  /* the rectangle must start a message of its own for the file
+     descriptor to arrive with it */
+  if (cl->ublen > 0 && !rfbSendUpdateBuf(cl))
+    return FALSE;
+
+  if (!cl->enableSharedMemory) {
+    rect.r.x = rect.r.y = rect.r.w = rect.r.h = 0;
+    rect.encoding = Swap32IfLE(rfbEncodingSharedMemory);
+    sm.bytesPerLine = 0;
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
+    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&sm, sz_rfbSharedMemoryMsg);
+    cl->ublen += sz_rfbSharedMemoryMsg;
+    return TRUE;
+  }
+
+  shm = (rfbSharedMemoryData*)calloc(1, sizeof(rfbSharedMemoryData));
+  if (shm == NULL)
+    return FALSE;
+  shm->width = width;
+  shm->height = height;
+  shm->bytesPerLine = width * (cl->format.bitsPerPixel / 8);
+  shm->size = (size_t)shm->bytesPerLine * height;
+  shm->format = cl->format;
+  shm->fd = CreateSharedMemoryFd(shm->size ? shm->size : 1);
+  if (shm->fd < 0) {
+    rfbLogPerror("rfbSendSharedMemory: cannot create shared memory");
+    free(shm);
+    return FALSE;
+  }
+  shm->map = mmap(NULL, shm->size ? shm->size : 1, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+  if (shm->map == MAP_FAILED) {
+    rfbLogPerror("rfbSendSharedMemory: mmap");
+    close(shm->fd);
+    free(shm);
+    return FALSE;
+  }
+  cl->sharedMemory = shm;
+
+  CopyToSharedMemory(cl, shm, 0, 0, width, height);
+
+  rect.r.x = 0;
+  rect.r.y = 0;
+  rect.r.w = Swap16IfLE(width);
+  rect.r.h = Swap16IfLE(height);
+  rect.encoding = Swap32IfLE(rfbEncodingSharedMemory);
+  sm.bytesPerLine = Swap32IfLE(shm->bytesPerLine);
+  memcpy(buf, (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
+  memcpy(buf + sz_rfbFramebufferUpdateRectHeader, (char *)&sm, sz_rfbSharedMemoryMsg);
+
+  rfbStatRecordEncodingSent(cl, rfbEncodingSharedMemory, sizeof(buf), shm->size);
+
+  return WriteWithFd(cl, buf, sizeof(buf), shm->fd);
+}
+
+/*
+ * rfbSendRectEncodingSharedMemory puts a rectangle into the shared memory
+ * and tells the client about it.
+ */
+
+rfbBool
+rfbSendRectEncodingSharedMemory(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  rfbSharedMemoryData* shm = (rfbSharedMemoryData*)cl->sharedMemory;
+  rfbFramebufferUpdateRectHeader rect;
+
+  if (shm == NULL)
+    return FALSE;
+
+  CopyToSharedMemory(cl, shm, x, y, w, h);
+
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+    if (!rfbSendUpdateBuf(cl))
+      return FALSE;
+  }
+
+  rect.r.x = Swap16IfLE(x);
+  rect.r.y = Swap16IfLE(y);
+  rect.r.w = Swap16IfLE(w);
+  rect.r.h = Swap16IfLE(h);
+  rect.encoding = Swap32IfLE(rfbEncodingSharedMemoryRect);
+
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+  rfbStatRecordEncodingSent(cl, rfbEncodingSharedMemoryRect,
+			    sz_rfbFramebufferUpdateRectHeader,
+			    sz_rfbFramebufferUpdateRectHeader + w * h * (cl->format.bitsPerPixel / 8));
+  return TRUE;
+}
+
+#else
+
+rfbBool
+rfbIsUnixSocket(int sock)
+{
+  return FALSE;
+}
+
+void
+rfbFreeSharedMemory(rfbClientPtr cl)
+{
+}
+
+rfbBool
+rfbSharedMemoryNeedsSetup(rfbClientPtr cl)
+{
+  return FALSE;
+}
+
+rfbBool
+rfbSendSharedMemory(rfbClientPtr cl)
+{
+  return FALSE;
+}
+
+rfbBool
+rfbSendRectEncodingSharedMemory(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  return FALSE;
+}
+
+#endif
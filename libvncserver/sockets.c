@@ -52,6 +52,7 @@
 #endif
 
 #include <rfb/rfb.h>
+#include "private.h"
 
 #ifdef LIBVNCSERVER_HAVE_SYS_TYPES_H
 #include <sys/types.h>
@@ -62,6 +63,9 @@
 #endif
 #ifdef LIBVNCSERVER_HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
+#ifndef WIN32
+#include <sys/un.h>
+#endif
 #endif
 #ifdef LIBVNCSERVER_HAVE_NETINET_IN_H
 #include <netinet/in.h>
@@ -143,6 +147,9 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 
     rfbScreen->socketState = RFB_SOCKET_READY;
 
+    if (rfbScreen->useIOUring && !rfbUringInit(rfbScreen))
+	rfbLog("Not using io_uring for client sockets\n");
+
     if (rfbScreen->inetdSock != -1) {
 	const int one = 1;
 
@@ -243,6 +250,15 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 	FD_SET(rfbScreen->udpSock, &(rfbScreen->allFds));
 	rfbScreen->maxFd = max((int)rfbScreen->udpSock,rfbScreen->maxFd);
     }
+
+    if (rfbScreen->unixSockPath) {
+	if ((rfbScreen->listenUnixSock = rfbListenOnUnixSocket(rfbScreen->unixSockPath)) < 0)
+	    return;
+	rfbLog("Listening for VNC connections on UNIX socket %s\n", rfbScreen->unixSockPath);
+
+	FD_SET(rfbScreen->listenUnixSock, &(rfbScreen->allFds));
+	rfbScreen->maxFd = max((int)rfbScreen->listenUnixSock,rfbScreen->maxFd);
+    }
 }
 
 void rfbShutdownSockets(rfbScreenInfoPtr rfbScreen)
@@ -275,6 +291,15 @@ void rfbShutdownSockets(rfbScreenInfoPtr rfbScreen)
 	FD_CLR(rfbScreen->udpSock,&rfbScreen->allFds);
 	rfbScreen->udpSock=-1;
     }
+
+    if(rfbScreen->listenUnixSock>-1) {
+	closesocket(rfbScreen->listenUnixSock);
+	FD_CLR(rfbScreen->listenUnixSock,&rfbScreen->allFds);
+	rfbScreen->listenUnixSock=-1;
+	unlink(rfbScreen->unixSockPath);
+    }
+
+    rfbUringShutdown(rfbScreen);
 }
 
 /*
@@ -359,6 +384,25 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 		return result;
 	}
 
+	if (rfbScreen->listenUnixSock != -1 && FD_ISSET(rfbScreen->listenUnixSock, &fds)) {
+	    int sock = accept(rfbScreen->listenUnixSock, NULL, NULL);
+
+	    if (sock < 0) {
+		rfbLogPerror("rfbCheckFds: accept");
+		return -1;
+	    }
+	    if (!rfbSetNonBlocking(sock)) {
+		closesocket(sock);
+		return -1;
+	    }
+	    rfbLog("Got connection on UNIX socket %s\n", rfbScreen->unixSockPath);
+	    rfbNewClient(rfbScreen,sock);
+
+	    FD_CLR(rfbScreen->listenUnixSock, &fds);
+	    if (--nfds == 0)
+		return result;
+	}
+
 	if ((rfbScreen->udpSock != -1) && FD_ISSET(rfbScreen->udpSock, &fds)) {
 	    if(!rfbScreen->udpClient)
 		rfbNewUDPClient(rfbScreen);
@@ -518,7 +562,7 @@ rfbCloseClient(rfbClientPtr cl)
 {
     rfbExtensionData* extension;
 
-    rfbLog("rfbCloseClient() cl: %p", cl);
+    rfbDebug("rfbCloseClient() cl: %p\n", cl);
     for(extension=cl->extensions; extension; extension=extension->next)
 	if(extension->extension->close)
 	    extension->extension->close(cl, extension->data);
@@ -644,6 +688,20 @@ rfbReadExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
 		    continue;
 	    }
 #endif
+            /* the ring waits and reads with one system call */
+            n = rfbUringRecv(cl, buf, len, timeout);
+            if (n > 0) {
+                buf += n;
+                len -= n;
+                continue;
+            } else if (n == 0) {
+                return 0;
+            } else if (n == -1) {
+                if (errno == ETIMEDOUT)
+                    rfbErr("ReadExact: timeout\n");
+                return n;
+            }
+
             FD_ZERO(&fds);
             FD_SET(sock, &fds);
             tv.tv_sec = timeout / 1000;
@@ -794,6 +852,13 @@ rfbWriteExact(rfbClientPtr cl,
 #endif
 
     LOCK(cl->outputMutex);
+    /* during a batch, the output of all clients is sent at once */
+    if ((n = rfbUringWrite(cl, buf, len)) != 0) {
+        if (n > 0)
+            cl->bytesSent += len;
+        UNLOCK(cl->outputMutex);
+        return n;
+    }
     while (len > 0) {
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
         if (cl->sslctx)
@@ -806,6 +871,8 @@ rfbWriteExact(rfbClientPtr cl,
 
             buf += n;
             len -= n;
+            cl->writesSent++;
+            cl->bytesSent += n;
 
         } else if (n == 0) {
 
@@ -824,6 +891,20 @@ rfbWriteExact(rfbClientPtr cl,
                 return n;
             }
 
+            /* the ring waits for the whole timeout at once */
+            n = rfbUringWaitWritable(cl, timeout);
+            if (n == 0) {
+                errno = ETIMEDOUT;
+                UNLOCK(cl->outputMutex);
+                return -1;
+            } else if (n != -2) {
+                if (n < 0) {
+                    UNLOCK(cl->outputMutex);
+                    return n;
+                }
+                continue;
+            }
+
             /* Retry every 5 seconds until we exceed timeout.  We
                need to do this because select doesn't necessarily return
                immediately when the other end has gone away */
@@ -870,9 +951,23 @@ int rfbWriteExactV(rfbClientPtr cl, struct iovec *iov, int cnt) {
                           : rfbMaxClientWait;
 
   LOCK(cl->outputMutex);
+  /* during a batch, the output of all clients is sent at once */
+  if (cnt > 0 && (n = rfbUringWrite(cl, iov[0].iov_base, iov[0].iov_len)) != 0) {
+    int i;
+
+    if (n > 0)
+      cl->bytesSent += iov[0].iov_len;
+    for (i = 1; n > 0 && i < cnt; i++)
+      if ((n = rfbUringWrite(cl, iov[i].iov_base, iov[i].iov_len)) > 0)
+        cl->bytesSent += iov[i].iov_len;
+    UNLOCK(cl->outputMutex);
+    return n;
+  }
   for (;;) {
     n = writev(s, iov, cnt);
     if (n > 0) {
+      cl->writesSent++;
+      cl->bytesSent += n;
       while ((cnt > 0) && (n >= (ssize_t)(iov->iov_len))) {
         n -= iov->iov_len;
         ++iov;
@@ -891,6 +986,20 @@ int rfbWriteExactV(rfbClientPtr cl, struct iovec *iov, int cnt) {
       if (errno == EAGAIN) {
         fd_set fds;
         struct timeval tv;
+        int waited;
+
+        /* the ring waits for the whole timeout at once */
+        waited = rfbUringWaitWritable(cl, timeout);
+        if (waited == 0) {
+          errno = ETIMEDOUT;
+          goto exit;
+        } else if (waited == 1) {
+          continue;
+        } else if (waited == -1) {
+          rfbLogPerror("WriteExactV: io_uring");
+          goto exit;
+        }
+
         /* Retry every 5 seconds until we exceed timeout.
          * We need to do this because select doesn't necessarily return
          * immediately when the other end has gone away */
@@ -1076,6 +1185,49 @@ rfbListenOnTCP6Port(int port,
 }
 
 
+/*
+ * rfbListenOnUnixSocket listens for local clients on the UNIX socket named
+ * path, replacing a stale one.
+ */
+
+int
+rfbListenOnUnixSocket(const char* path)
+{
+#ifdef WIN32
+    rfbErr("rfbListenOnUnixSocket: UNIX sockets are not supported\n");
+    return -1;
+#else
+    struct sockaddr_un addr;
+    int sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	rfbErr("rfbListenOnUnixSocket: path too long: %s\n", path);
+	return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+	rfbLogPerror("rfbListenOnUnixSocket: socket");
+	return -1;
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	rfbLogPerror("rfbListenOnUnixSocket: bind");
+	closesocket(sock);
+	return -1;
+    }
+    if (listen(sock, 32) < 0) {
+	rfbLogPerror("rfbListenOnUnixSocket: listen");
+	closesocket(sock);
+	return -1;
+    }
+    return sock;
+#endif
+}
+
+
 int
 rfbConnectToTcpAddr(char *host,
                     int port)
@@ -1194,6 +1346,53 @@ rfbSetNonBlocking(int sock)
   return TRUE;
 }
 
+/*
+ * rfbCorkClient holds back partial TCP segments while an update is written
+ * piece by piece, and rfbUncorkClient sends out what is left.  With
+ * TCP_NODELAY, every write would be a packet of its own otherwise.  The
+ * WebSockets and TLS layers write to the same socket, so they are corked
+ * as well.
+ */
+
+#if defined(TCP_CORK)
+#define RFB_TCP_CORK TCP_CORK
+#elif defined(TCP_NOPUSH) && !defined(__APPLE__)
+#define RFB_TCP_CORK TCP_NOPUSH
+#endif
+
+void
+rfbCorkClient(rfbClientPtr cl)
+{
+#ifdef RFB_TCP_CORK
+  int one = 1;
+
+  if (!cl->screen->corkUpdates || !cl->canCork || cl->corked || cl->sock < 0)
+    return;
+  /* queued output is written after the update anyway */
+  if (rfbUringBatching(cl))
+    return;
+  if (setsockopt(cl->sock, IPPROTO_TCP, RFB_TCP_CORK, (char *)&one, sizeof(one)) < 0) {
+    cl->canCork = FALSE;
+    return;
+  }
+  cl->corked = TRUE;
+#endif
+}
+
+void
+rfbUncorkClient(rfbClientPtr cl)
+{
+#ifdef RFB_TCP_CORK
+  int zero = 0;
+
+  if (!cl->corked)
+    return;
+  cl->corked = FALSE;
+  if (cl->sock >= 0)
+    setsockopt(cl->sock, IPPROTO_TCP, RFB_TCP_CORK, (char *)&zero, sizeof(zero));
+#endif
+}
+
 rfbBool rfbCheckMLExtEncoding525(int sock)
 {
 #if defined(__ANDROID__)
@@ -25,6 +25,14 @@
  */
 
 #include <rfb/rfb.h>
+#include "private.h"
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <stddef.h>
+#endif
 
 #ifdef _MSC_VER
 #define snprintf _snprintf /* Missing in MSVC */
@@ -119,6 +127,7 @@ char *encodingName(uint32_t type, char *buf, int len) {
     case rfbEncodingCacheZip:           snprintf(buf, len, "cacheZip");    break;
     case rfbEncodingSolMonoZip:         snprintf(buf, len, "monoZip");     break;
     case rfbEncodingUltraZip:           snprintf(buf, len, "ultraZip");    break;
+    case rfbEncodingLZ4:                snprintf(buf, len, "LZ4");         break;
 
     case rfbEncodingXCursor:            snprintf(buf, len, "Xcursor");     break;
     case rfbEncodingRichCursor:         snprintf(buf, len, "RichCursor");  break;
@@ -130,6 +139,7 @@ char *encodingName(uint32_t type, char *buf, int len) {
     case rfbEncodingSupportedMessages:  snprintf(buf, len, "SupportedMessage");  break;
     case rfbEncodingSupportedEncodings: snprintf(buf, len, "SupportedEncoding"); break;
     case rfbEncodingServerIdentity:     snprintf(buf, len, "ServerIdentify");    break;
+    case rfbEncodingZRLEStripes:        snprintf(buf, len, "ZRLEStripes"); break;
 
     /* The following lookups do not report in stats */
     case rfbEncodingCompressLevel0: snprintf(buf, len, "CompressLevel0");  break;
@@ -168,8 +178,11 @@ char *encodingName(uint32_t type, char *buf, int len) {
 
 rfbStatList *rfbStatLookupEncoding(rfbClientPtr cl, uint32_t type)
 {
-    rfbStatList *ptr;
+    rfbStatList *ptr, **slot;
     if (cl==NULL) return NULL;
+    /* the common types are found without searching */
+    slot = rfbMetricsStatSlot(cl, type, FALSE);
+    if (slot!=NULL && *slot!=NULL) return *slot;
     for (ptr = cl->statEncList; ptr!=NULL; ptr=ptr->Next)
     {
         if (ptr->type==type) return ptr;
@@ -183,6 +196,7 @@ rfbStatList *rfbStatLookupEncoding(rfbClientPtr cl, uint32_t type)
         /* add to the top of the list */
         ptr->Next = cl->statEncList;
         cl->statEncList = ptr;
+        if (slot!=NULL) *slot = ptr;
     }
     return ptr;
 }
@@ -190,8 +204,11 @@ rfbStatList *rfbStatLookupEncoding(rfbClientPtr cl, uint32_t type)
 
 rfbStatList *rfbStatLookupMessage(rfbClientPtr cl, uint32_t type)
 {
-    rfbStatList *ptr;
+    rfbStatList *ptr, **slot;
     if (cl==NULL) return NULL;
+    /* the common types are found without searching */
+    slot = rfbMetricsStatSlot(cl, type, TRUE);
+    if (slot!=NULL && *slot!=NULL) return *slot;
     for (ptr = cl->statMsgList; ptr!=NULL; ptr=ptr->Next)
     {
         if (ptr->type==type) return ptr;
@@ -205,6 +222,7 @@ rfbStatList *rfbStatLookupMessage(rfbClientPtr cl, uint32_t type)
         /* add to the top of the list */
         ptr->Next = cl->statMsgList;
         cl->statMsgList = ptr;
+        if (slot!=NULL) *slot = ptr;
     }
     return ptr;
 }
@@ -354,6 +372,30 @@ int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type)
   return 0;
 }
 
+int rfbStatGetWritesSent(rfbClientPtr cl)
+{
+    if (cl==NULL) return 0;
+    return cl->writesSent;
+}
+
+/* the segments the kernel sent, to see how well the writes were merged */
+int rfbStatGetSegmentsSent(rfbClientPtr cl)
+{
+#ifdef __linux__
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (cl==NULL || cl->sock<0 || !cl->canCork) return -1;
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(cl->sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 ||
+        len < offsetof(struct tcp_info, tcpi_segs_out) + sizeof(info.tcpi_segs_out))
+        return -1;
+    return (int)info.tcpi_segs_out;
+#else
+    return -1;
+#endif
+}
+
 
 
 
@@ -373,6 +415,8 @@ void rfbResetStats(rfbClientPtr cl)
         cl->statMsgList = ptr->Next;
         free(ptr);
     }
+    rfbMetricsResetStatSlots(cl);
+    cl->writesSent = 0;
 }
 
 
@@ -433,6 +477,11 @@ void rfbPrintStats(rfbClientPtr cl)
         savings = 100.0 - ((totalBytes/totalBytesIfRaw)*100.0);
     rfbLog(" %-20.20s: %6d | %9.0f/%9.0f (%5.1f%%)\n",
             "TOTALS", totalRects, totalBytes,totalBytesIfRaw, savings);
+    count = rfbStatGetSegmentsSent(cl);
+    if (count>=0)
+        rfbLog(" %-20.20s: %6d | %9d TCP segments\n", "WRITES", cl->writesSent, count);
+    else
+        rfbLog(" %-20.20s: %6d\n", "WRITES", cl->writesSent);
 
     totalRects=0.0;
     totalBytes=0.0;
@@ -1050,8 +1050,8 @@ CompressData(rfbClientPtr cl,
         pz->zfree = Z_NULL;
         pz->opaque = Z_NULL;
 
-        err = deflateInit2 (pz, zlibLevel, Z_DEFLATED, MAX_WBITS,
-                            MAX_MEM_LEVEL, zlibStrategy);
+        err = cl->deflateBackend->init (pz, zlibLevel, MAX_WBITS,
+                                        MAX_MEM_LEVEL, zlibStrategy);
         if (err != Z_OK)
             return FALSE;
 
@@ -1067,14 +1067,14 @@ CompressData(rfbClientPtr cl,
 
     /* Change compression parameters if needed. */
     if (zlibLevel != cl->zsLevel[streamId]) {
-        if (deflateParams (pz, zlibLevel, zlibStrategy) != Z_OK) {
+        if (cl->deflateBackend->params (pz, zlibLevel, zlibStrategy) != Z_OK) {
             return FALSE;
         }
         cl->zsLevel[streamId] = zlibLevel;
     }
 
     /* Actual compression. */
-    if (deflate(pz, Z_SYNC_FLUSH) != Z_OK ||
+    if (cl->deflateBackend->deflate(pz, Z_SYNC_FLUSH) != Z_OK ||
         pz->avail_in != 0 || pz->avail_out == 0) {
         return FALSE;
     }
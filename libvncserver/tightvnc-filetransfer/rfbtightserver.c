@@ -515,6 +515,17 @@ rfbHandleSecTypeTight(rfbClientPtr cl) {
 
 }
 
+static int rfbTightExtensionMessageTypes[] = {
+	rfbFileListRequest,
+	rfbFileDownloadRequest,
+	rfbFileUploadRequest,
+	rfbFileUploadData,
+	rfbFileDownloadCancel,
+	rfbFileUploadFailed,
+	rfbFileCreateDirRequest,
+	0
+};
+
 rfbProtocolExtension tightVncFileTransferExtension = {
 	NULL,
 	rfbTightExtensionInit,
@@ -524,7 +535,8 @@ rfbProtocolExtension tightVncFileTransferExtension = {
 	rfbTightExtensionClientClose,
 	rfbTightUsage,
 	rfbTightProcessArg,
-	NULL
+	NULL,
+	rfbTightExtensionMessageTypes
 };
 
 static rfbSecurityHandler tightVncSecurityHandler = {
@@ -0,0 +1,367 @@
+/*
+ * trace.c
+ *
+ * Routines to trace changes to the frame buffer on their way to the
+ * clients: each rfbMarkRegionAsModified() gets a damage id, and the
+ * stages it goes through for a client (deferred, picked up by the output,
+ * encoded, written) are recorded with a time stamp into a ring.  The ring
+ * can be dumped as Chrome trace JSON (chrome://tracing, Perfetto) or as
+ * the raw records.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+#include <rfb/rfbregion.h>
+
+typedef struct {
+  uint64_t seq;                /* position in the ring + 1, 0 while written */
+  uint64_t time;               /* us, rfbMetricsNow() */
+  uint32_t first, last;        /* the damage ids */
+  int32_t client;              /* socket of the client, -1 for marked */
+  uint16_t stage;
+  int16_t x, y, w, h;          /* bounding box, for marked */
+} rfbTraceRecord;
+
+typedef struct {
+  rfbTraceRecord* records;
+  uint64_t mask;
+  uint64_t head;
+} rfbTraceRing;
+
+static rfbTraceRing* traceRing = NULL;
+static uint32_t traceDamage = 0;
+
+static const char* traceStageNames[] = {
+  "marked", "deferred", "picked up", "encoded", "written"
+};
+
+/*
+ * rfbTraceStart starts recording into a ring of the given number of
+ * records (rounded up to a power of two); the oldest are overwritten.
+ */
+
+rfbBool
+rfbTraceStart(int records)
+{
+  rfbTraceRing* ring;
+  uint64_t size = 1;
+
+  if (traceRing)
+    return TRUE;
+  while (size < (uint64_t)(records > 0 ? records : 1))
+    size <<= 1;
+
+  ring = (rfbTraceRing*)calloc(1, sizeof(rfbTraceRing));
+  if (ring == NULL)
+    return FALSE;
+  ring->records = (rfbTraceRecord*)calloc(size, sizeof(rfbTraceRecord));
+  if (ring->records == NULL) {
+    free(ring);
+    return FALSE;
+  }
+  ring->mask = size - 1;
+  __atomic_store_n(&traceRing, ring, __ATOMIC_RELEASE);
+  return TRUE;
+}
+
+/*
+ * rfbTraceStop stops recording and drops the records.  Threads that may
+ * still be recording must be done, so call it after the clients are gone.
+ */
+
+void
+rfbTraceStop(void)
+{
+  rfbTraceRing* ring = __atomic_exchange_n(&traceRing, NULL, __ATOMIC_ACQ_REL);
+
+  if (ring == NULL)
+    return;
+  free(ring->records);
+  free(ring);
+}
+
+static void
+TraceRecord(rfbTraceRing* ring, rfbTraceStage stage, int client,
+	    uint32_t first, uint32_t last, int x, int y, int w, int h)
+{
+  uint64_t pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+  rfbTraceRecord* rec = &ring->records[pos & ring->mask];
+
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  rec->time = rfbMetricsNow();
+  rec->first = first;
+  rec->last = last;
+  rec->client = client;
+  rec->stage = stage;
+  rec->x = x;
+  rec->y = y;
+  rec->w = w;
+  rec->h = h;
+  __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* returns the id of a new damage, 0 if not tracing */
+uint32_t
+rfbTraceMarked(sraRegionPtr region)
+{
+  rfbTraceRing* ring = __atomic_load_n(&traceRing, __ATOMIC_ACQUIRE);
+  uint32_t id;
+  sraRect box;
+  sraRegionPtr bbox;
+
+  if (ring == NULL)
+    return 0;
+  do
+    id = __atomic_add_fetch(&traceDamage, 1, __ATOMIC_RELAXED);
+  while (id == 0);
+
+  bbox = sraRgnBBox(region);
+  if (!sraRgnPopRect(bbox, &box, 0))
+    box.x1 = box.y1 = box.x2 = box.y2 = 0;
+  sraRgnDestroy(bbox);
+  TraceRecord(ring, rfbTraceStageMarked, -1, id, id,
+	      box.x1, box.y1, box.x2 - box.x1, box.y2 - box.y1);
+  return id;
+}
+
+/* adds a damage to those pending for the client; updateMutex held */
+void
+rfbTraceClientDamage(rfbClientPtr cl, uint32_t id)
+{
+  if (id == 0)
+    return;
+  if (cl->traceFirstDamage == 0)
+    cl->traceFirstDamage = id;
+  cl->traceLastDamage = id;
+}
+
+/* records a stage for the damage pending for the client */
+void
+rfbTraceClient(rfbClientPtr cl, rfbTraceStage stage)
+{
+  rfbTraceRing* ring = __atomic_load_n(&traceRing, __ATOMIC_ACQUIRE);
+
+  if (ring == NULL || cl->traceFirstDamage == 0)
+    return;
+  TraceRecord(ring, stage, cl->sock, cl->traceFirstDamage, cl->traceLastDamage,
+	      0, 0, 0, 0);
+}
+
+/* records a stage for the damage an update took */
+void
+rfbTraceUpdate(rfbClientPtr cl, rfbTraceStage stage, uint32_t first, uint32_t last)
+{
+  rfbTraceRing* ring = __atomic_load_n(&traceRing, __ATOMIC_ACQUIRE);
+
+  if (ring == NULL || first == 0)
+    return;
+  TraceRecord(ring, stage, cl->sock, first, last, 0, 0, 0, 0);
+}
+
+/* copies the complete records out of the ring, oldest first */
+static int
+TraceSnapshot(rfbTraceRecord** records)
+{
+  rfbTraceRing* ring = __atomic_load_n(&traceRing, __ATOMIC_ACQUIRE);
+  uint64_t head, pos, start;
+  int n = 0;
+
+  *records = NULL;
+  if (ring == NULL)
+    return 0;
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  start = head > ring->mask + 1 ? head - (ring->mask + 1) : 0;
+  *records = (rfbTraceRecord*)malloc((head - start + 1) * sizeof(rfbTraceRecord));
+  if (*records == NULL)
+    return -1;
+  for (pos = start; pos < head; pos++) {
+    rfbTraceRecord* rec = &ring->records[pos & ring->mask];
+
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != pos + 1)
+      continue;
+    (*records)[n] = *rec;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    /* overwritten while copying */
+    if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != pos + 1)
+      continue;
+    n++;
+  }
+  return n;
+}
+
+/*
+ * rfbTraceDumpJSON writes the records in the Chrome trace event format.
+ * Each damage is an instant on the "marked" track; for each client it
+ * becomes an async span from being marked to being written, with the
+ * stages in between as instants, and the client's thread shows the
+ * encoding of each update.
+ */
+
+/* a damage still in the ring: its id as an offset from the oldest one,
+   which keeps them in order across the wrap of the ids */
+typedef struct {
+  uint32_t key;
+  uint64_t time;
+} rfbTraceMarkedDamage;
+
+static int
+CompareMarked(const void* a, const void* b)
+{
+  uint32_t ka = ((const rfbTraceMarkedDamage*)a)->key;
+  uint32_t kb = ((const rfbTraceMarkedDamage*)b)->key;
+
+  return ka < kb ? -1 : ka > kb;
+}
+
+/* the first of the n damages whose key is at least key */
+static int
+FindMarked(const rfbTraceMarkedDamage* marked, int n, uint32_t key)
+{
+  int lo = 0, hi = n;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (marked[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+rfbBool
+rfbTraceDumpJSON(FILE* f)
+{
+  rfbTraceRecord* records;
+  rfbTraceMarkedDamage* marked = NULL;
+  uint32_t base = 0;
+  int n, nMarked = 0, i, j, m, sep = 0;
+
+  n = TraceSnapshot(&records);
+  if (n < 0)
+    return FALSE;
+
+  /* damage ids are compared as serial numbers, (int32_t)(a - b), as they
+     wrap around; the ring holds far fewer than 2^31 of them */
+  for (i = 0; i < n; i++)
+    if (records[i].stage == rfbTraceStageMarked &&
+	(nMarked++ == 0 || (int32_t)(records[i].first - base) < 0))
+      base = records[i].first;
+  if (nMarked) {
+    marked = (rfbTraceMarkedDamage*)malloc(nMarked * sizeof(rfbTraceMarkedDamage));
+    if (marked == NULL) {
+      free(records);
+      return FALSE;
+    }
+    for (i = 0, m = 0; i < n; i++)
+      if (records[i].stage == rfbTraceStageMarked) {
+	marked[m].key = records[i].first - base;
+	marked[m++].time = records[i].time;
+      }
+    qsort(marked, nMarked, sizeof(rfbTraceMarkedDamage), CompareMarked);
+  }
+
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (i = 0; i < n; i++) {
+    rfbTraceRecord* rec = &records[i];
+    int32_t first, last;
+
+    if (rec->stage == rfbTraceStageMarked) {
+      fprintf(f, "%s{\"name\":\"marked\",\"cat\":\"rfb\",\"ph\":\"i\",\"s\":\"t\","
+	      "\"ts\":%llu,\"pid\":1,\"tid\":0,\"args\":{\"damage\":%u,"
+	      "\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d}}",
+	      sep++ ? ",\n" : "", (unsigned long long)rec->time, rec->first,
+	      rec->x, rec->y, rec->w, rec->h);
+      continue;
+    }
+
+    /* the update, from when it picked up the damage */
+    for (j = i - 1; rec->stage == rfbTraceStageEncoded && j >= 0; j--)
+      if (records[j].stage == rfbTraceStagePickedUp &&
+	  records[j].client == rec->client && records[j].first == rec->first)
+	break;
+    if (rec->stage == rfbTraceStageEncoded && j >= 0)
+      fprintf(f, "%s{\"name\":\"update\",\"cat\":\"rfb\",\"ph\":\"X\","
+	      "\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%d,"
+	      "\"args\":{\"first\":%u,\"last\":%u}}",
+	      sep++ ? ",\n" : "", (unsigned long long)records[j].time,
+	      (unsigned long long)(rec->time - records[j].time), rec->client + 1,
+	      rec->first, rec->last);
+
+    /* only the damage still in the ring */
+    first = (int32_t)(rec->first - base);
+    last = (int32_t)(rec->last - base);
+    if (nMarked == 0 || last < 0)
+      continue;
+    for (m = FindMarked(marked, nMarked, first < 0 ? 0 : (uint32_t)first);
+	 m < nMarked && marked[m].key <= (uint32_t)last; m++) {
+      uint32_t id = base + marked[m].key;
+
+      fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"rfb\",\"ph\":\"n\",\"id\":\"%d.%u\","
+	      "\"ts\":%llu,\"pid\":1,\"tid\":%d}",
+	      sep++ ? ",\n" : "", traceStageNames[rec->stage], rec->client, id,
+	      (unsigned long long)rec->time, rec->client + 1);
+      if (rec->stage == rfbTraceStageWritten)
+	fprintf(f, ",\n{\"name\":\"damage\",\"cat\":\"rfb\",\"ph\":\"b\",\"id\":\"%d.%u\","
+		"\"ts\":%llu,\"pid\":1,\"tid\":%d},\n"
+		"{\"name\":\"damage\",\"cat\":\"rfb\",\"ph\":\"e\",\"id\":\"%d.%u\","
+		"\"ts\":%llu,\"pid\":1,\"tid\":%d}",
+		rec->client, id, (unsigned long long)marked[m].time, rec->client + 1,
+		rec->client, id, (unsigned long long)rec->time, rec->client + 1);
+    }
+  }
+  fprintf(f, "\n]}\n");
+
+  free(marked);
+  free(records);
+  return !ferror(f);
+}
+
+/*
+ * rfbTraceDumpBinary writes the records as they are in memory, after a
+ * header: "RFBTRACE", the version (1) and the size of a record as 32-bit
+ * numbers, and the number of records as a 64-bit one, all in host byte
+ * order.
+ */
+
+rfbBool
+rfbTraceDumpBinary(FILE* f)
+{
+  rfbTraceRecord* records;
+  uint32_t header[2];
+  uint64_t count;
+  int n;
+
+  n = TraceSnapshot(&records);
+  if (n < 0)
+    return FALSE;
+  header[0] = 1;
+  header[1] = sizeof(rfbTraceRecord);
+  count = n;
+  fwrite("RFBTRACE", 1, 8, f);
+  fwrite(header, sizeof(header), 1, f);
+  fwrite(&count, sizeof(count), 1, f);
+  if (n > 0)
+    fwrite(records, sizeof(rfbTraceRecord), n, f);
+  free(records);
+  return !ferror(f);
+}
@@ -0,0 +1,900 @@
+/*
+ * uring.c
+ *
+ * Routines to implement the io_uring socket backend on Linux: the output
+ * of all clients during one pass of rfbProcessEvents() is queued and sent
+ * with one io_uring_enter(), out of buffers registered with the kernel, and
+ * waiting for a socket is done by the kernel with a linked timeout.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+#include <errno.h>
+
+#ifdef LIBVNCSERVER_HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_EXT_ARG
+#define URING_BACKEND
+#endif
+#endif
+
+#ifdef URING_BACKEND
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/* submission queue entries; the completion queue is twice as large */
+#define URING_ENTRIES 256
+
+/* the registered buffers the queued output is copied to */
+#define URING_CHUNK_SIZE UPDATE_BUF_SIZE
+#define URING_CHUNKS 256
+
+typedef struct rfbUringOutput rfbUringOutput;
+
+typedef struct {
+  int fd;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries;
+  struct io_uring_sqe* sqes;
+  unsigned *cqHead, *cqTail, *cqMask, cqEntries;
+  struct io_uring_cqe* cqes;
+  void *sqRing, *cqRing;
+  size_t sqRingSize, cqRingSize;
+  unsigned sqLocalTail;
+  unsigned inFlight;          /* completions not reaped yet */
+
+  char* chunks;
+  int chunkLen[URING_CHUNKS];
+  int freeChunks[URING_CHUNKS];
+  int nFree;
+  rfbBool registered;         /* chunks are registered with the kernel */
+
+  rfbBool batching;           /* within rfbUringBeginBatch/rfbUringFlush */
+  MUTEX(lock);
+} rfbUring;
+
+/* the output of a client waiting to be sent */
+struct rfbUringOutput {
+  rfbClientPtr cl;
+  int chunks[URING_CHUNKS];
+  int nChunks;
+  int done;                   /* bytes of chunks[0] already sent */
+  /* state of the round in flight */
+  int opLen[URING_CHUNKS];
+  int nOps, opsReaped;
+  rfbBool broken;             /* an op was short, the rest was cancelled */
+  rfbBool needPoll;           /* the socket was full */
+  rfbBool polling;
+  int error;
+  long progress;              /* when the client last took data */
+  struct __kernel_timespec timeout;
+};
+
+/* a recv or poll of rfbUringRecv/rfbUringWaitWritable */
+typedef struct {
+  int res;
+  rfbBool done;
+} rfbUringWait;
+
+/*
+ * The user_data of a submission tells what its completion is for: the
+ * low bits hold the kind, the others point to an rfbUringOutput or an
+ * rfbUringWait.  Completions of any kind may turn up whenever the ring is
+ * reaped.
+ */
+#define URING_TIMEOUT_DATA 0    /* a linked timeout or a cancel */
+#define URING_OUTPUT 1
+#define URING_WAIT 2
+#define URING_KIND_MASK 3
+
+#define URING_DATA(p, kind) ((__u64)(uintptr_t)(p) | (kind))
+#define URING_POINTER(data) ((void*)(uintptr_t)((data) & ~(__u64)URING_KIND_MASK))
+
+static int
+UringSetup(unsigned entries, struct io_uring_params* p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+UringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags,
+	   void* arg, size_t argSize)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int
+UringRegister(int fd, unsigned op, void* arg, unsigned n)
+{
+  return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static struct io_uring_sqe*
+UringGetSqe(rfbUring* ring)
+{
+  unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  unsigned index;
+  struct io_uring_sqe* sqe;
+
+  if (ring->sqLocalTail - head >= ring->sqEntries)
+    return NULL;
+  index = ring->sqLocalTail & *ring->sqMask;
+  sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sqArray[index] = index;
+  ring->sqLocalTail++;
+  ring->inFlight++;
+  return sqe;
+}
+
+static unsigned
+UringSqSpace(rfbUring* ring)
+{
+  return ring->sqEntries - (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE));
+}
+
+/* hands the queued entries to the kernel and waits for minComplete
+   completions */
+static int
+UringSubmit(rfbUring* ring, unsigned minComplete)
+{
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+  for (;;) {
+    unsigned toSubmit = ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    unsigned ready = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) - *ring->cqHead;
+
+    if (toSubmit == 0 && ready >= minComplete)
+      return 0;
+    if (UringEnter(ring->fd, toSubmit, minComplete,
+		   minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0 && errno != EINTR)
+      return -1;
+    if (minComplete == 0)
+      return 0;
+  }
+}
+
+static void
+UringSetTimeout(struct __kernel_timespec* ts, int msecs)
+{
+  ts->tv_sec = msecs / 1000;
+  ts->tv_nsec = (msecs % 1000) * 1000000L;
+}
+
+/* hands the queued entries to the kernel and waits for a completion, at
+   most msecs milliseconds */
+static int
+UringSubmitWait(rfbUring* ring, int msecs)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned toSubmit;
+
+  memset(&arg, 0, sizeof(arg));
+  UringSetTimeout(&ts, msecs);
+  arg.ts = (uintptr_t)&ts;
+
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+  toSubmit = ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (UringEnter(ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		 &arg, sizeof(arg)) < 0 && errno != EINTR && errno != ETIME)
+    return -1;
+  return 0;
+}
+
+static long
+NowMsecs(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/* calls handle for each completion there is */
+static void
+UringReap(rfbUring* ring, void (*handle)(rfbUring* ring, struct io_uring_cqe* cqe))
+{
+  unsigned head = *ring->cqHead;
+  unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    handle(ring, &ring->cqes[head & *ring->cqMask]);
+    ring->inFlight--;
+  }
+  __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+static int
+ScreenTimeout(rfbScreenInfoPtr screen)
+{
+  return (screen && screen->maxClientWait) ? screen->maxClientWait : rfbMaxClientWait;
+}
+
+static int
+ClientTimeout(rfbClientPtr cl)
+{
+  return ScreenTimeout(cl->screen);
+}
+
+/* the ring, if the client's socket may use it */
+static rfbUring*
+ClientRing(rfbClientPtr cl)
+{
+  rfbUring* ring;
+
+  /* the httpd writes through a client without a screen */
+  if (cl->screen == NULL)
+    return NULL;
+  ring = (rfbUring*)cl->screen->ioUring;
+  if (ring == NULL || cl->sock < 0)
+    return NULL;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  /* with a thread per client, each one blocks on its own */
+  if (cl->screen->backgroundLoop)
+    return NULL;
+#endif
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+  if (cl->wsctx || cl->sslctx)
+    return NULL;
+#endif
+  return ring;
+}
+
+rfbBool
+rfbUringInit(rfbScreenInfoPtr screen)
+{
+  struct io_uring_params p;
+  struct iovec iov;
+  rfbUring* ring;
+  int i;
+
+  if (screen->ioUring)
+    return TRUE;
+
+  ring = (rfbUring*)calloc(1, sizeof(rfbUring));
+  if (ring == NULL)
+    return FALSE;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = UringSetup(URING_ENTRIES, &p);
+  if (ring->fd < 0) {
+    rfbLogPerror("rfbUringInit: io_uring_setup");
+    free(ring);
+    return FALSE;
+  }
+  if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+    rfbErr("rfbUringInit: this kernel's io_uring is too old\n");
+    close(ring->fd);
+    free(ring);
+    return FALSE;
+  }
+
+  ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqRingSize > ring->sqRingSize)
+      ring->sqRingSize = ring->cqRingSize;
+    ring->cqRingSize = 0;
+  }
+  ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cqRing = ring->cqRingSize == 0 ? ring->sqRing :
+    mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+	 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  ring->chunks = malloc((size_t)URING_CHUNKS * URING_CHUNK_SIZE);
+  if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED ||
+      ring->sqes == MAP_FAILED || ring->chunks == NULL) {
+    rfbLogPerror("rfbUringInit: mmap");
+    ring->sqEntries = p.sq_entries;
+    screen->ioUring = ring;
+    rfbUringShutdown(screen);
+    return FALSE;
+  }
+
+  ring->sqHead = (unsigned*)((char*)ring->sqRing + p.sq_off.head);
+  ring->sqTail = (unsigned*)((char*)ring->sqRing + p.sq_off.tail);
+  ring->sqMask = (unsigned*)((char*)ring->sqRing + p.sq_off.ring_mask);
+  ring->sqArray = (unsigned*)((char*)ring->sqRing + p.sq_off.array);
+  ring->sqEntries = p.sq_entries;
+  ring->sqLocalTail = *ring->sqTail;
+  ring->cqHead = (unsigned*)((char*)ring->cqRing + p.cq_off.head);
+  ring->cqTail = (unsigned*)((char*)ring->cqRing + p.cq_off.tail);
+  ring->cqMask = (unsigned*)((char*)ring->cqRing + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)((char*)ring->cqRing + p.cq_off.cqes);
+  ring->cqEntries = p.cq_entries;
+
+  for (i = 0; i < URING_CHUNKS; i++)
+    ring->freeChunks[i] = URING_CHUNKS - 1 - i;
+  ring->nFree = URING_CHUNKS;
+
+  /* without enough locked memory allowed, plain writes do */
+  iov.iov_base = ring->chunks;
+  iov.iov_len = (size_t)URING_CHUNKS * URING_CHUNK_SIZE;
+  ring->registered = UringRegister(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+  if (!ring->registered)
+    rfbLogPerror("rfbUringInit: cannot register buffers");
+
+  INIT_MUTEX(ring->lock);
+  screen->ioUring = ring;
+  rfbLog("Using io_uring for client sockets%s\n",
+	 ring->registered ? ", with registered buffers" : "");
+  return TRUE;
+}
+
+void
+rfbUringShutdown(rfbScreenInfoPtr screen)
+{
+  rfbUring* ring = (rfbUring*)screen->ioUring;
+
+  if (ring == NULL)
+    return;
+  if (ring->sqes && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqEntries * sizeof(struct io_uring_sqe));
+  if (ring->cqRing && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing)
+    munmap(ring->cqRing, ring->cqRingSize);
+  if (ring->sqRing && ring->sqRing != MAP_FAILED)
+    munmap(ring->sqRing, ring->sqRingSize);
+  close(ring->fd);
+  free(ring->chunks);
+  if (ring->sqHead)
+    TINI_MUTEX(ring->lock);
+  free(ring);
+  screen->ioUring = NULL;
+}
+
+static void
+ReleaseChunks(rfbUring* ring, rfbUringOutput* out)
+{
+  int i;
+
+  for (i = 0; i < out->nChunks; i++)
+    ring->freeChunks[ring->nFree++] = out->chunks[i];
+  out->nChunks = 0;
+  out->done = 0;
+}
+
+void
+rfbUringFreeClient(rfbClientPtr cl)
+{
+  rfbUringOutput* out = (rfbUringOutput*)cl->ioUringOutput;
+
+  if (out == NULL)
+    return;
+  if (cl->screen->ioUring)
+    ReleaseChunks((rfbUring*)cl->screen->ioUring, out);
+  free(out);
+  cl->ioUringOutput = NULL;
+}
+
+void
+rfbUringBeginBatch(rfbScreenInfoPtr screen)
+{
+  rfbUring* ring = (rfbUring*)screen->ioUring;
+
+  if (ring)
+    ring->batching = TRUE;
+}
+
+/*
+ * Flushing goes in rounds.  Each round queues, for every client with
+ * output, its chunks as linked writes, or, if its socket was full, a poll
+ * with a linked timeout; then all of them are submitted with one system
+ * call.  Depending on the kernel, a write to a full socket either fails
+ * with EAGAIN, and the next round polls, or waits in the kernel; the
+ * writes to a client which took nothing for the client timeout are
+ * cancelled.
+ */
+
+static void
+HandleOutputCompletion(rfbUring* ring, rfbUringOutput* out, int res)
+{
+  if (out->polling) {
+    out->polling = FALSE;
+    if (res == -ECANCELED)
+      out->error = ETIMEDOUT;
+    else if (res < 0)
+      out->error = -res;
+    return;
+  }
+
+  if (out->broken || out->error) {
+    out->opsReaped++;
+    return;
+  }
+  if (res == -EAGAIN) {
+    out->needPoll = TRUE;
+    out->broken = TRUE;
+  } else if (res <= 0) {
+    out->error = res == 0 ? EPIPE : -res;
+  } else {
+    /* retire what was sent */
+    int len = out->opLen[out->opsReaped], sent = res;
+
+    out->cl->writesSent++;
+    out->progress = NowMsecs();
+    while (res > 0) {
+      int left = ring->chunkLen[out->chunks[0]] - out->done;
+
+      if (res < left) {
+	out->done += res;
+	break;
+      }
+      res -= left;
+      ring->freeChunks[ring->nFree++] = out->chunks[0];
+      memmove(out->chunks, out->chunks + 1, (out->nChunks - 1) * sizeof(int));
+      out->nChunks--;
+      out->done = 0;
+    }
+    if (sent < len)
+      out->broken = TRUE;
+  }
+  out->opsReaped++;
+}
+
+static void
+HandleCompletion(rfbUring* ring, struct io_uring_cqe* cqe)
+{
+  switch (cqe->user_data & URING_KIND_MASK) {
+  case URING_OUTPUT:
+    HandleOutputCompletion(ring, (rfbUringOutput*)URING_POINTER(cqe->user_data), cqe->res);
+    break;
+  case URING_WAIT: {
+    rfbUringWait* wait = (rfbUringWait*)URING_POINTER(cqe->user_data);
+
+    wait->res = cqe->res;
+    wait->done = TRUE;
+    break;
+  }
+  }
+}
+
+static void
+QueueOutput(rfbUring* ring, rfbUringOutput* out)
+{
+  struct io_uring_sqe* sqe;
+  int i;
+
+  out->nOps = out->opsReaped = 0;
+  out->broken = FALSE;
+  out->progress = NowMsecs();
+
+  if (out->needPoll) {
+    out->needPoll = FALSE;
+    out->polling = TRUE;
+    sqe = UringGetSqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = out->cl->sock;
+    sqe->poll32_events = POLLOUT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = URING_DATA(out, URING_OUTPUT);
+    UringSetTimeout(&out->timeout, ClientTimeout(out->cl));
+    sqe = UringGetSqe(ring);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uintptr_t)&out->timeout;
+    sqe->len = 1;
+    sqe->user_data = URING_TIMEOUT_DATA;
+    return;
+  }
+
+  for (i = 0; i < out->nChunks; i++) {
+    int chunk = out->chunks[i];
+    int offset = i == 0 ? out->done : 0;
+
+    sqe = UringGetSqe(ring);
+    sqe->opcode = ring->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = out->cl->sock;
+    sqe->addr = (uintptr_t)(ring->chunks + (size_t)chunk * URING_CHUNK_SIZE + offset);
+    sqe->len = ring->chunkLen[chunk] - offset;
+    sqe->buf_index = 0;
+    sqe->off = (__u64)-1;     /* no offset, it is a socket */
+    if (i + 1 < out->nChunks)
+      sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = URING_DATA(out, URING_OUTPUT);
+    out->opLen[out->nOps++] = sqe->len;
+  }
+}
+
+/* the next client to flush: only, or all clients of the screen */
+static rfbClientPtr
+NextClient(rfbClientIteratorPtr it, rfbClientPtr only, rfbClientPtr cl)
+{
+  if (only)
+    return cl ? NULL : only;
+  return rfbClientIteratorNext(it);
+}
+
+/* gives up on the clients which took nothing for the timeout */
+static void
+CancelStalledOutput(rfbUring* ring, rfbScreenInfoPtr screen, rfbClientPtr only)
+{
+  rfbClientIteratorPtr it = rfbGetClientIterator(screen);
+  rfbClientPtr cl = NULL;
+  long now = NowMsecs();
+
+  while ((cl = NextClient(it, only, cl)) != NULL) {
+    rfbUringOutput* out = (rfbUringOutput*)cl->ioUringOutput;
+    struct io_uring_sqe* sqe;
+
+    if (out == NULL || out->error || (out->opsReaped == out->nOps && !out->polling) ||
+	now - out->progress < ScreenTimeout(screen))
+      continue;
+    out->error = ETIMEDOUT;
+    if (UringSqSpace(ring) == 0)
+      UringSubmit(ring, 0);
+    /* the rest of a chain is cancelled along with the op in progress */
+    sqe = UringGetSqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = URING_DATA(out, URING_OUTPUT);
+    sqe->user_data = URING_TIMEOUT_DATA;
+  }
+  rfbReleaseClientIterator(it);
+}
+
+/* waits for everything in flight */
+static void
+WaitOutput(rfbUring* ring, rfbScreenInfoPtr screen, rfbClientPtr only)
+{
+  while (ring->inFlight > 0) {
+    if (UringSubmitWait(ring, ScreenTimeout(screen)) < 0) {
+      rfbLogPerror("rfbUringFlush: io_uring_enter");
+      return;
+    }
+    UringReap(ring, HandleCompletion);
+    CancelStalledOutput(ring, screen, only);
+  }
+}
+
+static void
+FlushRing(rfbUring* ring, rfbScreenInfoPtr screen, rfbClientPtr only)
+{
+  rfbBool pending = TRUE;
+
+  while (pending) {
+    rfbClientIteratorPtr it = rfbGetClientIterator(screen);
+    rfbClientPtr cl = NULL;
+
+    pending = FALSE;
+    while ((cl = NextClient(it, only, cl)) != NULL) {
+      rfbUringOutput* out = (rfbUringOutput*)cl->ioUringOutput;
+      unsigned needed;
+
+      if (out == NULL || out->nChunks == 0 || out->error)
+	continue;
+      if (cl->sock < 0) {
+	ReleaseChunks(ring, out);
+	continue;
+      }
+      /* keep the completions within the completion queue */
+      needed = out->needPoll ? 2 : out->nChunks;
+      if (UringSqSpace(ring) < needed || ring->inFlight + needed > ring->cqEntries)
+	WaitOutput(ring, screen, only);
+      QueueOutput(ring, out);
+      pending = TRUE;
+    }
+    rfbReleaseClientIterator(it);
+
+    if (!pending)
+      break;
+    WaitOutput(ring, screen, only);
+
+    /* drop the clients that failed */
+    it = rfbGetClientIterator(screen);
+    cl = NULL;
+    while ((cl = NextClient(it, only, cl)) != NULL) {
+      rfbUringOutput* out = (rfbUringOutput*)cl->ioUringOutput;
+
+      if (out && out->error) {
+	errno = out->error;
+	out->error = 0;
+	out->needPoll = FALSE;
+	ReleaseChunks(ring, out);
+	rfbLogPerror("rfbUringFlush: write");
+	rfbCloseClient(cl);
+      }
+    }
+    rfbReleaseClientIterator(it);
+  }
+}
+
+/*
+ * rfbUringFlush sends everything queued and ends the batch.  Clients
+ * whose output could not be sent are closed.
+ */
+
+void
+rfbUringFlush(rfbScreenInfoPtr screen)
+{
+  rfbUring* ring = (rfbUring*)screen->ioUring;
+
+  if (ring == NULL)
+    return;
+  LOCK(ring->lock);
+  FlushRing(ring, screen, NULL);
+  ring->batching = FALSE;
+  UNLOCK(ring->lock);
+}
+
+/*
+ * rfbUringFlushClient sends what is queued for one client, for output
+ * which must not overtake it.  Returns FALSE if the client was closed.
+ */
+
+rfbBool
+rfbUringFlushClient(rfbClientPtr cl)
+{
+  rfbUring* ring = (rfbUring*)cl->screen->ioUring;
+  rfbUringOutput* out = (rfbUringOutput*)cl->ioUringOutput;
+
+  if (ring == NULL || out == NULL || out->nChunks == 0)
+    return cl->sock >= 0;
+  LOCK(ring->lock);
+  FlushRing(ring, cl->screen, cl);
+  UNLOCK(ring->lock);
+  return cl->sock >= 0;
+}
+
+/*
+ * rfbUringWrite queues len bytes of output for the client while a batch
+ * is open.  Returns 1 if they were queued, 0 if the caller has to write
+ * them itself, or -1 if the client failed.
+ */
+
+int
+rfbUringWrite(rfbClientPtr cl, const char* buf, int len)
+{
+  rfbUring* ring = ClientRing(cl);
+  rfbUringOutput* out;
+
+  if (ring == NULL || !ring->batching)
+    return 0;
+
+  out = (rfbUringOutput*)cl->ioUringOutput;
+  if (out == NULL) {
+    out = (rfbUringOutput*)calloc(1, sizeof(rfbUringOutput));
+    if (out == NULL)
+      return 0;
+    out->cl = cl;
+    cl->ioUringOutput = out;
+  }
+
+  while (len > 0) {
+    int chunk, n;
+
+    /* fill up the last chunk first */
+    if (out->nChunks > 0 && ring->chunkLen[out->chunks[out->nChunks - 1]] < URING_CHUNK_SIZE) {
+      chunk = out->chunks[out->nChunks - 1];
+    } else {
+      if (ring->nFree == 0) {
+	/* everything is queued; send it to make room */
+	LOCK(ring->lock);
+	FlushRing(ring, cl->screen, NULL);
+	UNLOCK(ring->lock);
+	if (cl->sock < 0)
+	  return -1;
+	continue;
+      }
+      chunk = ring->freeChunks[--ring->nFree];
+      ring->chunkLen[chunk] = 0;
+      out->chunks[out->nChunks++] = chunk;
+    }
+    n = URING_CHUNK_SIZE - ring->chunkLen[chunk];
+    if (n > len)
+      n = len;
+    memcpy(ring->chunks + (size_t)chunk * URING_CHUNK_SIZE + ring->chunkLen[chunk], buf, n);
+    ring->chunkLen[chunk] += n;
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/* submits the queued entries and reaps, output of other clients
+   included, until the wait is done */
+static int
+UringWait(rfbUring* ring, rfbUringWait* wait)
+{
+  while (!wait->done) {
+    if (UringSubmit(ring, 1) < 0)
+      return -1;
+    UringReap(ring, HandleCompletion);
+  }
+  return 0;
+}
+
+/*
+ * rfbUringRecv receives from the client, waiting at most timeout
+ * milliseconds, in place of a select() followed by a read().  Returns what
+ * recv() would, with errno ETIMEDOUT on timeout, or -2 if the ring cannot
+ * be used.
+ */
+
+int
+rfbUringRecv(rfbClientPtr cl, char* buf, int len, int timeout)
+{
+  rfbUring* ring = ClientRing(cl);
+  struct __kernel_timespec ts;
+  struct io_uring_sqe* sqe;
+  rfbUringWait wait = { 0, FALSE };
+
+  if (ring == NULL || ring->batching)
+    return -2;
+
+  LOCK(ring->lock);
+  if (UringSqSpace(ring) < 2) {
+    UNLOCK(ring->lock);
+    return -2;
+  }
+  sqe = UringGetSqe(ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = cl->sock;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = URING_DATA(&wait, URING_WAIT);
+  UringSetTimeout(&ts, timeout);
+  sqe = UringGetSqe(ring);
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = (uintptr_t)&ts;
+  sqe->len = 1;
+  sqe->user_data = URING_TIMEOUT_DATA;
+
+  if (UringWait(ring, &wait) < 0) {
+    UNLOCK(ring->lock);
+    return -1;
+  }
+  UNLOCK(ring->lock);
+
+  if (wait.res == -ECANCELED) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  if (wait.res < 0) {
+    errno = -wait.res;
+    return -1;
+  }
+  return wait.res;
+}
+
+/*
+ * rfbUringWaitWritable waits until the client's socket takes more data,
+ * at most timeout milliseconds, in place of select() retries.  Returns 1
+ * when it does, 0 on timeout, -1 on error, or -2 if the ring cannot be
+ * used.
+ */
+
+int
+rfbUringWaitWritable(rfbClientPtr cl, int timeout)
+{
+  rfbUring* ring = ClientRing(cl);
+  struct __kernel_timespec ts;
+  struct io_uring_sqe* sqe;
+  rfbUringWait wait = { 0, FALSE };
+
+  if (ring == NULL || ring->batching)
+    return -2;
+
+  LOCK(ring->lock);
+  if (UringSqSpace(ring) < 2) {
+    UNLOCK(ring->lock);
+    return -2;
+  }
+  sqe = UringGetSqe(ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = cl->sock;
+  sqe->poll32_events = POLLOUT;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = URING_DATA(&wait, URING_WAIT);
+  UringSetTimeout(&ts, timeout);
+  sqe = UringGetSqe(ring);
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = (uintptr_t)&ts;
+  sqe->len = 1;
+  sqe->user_data = URING_TIMEOUT_DATA;
+
+  if (UringWait(ring, &wait) < 0) {
+    UNLOCK(ring->lock);
+    return -1;
+  }
+  UNLOCK(ring->lock);
+
+  if (wait.res == -ECANCELED)
+    return 0;
+  if (wait.res < 0) {
+    errno = -wait.res;
+    return -1;
+  }
+  return 1;
+}
+
+/* tells if the client's output is queued rather than written */
+rfbBool
+rfbUringBatching(rfbClientPtr cl)
+{
+  rfbUring* ring = ClientRing(cl);
+
+  return ring != NULL && ring->batching;
+}
+
+#else
+
+rfbBool
+rfbUringInit(rfbScreenInfoPtr screen)
+{
+  rfbErr("This LibVNCServer does not have io_uring support\n");
+  return FALSE;
+}
+
+void
+rfbUringShutdown(rfbScreenInfoPtr screen)
+{
+}
+
+void
+rfbUringFreeClient(rfbClientPtr cl)
+{
+}
+
+void
+rfbUringBeginBatch(rfbScreenInfoPtr screen)
+{
+}
+
+void
+rfbUringFlush(rfbScreenInfoPtr screen)
+{
+}
+
+rfbBool
+rfbUringFlushClient(rfbClientPtr cl)
+{
+  return cl->sock >= 0;
+}
+
+int
+rfbUringWrite(rfbClientPtr cl, const char* buf, int len)
+{
+  return 0;
+}
+
+int
+rfbUringRecv(rfbClientPtr cl, char* buf, int len, int timeout)
+{
+  return -2;
+}
+
+int
+rfbUringWaitWritable(rfbClientPtr cl, int timeout)
+{
+  return -2;
+}
+
+rfbBool
+rfbUringBatching(rfbClientPtr cl)
+{
+  return FALSE;
+}
+
+#endif
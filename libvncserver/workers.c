@@ -0,0 +1,160 @@
+/*
+ * workers.c
+ *
+ * Threads of a client that share the work on one rectangle.
+ *
+ * Encoders that cut a rectangle into independent jobs (ZRLEStripes, LZ4)
+ * hand them to rfbRunWorkers().  The threads are started with the first
+ * rectangle that needs them and wait for the next one in between; the
+ * thread sending the update takes jobs as well.  They are stopped by
+ * rfbFreeWorkers() when the client goes away.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "private.h"
+#include "workers.h"
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+
+typedef struct {
+  MUTEX(mutex);
+  COND(work);
+  COND(done);
+  pthread_t threads[RFB_MAX_WORKERS - 1];
+  int nThreads;
+
+  /* the jobs of the rectangle being encoded */
+  void (*run)(void* job);
+  char* jobs;
+  size_t jobSize;
+  int nJobs;
+  int nextJob;                  /* the next one to take */
+  int nDone;
+  rfbBool quit;
+} rfbWorkers;
+
+/* takes jobs until there are none left; called with the mutex held */
+static void takeJobs(rfbWorkers* workers)
+{
+  while (workers->nextJob < workers->nJobs) {
+    void* job = workers->jobs + workers->nextJob++ * workers->jobSize;
+
+    UNLOCK(workers->mutex);
+    workers->run(job);
+    LOCK(workers->mutex);
+    if (++workers->nDone == workers->nJobs)
+      TSIGNAL(workers->done);
+  }
+}
+
+static void* workerThread(void* arg)
+{
+  rfbWorkers* workers = (rfbWorkers*)arg;
+
+  LOCK(workers->mutex);
+  while (!workers->quit) {
+    takeJobs(workers);
+    if (!workers->quit)
+      WAIT(workers->work, workers->mutex);
+  }
+  UNLOCK(workers->mutex);
+  return NULL;
+}
+
+#endif
+
+/*
+ * rfbRunWorkers calls run on each of the nJobs jobs, which are jobSize bytes
+ * apart from jobs on, and returns when all of them are done.  The jobs must
+ * not touch anything the others touch.
+ */
+
+void rfbRunWorkers(rfbClientPtr cl, int nJobs, void (*run)(void* job),
+                   void* jobs, size_t jobSize)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  rfbWorkers* workers = (rfbWorkers*)cl->workers;
+#endif
+  int i;
+
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  if (workers == NULL && nJobs > 1) {
+    workers = (rfbWorkers*)calloc(1, sizeof(rfbWorkers));
+    if (workers != NULL) {
+      INIT_MUTEX(workers->mutex);
+      INIT_COND(workers->work);
+      INIT_COND(workers->done);
+      cl->workers = workers;
+    }
+  }
+
+  if (workers != NULL && nJobs > 1) {
+    /* if no more threads can be started, the others do all the work */
+    while (workers->nThreads < nJobs - 1 &&
+           workers->nThreads < RFB_MAX_WORKERS - 1 &&
+           pthread_create(&workers->threads[workers->nThreads], NULL,
+                          workerThread, workers) == 0)
+      workers->nThreads++;
+
+    if (workers->nThreads > 0) {
+      LOCK(workers->mutex);
+      workers->run = run;
+      workers->jobs = (char*)jobs;
+      workers->jobSize = jobSize;
+      workers->nJobs = nJobs;
+      workers->nextJob = 0;
+      workers->nDone = 0;
+      pthread_cond_broadcast(&workers->work);
+      takeJobs(workers);
+      while (workers->nDone < workers->nJobs)
+        WAIT(workers->done, workers->mutex);
+      UNLOCK(workers->mutex);
+      return;
+    }
+  }
+#endif
+
+  for (i = 0; i < nJobs; i++)
+    run((char*)jobs + i * jobSize);
+}
+
+void rfbFreeWorkers(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  rfbWorkers* workers = (rfbWorkers*)cl->workers;
+  int i;
+
+  if (workers == NULL)
+    return;
+
+  LOCK(workers->mutex);
+  workers->quit = TRUE;
+  pthread_cond_broadcast(&workers->work);
+  UNLOCK(workers->mutex);
+  for (i = 0; i < workers->nThreads; i++)
+    pthread_join(workers->threads[i], NULL);
+
+  TINI_MUTEX(workers->mutex);
+  TINI_COND(workers->work);
+  TINI_COND(workers->done);
+  free(workers);
+  cl->workers = NULL;
+#endif
+}
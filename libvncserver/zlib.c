@@ -169,9 +169,8 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
         cl->compStream.zfree = Z_NULL;
         cl->compStream.opaque = Z_NULL;
 
-        deflateInit2( &(cl->compStream),
+        cl->deflateBackend->init( &(cl->compStream),
                         cl->zlibCompressLevel,
-                        Z_DEFLATED,
                         MAX_WBITS,
                         MAX_MEM_LEVEL,
                         Z_DEFAULT_STRATEGY );
@@ -184,7 +183,7 @@ rfbSendOneRectEncodingZlib(rfbClientPtr cl,
     previousOut = cl->compStream.total_out;
 
     /* Perform the compression here. */
-    deflateResult = deflate( &(cl->compStream), Z_SYNC_FLUSH );
+    deflateResult = cl->deflateBackend->deflate( &(cl->compStream), Z_SYNC_FLUSH );
 
     /* Find the total size of the resulting compressed data. */
     zlibAfterBufLen = cl->compStream.total_out - previousOut;
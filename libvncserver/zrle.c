@@ -27,6 +27,7 @@
 #include "rfb/rfb.h"
 #include "private.h"
 #include "zrleoutstream.h"
+#include "workers.h"
 
 
 #define GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf)                                \
@@ -96,60 +97,43 @@
  * data.
  */
 
+#define ZRLE_BEFORE_BUF_SIZE (rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4)
 
-/*
- * rfbSendRectEncodingZRLE - send a given rectangle using ZRLE encoding.
- */
+/* free output chunks kept per screen, see zrleoutstream.h */
+#define ZRLE_POOL_MAX_FREE_CHUNKS 64
 
-rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
-{
-  zrleOutStream* zos;
-  rfbFramebufferUpdateRectHeader rect;
-  rfbZRLEHeader hdr;
-  int i;
-  char *zrleBeforeBuf;
+/* chunks handed to the socket with one writev() */
+#define ZRLE_MAX_IOV 64
 
-  if (cl->zrleBeforeBuf == NULL) {
-	cl->zrleBeforeBuf = (char *) malloc(rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4);
-  }
-  zrleBeforeBuf = cl->zrleBeforeBuf;
 
-  if (cl->preferredEncoding == rfbEncodingZYWRLE) {
-	  if (cl->tightQualityLevel < 0) {
-		  cl->zywrleLevel = 1;
-	  } else if (cl->tightQualityLevel < 3) {
-		  cl->zywrleLevel = 3;
-	  } else if (cl->tightQualityLevel < 6) {
-		  cl->zywrleLevel = 2;
-	  } else {
-		  cl->zywrleLevel = 1;
-	  }
-  } else
-	  cl->zywrleLevel = 0;
+/*
+ * zrleEncodeRect encodes a rectangle into zos, choosing the template
+ * instance for the client's pixel format.
+ */
 
-  if (!cl->zrleData)
-    cl->zrleData = zrleOutStreamNew();
-  zos = cl->zrleData;
-  zos->in.ptr = zos->in.start;
-  zos->out.ptr = zos->out.start;
+static void zrleEncodeRect(rfbClientPtr cl, int x, int y, int w, int h,
+                           zrleOutStream* zos, char* zrleBeforeBuf,
+                           int *zywrleBuf, void *paletteHelper)
+{
+  zrleOutStreamReset(zos);
 
   switch (cl->format.bitsPerPixel) {
 
   case 8:
-    zrleEncode8NE(x, y, w, h, zos, zrleBeforeBuf, cl);
+    zrleEncode8NE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, paletteHelper, cl);
     break;
 
   case 16:
 	if (cl->format.greenMax > 0x1F) {
 		if (cl->format.bigEndian)
-		  zrleEncode16BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode16BE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, paletteHelper, cl);
 		else
-		  zrleEncode16LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode16LE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, paletteHelper, cl);
 	} else {
 		if (cl->format.bigEndian)
-		  zrleEncode15BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode15BE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, paletteHelper, cl);
 		else
-		  zrleEncode15LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  zrleEncode15LE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, paletteHelper, cl);
 	}
     break;
 
@@ -166,31 +150,252 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
     if ((fitsInLS3Bytes && !cl->format.bigEndian) ||
         (fitsInMS3Bytes && cl->format.bigEndian)) {
 	if (cl->format.bigEndian)
-		zrleEncode24ABE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24ABE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, paletteHelper, cl);
 	else
-		zrleEncode24ALE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24ALE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, paletteHelper, cl);
     }
     else if ((fitsInLS3Bytes && cl->format.bigEndian) ||
              (fitsInMS3Bytes && !cl->format.bigEndian)) {
 	if (cl->format.bigEndian)
-		zrleEncode24BBE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24BBE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, paletteHelper, cl);
 	else
-		zrleEncode24BLE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode24BLE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, paletteHelper, cl);
     }
     else {
 	if (cl->format.bigEndian)
-		zrleEncode32BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode32BE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, paletteHelper, cl);
 	else
-		zrleEncode32LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		zrleEncode32LE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, paletteHelper, cl);
     }
   }
     break;
   }
+}
 
-  rfbStatRecordEncodingSent(cl, rfbEncodingZRLE, sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader + ZRLE_BUFFER_LENGTH(&zos->out),
-      + w * (cl->format.bitsPerPixel / 8) * h);
 
-  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader
+/* writes iov to the client; on failure closes it and resets zos */
+
+static rfbBool zrleWriteV(rfbClientPtr cl, zrleOutStream* zos,
+                          struct iovec* iov, int n)
+{
+  if (rfbWriteExactV(cl, iov, n) < 0) {
+    rfbLogPerror("zrleSendStream: rfbWriteExactV");
+    rfbCloseClient(cl);
+    zrleOutStreamReset(zos);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/*
+ * zrleSendStream writes the ZRLE header and the compressed data of zos to
+ * the client and gives the output chunks back to the pool.  Small outputs
+ * are copied into updateBuf like everything else, larger ones are passed
+ * to the socket directly as an iovec of the chunks.
+ */
+
+static rfbBool zrleSendStream(rfbClientPtr cl, zrleOutStream* zos)
+{
+  rfbZRLEHeader hdr;
+  zrleChunk *chunk;
+  int length = zrleOutStreamLength(zos);
+  rfbBool direct = (cl->ublen + sz_rfbZRLEHeader + length > UPDATE_BUF_SIZE);
+
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+  /* rfbWriteExactV knows nothing about WebSockets framing or TLS */
+  if (cl->wsctx || cl->sslctx)
+    direct = FALSE;
+#endif
+
+  if (cl->ublen + sz_rfbZRLEHeader > UPDATE_BUF_SIZE)
+    {
+      if (!rfbSendUpdateBuf(cl))
+        return FALSE;
+    }
+
+  hdr.length = Swap32IfLE(length);
+
+  memcpy(cl->updateBuf+cl->ublen, (char *)&hdr, sz_rfbZRLEHeader);
+  cl->ublen += sz_rfbZRLEHeader;
+
+  if (direct) {
+    struct iovec iov[ZRLE_MAX_IOV];
+    int n = 0;
+
+    iov[n].iov_base = cl->updateBuf;
+    iov[n++].iov_len = cl->ublen;
+
+    /* written before another chunk is added, so that the last write has
+       at least updateBuf, even if there are no chunks at all */
+    for (chunk = zos->head; chunk; chunk = chunk->next) {
+      if (n == ZRLE_MAX_IOV) {
+        if (!zrleWriteV(cl, zos, iov, n))
+          return FALSE;
+        n = 0;
+      }
+      iov[n].iov_base = chunk->data;
+      iov[n++].iov_len = ZRLE_CHUNK_LENGTH(zos, chunk);
+    }
+    if (!zrleWriteV(cl, zos, iov, n))
+      return FALSE;
+    cl->ublen = 0;
+  } else {
+    for (chunk = zos->head; chunk; chunk = chunk->next) {
+      int chunkLength = ZRLE_CHUNK_LENGTH(zos, chunk);
+      int i;
+
+      for (i = 0; i < chunkLength;) {
+
+        int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
+
+        if (i + bytesToCopy > chunkLength) {
+          bytesToCopy = chunkLength - i;
+        }
+
+        memcpy(cl->updateBuf+cl->ublen, chunk->data + i, bytesToCopy);
+
+        cl->ublen += bytesToCopy;
+        i += bytesToCopy;
+
+        if (cl->ublen == UPDATE_BUF_SIZE) {
+          if (!rfbSendUpdateBuf(cl)) {
+            zrleOutStreamReset(zos);
+            return FALSE;
+          }
+        }
+      }
+    }
+  }
+
+  zrleOutStreamReset(zos);
+  return TRUE;
+}
+
+
+/*
+ * A zrleStripe holds the zlib stream and the buffers for one stripe of a
+ * ZRLEStripes rectangle, so that the stripes can be encoded on separate
+ * threads.  Stripe i always uses the same stream, which is what the client
+ * expects.
+ */
+
+typedef struct {
+  zrleOutStream* zos;
+  char* beforeBuf;
+  zrlePaletteHelper* paletteHelper;
+  int zywrleBuf[rfbZRLETileWidth * rfbZRLETileHeight];
+
+  rfbClientPtr cl;
+  int x, y, w, h;
+} zrleStripe;
+
+static void zrleFreeStripe(zrleStripe* stripe)
+{
+  if (stripe->zos)
+    zrleOutStreamFree(stripe->zos);
+  stripe->zos = NULL;
+  free(stripe->beforeBuf);
+  stripe->beforeBuf = NULL;
+  free(stripe->paletteHelper);
+  stripe->paletteHelper = NULL;
+}
+
+/* makes sure the first n stripes of cl are allocated */
+static rfbBool zrleAllocStripes(rfbClientPtr cl, int n)
+{
+  zrleStripe* stripes;
+  int i;
+
+  if (!cl->zrleStripes)
+    cl->zrleStripes = calloc(rfbZRLEMaxStripes, sizeof(zrleStripe));
+  if (!cl->zrleStripes)
+    return FALSE;
+  stripes = (zrleStripe*)cl->zrleStripes;
+
+  for (i = 0; i < n; i++) {
+    if (stripes[i].zos)
+      continue;
+    stripes[i].zos = zrleOutStreamNew(cl->screen->zrleChunkPool,
+				      cl->deflateBackend);
+    stripes[i].beforeBuf = (char *) malloc(ZRLE_BEFORE_BUF_SIZE);
+    stripes[i].paletteHelper = (zrlePaletteHelper *) calloc(sizeof(zrlePaletteHelper), 1);
+    if (!stripes[i].zos || !stripes[i].beforeBuf || !stripes[i].paletteHelper) {
+      zrleFreeStripe(&stripes[i]);
+      return FALSE;
+    }
+    zrlePaletteHelperInit(stripes[i].paletteHelper);
+  }
+  return TRUE;
+}
+
+/*
+ * zrleStripeCount decides how many stripes a w x h rectangle is cut into:
+ * at most one per CPU, each at least one tile high and not so small that
+ * handing it to a thread costs more than it saves.
+ */
+
+static int zrleStripeCount(int w, int h)
+{
+  int rows = (h + rfbZRLETileHeight - 1) / rfbZRLETileHeight;
+  int n = rfbWorkerCount(w * h / (rfbZRLETileWidth * rfbZRLETileHeight), 4,
+                         rfbZRLEMaxStripes);
+
+  return n > rows ? rows : n;
+}
+
+static void zrleEncodeStripe(void* arg)
+{
+  zrleStripe* stripe = (zrleStripe*)arg;
+
+  zrleEncodeRect(stripe->cl, stripe->x, stripe->y, stripe->w, stripe->h,
+                 stripe->zos, stripe->beforeBuf, stripe->zywrleBuf,
+                 stripe->paletteHelper);
+}
+
+
+/*
+ * rfbSendRectEncodingZRLEStripes - send a given rectangle as independently
+ * compressed ZRLE stripes, encoding them in parallel.
+ */
+
+static rfbBool rfbSendRectEncodingZRLEStripes(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  rfbFramebufferUpdateRectHeader rect;
+  rfbZRLEStripesHeader hdr;
+  zrleStripe* stripes;
+  int nStripes = zrleStripeCount(w, h), stripeHeight, i, bytes;
+
+  stripeHeight = ((h + rfbZRLETileHeight - 1) / rfbZRLETileHeight + nStripes - 1)
+    / nStripes * rfbZRLETileHeight;
+  if (stripeHeight == 0)
+    stripeHeight = rfbZRLETileHeight;
+  nStripes = (h + stripeHeight - 1) / stripeHeight;
+  if (nStripes == 0)
+    nStripes = 1;
+
+  if (!zrleAllocStripes(cl, nStripes)) {
+    rfbErr("rfbSendRectEncodingZRLEStripes: out of memory\n");
+    return FALSE;
+  }
+  stripes = (zrleStripe*)cl->zrleStripes;
+
+  for (i = 0; i < nStripes; i++) {
+    stripes[i].cl = cl;
+    stripes[i].x = x;
+    stripes[i].y = y + i * stripeHeight;
+    stripes[i].w = w;
+    stripes[i].h = (i == nStripes - 1) ? h - i * stripeHeight : stripeHeight;
+  }
+
+  rfbRunWorkers(cl, nStripes, zrleEncodeStripe, stripes, sizeof(zrleStripe));
+
+  bytes = sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEStripesHeader;
+  for (i = 0; i < nStripes; i++)
+    bytes += sz_rfbZRLEHeader + zrleOutStreamLength(stripes[i].zos);
+  rfbStatRecordEncodingSent(cl, rfbEncodingZRLEStripes, bytes,
+      w * (cl->format.bitsPerPixel / 8) * h);
+
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEStripesHeader
       > UPDATE_BUF_SIZE)
     {
       if (!rfbSendUpdateBuf(cl))
@@ -201,37 +406,135 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   rect.r.y = Swap16IfLE(y);
   rect.r.w = Swap16IfLE(w);
   rect.r.h = Swap16IfLE(h);
-  rect.encoding = Swap32IfLE(cl->preferredEncoding);
+  rect.encoding = Swap32IfLE(rfbEncodingZRLEStripes);
 
   memcpy(cl->updateBuf+cl->ublen, (char *)&rect,
          sz_rfbFramebufferUpdateRectHeader);
   cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
-  hdr.length = Swap32IfLE(ZRLE_BUFFER_LENGTH(&zos->out));
+  hdr.nStripes = nStripes;
+  hdr.zywrleLevel = cl->zywrleLevel;
+  hdr.stripeHeight = Swap16IfLE(stripeHeight);
 
-  memcpy(cl->updateBuf+cl->ublen, (char *)&hdr, sz_rfbZRLEHeader);
-  cl->ublen += sz_rfbZRLEHeader;
+  memcpy(cl->updateBuf+cl->ublen, (char *)&hdr, sz_rfbZRLEStripesHeader);
+  cl->ublen += sz_rfbZRLEStripesHeader;
 
-  /* copy into updateBuf and send from there.  Maybe should send directly? */
+  for (i = 0; i < nStripes; i++)
+    if (!zrleSendStream(cl, stripes[i].zos))
+      return FALSE;
 
-  for (i = 0; i < ZRLE_BUFFER_LENGTH(&zos->out);) {
+  return TRUE;
+}
 
-    int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
 
-    if (i + bytesToCopy > ZRLE_BUFFER_LENGTH(&zos->out)) {
-      bytesToCopy = ZRLE_BUFFER_LENGTH(&zos->out) - i;
-    }
+/*
+ * rfbSendRectEncodingZRLEBand - send one band of a rectangle using ZRLE
+ * encoding.
+ */
 
-    memcpy(cl->updateBuf+cl->ublen, (uint8_t*)zos->out.start + i, bytesToCopy);
+static rfbBool rfbSendRectEncodingZRLEBand(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  zrleOutStream* zos;
+  rfbFramebufferUpdateRectHeader rect;
 
-    cl->ublen += bytesToCopy;
-    i += bytesToCopy;
+  if (cl->preferredEncoding == rfbEncodingZYWRLE) {
+	  if (cl->tightQualityLevel < 0) {
+		  cl->zywrleLevel = 1;
+	  } else if (cl->tightQualityLevel < 3) {
+		  cl->zywrleLevel = 3;
+	  } else if (cl->tightQualityLevel < 6) {
+		  cl->zywrleLevel = 2;
+	  } else {
+		  cl->zywrleLevel = 1;
+	  }
+  } else
+	  cl->zywrleLevel = 0;
+
+  if (cl->enableZRLEStripes)
+    return rfbSendRectEncodingZRLEStripes(cl, x, y, w, h);
+
+  if (cl->zrleBeforeBuf == NULL) {
+	cl->zrleBeforeBuf = (char *) malloc(ZRLE_BEFORE_BUF_SIZE);
+  }
+
+  if (cl->paletteHelper == NULL) {
+	cl->paletteHelper = (void *) calloc(sizeof(zrlePaletteHelper), 1);
+	zrlePaletteHelperInit((zrlePaletteHelper *) cl->paletteHelper);
+  }
+
+  if (!cl->zrleData)
+    cl->zrleData = zrleOutStreamNew(cl->screen->zrleChunkPool,
+				    cl->deflateBackend);
+  zos = cl->zrleData;
+
+  zrleEncodeRect(cl, x, y, w, h, zos, cl->zrleBeforeBuf, cl->zywrleBuf,
+                 cl->paletteHelper);
+
+  rfbStatRecordEncodingSent(cl, rfbEncodingZRLE, sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader + zrleOutStreamLength(zos),
+      + w * (cl->format.bitsPerPixel / 8) * h);
 
-    if (cl->ublen == UPDATE_BUF_SIZE) {
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader
+      > UPDATE_BUF_SIZE)
+    {
       if (!rfbSendUpdateBuf(cl))
         return FALSE;
     }
-  }
+
+  rect.r.x = Swap16IfLE(x);
+  rect.r.y = Swap16IfLE(y);
+  rect.r.w = Swap16IfLE(w);
+  rect.r.h = Swap16IfLE(h);
+  rect.encoding = Swap32IfLE(cl->preferredEncoding);
+
+  memcpy(cl->updateBuf+cl->ublen, (char *)&rect,
+         sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+  return zrleSendStream(cl, zos);
+}
+
+
+/*
+ * zrleMaxLines is the height of the bands a rectangle w wide is sent in:
+ * whole tile rows of at most ZRLE_MAX_RECT_SIZE bytes of pixel data, but
+ * at least one.  Deflate adds next to nothing to incompressible data, so
+ * the chunks a client holds for a band are bounded by about the same.
+ */
+
+static int zrleMaxLines(rfbClientPtr cl, int w)
+{
+  int bytesPerTileRow = w * (cl->format.bitsPerPixel / 8) * rfbZRLETileHeight;
+  int tileRows = ZRLE_MAX_RECT_SIZE / (bytesPerTileRow > 0 ? bytesPerTileRow : 1);
+
+  return (tileRows > 1 ? tileRows : 1) * rfbZRLETileHeight;
+}
+
+int rfbNumCodedRectsZRLE(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  (void)x;
+  (void)y;
+  if (h <= 0)
+    return 1;
+  return (h - 1) / zrleMaxLines(cl, w) + 1;
+}
+
+
+/*
+ * rfbSendRectEncodingZRLE - send a given rectangle using ZRLE encoding,
+ * as rfbNumCodedRectsZRLE bands.
+ */
+
+rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  int maxLines = zrleMaxLines(cl, w), lines;
+
+  do {
+    lines = h < maxLines ? h : maxLines;
+    if (!rfbSendRectEncodingZRLEBand(cl, x, y, w, lines))
+      return FALSE;
+    y += lines;
+    h -= lines;
+  } while (h > 0);
 
   return TRUE;
 }
@@ -253,5 +556,26 @@ void rfbFreeZrleData(rfbClientPtr cl)
 		free(cl->paletteHelper);
 	}
 	cl->paletteHelper = NULL;
+
+	if (cl->zrleStripes) {
+		int i;
+		for (i = 0; i < rfbZRLEMaxStripes; i++)
+			zrleFreeStripe(&((zrleStripe*)cl->zrleStripes)[i]);
+		free(cl->zrleStripes);
+	}
+	cl->zrleStripes = NULL;
 }
 
+
+void rfbZrleInitScreen(rfbScreenInfoPtr screen)
+{
+	screen->zrleChunkPool = zrleChunkPoolNew(ZRLE_POOL_MAX_FREE_CHUNKS);
+}
+
+void rfbZrleCleanup(rfbScreenInfoPtr screen)
+{
+	if (screen->zrleChunkPool) {
+		zrleChunkPoolFree(screen->zrleChunkPool);
+	}
+	screen->zrleChunkPool = NULL;
+}
@@ -29,6 +29,9 @@
  * Note that the buf argument to ZRLE_ENCODE needs to be at least one pixel
  * bigger than the largest tile of pixel data, since the ZRLE encoding
  * algorithm writes to the position one past the end of the pixel data.
+ * buf, zywrleBuf and paletteHelper (which must have been initialised with
+ * zrlePaletteHelperInit) belong to one ZRLE_ENCODE call at a time, so
+ * several rectangles can be encoded concurrently with separate ones.
  */
 
 #include "zrleoutstream.h"
@@ -62,18 +65,27 @@
 #define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,CPIXEL)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,CPIXEL,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,CPIXEL,END_FIX)
+#define ZRLE_ANALYSE_TILE __RFB_CONCAT3E(zrleAnalyseTile,CPIXEL,END_FIX)
+#define ZRLE_LIST_RUNS __RFB_CONCAT3E(zrleListRuns,CPIXEL,END_FIX)
+#define ZRLE_SKIP_RUN zrleSkipRun32
 #define BPPOUT 24
 #elif BPP==15
 #define PIXEL_T __RFB_CONCAT2E(zrle_U,16)
 #define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,16)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,BPP,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,BPP,END_FIX)
+#define ZRLE_ANALYSE_TILE __RFB_CONCAT3E(zrleAnalyseTile,BPP,END_FIX)
+#define ZRLE_LIST_RUNS __RFB_CONCAT3E(zrleListRuns,BPP,END_FIX)
+#define ZRLE_SKIP_RUN zrleSkipRun16
 #define BPPOUT 16
 #else
 #define PIXEL_T __RFB_CONCAT2E(zrle_U,BPP)
 #define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,BPP)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,BPP,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,BPP,END_FIX)
+#define ZRLE_ANALYSE_TILE __RFB_CONCAT3E(zrleAnalyseTile,BPP,END_FIX)
+#define ZRLE_LIST_RUNS __RFB_CONCAT3E(zrleListRuns,BPP,END_FIX)
+#define ZRLE_SKIP_RUN __RFB_CONCAT2E(zrleSkipRun,BPP)
 #define BPPOUT BPP
 #endif
 
@@ -84,10 +96,75 @@ static const int bitsPerPackedPixel[] = {
   0, 1, 2, 2, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
 };
 
+/*
+ * zrleSkipRun<N> returns the first pixel at or after ptr which differs from
+ * pix.  Whole 16 byte blocks are compared at once where SSE2 or NEON is
+ * available; the remainder is done pixel by pixel, which relies on the pixel
+ * at end being different from the last pixel of the tile (see below).
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ZRLE_SIMD_SKIP(T, vpix)                                              \
+  while ((const zrle_U8*)end - (const zrle_U8*)ptr >= 16 &&                  \
+         _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)ptr), \
+                                          vpix)) == 0xFFFF)                  \
+    ptr += 16 / sizeof(T);
+#define ZRLE_SIMD_PIX8(p)  __m128i vpix = _mm_set1_epi8((char)(p))
+#define ZRLE_SIMD_PIX16(p) __m128i vpix = _mm_set1_epi16((short)(p))
+#define ZRLE_SIMD_PIX32(p) __m128i vpix = _mm_set1_epi32((int)(p))
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ZRLE_SIMD_SKIP(T, vpix)                                              \
+  while ((const zrle_U8*)end - (const zrle_U8*)ptr >= 16) {                  \
+    uint8x16_t eq = vceqq_u8(vld1q_u8((const zrle_U8*)ptr), vpix);            \
+    uint8x8_t m = vand_u8(vget_low_u8(eq), vget_high_u8(eq));                \
+    if (vget_lane_u64(vreinterpret_u64_u8(m), 0) != ~(uint64_t)0)            \
+      break;                                                                 \
+    ptr += 16 / sizeof(T);                                                   \
+  }
+#define ZRLE_SIMD_PIX8(p)  uint8x16_t vpix = vdupq_n_u8(p)
+#define ZRLE_SIMD_PIX16(p) uint8x16_t vpix = vreinterpretq_u8_u16(vdupq_n_u16(p))
+#define ZRLE_SIMD_PIX32(p) uint8x16_t vpix = vreinterpretq_u8_u32(vdupq_n_u32(p))
+#endif
+
+#ifdef ZRLE_SIMD_SKIP
+#define ZRLE_DEFINE_SKIP_RUN(bits)                                           \
+static __RFB_CONCAT2E(zrle_U,bits)*                                          \
+__RFB_CONCAT2E(zrleSkipRun,bits)(__RFB_CONCAT2E(zrle_U,bits)* ptr,           \
+                                 const __RFB_CONCAT2E(zrle_U,bits)* end,     \
+                                 __RFB_CONCAT2E(zrle_U,bits) pix)            \
+{                                                                            \
+  __RFB_CONCAT2E(ZRLE_SIMD_PIX,bits)(pix);                                   \
+  ZRLE_SIMD_SKIP(__RFB_CONCAT2E(zrle_U,bits), vpix)                          \
+  while (*ptr == pix)                                                        \
+    ptr++;                                                                   \
+  return ptr;                                                                \
+}
+#else
+#define ZRLE_DEFINE_SKIP_RUN(bits)                                           \
+static __RFB_CONCAT2E(zrle_U,bits)*                                          \
+__RFB_CONCAT2E(zrleSkipRun,bits)(__RFB_CONCAT2E(zrle_U,bits)* ptr,           \
+                                 const __RFB_CONCAT2E(zrle_U,bits)* end,     \
+                                 __RFB_CONCAT2E(zrle_U,bits) pix)            \
+{                                                                            \
+  (void)end;                                                                 \
+  while (*ptr == pix)                                                        \
+    ptr++;                                                                   \
+  return ptr;                                                                \
+}
+#endif
+
+ZRLE_DEFINE_SKIP_RUN(8)
+ZRLE_DEFINE_SKIP_RUN(16)
+ZRLE_DEFINE_SKIP_RUN(32)
+
 #endif /* ZRLE_ONCE */
 
 void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, zrleOutStream* os,
 		int zywrle_level, int *zywrleBuf, void *paletteHelper);
+void ZRLE_ANALYSE_TILE (PIXEL_T* data, int w, int h, zrlePaletteHelper* ph,
+		int *runs, int *singlePixels);
 
 #if BPP!=8
 #define ZYWRLE_ENCODE
@@ -95,7 +172,8 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, zrleOutStream* os,
 #endif
 
 static void ZRLE_ENCODE (int x, int y, int w, int h,
-		  zrleOutStream* os, void* buf
+		  zrleOutStream* os, void* buf,
+		  int *zywrleBuf, void *paletteHelper
                   EXTRA_ARGS
                   )
 {
@@ -109,18 +187,106 @@ static void ZRLE_ENCODE (int x, int y, int w, int h,
 
       GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf);
 
-      if (cl->paletteHelper == NULL) {
-          cl->paletteHelper = (void *) calloc(sizeof(zrlePaletteHelper), 1);
-      }
-
       ZRLE_ENCODE_TILE((PIXEL_T*)buf, tw, th, os,
-		      cl->zywrleLevel, cl->zywrleBuf, cl->paletteHelper);
+		      cl->zywrleLevel, zywrleBuf, paletteHelper);
     }
   }
   zrleOutStreamFlush(os);
 }
 
 
+/*
+ * ZRLE_LIST_RUNS finds the palette, the runs and the number of single
+ * pixels of a tile in one pass.  The runs are stored in the palette helper
+ * together with their palette index, so the encoder can write them out
+ * without scanning the pixels again.  The pixel after the end of data must
+ * differ from the last pixel of the tile.
+ */
+
+static void ZRLE_LIST_RUNS(PIXEL_T* data, int w, int h, zrlePaletteHelper* ph,
+	int *runs, int *singlePixels)
+{
+  PIXEL_T* ptr = data;
+  PIXEL_T* end = ptr + h * w;
+  int nRuns = 0, nSingle = 0, n = 0;
+
+  zrlePaletteHelperReset(ph);
+
+  while (ptr < end) {
+    PIXEL_T pix = *ptr;
+    PIXEL_T* runEnd = ptr + 1;
+    int index;
+
+    if (*runEnd != pix) {
+      nSingle++;
+    } else {
+      runEnd = ZRLE_SKIP_RUN(runEnd + 1, end, pix);
+      nRuns++;
+    }
+
+    index = zrlePaletteHelperInsert(ph, pix);
+    ph->runLength[n] = runEnd - ptr;
+    ph->runIndex[n] = index < 0 ? 255 : index;
+    n++;
+    ptr = runEnd;
+  }
+
+  ph->nRuns = n;
+  *runs = nRuns;
+  *singlePixels = nSingle;
+}
+
+/*
+ * ZRLE_ANALYSE_TILE is ZRLE_LIST_RUNS with two shortcuts.  Solid tiles are
+ * by far the most common case, so they are checked for before doing any
+ * hashing.  Tiles with hardly a run in their first row (photos, noise) are
+ * nearly always sent raw, and recording a run per pixel made them slower
+ * than the old pixel by pixel count, so they are only counted; ph->nRuns
+ * is 0 then and the encoder lists the runs if it needs them after all.
+ */
+
+void ZRLE_ANALYSE_TILE(PIXEL_T* data, int w, int h, zrlePaletteHelper* ph,
+	int *runs, int *singlePixels)
+{
+  PIXEL_T* ptr = data;
+  PIXEL_T* end = ptr + h * w;
+  int nRuns = 0, nSingle = 0, equal = 0, x;
+
+  if (ZRLE_SKIP_RUN(ptr + 1, end, *ptr) == end) {
+    zrlePaletteHelperReset(ph);
+    ph->runLength[0] = h * w;
+    ph->runIndex[0] = zrlePaletteHelperInsert(ph, *ptr);
+    ph->nRuns = 1;
+    *runs = (h * w > 1);
+    *singlePixels = (h * w == 1);
+    return;
+  }
+
+  for (x = 1; x < w; x++)
+    equal += (ptr[x] == ptr[x - 1]);
+  if (equal * 8 >= w) {
+    ZRLE_LIST_RUNS(data, w, h, ph, runs, singlePixels);
+    return;
+  }
+
+  zrlePaletteHelperReset(ph);
+  while (ptr < end) {
+    PIXEL_T pix = *ptr;
+
+    if (*++ptr != pix) {
+      nSingle++;
+    } else {
+      while (*++ptr == pix) ;
+      nRuns++;
+    }
+    zrlePaletteHelperInsert(ph, pix);
+  }
+
+  ph->nRuns = 0;
+  *runs = nRuns;
+  *singlePixels = nSingle;
+}
+
 void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 	int zywrle_level, int *zywrleBuf,  void *paletteHelper)
 {
@@ -136,25 +302,14 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 
   int estimatedBytes;
   int plainRleBytes;
+  int paletteSize;
   int i;
 
-  PIXEL_T* ptr = data;
-  PIXEL_T* end = ptr + h * w;
-  *end = ~*(end-1); /* one past the end is different so the while loop ends */
+  PIXEL_T* end = data + h * w;
+  *end = ~*(end-1); /* one past the end is different so the run scan ends */
 
   ph = (zrlePaletteHelper *) paletteHelper;
-  zrlePaletteHelperInit(ph);
-
-  while (ptr < end) {
-    PIXEL_T pix = *ptr;
-    if (*++ptr != pix) {
-      singlePixels++;
-    } else {
-      while (*++ptr == pix) ;
-      runs++;
-    }
-    zrlePaletteHelperInsert(ph, pix);
-  }
+  ZRLE_ANALYSE_TILE(data, w, h, ph, &runs, &singlePixels);
 
   /* Solid tile is a special case */
 
@@ -207,36 +362,36 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
     }
   }
 
-  if (!usePalette) ph->size = 0;
+  /* the tile was only counted, see ZRLE_ANALYSE_TILE */
+  if ((useRle || usePalette) && ph->nRuns == 0)
+    ZRLE_LIST_RUNS(data, w, h, ph, &runs, &singlePixels);
+
+  /* ph->size must stay intact, zrlePaletteHelperReset needs it */
+  paletteSize = usePalette ? ph->size : 0;
 
-  zrleOutStreamWriteU8(os, (useRle ? 128 : 0) | ph->size);
+  zrleOutStreamWriteU8(os, (useRle ? 128 : 0) | paletteSize);
 
-  for (i = 0; i < ph->size; i++) {
+  for (i = 0; i < paletteSize; i++) {
     zrleOutStreamWRITE_PIXEL(os, ph->palette[i]);
   }
 
   if (useRle) {
 
     PIXEL_T* ptr = data;
-    PIXEL_T* end = ptr + w * h;
-    PIXEL_T* runStart;
-    PIXEL_T pix;
-    while (ptr < end) {
-      int len;
-      runStart = ptr;
-      pix = *ptr++;
-      while (*ptr == pix && ptr < end)
-        ptr++;
-      len = ptr - runStart;
+    int r;
+    for (r = 0; r < ph->nRuns; r++) {
+      int len = ph->runLength[r];
+      PIXEL_T pix = *ptr;
+      ptr += len;
       if (len <= 2 && usePalette) {
-        int index = zrlePaletteHelperLookup(ph, pix);
+        int index = ph->runIndex[r];
         if (len == 2)
           zrleOutStreamWriteU8(os, index);
         zrleOutStreamWriteU8(os, index);
         continue;
       }
       if (usePalette) {
-        int index = zrlePaletteHelperLookup(ph, pix);
+        int index = ph->runIndex[r];
         zrleOutStreamWriteU8(os, index | 128);
       } else {
         zrleOutStreamWRITE_PIXEL(os, pix);
@@ -255,9 +410,11 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 
     if (usePalette) {
       int bppp;
-      PIXEL_T* ptr = data;
+      int r = 0;
+      int left = ph->runLength[0];
+      zrle_U8 index = ph->runIndex[0];
 
-      /* packed pixels */
+      /* packed pixels, taking the indices from the run list */
 
       assert (ph->size < 17);
 
@@ -266,12 +423,15 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
       for (i = 0; i < h; i++) {
         zrle_U8 nbits = 0;
         zrle_U8 byte = 0;
+        int x;
 
-        PIXEL_T* eol = ptr + w;
-
-        while (ptr < eol) {
-          PIXEL_T pix = *ptr++;
-          zrle_U8 index = zrlePaletteHelperLookup(ph, pix);
+        for (x = 0; x < w; x++) {
+          if (left == 0) {
+            r++;
+            left = ph->runLength[r];
+            index = ph->runIndex[r];
+          }
+          left--;
           byte = (byte << bppp) | index;
           nbits += bppp;
           if (nbits >= 8) {
@@ -312,5 +472,8 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 #undef zrleOutStreamWRITE_PIXEL
 #undef ZRLE_ENCODE
 #undef ZRLE_ENCODE_TILE
+#undef ZRLE_ANALYSE_TILE
+#undef ZRLE_LIST_RUNS
+#undef ZRLE_SKIP_RUN
 #undef ZYWRLE_ENCODE_TILE
 #undef BPPOUT
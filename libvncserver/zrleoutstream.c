@@ -22,7 +22,6 @@
 #include <stdlib.h>
 
 #define ZRLE_IN_BUFFER_SIZE  16384
-#define ZRLE_OUT_BUFFER_SIZE 1024
 #undef  ZRLE_DEBUG
 
 static rfbBool zrleBufferAlloc(zrleBuffer *buffer, int size)
@@ -45,25 +44,96 @@ static void zrleBufferFree(zrleBuffer *buffer)
   buffer->start = buffer->ptr = buffer->end = NULL;
 }
 
-static rfbBool zrleBufferGrow(zrleBuffer *buffer, int size)
+zrleChunkPool *zrleChunkPoolNew(int maxFree)
 {
-  int offset;
+  zrleChunkPool *pool;
 
-  size  += buffer->end - buffer->start;
-  offset = ZRLE_BUFFER_LENGTH (buffer);
+  pool = calloc(sizeof(zrleChunkPool), 1);
+  if (pool == NULL)
+    return NULL;
 
-  buffer->start = realloc(buffer->start, size);
-  if (!buffer->start) {
-    return FALSE;
+  pool->maxFree = maxFree;
+  INIT_MUTEX(pool->mutex);
+
+  return pool;
+}
+
+void zrleChunkPoolFree(zrleChunkPool *pool)
+{
+  while (pool->free) {
+    zrleChunk *next = pool->free->next;
+    free(pool->free);
+    pool->free = next;
   }
+  TINI_MUTEX(pool->mutex);
+  free(pool);
+}
 
-  buffer->end = buffer->start + size;
-  buffer->ptr = buffer->start + offset;
+static zrleChunk *zrleChunkGet(zrleChunkPool *pool)
+{
+  zrleChunk *chunk = NULL;
+
+  if (pool) {
+    LOCK(pool->mutex);
+    if ((chunk = pool->free) != NULL) {
+      pool->free = chunk->next;
+      pool->nFree--;
+    }
+    UNLOCK(pool->mutex);
+  }
+  if (chunk == NULL)
+    chunk = malloc(sizeof(zrleChunk));
+  if (chunk)
+    chunk->next = NULL;
+
+  return chunk;
+}
+
+/* gives a chain of chunks back to the pool, freeing what it cannot keep */
+static void zrleChunkPut(zrleChunkPool *pool, zrleChunk *chunk)
+{
+  while (chunk) {
+    zrleChunk *next = chunk->next;
+    rfbBool kept = FALSE;
+
+    if (pool) {
+      LOCK(pool->mutex);
+      if (pool->nFree < pool->maxFree) {
+	chunk->next = pool->free;
+	pool->free = chunk;
+	pool->nFree++;
+	kept = TRUE;
+      }
+      UNLOCK(pool->mutex);
+    }
+    if (!kept)
+      free(chunk);
+    chunk = next;
+  }
+}
+
+/* appends a new chunk to the output when the last one is full */
+static rfbBool zrleOutStreamNextChunk(zrleOutStream *os)
+{
+  zrleChunk *chunk = zrleChunkGet(os->pool);
+
+  if (chunk == NULL)
+    return FALSE;
+
+  if (os->tail)
+    os->tail->next = chunk;
+  else
+    os->head = chunk;
+  os->tail = chunk;
+  os->nChunks++;
+
+  os->out.start = os->out.ptr = chunk->data;
+  os->out.end = chunk->data + ZRLE_CHUNK_SIZE;
 
   return TRUE;
 }
 
-zrleOutStream *zrleOutStreamNew(void)
+zrleOutStream *zrleOutStreamNew(zrleChunkPool *pool, rfbDeflateBackend *backend)
 {
   zrleOutStream *os;
 
@@ -76,16 +146,18 @@ zrleOutStream *zrleOutStreamNew(void)
     return NULL;
   }
 
-  if (!zrleBufferAlloc(&os->out, ZRLE_OUT_BUFFER_SIZE)) {
-    zrleBufferFree(&os->in);
-    free(os);
-    return NULL;
-  }
+  os->out.start = os->out.ptr = os->out.end = NULL;
+  os->head = os->tail = NULL;
+  os->nChunks = 0;
+  os->pool = pool;
+  os->backend = backend ? backend : &rfbDeflateBackendZlib;
 
   os->zs.zalloc = Z_NULL;
   os->zs.zfree  = Z_NULL;
   os->zs.opaque = Z_NULL;
-  if (deflateInit(&os->zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+  /* the parameters deflateInit() uses */
+  if (os->backend->init(&os->zs, Z_DEFAULT_COMPRESSION, MAX_WBITS, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
     zrleBufferFree(&os->in);
     free(os);
     return NULL;
@@ -96,12 +168,29 @@ zrleOutStream *zrleOutStreamNew(void)
 
 void zrleOutStreamFree (zrleOutStream *os)
 {
-  deflateEnd(&os->zs);
+  os->backend->end(&os->zs);
   zrleBufferFree(&os->in);
-  zrleBufferFree(&os->out);
+  zrleOutStreamReset(os);
   free(os);
 }
 
+/* discards pending input and output; the output chunks go back to the pool */
+void zrleOutStreamReset(zrleOutStream *os)
+{
+  zrleChunkPut(os->pool, os->head);
+  os->head = os->tail = NULL;
+  os->nChunks = 0;
+  os->out.start = os->out.ptr = os->out.end = NULL;
+  os->in.ptr = os->in.start;
+}
+
+int zrleOutStreamLength(zrleOutStream *os)
+{
+  if (os->nChunks == 0)
+    return 0;
+  return (os->nChunks - 1) * ZRLE_CHUNK_SIZE + ZRLE_BUFFER_LENGTH(&os->out);
+}
+
 rfbBool zrleOutStreamFlush(zrleOutStream *os)
 {
   os->zs.next_in = os->in.start;
@@ -115,8 +204,7 @@ rfbBool zrleOutStreamFlush(zrleOutStream *os)
     do {
       int ret;
 
-      if (os->out.ptr >= os->out.end &&
-	  !zrleBufferGrow(&os->out, os->out.end - os->out.start)) {
+      if (os->out.ptr >= os->out.end && !zrleOutStreamNextChunk(os)) {
 	rfbLog("zrleOutStreamFlush: failed to grow output buffer\n");
 	return FALSE;
       }
@@ -129,7 +217,7 @@ rfbBool zrleOutStreamFlush(zrleOutStream *os)
 	     os->zs.avail_in, os->zs.avail_out);
 #endif 
 
-      if ((ret = deflate(&os->zs, Z_SYNC_FLUSH)) != Z_OK) {
+      if ((ret = os->backend->deflate(&os->zs, Z_SYNC_FLUSH)) != Z_OK) {
 	rfbLog("zrleOutStreamFlush: deflate failed with error code %d\n", ret);
 	return FALSE;
       }
@@ -162,8 +250,7 @@ static int zrleOutStreamOverrun(zrleOutStream *os,
     do {
       int ret;
 
-      if (os->out.ptr >= os->out.end &&
-	  !zrleBufferGrow(&os->out, os->out.end - os->out.start)) {
+      if (os->out.ptr >= os->out.end && !zrleOutStreamNextChunk(os)) {
 	rfbLog("zrleOutStreamOverrun: failed to grow output buffer\n");
 	return FALSE;
       }
@@ -176,7 +263,7 @@ static int zrleOutStreamOverrun(zrleOutStream *os,
 	     os->zs.avail_in, os->zs.avail_out);
 #endif
 
-      if ((ret = deflate(&os->zs, 0)) != Z_OK) {
+      if ((ret = os->backend->deflate(&os->zs, 0)) != Z_OK) {
 	rfbLog("zrleOutStreamOverrun: deflate failed with error code %d\n", ret);
 	return 0;
       }
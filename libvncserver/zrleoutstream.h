@@ -31,17 +31,59 @@ typedef struct {
   zrle_U8 *end;
 } zrleBuffer;
 
+/*
+ * The compressed output is kept in a chain of fixed size chunks rather than
+ * in one buffer which is realloc'ed as it grows.  The chunks come from a
+ * pool shared by all streams of a screen and go back to it as soon as the
+ * output has been sent, so idle clients hold no output memory at all and
+ * the pool keeps at most maxFree chunks around.  A busy client holds the
+ * output of one rectangle, which zrle.c keeps to about ZRLE_MAX_RECT_SIZE
+ * by sending large ones in bands.
+ */
+
+#define ZRLE_CHUNK_SIZE 32768
+
+typedef struct _zrleChunk {
+  struct _zrleChunk *next;
+  zrle_U8 data[ZRLE_CHUNK_SIZE];
+} zrleChunk;
+
+typedef struct {
+  zrleChunk *free;
+  int        nFree;
+  int        maxFree;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+  MUTEX(mutex);
+#endif
+} zrleChunkPool;
+
 typedef struct {
   zrleBuffer in;
-  zrleBuffer out;
+  zrleBuffer out;         /* the unused part of the last chunk */
+
+  zrleChunk     *head;
+  zrleChunk     *tail;
+  int            nChunks;
+  zrleChunkPool *pool;    /* may be NULL */
 
-  z_stream   zs;
+  z_stream           zs;
+  rfbDeflateBackend *backend;
 } zrleOutStream;
 
 #define ZRLE_BUFFER_LENGTH(b) ((b)->ptr - (b)->start)
 
-zrleOutStream *zrleOutStreamNew           (void);
+/* the number of bytes of output in chunk c of os */
+#define ZRLE_CHUNK_LENGTH(os, c) \
+  ((c) == (os)->tail ? ZRLE_BUFFER_LENGTH(&(os)->out) : ZRLE_CHUNK_SIZE)
+
+zrleChunkPool *zrleChunkPoolNew           (int            maxFree);
+void           zrleChunkPoolFree          (zrleChunkPool *pool);
+
+zrleOutStream *zrleOutStreamNew           (zrleChunkPool     *pool,
+					   rfbDeflateBackend *backend);
 void           zrleOutStreamFree          (zrleOutStream *os);
+void           zrleOutStreamReset         (zrleOutStream *os);
+int            zrleOutStreamLength        (zrleOutStream *os);
 rfbBool        zrleOutStreamFlush         (zrleOutStream *os);
 void           zrleOutStreamWriteBytes    (zrleOutStream *os,
 					   const zrle_U8 *data,
@@ -22,30 +22,27 @@
 #include <assert.h>
 #include <string.h>
 
-#define ZRLE_HASH(pix) (((pix) ^ ((pix) >> 17)) & 4095)
-
 void zrlePaletteHelperInit(zrlePaletteHelper *helper)
 {
   memset(helper->palette, 0, sizeof(helper->palette));
   memset(helper->index, 255, sizeof(helper->index));
   memset(helper->key, 0, sizeof(helper->key));
   helper->size = 0;
+  helper->nRuns = 0;
 }
 
-void zrlePaletteHelperInsert(zrlePaletteHelper *helper, zrle_U32 pix)
+void zrlePaletteHelperReset(zrlePaletteHelper *helper)
 {
-  if (helper->size < ZRLE_PALETTE_MAX_SIZE) {
-    int i = ZRLE_HASH(pix);
-
-    while (helper->index[i] != 255 && helper->key[i] != pix)
-      i++;
-    if (helper->index[i] != 255) return;
-
-    helper->index[i] = helper->size;
-    helper->key[i] = pix;
-    helper->palette[helper->size] = pix;
-  }
-  helper->size++;
+  int i, n = helper->size;
+
+  /* clearing the 4K slot table for every tile costs more than analysing
+     a simple tile, so only undo the slots we used */
+  if (n > ZRLE_PALETTE_MAX_SIZE)
+    n = ZRLE_PALETTE_MAX_SIZE;
+  for (i = 0; i < n; i++)
+    helper->index[helper->slot[i]] = 255;
+  helper->size = 0;
+  helper->nRuns = 0;
 }
 
 int zrlePaletteHelperLookup(zrlePaletteHelper *helper, zrle_U32 pix)
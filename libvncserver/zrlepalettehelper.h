@@ -20,27 +20,65 @@
 
 /*
  * The PaletteHelper class helps us build up the palette from pixel data by
- * storing a reverse index using a simple hash-table
+ * storing a reverse index using a simple hash-table.  It also holds the run
+ * list of the current tile, so that the encoder does not have to scan the
+ * pixels and probe the hash a second time when writing the tile out.
  */
 
 #ifndef __ZRLE_PALETTE_HELPER_H__
 #define __ZRLE_PALETTE_HELPER_H__
 
 #include "zrletypes.h"
+#include "rfb/rfbproto.h"
 
 #define ZRLE_PALETTE_MAX_SIZE 127
+#define ZRLE_TILE_MAX_PIXELS  (rfbZRLETileWidth * rfbZRLETileHeight)
 
 typedef struct {
   zrle_U32  palette[ZRLE_PALETTE_MAX_SIZE];
+  zrle_U16  slot[ZRLE_PALETTE_MAX_SIZE];
   zrle_U8   index[ZRLE_PALETTE_MAX_SIZE + 4096];
   zrle_U32  key[ZRLE_PALETTE_MAX_SIZE + 4096];
   int       size;
+
+  /* runs of the last analysed tile; runIndex is only valid if the
+     palette did not overflow */
+  int       nRuns;
+  zrle_U16  runLength[ZRLE_TILE_MAX_PIXELS];
+  zrle_U8   runIndex[ZRLE_TILE_MAX_PIXELS];
 } zrlePaletteHelper;
 
+/* zrlePaletteHelperInit must be called once on a new helper, after that
+   zrlePaletteHelperReset only clears the hash slots used by the last tile */
 void zrlePaletteHelperInit  (zrlePaletteHelper *helper);
-void zrlePaletteHelperInsert(zrlePaletteHelper *helper,
-			     zrle_U32           pix);
+void zrlePaletteHelperReset (zrlePaletteHelper *helper);
 int  zrlePaletteHelperLookup(zrlePaletteHelper *helper,
 			     zrle_U32           pix);
 
+/* Fibonacci hashing: unlike the old xor-shift this spreads pixels which
+   differ only in their low (blue) or high (red) bits over the whole table. */
+#define ZRLE_HASH(pix) ((zrle_U32)((pix) * 0x9E3779B1U) >> 20)
+
+/* returns the palette index of pix, or -1 if the palette is full.  This is
+   called once per run, so it is inlined into the tile analyser. */
+static inline int zrlePaletteHelperInsert(zrlePaletteHelper *helper,
+					  zrle_U32           pix)
+{
+  if (helper->size < ZRLE_PALETTE_MAX_SIZE) {
+    int i = ZRLE_HASH(pix);
+
+    while (helper->index[i] != 255 && helper->key[i] != pix)
+      i++;
+    if (helper->index[i] != 255) return helper->index[i];
+
+    helper->index[i] = helper->size;
+    helper->key[i] = pix;
+    helper->slot[helper->size] = i;
+    helper->palette[helper->size] = pix;
+    return helper->size++;
+  }
+  helper->size++;
+  return -1;
+}
+
 #endif /* __ZRLE_PALETTE_HELPER_H__ */
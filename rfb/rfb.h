@@ -222,6 +222,10 @@ typedef struct _rfbProtocolExtension {
 	/** processArguments returns the number of handled arguments */
 	int (*processArgument)(int argc, char *argv[]);
 	struct _rfbProtocolExtension* next;
+	/** if messageTypes is not NULL, it contains a 0 terminated list of
+	   the message types handleMessage is to be called for; otherwise it
+	   is called for all messages the server does not handle itself. */
+	int *messageTypes;
 } rfbProtocolExtension;
 
 typedef struct _rfbExtensionData {
@@ -230,6 +234,24 @@ typedef struct _rfbExtensionData {
 	struct _rfbExtensionData* next;
 } rfbExtensionData;
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/**
+ * Deflate implementation used by the zlib, tight and ZRLE encoders.  The
+ * functions behave like their zlib namesakes (deflateInit2, deflateParams,
+ * deflate and deflateEnd) and work on the encoder's z_stream, so every
+ * backend has to produce a stream which zlib's inflate can decode.
+ */
+
+typedef struct _rfbDeflateBackend {
+	const char* name;
+	int (*init)(z_streamp strm, int level, int windowBits, int memLevel,
+			int strategy);
+	int (*params)(z_streamp strm, int level, int strategy);
+	int (*deflate)(z_streamp strm, int flush);
+	int (*end)(z_streamp strm);
+} rfbDeflateBackend;
+#endif
+
 /**
  * Per-screen (framebuffer) structure.  There can be as many as you wish,
  * each serving different clients. However, you have to call
@@ -241,6 +263,13 @@ typedef struct _rfbScreenInfo
     /** this structure has children that are scaled versions of this screen */
     struct _rfbScreenInfo *scaledScreenNext;
     int scaledScreenRefCount;
+    /** in a scaled screen, the part of the original changed since it was
+        last scaled into this one; scaled when sent, see rfbScaledScreenPrepare() */
+    struct sraRegion* scaledDamage;
+    MUTEX(scaledDamageMutex);
+    /** in a scaled screen, the filter tables and line buffers it is scaled
+        with, kept until the scale factor changes */
+    struct _rfbScaler* scaler;
 
     int width;
     int paddedWidthInBytes;
@@ -292,6 +321,8 @@ typedef struct _rfbScreenInfo
     /* http stuff */
     rfbBool httpInitDone;
     rfbBool httpEnableProxyConnect;
+    /** the httpd serves rfbMetricsFormat() as /metrics */
+    rfbBool httpEnableMetrics;
     int httpPort;
     char* httpDir;
     SOCKET httpListenSock;
@@ -393,6 +424,28 @@ typedef struct _rfbScreenInfo
     SOCKET listen6Sock;
     int http6Port;
     SOCKET httpListen6Sock;
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    /** output buffers shared by the ZRLE streams of all clients */
+    void* zrleChunkPool;
+    /** deflate implementation for new clients; NULL means plain zlib */
+    rfbDeflateBackend* deflateBackend;
+#endif
+    /** if set, also listen for local clients on a UNIX socket of this
+        name; they can use the shared memory transport */
+    char* unixSockPath;
+    SOCKET listenUnixSock;
+    /** if set, the output of all clients is sent through io_uring, see
+        uring.c; only on Linux and without a background thread */
+    rfbBool useIOUring;
+    void* ioUring;
+    /** if set, the pieces of an update are sent as full TCP segments */
+    rfbBool corkUpdates;
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+    /** the context information of the application areas, see
+        rfbMLExtSetContextInformation() */
+    struct rfbMLExtContextArea* mlContextAreas;
+    MUTEX(mlContextMutex);
+#endif
 } rfbScreenInfo, *rfbScreenInfoPtr;
 
 
@@ -439,6 +492,43 @@ typedef struct _rfbStatList {
     struct _rfbStatList *Next;
 } rfbStatList;
 
+/** log-linear histogram, see metrics.c */
+#define RFB_HISTOGRAM_BUCKETS 256
+
+typedef struct _rfbHistogram {
+    uint64_t count, sum, min, max;
+    uint32_t buckets[RFB_HISTOGRAM_BUCKETS];
+} rfbHistogram;
+
+typedef enum {
+    rfbMetricUpdateLatency,   /**< us from a change to the end of its update */
+    rfbMetricQueueDepth,      /**< bytes in the send queue after an update */
+    rfbMetricFrameBytes,      /**< bytes per framebuffer update */
+    rfbMetricEncodeTime       /**< us per rectangle, for one encoding */
+} rfbMetric;
+
+typedef enum {
+    rfbCounterUpdates,
+    rfbCounterRects,
+    rfbCounterBytes,
+    rfbCounterMax
+} rfbCounter;
+
+/** encodings timed separately, the others are counted together */
+#define RFB_METRICS_ENCODINGS 16
+
+struct _rfbClientMetrics;
+
+/** the stages of a change traced from rfbMarkRegionAsModified() to the socket,
+    see trace.c */
+typedef enum {
+    rfbTraceStageMarked,
+    rfbTraceStageDeferred,    /**< waiting for more changes to coalesce */
+    rfbTraceStagePickedUp,    /**< taken into a framebuffer update */
+    rfbTraceStageEncoded,
+    rfbTraceStageWritten
+} rfbTraceStage;
+
 typedef struct _rfbSslCtx rfbSslCtx;
 typedef struct _wsCtx wsCtx;
 
@@ -593,7 +683,18 @@ typedef struct _rfbClientRec {
     struct _rfbStatList *statEncList;
     struct _rfbStatList *statMsgList;
     int rawBytesEquivalent;
+    /** bytes handed to the socket */
     int bytesSent;
+    /** system calls writing to the socket, see rfbStatGetWritesSent() */
+    int writesSent;
+
+    /** counters and histograms, see rfbMetricsGetHistogram() */
+    struct _rfbClientMetrics* metrics;
+    /** the ids of the traced changes not sent yet, 0 if none */
+    uint32_t traceFirstDamage, traceLastDamage;
+
+    /** TCP_CORK can be used on the socket, and is set during an update */
+    rfbBool canCork, corked;
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     /* zlib encoding -- necessary compression state info per client */
@@ -601,6 +702,8 @@ typedef struct _rfbClientRec {
     struct z_stream_s compStream;
     rfbBool compStreamInited;
     uint32_t zlibCompressLevel;
+    /** deflate implementation of all compressed streams of this client */
+    rfbDeflateBackend* deflateBackend;
 #endif
 #if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
     /** the quality level is also used by ZYWRLE and TightPng */
@@ -632,12 +735,21 @@ typedef struct _rfbClientRec {
 #ifdef LIBVNCSERVER_HAVE_ML_EXT
     rfbBool enableMLExtContextInformation; /**< client supports context information encoding for mirrorlink */
     rfbBool enableMLExtEncoding525;
+    struct rfbFramebufferBlock* fbBlocks; /**< what the client blocks, by application */
+    struct sraRegion* blockedRegion;      /**< all of it, NULL if nothing; see fbblock.c */
+    /** the context information rectangles last sent, and the next ones */
+    char *mlContextSent, *mlContextNext;
+    int mlContextSentLen, mlContextNextLen;
+    int mlContextSentSize, mlContextNextSize;
 #endif
     rfbBool useRichCursorEncoding;    /**< rfbEncodingRichCursor is preferred */
     rfbBool cursorWasChanged;         /**< cursor shape update should be sent */
     rfbBool cursorWasMoved;           /**< cursor position update should be sent */
     int cursorX,cursorY;	      /**< the coordinates of the cursor,
 					 if enableCursorShapeUpdates = FALSE */
+    /** the frame buffer with the cursor drawn in, where it is sent from,
+        if enableCursorShapeUpdates = FALSE; see cursor.c */
+    struct _rfbScreenInfo* cursorOverlay;
 
     rfbBool useNewFBSize;             /**< client supports NewFBSize encoding */
     rfbBool newFBSizePending;         /**< framebuffer size was changed */
@@ -664,13 +776,30 @@ typedef struct _rfbClientRec {
     void* zrleData;
     int zywrleLevel;
     int zywrleBuf[rfbZRLETileWidth * rfbZRLETileHeight];
+    rfbBool enableZRLEStripes;        /**< client supports ZRLEStripes encoding */
+    void* zrleStripes;                /**< per-stripe streams and buffers */
 #endif
 
+    /** output buffers of the LZ4 encoder threads */
+    void* lz4Data;
+    /** threads sharing the work on a rectangle, see workers.c */
+    void* workers;
+
+    /** the client is on a UNIX socket and asked for the shared memory
+        transport */
+    rfbBool enableSharedMemory;
+    /** the frame buffer shared with the client, see shm.c */
+    void* sharedMemory;
+    /** output queued for io_uring, see uring.c */
+    void* ioUringOutput;
+
     /** if progressive updating is on, this variable holds the current
      * y coordinate of the progressive slice. */
     int progressiveSliceY;
 
     rfbExtensionData* extensions;
+    /** per message type, the first of the extensions to try */
+    rfbExtensionData** extensionHandlers;
 
     /** for threaded zrle */
     char *zrleBeforeBuf;
@@ -766,9 +895,12 @@ extern int rfbConnect(rfbScreenInfoPtr rfbScreen, char* host, int port);
 extern int rfbConnectToTcpAddr(char* host, int port);
 extern int rfbListenOnTCPPort(int port, in_addr_t iface);
 extern int rfbListenOnTCP6Port(int port, const char* iface);
+extern int rfbListenOnUnixSocket(const char* path);
 extern int rfbListenOnUDPPort(int port, in_addr_t iface);
 extern int rfbStringToAddr(char* string,in_addr_t* addr);
 extern rfbBool rfbSetNonBlocking(int sock);
+extern void rfbCorkClient(rfbClientPtr cl);
+extern void rfbUncorkClient(rfbClientPtr cl);
 extern rfbBool rfbCheckMLExtEncoding525(int sock);
 
 
@@ -877,6 +1009,17 @@ extern rfbBool rfbSendRectEncodingHextile(rfbClientPtr cl, int x, int y, int w,
 
 extern rfbBool rfbSendRectEncodingUltra(rfbClientPtr cl, int x,int y,int w,int h);
 
+/* lz4.c */
+
+extern rfbBool rfbSendRectEncodingLZ4(rfbClientPtr cl, int x,int y,int w,int h);
+
+/* shm.c */
+
+extern rfbBool rfbIsUnixSocket(int sock);
+extern rfbBool rfbSharedMemoryNeedsSetup(rfbClientPtr cl);
+extern rfbBool rfbSendSharedMemory(rfbClientPtr cl);
+extern rfbBool rfbSendRectEncodingSharedMemory(rfbClientPtr cl, int x,int y,int w,int h);
+
 #ifdef LIBVNCSERVER_HAVE_ML_EXT_ENCODING525
 extern rfbBool rfbSendRectEncodingScanLineRLE(rfbClientPtr cl, int x,int y,int w,int h);
 #endif
@@ -935,6 +1078,7 @@ typedef struct rfbCursor {
     unsigned char *richSource; /**< source bytes for a rich cursor */
     unsigned char *alphaSource; /**< source for alpha blending info */
     rfbBool alphaPreMultiplied; /**< if richSource already has alpha applied */
+    struct rfbEncodedCursor* encoded; /**< the shape updates sent, see rfbSendCursorShape() */
 } rfbCursor, *rfbCursorPtr;
 extern unsigned char rfbReverseByte[0x100];
 
@@ -954,9 +1098,27 @@ extern void rfbDefaultPtrAddEvent(int buttonMask,int x,int y,rfbClientPtr cl);
 
 /* zrle.c */
 #ifdef LIBVNCSERVER_HAVE_LIBZ
+/** Maximum ZRLE rectangle size in bytes of pixel data.  A larger one is
+ * sent as bands of whole tile rows, so that the compressed output a client
+ * holds at a time stays near this; always allow at least one tile row.
+ */
+#define ZRLE_MAX_RECT_SIZE (1024*1024)
+
+extern int rfbNumCodedRectsZRLE(rfbClientPtr cl, int x, int y, int w, int h);
 extern rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w,int h);
 #endif
 
+/* deflate.c */
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/** plain zlib, this is the default */
+extern rfbDeflateBackend rfbDeflateBackendZlib;
+/** zlib at its fastest level whatever level the encoder asks for (except
+   0, which is kept); trades some compression for much less CPU */
+extern rfbDeflateBackend rfbDeflateBackendFast;
+/** returns the built-in backend called name, or NULL */
+extern rfbDeflateBackend* rfbGetDeflateBackend(const char* name);
+#endif
+
 /* stats.c */
 
 extern void rfbResetStats(rfbClientPtr cl);
@@ -1023,6 +1185,28 @@ typedef void (*rfbLogProc)(const char *format, ...);
 extern rfbLogProc rfbLog, rfbErr;
 extern void rfbLogPerror(const char *str);
 
+/* Log levels.  Messages above rfbLogLevel are skipped at run time, and
+   those above RFB_LOG_MAX_LEVEL are not even compiled in: build with
+   -DRFB_LOG_MAX_LEVEL=RFB_LOG_INFO to drop the debug tracing. */
+#define RFB_LOG_ERROR 0
+#define RFB_LOG_INFO  1
+#define RFB_LOG_DEBUG 2
+#ifndef RFB_LOG_MAX_LEVEL
+#define RFB_LOG_MAX_LEVEL RFB_LOG_DEBUG
+#endif
+extern int rfbLogLevel;
+
+#define rfbDebug(...) \
+  do { \
+    if (RFB_LOG_DEBUG <= RFB_LOG_MAX_LEVEL && rfbLogLevel >= RFB_LOG_DEBUG) \
+      rfbLog(__VA_ARGS__); \
+  } while (0)
+
+/* asynclog.c */
+
+extern rfbBool rfbStartAsyncLog(void);
+extern void rfbStopAsyncLog(void);
+
 void rfbScheduleCopyRect(rfbScreenInfoPtr rfbScreen,int x1,int y1,int x2,int y2,int dx,int dy);
 void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,int dx,int dy);
 
@@ -1105,6 +1289,52 @@ extern int rfbStatGetMessageCountSent(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetMessageCountRcvd(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetEncodingCountSent(rfbClientPtr cl, uint32_t type);
 extern int rfbStatGetEncodingCountRcvd(rfbClientPtr cl, uint32_t type);
+/** the number of writes to the client's socket, and of TCP segments sent
+    (-1 if the system does not tell) */
+extern int rfbStatGetWritesSent(rfbClientPtr cl);
+extern int rfbStatGetSegmentsSent(rfbClientPtr cl);
+
+/* metrics.c */
+
+/** microseconds of a monotonic clock */
+extern uint64_t rfbMetricsNow(void);
+extern void rfbHistogramRecord(rfbHistogram* h, uint64_t value);
+extern void rfbHistogramMerge(rfbHistogram* into, const rfbHistogram* h);
+/** e.g. rfbHistogramPercentile(h, 99.9) */
+extern uint64_t rfbHistogramPercentile(const rfbHistogram* h, double percentile);
+/** NULL if nothing was recorded; encoding is only for rfbMetricEncodeTime */
+extern const rfbHistogram* rfbMetricsGetHistogram(rfbClientPtr cl, rfbMetric metric, uint32_t encoding);
+extern uint64_t rfbMetricsGetCounter(rfbClientPtr cl, rfbCounter counter);
+/** text exposition of the metrics of all clients, returns the length like snprintf */
+extern int rfbMetricsFormat(rfbScreenInfoPtr screen, char* buf, int len);
+
+/* trace.c */
+
+/** starts tracing changes into a ring of that many records */
+extern rfbBool rfbTraceStart(int records);
+extern void rfbTraceStop(void);
+/** writes the trace in the Chrome trace event format */
+extern rfbBool rfbTraceDumpJSON(FILE* f);
+/** writes the raw trace records */
+extern rfbBool rfbTraceDumpBinary(FILE* f);
+
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+/* fbblock.c */
+
+/** stops sending the client a rectangle of its frame buffer, for an application */
+extern void rfbBlockFramebuffer(rfbClientPtr cl, uint32_t appId, int x, int y, int w, int h);
+extern void rfbUnblockFramebuffer(rfbClientPtr cl, uint32_t appId);
+/** handles a Framebuffer Blocking Notification read by the MirrorLink extension */
+extern void rfbMLExtFBBlockingNotify(rfbClientPtr cl, const rfbMLExt_FBBlockingNotify_t* msg);
+
+/* rfbserver.c */
+
+/** sets the context information sent for the area of an application, in
+    the host's byte order; it is only sent again when it changed */
+extern void rfbMLExtSetContextInformation(rfbScreenInfoPtr screen, int x, int y, int w, int h,
+                                          const rfbMLExt_ContextInformation_t* ctx);
+extern void rfbMLExtClearContextInformation(rfbScreenInfoPtr screen, uint32_t appId);
+#endif
 
 /** Set which version you want to advertise 3.3, 3.6, 3.7 and 3.8 are currently supported*/
 extern void rfbSetProtocolVersion(rfbScreenInfoPtr rfbScreen, int major_, int minor_);
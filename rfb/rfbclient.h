@@ -85,6 +85,10 @@ typedef struct {
   struct timeval tv;
   rfbBool readTimestamp;
   rfbBool doNotSleep;
+  /** play back this many times as fast as recorded */
+  double speed;
+  /** private: mapping of the file, index and clock of the playback */
+  void* data;
 } rfbVNCRec;
 
 /** client data */
@@ -95,6 +99,26 @@ typedef struct rfbClientData {
 	struct rfbClientData* next;
 } rfbClientData;
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/** decoder state for one stripe of a ZRLEStripes rectangle */
+
+typedef struct {
+  z_stream decompStream;
+  rfbBool decompStreamInited;
+  char* buffer;           /**< compressed data of the current stripe */
+  int bufferSize;
+  int length;
+  char* rawBuffer;        /**< inflated tiles of the current stripe */
+  int rawBufferSize;
+  int zywrleBuf[rfbZRLETileWidth * rfbZRLETileHeight];
+
+  struct _rfbClient* client;
+  int x, y, w, h;
+  int zywrleLevel;
+  rfbBool result;
+} rfbZRLEStripe;
+#endif
+
 /** app data (belongs into rfbClient?) */
 
 typedef struct {
@@ -177,6 +201,37 @@ typedef void (*BellProc)(struct _rfbClient* client);
 typedef void (*GotCursorShapeProc)(struct _rfbClient* client, int xhot, int yhot, int width, int height, int bytesPerPixel);
 typedef void (*GotCopyRectProc)(struct _rfbClient* client, int src_x, int src_y, int w, int h, int dest_x, int dest_y);
 
+/**
+ * A decoded H.264 picture in 4:2:0 YUV, as handed out by an rfbH264Decoder.
+ * The chroma samples of a row are uvStep bytes apart: 1 for planar I420,
+ * 2 for NV12, where v is u + 1.
+ */
+typedef struct {
+	const uint8_t *y, *u, *v;
+	int yPitch, uvPitch, uvStep;
+	int width, height;
+} rfbH264Picture;
+
+/**
+ * An H.264 decoder backend. Every client using the H.264 encoding has an
+ * instance of its own, made by create() on the first H.264 rectangle.
+ */
+typedef struct {
+	const char* name;
+	/** returns the state of a new instance, or NULL if the backend cannot run here */
+	void* (*create)(struct _rfbClient* client);
+	/** decodes the Annex B data of one frame; sliceType is 2 for I frames */
+	rfbBool (*decode)(void* decoder, const uint8_t* data, int len, int sliceType, int width, int height);
+	/** gives access to the last picture decoded */
+	rfbBool (*getPicture)(void* decoder, rfbH264Picture* picture);
+	/** releases what getPicture() handed out, may be NULL */
+	void (*putPicture)(void* decoder, rfbH264Picture* picture);
+	/** shows the last picture in client->outputWindow itself, may be NULL;
+	    returns TRUE if the frame buffer need not be updated */
+	rfbBool (*present)(void* decoder, struct _rfbClient* client, int width, int height);
+	void (*destroy)(void* decoder);
+} rfbH264Decoder;
+
 typedef struct _rfbClient {
 	uint8_t* frameBuffer;
 	int width, height;
@@ -347,6 +402,64 @@ typedef struct _rfbClient {
         /* Output Window ID. When set, client application enables libvncclient to perform direct rendering in its window */
         unsigned long outputWindow;
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+	/** ZRLEStripes decoders, allocated on the first such rectangle */
+	rfbZRLEStripe* zrleStripes;
+#endif
+
+	/** threads sharing the work on a rectangle, see workers.c */
+	void* workers;
+
+	/** LZ4 encoding: compressed data and tile offsets of the current rectangle */
+	char* lz4Buffer;
+	int lz4BufferSize;
+	uint32_t* lz4Offsets;
+	int lz4OffsetsSize;
+
+	/** number of bytes read from the server so far */
+	unsigned long bytesReceived;
+
+	/** state of the rfbClientMux driving this client, if any */
+	void* muxData;
+
+	/** receive buffer used instead of buf once it has been resized */
+	char* readBuf;
+	int readBufSize;
+	int readBufIdleReads;
+
+	/** tight encoding: threads decoding JPEG rectangles in the background */
+	void* jpegDecoder;
+	/** tight encoding: TurboJPEG instance decoding into the frame buffer */
+	void* jpegHandle;
+
+	/** H.264 encoding: the decoder backend to use; if NULL, the first of
+	    the built-in ones that works here */
+	rfbH264Decoder* h264Decoder;
+	/** H.264 encoding: state of the decoder of this client */
+	void* h264Data;
+
+	/** Keep up to this many FramebufferUpdateRequests outstanding, sent
+	    about one frame time of the server apart, so that the server need not
+	    wait a round trip for the next request after each update. 0 or 1
+	    sends one request after each update. See
+	    SendPipelinedFramebufferUpdateRequests(). */
+	int maxPendingUpdateRequests;
+	/** state of the pipelined update requests */
+	void* updatePipeline;
+
+	/** Recording: seconds between keyframes, 10 if 0. See
+	    rfbClientRecordStart(). */
+	int recordKeyframeInterval;
+	/** state of the recording, if any */
+	void* vncRecorder;
+
+	/** SharedMemory pseudo-encoding: the memory the server handed out on
+	    a UNIX socket, if any */
+	void* sharedMemory;
+	/** file descriptor the server passed along with data read last, -1 if
+	    none */
+	int receivedFd;
+
 	/** Note that the CoRRE encoding uses this buffer and assumes it is big enough
 	   to hold 255 * 255 * 32 bits -> 260100 bytes.  640*480 = 307200 bytes.
 	   Hextile also assumes it is big enough to hold 16 * 16 * 32 bits.
@@ -417,6 +530,16 @@ extern rfbBool SendIncrementalFramebufferUpdateRequest(rfbClient* client);
 extern rfbBool SendFramebufferUpdateRequest(rfbClient* client,
 					 int x, int y, int w, int h,
 					 rfbBool incremental);
+/**
+ * Sends the next pipelined update request if it is due, when
+ * client->maxPendingUpdateRequests is more than 1. WaitForMessage() and
+ * rfbClientMuxRun() call this while they wait, loops that wait for the socket
+ * of the client in some other way should call it too.
+ * @param client The client
+ * @return the number of microseconds until it should be called again, -1
+ * if there is no need to, or -2 if sending the request failed
+ */
+extern int SendPipelinedFramebufferUpdateRequests(rfbClient* client);
 extern rfbBool SendScaleSetting(rfbClient* client,int scaleSetting);
 /**
  * Sends a pointer event to the server. A pointer event includes a cursor
@@ -548,6 +671,11 @@ void rfbClientRegisterExtension(rfbClientProtocolExtension* e);
 extern rfbBool errorMessageOnReadFailure;
 
 extern rfbBool ReadFromRFBServer(rfbClient* client, char *out, unsigned int n);
+/**
+ * Reads lines of bytesPerLine bytes each into dst, with consecutive lines
+ * stride bytes apart, directly from the socket where possible.
+ */
+extern rfbBool ReadRectFromRFBServer(rfbClient* client, char *dst, int stride, int bytesPerLine, int lines);
 extern rfbBool WriteToRFBServer(rfbClient* client, char *buf, int n);
 extern int FindFreeTcpPort(void);
 extern int ListenAtTcpPort(int port);
@@ -573,6 +701,101 @@ extern rfbBool SameMachine(int sock);
  */
 extern int WaitForMessage(rfbClient* client,unsigned int usecs);
 
+/* mux.c */
+
+/**
+ * An rfbClientMux drives many connected clients from a single thread. It waits
+ * for all their sockets at once and handles the messages as they arrive. The
+ * message handling of each client runs on a stack of its own: if a message
+ * has only partially arrived, the client is suspended in ReadFromRFBServer()
+ * and resumed once more data is there, so one slow connection never holds up
+ * the others.
+ */
+typedef struct _rfbClientMux rfbClientMux;
+/**
+ * Called when the connection of a client failed or was closed. The client has
+ * already been removed from the mux; it is up to this callback to clean it up.
+ */
+typedef void (*rfbClientMuxClosedProc)(rfbClientMux* mux, rfbClient* client);
+/**
+ * Creates a new, empty mux.
+ * @param closed Called for every client whose connection ends, may be NULL
+ * @return the new mux, or NULL on failure
+ */
+extern rfbClientMux* rfbClientMuxNew(rfbClientMuxClosedProc closed);
+/**
+ * Hands a client to a mux. The client must have been set up successfully with
+ * rfbInitClient() and must not be handled by anything else from then on.
+ * @return true if the client was added, false otherwise
+ */
+extern rfbBool rfbClientMuxAdd(rfbClientMux* mux, rfbClient* client);
+/**
+ * Takes a client out of a mux again. This may not be called while a message
+ * of that client is being handled, e.g. from one of its callbacks.
+ */
+extern void rfbClientMuxRemove(rfbClientMux* mux, rfbClient* client);
+/**
+ * Waits up to usecs microseconds for messages from any client of the mux and
+ * handles everything that has arrived.
+ * @return the number of messages handled completely, or -1 on failure
+ */
+extern int rfbClientMuxRun(rfbClientMux* mux, unsigned int usecs);
+/**
+ * Removes all clients from a mux (without cleaning them up) and frees it.
+ */
+extern void rfbClientMuxDestroy(rfbClientMux* mux);
+
+/* vncrec.c */
+
+/**
+ * Starts recording the session to a vncrec file, replacing any recording in
+ * progress. It can be played back like any other vncrec file, with a
+ * client of the same pixel format, and also seeks quickly: every
+ * client->recordKeyframeInterval seconds the whole frame buffer is written,
+ * and listed in the index filename.idx. Can only be called once the
+ * connection is set up, e.g. after rfbInitClient().
+ * @param client The client to record
+ * @param filename The file to write
+ * @return true if the recording was started, false otherwise
+ */
+extern rfbBool rfbClientRecordStart(rfbClient* client, const char* filename);
+/**
+ * Stops recording, if the client records.
+ */
+extern void rfbClientRecordStop(rfbClient* client);
+/**
+ * Moves the playback of a vncrec file to the given time from the start of
+ * the recording. Recordings with an index go on from the keyframe before
+ * that time, and play everything up to it at once; others can only skip
+ * ahead. The playback speed is set with client->vncRec->speed.
+ * @param client The client playing back
+ * @param msecs Milliseconds from the start of the recording
+ * @return true if the playback was moved, false otherwise
+ */
+extern rfbBool rfbClientPlaybackSeek(rfbClient* client, unsigned int msecs);
+/**
+ * @return the time from the start of a vncrec file to its last keyframe in
+ * milliseconds, or -1 if it has no index
+ */
+extern int64_t rfbClientPlaybackLength(rfbClient* client);
+
+/* h264.c */
+
+#ifdef LIBVNCSERVER_CONFIG_LIBVA
+/** Decodes on the GPU with VA-API; needs an X display. */
+extern rfbH264Decoder rfbH264DecoderVA;
+#endif
+#ifdef LIBVNCSERVER_HAVE_LIBAVCODEC
+/** Decodes on the CPU with libavcodec. */
+extern rfbH264Decoder rfbH264DecoderAVCodec;
+#endif
+/**
+ * Converts a region of a decoded picture into the frame buffer, at the same
+ * position. Useful for decoder backends of the application that need to
+ * convert pictures of their own.
+ */
+extern void rfbH264ConvertPicture(rfbClient* client, const rfbH264Picture* picture, int x, int y, int w, int h);
+
 /* vncviewer.c */
 /**
  * Allocates and returns a pointer to an rfbClient structure. This will probably
@@ -619,6 +842,11 @@ rfbClient* rfbGetClient(int bitsPerSample,int samplesPerPixel,int bytesPerPixel)
  * <tr><td>-qosdscp</td><td>Set the Quality of Service Differentiated Services
  * Code Point (QoS DSCP). The next item in the argv array is the code point as
  * an integer.</td></tr>
+ * <tr><td>-record</td><td>Record the session, see rfbClientRecordStart(). The
+ * next item in the argv array is the file name.</td></tr>
+ * <tr><td>-pipeline</td><td>Keep up to this many framebuffer update requests
+ * outstanding, see maxPendingUpdateRequests. The next item in the argv array
+ * is the number as an integer.</td></tr>
  * <tr><td>-repeaterdest</td><td>Set a VNC repeater address. The next item in the argv array is
  * the repeater's address as a string.</td></tr>
  * </table>
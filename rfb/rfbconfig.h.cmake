@@ -21,6 +21,9 @@
 /* Define to 1 if you have the `jpeg' library (-ljpeg). */
 #cmakedefine LIBVNCSERVER_HAVE_LIBJPEG  1 
 
+/* Define if you have the `avcodec' library (-lavcodec). */
+#cmakedefine LIBVNCSERVER_HAVE_LIBAVCODEC  1
+
 /* Define if you have the `png' library (-lpng). */
 #cmakedefine LIBVNCSERVER_HAVE_LIBPNG  1
 
@@ -30,6 +33,9 @@
 /* Define to 1 if you have the `z' library (-lz). */
 #cmakedefine LIBVNCSERVER_HAVE_LIBZ  1 
 
+/* Define to 1 if you have the <linux/io_uring.h> header file. */
+#cmakedefine LIBVNCSERVER_HAVE_LINUX_IO_URING_H 1
+
 /* Define to 1 if you have the <netinet/in.h> header file. */
 #cmakedefine LIBVNCSERVER_HAVE_NETINET_IN_H  1 
 
@@ -524,6 +524,10 @@ typedef struct {
 #define rfbEncodingSupportedMessages  0xFFFE0001
 #define rfbEncodingSupportedEncodings 0xFFFE0002
 #define rfbEncodingServerIdentity     0xFFFE0003
+#define rfbEncodingZRLEStripes        0xFFFE0010
+#define rfbEncodingLZ4                0xFFFE0011
+#define rfbEncodingSharedMemory       0xFFFE0012
+#define rfbEncodingSharedMemoryRect   0xFFFE0013
 
 
 /*****************************************************************************
@@ -954,6 +958,78 @@ typedef struct {
 #define rfbZRLETileHeight 64
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * ZRLEStripes - a LibVNCServer extension to ZRLE which lets both ends spread
+ * the work over several cores.  A client which announces the
+ * rfbEncodingZRLEStripes pseudo-encoding may get rectangles of that encoding
+ * type wherever it would otherwise get ZRLE or ZYWRLE.  Such a rectangle is
+ * cut into nStripes horizontal stripes of stripeHeight rows (the last one
+ * may be shorter), each encoded exactly like a ZRLE rectangle of its own.
+ * Stripe i of every rectangle is compressed with its own zlib stream i, so
+ * the stripes can be inflated independently.  The header is followed by
+ * nStripes rfbZRLEHeaders, each followed by the data of that stripe.
+ */
+
+typedef struct {
+    uint8_t nStripes;		/* 1 .. rfbZRLEMaxStripes */
+    uint8_t zywrleLevel;	/* 0 for ZRLE, 1 .. 3 for ZYWRLE */
+    uint16_t stripeHeight;	/* a multiple of rfbZRLETileHeight */
+} rfbZRLEStripesHeader;
+
+#define sz_rfbZRLEStripesHeader 4
+
+#define rfbZRLEMaxStripes 16
+
+
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * LZ4 - a LibVNCServer encoding for fast links (LAN, USB tethering) where
+ * compression speed matters more than the compression ratio.  The rectangle
+ * is cut into tiles of rfbLZ4TileWidth x rfbLZ4TileHeight pixels (smaller at
+ * the right and bottom edges), taken left to right, top to bottom.  The
+ * rectangle header is followed by one CARD32 per tile, then the data of all
+ * tiles in the same order.  The low 31 bits of each CARD32 give the length
+ * of the tile's data: its pixels, in the client's pixel format and row by
+ * row, compressed as one LZ4 block, or sent as they are if rfbLZ4TileRaw is
+ * set.  No state is kept from one tile to the next, so both ends can work
+ * on the tiles in parallel.
+ */
+
+#define rfbLZ4TileWidth 64
+#define rfbLZ4TileHeight 64
+
+#define rfbLZ4TileRaw 0x80000000
+
+
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * SharedMemory - a LibVNCServer extension for clients on the same host,
+ * connected through a UNIX socket, which lets them take the pixels from
+ * memory shared with the server instead of the socket.  The client asks for
+ * it with the rfbEncodingSharedMemory pseudo-encoding.
+ *
+ * The server answers with an rfbEncodingSharedMemory rectangle at 0,0 the
+ * size of the frame buffer, followed by a CARD32 giving the bytes per line.
+ * A file descriptor is passed along with the first byte of the rectangle
+ * header (SCM_RIGHTS).  It refers to memory of height times that many
+ * bytes, which holds the whole frame buffer in the client's pixel format,
+ * so the rectangle counts as an update of all of it.  From then on the
+ * server sends rfbEncodingSharedMemoryRect rectangles, which have no data:
+ * their pixels are in the shared memory.  A new rfbEncodingSharedMemory
+ * rectangle replaces the memory, e.g. after a change of the size or pixel
+ * format; one of size 0x0 withdraws it.
+ *
+ * The server only writes to the memory while it sends an update, so a
+ * client which copies the pixels out before it asks for the next one never
+ * sees them change under its hands.  With several requests outstanding it
+ * may copy newer pixels early; the following update reports them anyway.
+ */
+
+typedef struct {
+    uint32_t bytesPerLine;
+} rfbSharedMemoryMsg;
+
+#define sz_rfbSharedMemoryMsg 4
+
+
 /*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * ZLIBHEX - zlib compressed Hextile Encoding.  Essentially, this is the
  * hextile encoding with zlib compression on the tiles that can not be
@@ -22,11 +22,13 @@ static encoding_t testEncodings[]={
 	{ rfbEncodingCoRRE, "corre" },
 	{ rfbEncodingHextile, "hextile" },
 	{ rfbEncodingUltra, "ultra" },
+	{ rfbEncodingLZ4, "lz4" },
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 	{ rfbEncodingZlib, "zlib" },
 	{ rfbEncodingZlibHex, "zlibhex" },
 	{ rfbEncodingZRLE, "zrle" },
 	{ rfbEncodingZYWRLE, "zywrle" },
+	{ rfbEncodingZRLEStripes, "zrlestripes zrle" },
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 	{ rfbEncodingTight, "tight" },
 #endif
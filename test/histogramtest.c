@@ -0,0 +1,110 @@
+/*
+ * histogramtest - checks the buckets of the metrics histograms (eight to a
+ * power of two, so a value is known within an eighth) and the percentiles
+ * read from them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <rfb/rfb.h>
+
+static int failed;
+
+#define CHECK(cond, ...) \
+	do { if (!(cond)) { printf(__VA_ARGS__); printf("\n"); failed = 1; } } while (0)
+
+/* the smallest value of a bucket: 0 to 7 have their own, then every power
+   of two 2^e is split into eight buckets of 2^(e-3) */
+static uint64_t bucketStart(int bucket)
+{
+	if (bucket < 8)
+		return bucket;
+	return (uint64_t)(8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+/* the bucket a single value goes into */
+static int bucketOf(uint64_t value)
+{
+	rfbHistogram h;
+	int i, bucket = -1;
+
+	memset(&h, 0, sizeof(h));
+	rfbHistogramRecord(&h, value);
+	for (i = 0; i < RFB_HISTOGRAM_BUCKETS; i++)
+		if (h.buckets[i]) {
+			CHECK(bucket == -1 && h.buckets[i] == 1, "%llu counted more than once",
+			      (unsigned long long)value);
+			bucket = i;
+		}
+	return bucket;
+}
+
+static void testBuckets(void)
+{
+	int b;
+
+	for (b = 0; b < RFB_HISTOGRAM_BUCKETS; b++) {
+		uint64_t start = bucketStart(b);
+
+		CHECK(bucketOf(start) == b, "%llu in bucket %d, not %d",
+		      (unsigned long long)start, bucketOf(start), b);
+		if (b > 0)
+			CHECK(bucketOf(start - 1) == b - 1, "%llu in bucket %d, not %d",
+			      (unsigned long long)start - 1, bucketOf(start - 1), b - 1);
+		if (b >= 8 && b < RFB_HISTOGRAM_BUCKETS - 1)
+			CHECK((bucketStart(b + 1) - start) * 8 <= start,
+			      "bucket %d is wider than an eighth of its values", b);
+	}
+	CHECK(bucketOf(UINT64_MAX) == RFB_HISTOGRAM_BUCKETS - 1,
+	      "the largest value is not in the last bucket");
+}
+
+static void testPercentiles(void)
+{
+	rfbHistogram h, low, high;
+	uint64_t i, p;
+
+	memset(&h, 0, sizeof(h));
+	CHECK(rfbHistogramPercentile(&h, 50) == 0, "percentile of nothing");
+
+	rfbHistogramRecord(&h, 12345);
+	CHECK(rfbHistogramPercentile(&h, 0) == 12345 &&
+	      rfbHistogramPercentile(&h, 50) == 12345 &&
+	      rfbHistogramPercentile(&h, 100) == 12345,
+	      "percentiles of a single value are not that value");
+
+	/* 1 to 1000 once each, half of them merged in from another histogram */
+	memset(&h, 0, sizeof(h));
+	memset(&low, 0, sizeof(low));
+	memset(&high, 0, sizeof(high));
+	for (i = 1; i <= 500; i++)
+		rfbHistogramRecord(&low, i);
+	for (i = 501; i <= 1000; i++)
+		rfbHistogramRecord(&high, i);
+	rfbHistogramMerge(&h, &low);
+	rfbHistogramMerge(&h, &high);
+	CHECK(h.count == 1000 && h.min == 1 && h.max == 1000 && h.sum == 500500,
+	      "merged count %u, min %llu, max %llu, sum %llu", (unsigned)h.count,
+	      (unsigned long long)h.min, (unsigned long long)h.max,
+	      (unsigned long long)h.sum);
+
+	/* rounded up to the end of the bucket of the true percentile */
+	for (i = 1; i <= 1000; i++) {
+		p = rfbHistogramPercentile(&h, i / 10.0);
+		CHECK(p >= i && p <= i + i / 8 + 1, "%.1f%% percentile %llu for %llu",
+		      i / 10.0, (unsigned long long)p, (unsigned long long)i);
+	}
+	CHECK(rfbHistogramPercentile(&h, 0) == 1, "0%% percentile is not the minimum");
+	CHECK(rfbHistogramPercentile(&h, 100) == 1000, "100%% percentile is not the maximum");
+	CHECK(rfbHistogramPercentile(&h, 99.9) == 999 || rfbHistogramPercentile(&h, 99.9) == 1000,
+	      "99.9%% percentile %llu", (unsigned long long)rfbHistogramPercentile(&h, 99.9));
+}
+
+int main(int argc, char** argv)
+{
+	testBuckets();
+	testPercentiles();
+	printf("histograms: %s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
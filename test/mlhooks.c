@@ -0,0 +1,32 @@
+/*
+ * mlhooks.c - the MirrorLink builds of libvncserver and libvncclient call
+ * these functions of the application; the tests have nothing to do there.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifdef LIBVNCSERVER_HAVE_ML_EXT
+
+void __vnc_fb_update_req(rfbClientPtr cl)
+{
+}
+
+void __vnc_fb_encoding525_bytes(rfbClientPtr cl, size_t acc_bytes)
+{
+}
+
+int __vnc_fb_is_blocking(rfbClient* client)
+{
+	return 0;
+}
+
+void __vnc_fb_update_req_sent(rfbClient* client)
+{
+}
+
+void __vnc_fb_new_fb_size(rfbClient* client)
+{
+}
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * pipelinetest - drives the pipelined FramebufferUpdateRequests of
+ * libvncclient against a server simulated on the other end of a socket
+ * pair.  The server can answer a request a round trip after it was sent,
+ * sends at most one update per frame time and answers all the requests it
+ * can with one update.
+ *
+ * It checks that outstanding requests are given up on after a second, that
+ * a request that cannot be sent is reported, that
+ * the requests the client sends on its own are at least a millisecond
+ * apart, and that no more than maxPendingUpdateRequests but enough requests
+ * are kept outstanding for the server to send more updates than it could
+ * with one request at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <rfb/rfbclient.h>
+
+#define RTT 20000               /* us */
+#define FRAME_TIME 5000         /* us */
+#define RUN_TIME 500000         /* us */
+#define MAX_PENDING 8
+
+static int64_t now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static rfbClient* newClient(int maxPending, int* serverSock)
+{
+	rfbClient* client;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	client = rfbGetClient(8, 3, 4);
+	client->sock = sv[0];
+	client->width = client->height = 64;
+	client->updateRect.x = client->updateRect.y = 0;
+	client->updateRect.w = client->updateRect.h = 64;
+	client->supportedMessages.client2server[rfbFramebufferUpdateRequest / 8] |=
+		1 << (rfbFramebufferUpdateRequest % 8);
+	client->maxPendingUpdateRequests = maxPending;
+	*serverSock = sv[1];
+	return client;
+}
+
+static void freeClient(rfbClient* client, int serverSock)
+{
+	close(client->sock);
+	close(serverSock);
+	rfbClientCleanup(client);
+}
+
+/* the number of requests that have arrived at the server */
+static int receiveRequests(int sock)
+{
+	rfbFramebufferUpdateRequestMsg fur;
+	int n = 0;
+
+	while (recv(sock, (char *)&fur, sz_rfbFramebufferUpdateRequestMsg, MSG_DONTWAIT)
+			== sz_rfbFramebufferUpdateRequestMsg) {
+		if (fur.type != rfbFramebufferUpdateRequest || !fur.incremental) {
+			fprintf(stderr, "unexpected message %d\n", fur.type);
+			exit(1);
+		}
+		n++;
+	}
+	return n;
+}
+
+static void sendUpdate(rfbClient* client, int sock)
+{
+	rfbFramebufferUpdateMsg fu;
+
+	memset(&fu, 0, sizeof(fu));
+	fu.type = rfbFramebufferUpdate;
+	if (write(sock, (char *)&fu, sz_rfbFramebufferUpdateMsg) != sz_rfbFramebufferUpdateMsg
+			|| !HandleRFBServerMessage(client)) {
+		fprintf(stderr, "cannot deliver an update\n");
+		exit(1);
+	}
+}
+
+static int testExpiry(void)
+{
+	int sock, due, n, ok = 1;
+	rfbClient* client = newClient(MAX_PENDING, &sock);
+
+	due = SendPipelinedFramebufferUpdateRequests(client);
+	n = receiveRequests(sock);
+	if (n != 1 || due <= 900000 || due > 1001000) {
+		printf("first request: %d sent, next due in %d us\n", n, due);
+		ok = 0;
+	}
+	SendPipelinedFramebufferUpdateRequests(client);
+	n = receiveRequests(sock);
+	if (n != 0) {
+		printf("%d requests sent before the first one was answered\n", n);
+		ok = 0;
+	}
+	usleep(due + 10000);
+	SendPipelinedFramebufferUpdateRequests(client);
+	n = receiveRequests(sock);
+	if (n != 1) {
+		printf("%d requests sent after the first one expired\n", n);
+		ok = 0;
+	}
+
+	freeClient(client, sock);
+	printf("expiry: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+static int testFailure(void)
+{
+	int sock, due;
+	rfbClient* client = newClient(MAX_PENDING, &sock);
+
+	close(sock);
+	due = SendPipelinedFramebufferUpdateRequests(client);
+	close(client->sock);
+	rfbClientCleanup(client);
+	printf("send failure: %s\n", due == -2 ? "ok" : "FAILED");
+	return due == -2;
+}
+
+/*
+ * Runs the simulated server for RUN_TIME; returns the number of updates it
+ * sent, the most requests it had outstanding and the shortest time between
+ * two requests of which the latter was sent by
+ * SendPipelinedFramebufferUpdateRequests.
+ */
+
+static int simulate(int maxPending, int* maxOutstanding, int64_t* minGap)
+{
+	int64_t arrived[256], start = now(), lastUpdate = 0, lastRequest = 0, t;
+	int nArrived = 0, updates = 0, sock, n, i;
+	rfbClient* client = newClient(maxPending, &sock);
+
+	*maxOutstanding = 0;
+	*minGap = RTT;
+	if (maxPending <= 1)
+		SendIncrementalFramebufferUpdateRequest(client);
+
+	while ((t = now()) - start < RUN_TIME) {
+		SendPipelinedFramebufferUpdateRequests(client);
+		n = receiveRequests(sock);
+		t = now();
+		if (n > 0) {
+			if (lastRequest != 0 && t - lastRequest < *minGap)
+				*minGap = t - lastRequest;
+			lastRequest = t;
+		}
+		for (i = 0; i < n && nArrived < 256; i++)
+			arrived[nArrived++] = t;
+		if (nArrived > *maxOutstanding)
+			*maxOutstanding = nArrived;
+
+		/* one update answers all the requests that have made it */
+		if (nArrived > 0 && t - arrived[0] >= RTT && t - lastUpdate >= FRAME_TIME) {
+			for (i = 0; i < nArrived && t - arrived[i] >= RTT; i++)
+				;
+			memmove(arrived, arrived + i, (nArrived - i) * sizeof(arrived[0]));
+			nArrived -= i;
+
+			sendUpdate(client, sock);
+			updates++;
+			lastUpdate = t;
+
+			/* the request sent right away when the update arrived */
+			n = receiveRequests(sock);
+			t = now();
+			if (n > 0)
+				lastRequest = t;
+			for (i = 0; i < n && nArrived < 256; i++)
+				arrived[nArrived++] = t;
+		}
+		usleep(200);
+	}
+
+	freeClient(client, sock);
+	return updates;
+}
+
+int main(int argc, char** argv)
+{
+	int ok, single, pipelined, outstanding, ignore;
+	int64_t gap, ignoreGap;
+
+	signal(SIGPIPE, SIG_IGN);
+	ok = testExpiry();
+	ok = testFailure() && ok;
+
+	single = simulate(1, &ignore, &ignoreGap);
+	pipelined = simulate(MAX_PENDING, &outstanding, &gap);
+	printf("updates in %d ms: %d with one request at a time, %d pipelined\n",
+	       RUN_TIME / 1000, single, pipelined);
+	printf("at most %d requests outstanding, at least %d us apart\n",
+	       outstanding, (int)gap);
+
+	if (pipelined < 2 * single) {
+		printf("target: FAILED, the pipeline does not keep the server busy\n");
+		ok = 0;
+	} else if (outstanding < 3 || outstanding > MAX_PENDING + 1) {
+		printf("target: FAILED, %d outstanding for a limit of %d\n",
+		       outstanding, MAX_PENDING);
+		ok = 0;
+	} else
+		printf("target: ok\n");
+
+	/* the clock is read right after the request was sent */
+	if (gap < 900) {
+		printf("spacing: FAILED\n");
+		ok = 0;
+	} else
+		printf("spacing: ok\n");
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,129 @@
+/*
+ * scaletest - checks the frame buffer scaler: every channel of a scaled
+ * down pixel is within one step of the area average of the pixels it
+ * covers, computed in double precision, and scaling the frame buffer in
+ * tiles gives exactly what scaling it at once does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <rfb/rfb.h>
+#include "../libvncserver/scale.h"
+
+/* tiles of odd sizes, not aligned to anything */
+#define TILE_WIDTH 53
+#define TILE_HEIGHT 37
+
+static int channel(rfbScreenInfoPtr s, int x, int y, int c)
+{
+	const rfbPixelFormat *f = &s->serverFormat;
+	int bpp = s->bitsPerPixel / 8;
+	uint32_t pixel = 0;
+
+	memcpy(&pixel, s->frameBuffer + y * s->paddedWidthInBytes + x * bpp, bpp);
+	switch (c) {
+	case 0: return (pixel >> f->redShift) & f->redMax;
+	case 1: return (pixel >> f->greenShift) & f->greenMax;
+	default: return (pixel >> f->blueShift) & f->blueMax;
+	}
+}
+
+/* the largest difference to the area average */
+static double areaError(rfbScreenInfoPtr s, rfbScreenInfoPtr d)
+{
+	double max = 0;
+	int x, y, c, i, j;
+
+	for (y = 0; y < d->height; y++)
+		for (x = 0; x < d->width; x++)
+			for (c = 0; c < 3; c++) {
+				double x1 = (double)x * s->width / d->width;
+				double x2 = (double)(x + 1) * s->width / d->width;
+				double y1 = (double)y * s->height / d->height;
+				double y2 = (double)(y + 1) * s->height / d->height;
+				double sum = 0, e;
+
+				for (j = (int)y1; j < y2 && j < s->height; j++) {
+					double h = fmin(y2, j + 1) - fmax(y1, j);
+
+					for (i = (int)x1; i < x2 && i < s->width; i++)
+						sum += (fmin(x2, i + 1) - fmax(x1, i)) * h * channel(s, i, j, c);
+				}
+				e = fabs(sum / ((x2 - x1) * (y2 - y1)) - channel(d, x, y, c));
+				if (e > max)
+					max = e;
+			}
+	return max;
+}
+
+static int run(int bitsPerSample, int bytesPerPixel, int width, int height,
+		int scaledWidth, int scaledHeight)
+{
+	rfbScreenInfoPtr s, d;
+	char *full;
+	size_t size;
+	double error = 0;
+	int i, x, y, ok = 1;
+
+	s = rfbGetScreen(NULL, NULL, width, height, bitsPerSample, 3, bytesPerPixel);
+	s->frameBuffer = malloc(s->paddedWidthInBytes * height);
+	srand(1);
+	for (i = 0; i < s->paddedWidthInBytes * height; i++)
+		s->frameBuffer[i] = rand() ^ (i >> 5);
+
+	/* what rfbScaledScreenAllocate would set up */
+	d = malloc(sizeof(*d));
+	memcpy(d, s, sizeof(*d));
+	d->width = scaledWidth;
+	d->height = scaledHeight;
+	d->paddedWidthInBytes = scaledWidth * bytesPerPixel;
+	size = (size_t)d->paddedWidthInBytes * scaledHeight;
+	d->frameBuffer = calloc(1, size);
+	full = malloc(size);
+
+	rfbScaledScreenUpdateRect(s, d, 0, 0, width, height);
+	memcpy(full, d->frameBuffer, size);
+	if (scaledWidth <= width && scaledHeight <= height) {
+		error = areaError(s, d);
+		if (error > 1.0)
+			ok = 0;
+	}
+
+	memset(d->frameBuffer, 0, size);
+	for (y = 0; y < height; y += TILE_HEIGHT)
+		for (x = 0; x < width; x += TILE_WIDTH)
+			rfbScaledScreenUpdateRect(s, d, x, y, TILE_WIDTH, TILE_HEIGHT);
+	if (memcmp(full, d->frameBuffer, size) != 0)
+		ok = 0;
+
+	printf("%2d bpp %dx%d to %dx%d: largest error %.2f, tiles %s: %s\n",
+	       bytesPerPixel * 8, width, height, scaledWidth, scaledHeight, error,
+	       memcmp(full, d->frameBuffer, size) ? "differ" : "match",
+	       ok ? "ok" : "FAILED");
+
+	free(full);
+	rfbScaledScreenFreeScaler(d);
+	free(d->frameBuffer);
+	free(d);
+	free(s->frameBuffer);
+	rfbScreenCleanup(s);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int ok = 1;
+
+	ok &= run(8, 4, 800, 480, 400, 240);
+	ok &= run(8, 4, 800, 480, 533, 320);
+	ok &= run(8, 4, 640, 480, 211, 157);
+	ok &= run(8, 4, 800, 600, 257, 193);
+	ok &= run(5, 2, 800, 480, 400, 240);
+	ok &= run(5, 2, 800, 480, 640, 384);
+	ok &= run(2, 1, 640, 480, 320, 240);
+	ok &= run(8, 4, 320, 240, 800, 480);
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,259 @@
+/*
+ * tightjpegbench - time libvncclient decoding the JPEG rectangles of the
+ * tight encoding, in the two ways tight.c has: straight into the frame
+ * buffer with TurboJPEG when its pixel format has a TurboJPEG match, and
+ * through libjpeg into a row of RGB that is converted pixel by pixel when
+ * it has none.
+ *
+ * A 1024x768 frame is sent as 1024x64 rectangles, like the tight encoder
+ * does with its maximum rectangle size of 65536 pixels, to clients on the
+ * other end of a socket pair which handle it with HandleRFBServerMessage().
+ *
+ * usage: tightjpegbench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <rfb/rfbclient.h>
+#include "turbojpeg.h"
+
+#define FW 1024
+#define FH 768
+#define RW 1024
+#define RH 64
+#define NRECTS (FW / RW * FH / RH)
+
+typedef struct {
+	char *data;
+	size_t len;
+	int sock;
+} update;
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* smooth gradients with some noise, the kind of content sent as JPEG */
+static void makeFrame(unsigned char *rgb)
+{
+	unsigned int seed = 1;
+	int x, y;
+
+	for (y = 0; y < FH; y++)
+		for (x = 0; x < FW; x++) {
+			unsigned char *p = &rgb[(y * FW + x) * 3];
+			int noise = rand_r(&seed) % 16;
+
+			p[0] = (unsigned char)(127 + 120 * sin(x / 97.0) * cos(y / 53.0)) ^ noise;
+			p[1] = (unsigned char)((x + y) / 7 + noise);
+			p[2] = (unsigned char)(127 + 120 * sin((x - y) / 71.0)) ^ noise;
+		}
+}
+
+static char *put16(char *p, int v)
+{
+	*p++ = (char)(v >> 8);
+	*p++ = (char)v;
+	return p;
+}
+
+/* a FramebufferUpdate of the frame as tight JPEG rectangles */
+static int makeUpdate(tjhandle compressor, unsigned char *rgb, int quality,
+		int subsamp, update *u)
+{
+	unsigned char *jpeg = malloc(tjBufSize(RW, RH, TJSAMP_444));
+	unsigned long jpegLen;
+	char *p;
+	int r;
+
+	u->data = malloc(sz_rfbFramebufferUpdateMsg +
+		NRECTS * (sz_rfbFramebufferUpdateRectHeader + 4 + tjBufSize(RW, RH, TJSAMP_444)));
+	if (!jpeg || !u->data)
+		return 0;
+
+	p = u->data;
+	*p++ = rfbFramebufferUpdate;
+	*p++ = 0;
+	p = put16(p, NRECTS);
+	for (r = 0; r < NRECTS; r++) {
+		int x = (r % (FW / RW)) * RW, y = (r / (FW / RW)) * RH;
+
+		/* jpeg is big enough for any image */
+		if (tjCompress2(compressor, rgb + (y * FW + x) * 3, RW, FW * 3, RH,
+				TJPF_RGB, &jpeg, &jpegLen, subsamp, quality, 0) < 0) {
+			fprintf(stderr, "tjCompress2: %s\n", tjGetErrorStr());
+			return 0;
+		}
+
+		p = put16(p, x);
+		p = put16(p, y);
+		p = put16(p, RW);
+		p = put16(p, RH);
+		p = put16(p, 0);
+		p = put16(p, rfbEncodingTight);
+		*p++ = (char)(rfbTightJpeg << 4);
+		/* compact length: 7 bits at a time, low bits first */
+		*p++ = (char)((jpegLen & 0x7f) | (jpegLen > 0x7f ? 0x80 : 0));
+		if (jpegLen > 0x7f) {
+			*p++ = (char)((jpegLen >> 7 & 0x7f) | (jpegLen > 0x3fff ? 0x80 : 0));
+			if (jpegLen > 0x3fff)
+				*p++ = (char)(jpegLen >> 14);
+		}
+		memcpy(p, jpeg, jpegLen);
+		p += jpegLen;
+	}
+	u->len = p - u->data;
+	free(jpeg);
+	return 1;
+}
+
+static rfbClient *newClient(int redShift, int greenShift, int blueShift, int *serverSock)
+{
+	rfbClient *client;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	client = rfbGetClient(8, 3, 4);
+	client->sock = sv[0];
+	client->width = FW;
+	client->height = FH;
+	client->frameBuffer = calloc(FW * FH, 4);
+	client->format.redShift = redShift;
+	client->format.greenShift = greenShift;
+	client->format.blueShift = blueShift;
+	*serverSock = sv[1];
+	return client;
+}
+
+static void freeClient(rfbClient *client, int serverSock)
+{
+	close(client->sock);
+	close(serverSock);
+	rfbClientCleanup(client);
+}
+
+static void *writeUpdate(void *arg)
+{
+	update *u = (update *)arg;
+	size_t done = 0;
+
+	while (done < u->len) {
+		ssize_t n = write(u->sock, u->data + done, u->len - done);
+
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	return NULL;
+}
+
+/* the seconds it takes the client to handle the update iterations times */
+static double decode(rfbClient *client, int sock, update *u, int iterations)
+{
+	pthread_t writer;
+	double t = now();
+	int i;
+
+	u->sock = sock;
+	for (i = 0; i < iterations; i++) {
+		pthread_create(&writer, NULL, writeUpdate, u);
+		if (!HandleRFBServerMessage(client)) {
+			fprintf(stderr, "the update was not decoded\n");
+			exit(1);
+		}
+		pthread_join(writer, NULL);
+	}
+	return now() - t;
+}
+
+static int channel(rfbClient *client, int i, int c)
+{
+	uint32_t pixel = ((uint32_t *)client->frameBuffer)[i];
+
+	switch (c) {
+	case 0: return (pixel >> client->format.redShift) & 0xff;
+	case 1: return (pixel >> client->format.greenShift) & 0xff;
+	default: return (pixel >> client->format.blueShift) & 0xff;
+	}
+}
+
+static int sameColours(rfbClient *a, rfbClient *b)
+{
+	int i, c;
+
+	for (i = 0; i < FW * FH; i++)
+		for (c = 0; c < 3; c++)
+			if (channel(a, i, c) != channel(b, i, c))
+				return 0;
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct { const char *name; int quality, subsamp; } settings[] = {
+		{ "q95 4:4:4", 95, TJSAMP_444 },
+		{ "q80 4:2:0", 80, TJSAMP_420 },
+		{ "q40 4:2:0", 40, TJSAMP_420 },
+		{ "q15 gray", 15, TJSAMP_GRAY },
+	};
+	int iterations = argc > 1 ? atoi(argv[1]) : 20;
+	unsigned char *rgb = malloc(FW * FH * 3);
+	tjhandle compressor = tjInitCompress();
+	rfbClient *direct, *rows;
+	int directSock, rowsSock, s, failed = 0;
+
+	if (!rgb || !compressor || iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	makeFrame(rgb);
+
+	/* red, green and blue bytes in memory order match TJPF_RGBX (TJPF_XBGR
+	   on big endian hosts); red, blue and green have no TurboJPEG format */
+	direct = newClient(0, 8, 16, &directSock);
+	rows = newClient(0, 16, 8, &rowsSock);
+
+	printf("%-10s %10s %14s %14s %8s\n", "jpeg", "kB/frame",
+		"rows Mpix/s", "direct Mpix/s", "speedup");
+
+	for (s = 0; s < (int)(sizeof(settings) / sizeof(settings[0])); s++) {
+		double tRows, tDirect, mpix;
+		update u;
+
+		if (!makeUpdate(compressor, rgb, settings[s].quality, settings[s].subsamp, &u))
+			return 1;
+
+		decode(direct, directSock, &u, 1);
+		decode(rows, rowsSock, &u, 1);
+		if (!sameColours(rows, direct)) {
+			fprintf(stderr, "%s: the frame buffers differ\n", settings[s].name);
+			failed++;
+		}
+
+		tRows = decode(rows, rowsSock, &u, iterations);
+		tDirect = decode(direct, directSock, &u, iterations);
+
+		mpix = (double)iterations * FW * FH / 1000000.0;
+		printf("%-10s %10.1f %14.1f %14.1f %7.2fx\n", settings[s].name,
+			u.len / 1024.0, mpix / tRows, mpix / tDirect, tRows / tDirect);
+		free(u.data);
+	}
+
+	freeClient(direct, directSock);
+	freeClient(rows, rowsSock);
+	tjDestroy(compressor);
+	free(rgb);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * vncrectest - records a session with rfbClientRecordStart(), plays the
+ * recording back and seeks back and forth in it.
+ *
+ * The server shows a new frame every half second, each one filled with a
+ * colour of its own, for three seconds; keyframes are written every second.
+ * Seeking to a quarter of a second after a frame was shown has to give
+ * that frame, whichever keyframe the playback goes on from.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbclient.h>
+
+#ifndef LIBVNCSERVER_HAVE_LIBPTHREAD
+#error This test needs pthread support (the server runs in the background)
+#endif
+
+#define WIDTH 128
+#define HEIGHT 96
+#define FRAMES 6
+#define FRAME_TIME 500000       /* us */
+#define FILENAME "vncrectest.vnc"
+
+#define FRAME_COLOUR(k) (10 + 40 * (k))
+
+static int64_t now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int64_t recTime(rfbClient* client)
+{
+	return (int64_t)client->vncRec->tv.tv_sec * 1000000 + client->vncRec->tv.tv_usec;
+}
+
+/* the colour of the whole frame buffer, -1 if it is not all the same */
+static int frameColour(rfbClient* client)
+{
+	int i, colour = client->frameBuffer[0];
+
+	if (client->width != WIDTH || client->height != HEIGHT)
+		return -1;
+	for (i = 0; i < WIDTH * HEIGHT; i++)
+		if (client->frameBuffer[i * 4] != colour)
+			return -1;
+	return colour;
+}
+
+/* what the playback showed at seekTarget */
+static int64_t seekTarget;
+static int seekColour;
+static rfbBool seekDone;
+
+static void finishedPlaybackUpdate(rfbClient* client)
+{
+	if (recTime(client) <= seekTarget)
+		seekColour = frameColour(client);
+	else
+		seekDone = TRUE;
+}
+
+static volatile rfbBool stopServer;
+static rfbBool gotUpdate;
+
+static void finishedUpdate(rfbClient* client)
+{
+	gotUpdate = TRUE;
+}
+
+/* rfbRunEventLoop() cannot run in the background in MirrorLink builds */
+static void* runServer(void* data)
+{
+	rfbScreenInfoPtr server = (rfbScreenInfoPtr)data;
+
+	while (!stopServer)
+		rfbProcessEvents(server, 10000);
+	return NULL;
+}
+
+static void record(int64_t* shown)
+{
+	int argc = 3, k;
+	char* argv[] = { "vncrectest", "-rfbport", "5981", NULL };
+	int cargc = 2;
+	char* cargv[] = { "vncrectest", "127.0.0.1:5981", NULL };
+	rfbScreenInfoPtr server;
+	rfbClient* client;
+	pthread_t thread;
+
+	server = rfbGetScreen(&argc, argv, WIDTH, HEIGHT, 8, 3, 4);
+	server->frameBuffer = calloc(WIDTH * HEIGHT, 4);
+	/* no cursor drawn into the frames */
+	server->cursor = NULL;
+	rfbInitServer(server);
+	pthread_create(&thread, NULL, runServer, server);
+
+	client = rfbGetClient(8, 3, 4);
+	client->appData.encodingsString = "raw";
+	client->recordKeyframeInterval = 1;
+	client->FinishedFrameBufferUpdate = finishedUpdate;
+	if (!rfbInitClient(client, &cargc, cargv)) {
+		fprintf(stderr, "cannot connect\n");
+		exit(1);
+	}
+	/* the blank frame buffer goes into the first keyframe */
+	while (!gotUpdate)
+		if (WaitForMessage(client, 1000000) <= 0 || !HandleRFBServerMessage(client)) {
+			fprintf(stderr, "no update\n");
+			exit(1);
+		}
+	if (!rfbClientRecordStart(client, FILENAME)) {
+		fprintf(stderr, "cannot record\n");
+		exit(1);
+	}
+
+	for (k = 0; k < FRAMES; k++) {
+		int64_t t;
+
+		memset(server->frameBuffer, FRAME_COLOUR(k), WIDTH * HEIGHT * 4);
+		rfbMarkRectAsModified(server, 0, 0, WIDTH, HEIGHT);
+		shown[k] = now();
+		while ((t = now()) < shown[k] + FRAME_TIME) {
+			if (WaitForMessage(client, shown[k] + FRAME_TIME - t) > 0 &&
+					!HandleRFBServerMessage(client)) {
+				fprintf(stderr, "connection lost\n");
+				exit(1);
+			}
+		}
+	}
+
+	rfbClientRecordStop(client);
+	rfbClientCleanup(client);
+	stopServer = TRUE;
+	pthread_join(thread, NULL);
+	rfbShutdownServer(server, TRUE);
+	free(server->frameBuffer);
+	rfbScreenCleanup(server);
+}
+
+int main(int argc, char** argv)
+{
+	/* out of order, to seek backwards as well as forwards */
+	static const int seeks[] = { 4, 1, 3, 0, 2, 5 };
+	int64_t shown[FRAMES], start, length;
+	int cargc = 3, i, ok = 1;
+	char* cargv[] = { "vncrectest", "-play", FILENAME, NULL };
+	rfbClient* client;
+
+	record(shown);
+
+	client = rfbGetClient(8, 3, 4);
+	if (!rfbInitClient(client, &cargc, cargv)) {
+		fprintf(stderr, "cannot open the recording\n");
+		return 1;
+	}
+	client->vncRec->doNotSleep = TRUE;
+	client->FinishedFrameBufferUpdate = finishedPlaybackUpdate;
+
+	/* the recording starts with a keyframe of the blank frame buffer */
+	seekTarget = INT64_MAX;
+	if (!HandleRFBServerMessage(client) || seekColour != 0) {
+		printf("first keyframe: FAILED\n");
+		ok = 0;
+	}
+	start = recTime(client);
+
+	length = rfbClientPlaybackLength(client);
+	printf("%d ms up to the last keyframe\n", (int)length);
+	if (length < 1000) {
+		printf("index: FAILED\n");
+		ok = 0;
+	}
+
+	for (i = 0; i < FRAMES; i++) {
+		int k = seeks[i];
+		unsigned int msecs = (unsigned int)((shown[k] - shown[0]) / 1000 + FRAME_TIME / 2000);
+
+		seekTarget = start + msecs * 1000;
+		seekColour = -1;
+		seekDone = FALSE;
+		if (!rfbClientPlaybackSeek(client, msecs)) {
+			printf("seek to %u ms: FAILED\n", msecs);
+			ok = 0;
+			continue;
+		}
+		while (!seekDone && HandleRFBServerMessage(client))
+			;
+		printf("seek to %u ms: frame colour %d, want %d\n", msecs,
+		       seekColour, FRAME_COLOUR(k));
+		if (seekColour != FRAME_COLOUR(k))
+			ok = 0;
+	}
+
+	rfbClientCleanup(client);
+	unlink(FILENAME);
+	unlink(FILENAME ".idx");
+
+	printf("vncrec round trip: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
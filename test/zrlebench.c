@@ -0,0 +1,246 @@
+/*
+ * zrlebench - compare the ZRLE tile analyser against the previous
+ * implementation (palette hash cleared for every tile, pixel by pixel
+ * run detection), time whole tile encodes and compare the deflate
+ * backends on a frame mixing all kinds of tiles.
+ *
+ * usage: zrlebench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <rfb/rfb.h>
+#include "../libvncserver/zrleoutstream.h"
+#include "../libvncserver/zrlepalettehelper.h"
+
+/* exported by zrleencodetemplate.c */
+void zrleAnalyseTile32LE(zrle_U32* data, int w, int h, zrlePaletteHelper* ph,
+		int *runs, int *singlePixels);
+void zrleEncodeTile32LE(zrle_U32* data, int w, int h, zrleOutStream* os,
+		int zywrle_level, int *zywrleBuf, void *paletteHelper);
+
+#define TW rfbZRLETileWidth
+#define TH rfbZRLETileHeight
+
+/* the analysis loop as it was before the fused analyser */
+
+typedef struct {
+	zrle_U32 palette[ZRLE_PALETTE_MAX_SIZE];
+	zrle_U8 index[ZRLE_PALETTE_MAX_SIZE + 4096];
+	zrle_U32 key[ZRLE_PALETTE_MAX_SIZE + 4096];
+	int size;
+} legacyPaletteHelper;
+
+#define LEGACY_HASH(pix) (((pix) ^ ((pix) >> 17)) & 4095)
+
+static void legacyInsert(legacyPaletteHelper *helper, zrle_U32 pix)
+{
+	if (helper->size < ZRLE_PALETTE_MAX_SIZE) {
+		int i = LEGACY_HASH(pix);
+
+		while (helper->index[i] != 255 && helper->key[i] != pix)
+			i++;
+		if (helper->index[i] != 255) return;
+
+		helper->index[i] = helper->size;
+		helper->key[i] = pix;
+		helper->palette[helper->size] = pix;
+	}
+	helper->size++;
+}
+
+static void legacyAnalyse(zrle_U32 *data, int w, int h,
+		legacyPaletteHelper *ph, int *runs, int *singlePixels)
+{
+	zrle_U32 *ptr = data, *end = data + w * h;
+
+	memset(ph->palette, 0, sizeof(ph->palette));
+	memset(ph->index, 255, sizeof(ph->index));
+	memset(ph->key, 0, sizeof(ph->key));
+	ph->size = 0;
+	*runs = *singlePixels = 0;
+
+	while (ptr < end) {
+		zrle_U32 pix = *ptr;
+		if (*++ptr != pix) {
+			(*singlePixels)++;
+		} else {
+			while (*++ptr == pix) ;
+			(*runs)++;
+		}
+		legacyInsert(ph, pix);
+	}
+}
+
+/* test tiles */
+
+enum { SOLID, DESKTOP, TEXT, PHOTO, NUM_KINDS };
+static const char *kindName[NUM_KINDS] = { "solid", "desktop", "text", "photo" };
+
+static void makeTile(int kind, zrle_U32 *tile, unsigned int *seed)
+{
+	int i, x, y;
+
+	switch (kind) {
+	case SOLID:
+		for (i = 0; i < TW * TH; i++)
+			tile[i] = 0x00336699;
+		break;
+	case DESKTOP:
+		/* a few flat areas with borders */
+		for (y = 0; y < TH; y++)
+			for (x = 0; x < TW; x++)
+				tile[y * TW + x] = (x < 20 ? 0x00c0c0c0 :
+					(y % 16 == 0 ? 0x00404040 : 0x00ffffff));
+		break;
+	case TEXT:
+		/* two colours with short runs and some anti-aliasing */
+		for (i = 0; i < TW * TH; i++) {
+			int r = rand_r(seed) % 10;
+			tile[i] = r < 6 ? 0x00ffffff : (r < 9 ? 0 : 0x00808080 + r);
+		}
+		break;
+	case PHOTO:
+		for (i = 0; i < TW * TH; i++)
+			tile[i] = rand_r(seed) & 0x00ffffff;
+		break;
+	}
+	tile[TW * TH] = ~tile[TW * TH - 1];
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* a 1024x768 frame: mostly desktop and text tiles, some solid ones and
+   a photo in one corner; encoded as one update per iteration */
+
+#define FRAME_TILES (1024 / TW * 768 / TH)
+
+static int frameKind(int t)
+{
+	int tx = t % (1024 / TW), ty = t / (1024 / TW);
+
+	if (tx < 4 && ty < 4)
+		return PHOTO;
+	return (t % 7 == 0) ? SOLID : (t % 3 == 0 ? TEXT : DESKTOP);
+}
+
+static void benchBackend(rfbDeflateBackend *backend, zrle_U32 **frame,
+		zrle_U32 *copy, zrlePaletteHelper *ph, int *zywrleBuf,
+		int iterations)
+{
+	zrleOutStream *os = zrleOutStreamNew(NULL, backend);
+	double t, mpix;
+	int i, n, bytes = 0;
+
+	if (!os)
+		return;
+	t = now();
+	for (i = 0; i < iterations; i++) {
+		for (n = 0; n < FRAME_TILES; n++) {
+			memcpy(copy, frame[n], (TW * TH + 1) * sizeof(zrle_U32));
+			zrleEncodeTile32LE(copy, TW, TH, os, 0, zywrleBuf, ph);
+		}
+		zrleOutStreamFlush(os);
+		bytes = zrleOutStreamLength(os);
+		zrleOutStreamReset(os);
+	}
+	t = now() - t;
+
+	mpix = (double)iterations * FRAME_TILES * TW * TH / 1000000.0;
+	printf("%-8s %14.1f %14d\n", backend->name, mpix / t, bytes);
+	zrleOutStreamFree(os);
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+	zrle_U32 *tile = malloc((TW * TH + 1) * sizeof(zrle_U32));
+	zrle_U32 *copy = malloc((TW * TH + 1) * sizeof(zrle_U32));
+	legacyPaletteHelper *lph = malloc(sizeof(legacyPaletteHelper));
+	zrlePaletteHelper *ph = malloc(sizeof(zrlePaletteHelper));
+	zrleOutStream *os = zrleOutStreamNew(NULL, NULL);
+	zrle_U32 *frame[FRAME_TILES];
+	int *zywrleBuf = malloc(TW * TH * sizeof(int));
+	unsigned int seed = 1;
+	int kind, i, failed = 0;
+
+	if (!tile || !copy || !lph || !ph || !os || !zywrleBuf || iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	zrlePaletteHelperInit(ph);
+
+	printf("%-8s %14s %14s %8s %14s\n", "tile", "legacy Mpix/s",
+		"analyser Mpix/s", "speedup", "encode Mpix/s");
+
+	for (kind = 0; kind < NUM_KINDS; kind++) {
+		int runs, singles, lruns, lsingles;
+		double t, tLegacy, tNew, tEncode, mpix;
+
+		makeTile(kind, tile, &seed);
+
+		legacyAnalyse(tile, TW, TH, lph, &lruns, &lsingles);
+		zrleAnalyseTile32LE(tile, TW, TH, ph, &runs, &singles);
+		if (runs != lruns || singles != lsingles || ph->size != lph->size ||
+		    memcmp(ph->palette, lph->palette, sizeof(zrle_U32) *
+			   (ph->size < ZRLE_PALETTE_MAX_SIZE ? ph->size : ZRLE_PALETTE_MAX_SIZE))) {
+			fprintf(stderr, "%s: analysis mismatch (runs %d/%d, single %d/%d, palette %d/%d)\n",
+				kindName[kind], runs, lruns, singles, lsingles, ph->size, lph->size);
+			failed++;
+		}
+
+		t = now();
+		for (i = 0; i < iterations; i++)
+			legacyAnalyse(tile, TW, TH, lph, &lruns, &lsingles);
+		tLegacy = now() - t;
+
+		t = now();
+		for (i = 0; i < iterations; i++)
+			zrleAnalyseTile32LE(tile, TW, TH, ph, &runs, &singles);
+		tNew = now() - t;
+
+		t = now();
+		for (i = 0; i < iterations; i++) {
+			/* the encoder may modify the tile (ZYWRLE), so work on a copy */
+			memcpy(copy, tile, (TW * TH + 1) * sizeof(zrle_U32));
+			zrleOutStreamReset(os);
+			zrleEncodeTile32LE(copy, TW, TH, os, 0, zywrleBuf, ph);
+			zrleOutStreamFlush(os);
+		}
+		tEncode = now() - t;
+
+		mpix = (double)iterations * TW * TH / 1000000.0;
+		printf("%-8s %14.1f %14.1f %7.2fx %14.1f\n", kindName[kind],
+			mpix / tLegacy, mpix / tNew, tLegacy / tNew, mpix / tEncode);
+	}
+
+	/* the frame is encoded iterations / 100 times */
+	printf("\n%-8s %14s %14s\n", "deflate", "frame Mpix/s", "bytes/frame");
+	for (i = 0; i < FRAME_TILES; i++) {
+		frame[i] = malloc((TW * TH + 1) * sizeof(zrle_U32));
+		if (!frame[i])
+			return 1;
+		makeTile(frameKind(i), frame[i], &seed);
+	}
+	benchBackend(&rfbDeflateBackendZlib, frame, copy, ph, zywrleBuf,
+		(iterations + 99) / 100);
+	benchBackend(&rfbDeflateBackendFast, frame, copy, ph, zywrleBuf,
+		(iterations + 99) / 100);
+	for (i = 0; i < FRAME_TILES; i++)
+		free(frame[i]);
+
+	zrleOutStreamFree(os);
+	free(zywrleBuf);
+	free(ph);
+	free(lph);
+	free(copy);
+	free(tile);
+	return failed ? 1 : 0;
+}